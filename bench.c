@@ -0,0 +1,687 @@
+/**
+ * bench.c - Scaling benchmark of the thread pool (1 to N threads), of the pipeline and of the PNG encoder,
+ * and comparison of some hot paths with the code they replaced or compete with.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "md5.h"
+#include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
+#if defined(USE_OPENSSL)
+#include <openssl/evp.h>
+#endif
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+#include "lodepng.h"
+
+// Best of BENCH_RUNS runs for each number of threads
+#define BENCH_RUNS 3
+
+// Images encoded with lodepng (one-shot and reusable encoder)
+#define BENCH_ENCODES 10000
+
+// Digests read by the original descriptor code and by identicon_digest_descriptor()
+#define BENCH_DIGESTS 100000
+// Length of these digests (MD5)
+#define BENCH_DIGEST_SIZE 16
+
+// Pixels filled by each span fill implementation at each span length
+#define BENCH_FILL_PIXELS (1 << 26)
+
+// Salt appended to the keys by the hash benchmarks
+#define BENCH_SALT "salt"
+
+// Names of the stages of the pipeline
+static const char *stage_names[IDENTICON_STAGES] = { "hash", "render", "encode", "write" };
+
+// Hash types having a multi-buffer kernel, and their names
+static const identicon_hash_t mb_hash_types[] = {
+	IDENTICON_HASH_MD5, IDENTICON_HASH_SHA1, IDENTICON_HASH_SHA256, IDENTICON_HASH_SHA512
+};
+static const char *mb_hash_names[] = { "MD5", "SHA1", "SHA256", "SHA512" };
+
+// Names of all the hash types
+static const char *hash_names[] = {
+	"MD5", "SHA1", "SHA256", "SHA512", "XXH3-128", "BLAKE3", "BLAKE2B-128", "BLAKE2B-160"
+};
+
+
+/**
+ * Get a monotonic time.
+ *
+ * @return The time in seconds.
+ */
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+/**
+ * Output callback of the pipeline (counts the bytes).
+ *
+ * @param[in] index The index of the key.
+ * @param[in] data  The PNG image.
+ * @param[in] len   The length of the image.
+ * @param[in] user  The total length.
+ *
+ * @return Always true.
+ */
+static bool count_bytes(size_t index, const unsigned char *data, size_t len, void *user) {
+	(void)index;
+	(void)data;
+
+	*(size_t *)user += len;
+
+	return true;
+}
+
+
+/**
+ * Convert "Hue Saturation Lightness" to "Red Green Blue" color space (copy of the library one).
+ *
+ * @param[in] h The hue value.
+ * @param[in] s The saturation value.
+ * @param[in] l The lightness value.
+ *
+ * @return A variable containig red, green and blue values.
+ */
+static identicon_RGB_t hsl2rgb(double h, double s, double b) {
+	double hsl[6];
+	identicon_RGB_t color;
+
+	h *= 6;
+	hsl[0] = b += s *= b < 0.5 ? b : 1 - b;
+	hsl[1] = b - (int)h % 1 * s * 2;
+	hsl[2] = b -= s *= 2;
+	hsl[3] = b;
+	hsl[4] = b + (int)h % 1 * s;
+	hsl[5] = b + s;
+
+	color.red = floor(hsl[(int)h % 6] * 255);
+	color.green = floor(hsl[((int)h|16) % 6] * 255);
+	color.blue = floor(hsl[((int)h|8) % 6] * 255);
+
+	return color;
+}
+
+
+/**
+ * Convert a bytes array to its hexadecimal representation and then to its decimal representation.
+ *
+ * This is the code the library used before digest_hue() and digest_cell().
+ *
+ * @param[in] str The array of bytes.
+ *
+ * @return The decimal representation of input bytes array or 0 if an error occurred.
+ */
+static unsigned long hex2int(const unsigned char *str) {
+	char buf[21];
+	size_t len, i;
+
+	if (str == NULL)
+		return 0;
+
+	len = strlen((const char *)str);
+
+	if (len > 10)
+		len = 10;
+
+	for (i = 0; i < len; i++)
+		snprintf(&buf[i*2], 3, "%02x", str[i]);
+
+	buf[i*2] = '\0';
+
+	return strtoul(buf, NULL, 16);
+}
+
+
+/**
+ * Compute the descriptor of a digest the way the library used to.
+ *
+ * The digest is kept between NUL bytes: strlen() stops at its end and a digest
+ * having a NUL byte in its first 7 bytes reads the hue from the padding (hue 0).
+ *
+ * @param[out] desc The descriptor.
+ * @param[in]  hash The digest.
+ * @param[in]  len  The length of the digest.
+ */
+static void old_digest_descriptor(identicon_descriptor_t *desc, const unsigned char *hash, size_t len) {
+	unsigned char digest[7 + IDENTICON_MAX_DIGEST_SIZE + 1], *padded = digest + 7;
+	unsigned char c[2];
+	double h;
+	int i;
+
+	memset(digest, 0, sizeof(digest));
+	memcpy(padded, hash, len);
+	memset(c, 0, 2);
+
+	h = (double)hex2int(&padded[strlen((char *)padded) - 7]);
+	desc->foreground = hsl2rgb(h / 0xfffffff, 0.5, 0.7);
+
+	desc->pattern = 0;
+	for (i = 0; i < 15; i++) {
+		c[0] = padded[i];
+		if ((hex2int(c) % 2) == 0)
+			desc->pattern |= 1 << i;
+	}
+}
+
+
+/**
+ * Time every span fill implementation supported by the CPU on spans of 32 to 4096 pixels.
+ *
+ * @return True if every implementation fills the spans right.
+ */
+static bool bench_fill_span(void) {
+	identicon_fill_span_impl_t impls[IDENTICON_FILL_SPAN_IMPLS];
+	static uint32_t span[4096 + 1];
+	const uint32_t pixel = 0x80c0e0ff, guard = 0x01020304;
+	size_t n, len, i, j, k, reps;
+	volatile uint32_t sink = 0;
+	double start;
+	bool same = true;
+
+	n = identicon_fill_span_impls(impls);
+
+	printf("\nfill span (ns/span)\n  pixels");
+	for (i = 0; i < n; i++)
+		printf(" %10s", impls[i].name);
+	printf("\n");
+
+	for (len = 32; len <= 4096; len *= 2) {
+		printf("%8zu", len);
+		reps = BENCH_FILL_PIXELS / len;
+
+		for (i = 0; i < n; i++) {
+			// Spans start one pixel into the buffer (unaligned for the vector stores)
+			for (j = 0; j <= 4096; j++)
+				span[j] = guard;
+
+			start = now();
+			for (k = 0; k < reps; k++) {
+				impls[i].fill((unsigned char *)&span[1], pixel + k, len - (k & 1));
+				sink += span[1 + (k % len)];
+			}
+			start = now() - start;
+
+			// The last fill was of (len - 1) or len pixels, with the last value, and none went past len
+			for (j = 1, k = reps - 1; j <= len - (k & 1); j++) {
+				if (span[j] != pixel + k)
+					same = false;
+			}
+			for (j = len + 1; j <= 4096; j++) {
+				if (span[j] != guard)
+					same = false;
+			}
+			if (span[0] != guard)
+				same = false;
+
+			printf(" %10.1f", start * 1e9 / reps);
+		}
+
+		printf("\n");
+	}
+
+	(void)sink;
+
+	return same;
+}
+
+
+/**
+ * Time the descriptor of each key with every hash type (one key at a time, then in batches).
+ *
+ * @param[in] keys  The keys.
+ * @param[in] count The number of keys.
+ *
+ * @return True if both ways give the same descriptors.
+ */
+static bool bench_hash_types(const identicon_key_t *keys, size_t count) {
+	identicon_opts2_t options, *opts = &options;
+	identicon_descriptor_t *descs, desc;
+	double start, single, batch;
+	size_t i;
+	int t;
+	bool same = true;
+
+	descs = malloc(count * sizeof(identicon_descriptor_t));
+	if (descs == NULL)
+		return false;
+
+	identicon_opts2_init(opts);
+	opts->salt = BENCH_SALT;
+	opts->salt_len = sizeof(BENCH_SALT) - 1;
+
+	printf("\nhash          ns/key (single)   ns/key (batch)\n");
+
+	for (t = IDENTICON_HASH_MD5; t <= IDENTICON_HASH_BLAKE2B_160; t++) {
+		opts->hash_type = t;
+
+		start = now();
+		if (!identicon_compute_descriptors2(keys, count, opts, descs)) {
+			free(descs);
+			return false;
+		}
+		batch = now() - start;
+
+		start = now();
+		for (i = 0; i < count; i++) {
+			opts->key = keys[i].str;
+			opts->key_len = keys[i].len;
+			if (!identicon_compute_descriptor2(opts, &desc) || (desc.pattern != descs[i].pattern) ||
+					(memcmp(&desc.foreground, &descs[i].foreground, sizeof(identicon_RGB_t)) != 0))
+				same = false;
+		}
+		single = now() - start;
+
+		printf("%-12s %16.1f %16.1f\n", hash_names[t], single * 1e9 / count, batch * 1e9 / count);
+	}
+
+	free(descs);
+
+	return same;
+}
+
+
+/**
+ * Hash a key followed by the salt with the scalar code of libs/.
+ *
+ * @param[in]  hash_type The hash algorithm to use (MD5, SHA1, SHA256 or SHA512).
+ * @param[in]  key       The key.
+ * @param[out] hash      The hash.
+ */
+static void scalar_hash(identicon_hash_t hash_type, const identicon_key_t *key, unsigned char *hash) {
+	struct md5_ctx md5;
+	struct sha1_ctx sha1;
+	struct sha256_ctx sha256;
+	struct sha512_ctx sha512;
+
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5:
+			md5_init_ctx(&md5);
+			md5_process_bytes(key->str, key->len, &md5);
+			md5_process_bytes(BENCH_SALT, sizeof(BENCH_SALT) - 1, &md5);
+			md5_finish_ctx(&md5, hash);
+			break;
+		case IDENTICON_HASH_SHA1:
+			sha1_init_ctx(&sha1);
+			sha1_process_bytes(key->str, key->len, &sha1);
+			sha1_process_bytes(BENCH_SALT, sizeof(BENCH_SALT) - 1, &sha1);
+			sha1_finish_ctx(&sha1, hash);
+			break;
+		case IDENTICON_HASH_SHA256:
+			sha256_init_ctx(&sha256);
+			sha256_process_bytes(key->str, key->len, &sha256);
+			sha256_process_bytes(BENCH_SALT, sizeof(BENCH_SALT) - 1, &sha256);
+			sha256_finish_ctx(&sha256, hash);
+			break;
+		default:
+			sha512_init_ctx(&sha512);
+			sha512_process_bytes(key->str, key->len, &sha512);
+			sha512_process_bytes(BENCH_SALT, sizeof(BENCH_SALT) - 1, &sha512);
+			sha512_finish_ctx(&sha512, hash);
+			break;
+	}
+}
+
+
+/**
+ * Time the multi-buffer kernels against the scalar code of libs/ (and OpenSSL EVP if built with it).
+ *
+ * @param[in] keys  The keys.
+ * @param[in] count The number of keys.
+ *
+ * @return True if every way gives the same hashes.
+ */
+static bool bench_multihash(const identicon_key_t *keys, size_t count) {
+	unsigned char (*hashes)[IDENTICON_MAX_DIGEST_SIZE], (*expected)[IDENTICON_MAX_DIGEST_SIZE];
+	size_t t, i, n, hash_len;
+	double start, mb_time, scalar_time;
+	bool same = true;
+#if defined(USE_OPENSSL)
+	EVP_MD_CTX *evp = EVP_MD_CTX_new();
+	const EVP_MD *md;
+	double evp_time;
+#endif
+
+	hashes = malloc(count * sizeof(*hashes));
+	expected = malloc(count * sizeof(*expected));
+	if ((hashes == NULL) || (expected == NULL)) {
+		free(hashes);
+		free(expected);
+		return false;
+	}
+
+#if defined(USE_OPENSSL)
+	printf("\nhash        multi-buffer   scalar libs/   OpenSSL EVP (keys/s)\n");
+#else
+	printf("\nhash        multi-buffer   scalar libs/ (keys/s)\n");
+#endif
+
+	for (t = 0; t < sizeof(mb_hash_types) / sizeof(mb_hash_types[0]); t++) {
+		start = now();
+		for (i = 0, hash_len = 0; i < count; i += n) {
+			n = (count - i < 256) ? count - i : 256;
+			hash_len = identicon_multihash(mb_hash_types[t], keys + i, n, (const unsigned char *)BENCH_SALT,
+					sizeof(BENCH_SALT) - 1, hashes + i);
+			if (hash_len == 0)
+				break;
+		}
+		mb_time = now() - start;
+
+		start = now();
+		for (i = 0; i < count; i++)
+			scalar_hash(mb_hash_types[t], &keys[i], expected[i]);
+		scalar_time = now() - start;
+
+		// Without a multi-buffer kernel for this CPU there is nothing to compare
+		for (i = 0; (hash_len != 0) && (i < count); i++) {
+			if (memcmp(hashes[i], expected[i], hash_len) != 0)
+				same = false;
+		}
+
+		printf("%-8s %15.0f %14.0f", mb_hash_names[t], (hash_len != 0) ? count / mb_time : 0, count / scalar_time);
+
+#if defined(USE_OPENSSL)
+		switch (mb_hash_types[t]) {
+			case IDENTICON_HASH_MD5: md = EVP_md5(); break;
+			case IDENTICON_HASH_SHA1: md = EVP_sha1(); break;
+			case IDENTICON_HASH_SHA256: md = EVP_sha256(); break;
+			default: md = EVP_sha512(); break;
+		}
+
+		start = now();
+		for (i = 0; i < count; i++) {
+			if ((evp == NULL) || !EVP_DigestInit_ex(evp, md, NULL) ||
+					!EVP_DigestUpdate(evp, keys[i].str, keys[i].len) ||
+					!EVP_DigestUpdate(evp, BENCH_SALT, sizeof(BENCH_SALT) - 1) ||
+					!EVP_DigestFinal_ex(evp, hashes[i], NULL)) {
+				same = false;
+				break;
+			}
+		}
+		evp_time = now() - start;
+
+		for (i = 0; i < count; i++) {
+			if (memcmp(hashes[i], expected[i], EVP_MD_size(md)) != 0)
+				same = false;
+		}
+
+		printf(" %14.0f", count / evp_time);
+#endif
+
+		printf("\n");
+	}
+
+#if defined(USE_OPENSSL)
+	EVP_MD_CTX_free(evp);
+#endif
+	free(expected);
+	free(hashes);
+
+	return same;
+}
+
+
+/**
+ * Time the original descriptor code against identicon_digest_descriptor() on the same digests.
+ *
+ * @return True if both give the same descriptors.
+ */
+static bool bench_digest_descriptor(void) {
+	unsigned char (*digests)[BENCH_DIGEST_SIZE];
+	identicon_descriptor_t *descs, desc;
+	uint64_t x = 88172645463325252ULL;
+	double start, old_time, new_time;
+	size_t i, j;
+	bool same = true;
+
+	digests = malloc(BENCH_DIGESTS * sizeof(*digests));
+	descs = malloc(BENCH_DIGESTS * sizeof(identicon_descriptor_t));
+	if ((digests == NULL) || (descs == NULL)) {
+		free(digests);
+		free(descs);
+		return false;
+	}
+
+	// Random digests (xorshift64), some of them with NUL bytes among the first 7
+	for (i = 0; i < BENCH_DIGESTS; i++) {
+		for (j = 0; j < BENCH_DIGEST_SIZE; j++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			digests[i][j] = x >> 56;
+		}
+		if (i % 64 == 0)
+			digests[i][x % 7] = 0;
+	}
+
+	start = now();
+	for (i = 0; i < BENCH_DIGESTS; i++)
+		old_digest_descriptor(&descs[i], digests[i], BENCH_DIGEST_SIZE);
+	old_time = now() - start;
+
+	start = now();
+	for (i = 0; i < BENCH_DIGESTS; i++) {
+		identicon_digest_descriptor(&desc, digests[i], BENCH_DIGEST_SIZE);
+		if ((desc.pattern != descs[i].pattern) || (desc.foreground.red != descs[i].foreground.red) ||
+				(desc.foreground.green != descs[i].foreground.green) ||
+				(desc.foreground.blue != descs[i].foreground.blue))
+			same = false;
+	}
+	new_time = now() - start;
+
+	printf("\ndescriptor: %.1f ns/digest with hex strings, %.1f ns/digest from the digest bytes\n",
+			old_time * 1e9 / BENCH_DIGESTS, new_time * 1e9 / BENCH_DIGESTS);
+
+	free(descs);
+	free(digests);
+
+	return same;
+}
+
+
+int main(int argc, char **argv) {
+	identicon_pipeline_config_t config;
+	identicon_stage_stats_t stats[IDENTICON_STAGES];
+	identicon_pipeline_t *pipeline;
+	size_t total = 0;
+	int s;
+	identicon_key_t *keys;
+	identicon_opts2_t options, *opts = &options;
+	identicon_pool_t *pool;
+	identicon_ctx_t *ctx;
+	identicon_encoder_t *encoder;
+	unsigned char *out, *img, *png, *png2;
+	size_t *lens, len, len2, n;
+	double one_shot, reused;
+	char *strings;
+	size_t count = 100000, i;
+	unsigned int max_threads = 0, threads, run;
+	double start, best, base = 0;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		max_threads = strtoul(argv[2], NULL, 10);
+
+	if (count == 0) {
+		printf("Usage: %s [keys] [max threads]\n", argv[0]);
+		return 1;
+	}
+
+	// Find out the number of CPUs if needed
+	if (max_threads == 0) {
+		pool = new_identicon_pool(0);
+		max_threads = identicon_pool_threads(pool);
+		free_identicon_pool(pool);
+	}
+
+	identicon_opts2_init(opts);
+	opts->size = 64;
+
+	keys = malloc(count * sizeof(identicon_key_t));
+	strings = malloc(count * 32);
+	lens = malloc(count * sizeof(size_t));
+	out = malloc(count * identicon_png_size_bound2(opts));
+
+	if ((keys == NULL) || (strings == NULL) || (lens == NULL) || (out == NULL)) {
+		printf("Out of memory.\n");
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		keys[i].str = strings + (i * 32);
+		keys[i].len = snprintf(strings + (i * 32), 32, "user-%zu@example.com", i);
+	}
+
+	printf("%zu keys, %ux%u PNG images\n", count, opts->size, opts->size);
+	printf("threads   keys/s   speedup\n");
+
+	for (threads = 1; threads <= max_threads; threads = (threads < max_threads && threads * 2 > max_threads) ?
+			max_threads : threads * 2) {
+		pool = new_identicon_pool(threads);
+		if (pool == NULL) {
+			printf("Cannot create a pool of %u threads.\n", threads);
+			return 1;
+		}
+
+		for (run = 0, best = 0; run < BENCH_RUNS; run++) {
+			start = now();
+			if (identicon_pool_write_png2(pool, keys, count, opts, NULL, out, lens) == NULL) {
+				printf("Cannot write the images.\n");
+				return 1;
+			}
+			start = now() - start;
+			if ((run == 0) || (start < best))
+				best = start;
+		}
+
+		free_identicon_pool(pool);
+
+		if (threads == 1)
+			base = best;
+
+		printf("%7u %8.0f %8.2fx\n", threads, count / best, base / best);
+
+		if (threads == max_threads)
+			break;
+	}
+
+	// One thread per stage is enough to see which one limits the throughput
+	identicon_pipeline_config_init(&config);
+	config.output = count_bytes;
+	config.output_user = &total;
+
+	pipeline = new_identicon_pipeline(opts, &config);
+	if (pipeline == NULL) {
+		printf("Cannot create the pipeline.\n");
+		return 1;
+	}
+
+	start = now();
+	if (!identicon_pipeline_run(pipeline, keys, count)) {
+		printf("Cannot run the pipeline.\n");
+		return 1;
+	}
+	start = now() - start;
+
+	identicon_pipeline_get_stats(pipeline, stats);
+	printf("\npipeline: %.0f keys/s, %zu bytes\n", count / start, total);
+	printf("stage    threads  max queue  wait (ms)  stall (ms)\n");
+	for (s = 0; s < IDENTICON_STAGES; s++)
+		printf("%-8s %7u %10zu %10.1f %11.1f\n", stage_names[s], stats[s].workers, stats[s].queue_max_depth,
+				stats[s].wait_ns / 1e6, stats[s].stall_ns / 1e6);
+
+	free_identicon_pipeline(pipeline);
+
+	// Same images with lodepng, building its state for each one or keeping it in an encoder
+	ctx = new_identicon_ctx();
+	encoder = new_identicon_encoder();
+	if ((ctx == NULL) || (encoder == NULL)) {
+		printf("Cannot create the encoder.\n");
+		return 1;
+	}
+
+	n = (count < BENCH_ENCODES) ? count : BENCH_ENCODES;
+	for (i = 0, one_shot = 0, reused = 0; i < n; i++) {
+		opts->key = keys[i].str;
+		opts->key_len = keys[i].len;
+		img = identicon_ctx_render2(ctx, opts);
+
+		start = now();
+		if (lodepng_encode32(&png, &len, img, opts->size, opts->size) != 0) {
+			printf("Cannot encode the images.\n");
+			return 1;
+		}
+		one_shot += now() - start;
+
+		start = now();
+		png2 = identicon_encoder_encode(encoder, img, opts->size, &len2);
+		reused += now() - start;
+
+		if ((png2 == NULL) || (len != len2) || (memcmp(png, png2, len) != 0)) {
+			printf("The encoder does not give the same images.\n");
+			return 1;
+		}
+
+		identicon_free(png);
+		identicon_free(png2);
+	}
+
+	printf("\nlodepng: %.0f images/s one-shot, %.0f images/s with an encoder\n", n / one_shot, n / reused);
+
+	free_identicon_encoder(encoder);
+	free_identicon_ctx(ctx);
+
+	if (!bench_fill_span()) {
+		printf("A span fill implementation is wrong.\n");
+		return 1;
+	}
+
+	if (!bench_hash_types(keys, count)) {
+		printf("The descriptors of the keys differ.\n");
+		return 1;
+	}
+
+	if (!bench_multihash(keys, count)) {
+		printf("The hashes of the keys differ.\n");
+		return 1;
+	}
+
+	if (!bench_digest_descriptor()) {
+		printf("The descriptors of the digests differ.\n");
+		return 1;
+	}
+
+	free(out);
+	free(lens);
+	free(strings);
+	free(keys);
+
+	return 0;
+}
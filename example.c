@@ -27,36 +27,38 @@
 #define INCHES_PER_METER (100.0/2.54)
 #define DPI 72
 #elif defined(USE_STB)
+#include "identicon-c.h"
+#define STBIW_MALLOC(sz) identicon_malloc(sz)
+#define STBIW_REALLOC(p, newsz) identicon_realloc(p, newsz)
+#define STBIW_FREE(p) identicon_free(p)
 #ifndef STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #endif
 #include "stb_image_write.h"
-#else
-#ifndef LODEPNG_NO_COMPILE_CPP
-#define LODEPNG_NO_COMPILE_CPP
-#endif
-#include "lodepng.h"
 #endif
 
 #include "identicon-c.h"
 
 int main(int argc, char **argv) {
 	unsigned char *img = NULL;
+	identicon_ctx_t *ctx = NULL;
 	char *filename = NULL;
-	identicon_options_t *opts = new_default_identicon_options();
+	identicon_opts2_t options, *opts = &options;
+
+	identicon_opts2_init(opts);
 
 	if (argc < 4) {
-		printf("Usage: %s <md5|sha1|sha256|sha512> string [salt] output.png\n", argv[0]);
+		printf("Usage: %s <md5|sha1|sha256|sha512|xxh3|blake3|blake2b128|blake2b160> string [salt] output.png\n", argv[0]);
 		return 1;
 	} else if (argc == 4) {
-		strncpy(opts->str, argv[2], strlen(argv[2]) % IDENTICON_MAX_STRING_LENGTH);
-		opts->str[IDENTICON_MAX_STRING_LENGTH-1] = '\0';
+		opts->key = argv[2];
+		opts->key_len = strlen(argv[2]);
 		filename = argv[3];
 	} else {
-		strncpy(opts->str, argv[2], strlen(argv[2]) % IDENTICON_MAX_STRING_LENGTH);
-		opts->str[IDENTICON_MAX_STRING_LENGTH-1] = '\0';
-		strncpy(opts->salt, argv[3], strlen(argv[3]) % IDENTICON_MAX_SALT_LENGTH);
-		opts->salt[IDENTICON_MAX_SALT_LENGTH-1] = '\0';
+		opts->key = argv[2];
+		opts->key_len = strlen(argv[2]);
+		opts->salt = argv[3];
+		opts->salt_len = strlen(argv[3]);
 		filename = argv[4];
 	}
 
@@ -66,6 +68,14 @@ int main(int argc, char **argv) {
 		opts->hash_type = IDENTICON_HASH_SHA256;
 	else if (!strcmp(argv[1], "sha512"))
 		opts->hash_type = IDENTICON_HASH_SHA512;
+	else if (!strcmp(argv[1], "xxh3"))
+		opts->hash_type = IDENTICON_HASH_XXH3_128;
+	else if (!strcmp(argv[1], "blake3"))
+		opts->hash_type = IDENTICON_HASH_BLAKE3;
+	else if (!strcmp(argv[1], "blake2b128"))
+		opts->hash_type = IDENTICON_HASH_BLAKE2B_128;
+	else if (!strcmp(argv[1], "blake2b160"))
+		opts->hash_type = IDENTICON_HASH_BLAKE2B_160;
 	else
 		opts->hash_type = IDENTICON_HASH_MD5;
 	
@@ -73,7 +83,9 @@ int main(int argc, char **argv) {
 	opts->stroke = false;
 	opts->size = 256;
 
-	img = new_identicon(opts);
+	// The image belongs to the context (reusable for more identicons)
+	ctx = new_identicon_ctx();
+	img = identicon_ctx_render2(ctx, opts);
 
 	if (img != NULL) {
 #if defined(USE_CAIRO)
@@ -91,77 +103,56 @@ int main(int argc, char **argv) {
 #elif defined(USE_LIBPNG)
 		printf("Creating \"%s\" using LibPNG.\n", filename);
 		static FILE *fp;
-		uint32_t i;
 		png_structp png_ptr;
 		png_infop info_ptr;
-		png_byte **row_pointers;
 
 		fp = fopen(filename, "wb");
 		if (fp == NULL) {
-			free(opts);
-			free(img);
+			free_identicon_ctx(ctx);
 			return 1;
 		}
 
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		png_ptr = png_create_identicon_write_struct(NULL, NULL, NULL);
 		if (png_ptr == NULL) {
 			fclose(fp);
-			free(opts);
-			free(img);
+			free_identicon_ctx(ctx);
 			return 1;
 		}
 
 		info_ptr = png_create_info_struct(png_ptr);
 		if (info_ptr == NULL) {
+			png_destroy_write_struct(&png_ptr, NULL);
 			fclose(fp);
-			free(opts);
-			free(img);
+			free_identicon_ctx(ctx);
 			return 1;
 		}
 
 		if (setjmp(png_jmpbuf(png_ptr))) {
 			fclose(fp);
 			png_destroy_write_struct(&png_ptr, &info_ptr);
-			free(opts);
-			free(img);
+			free_identicon_ctx(ctx);
 			return 1;
 		}
 
 		png_init_io(png_ptr, fp);
-		png_set_IHDR(png_ptr, info_ptr, opts->size, opts->size, 8,
-				PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
-				PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 		png_set_pHYs(png_ptr, info_ptr, DPI * INCHES_PER_METER,
 				DPI * INCHES_PER_METER, PNG_RESOLUTION_METER);
-		png_write_info(png_ptr, info_ptr);
-
-		row_pointers = png_new_identicon_from_array(img, opts);
-
-		if (row_pointers != NULL) {
-			for (i = 0; i < opts->size; i++) {
-				png_write_row(png_ptr, row_pointers[i]);
-			}
-			png_write_end(png_ptr, info_ptr);
-		}
+		png_write_identicon2(png_ptr, info_ptr, opts);
 
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 		fclose(fp);
-
-		for (i = 0; i < opts->size; i++)
-			free(row_pointers[i]);
-		free(row_pointers);
 #elif defined(USE_STB)
 		printf("Creating \"%s\" using STB.\n", filename);
 		stbi_write_png(filename, opts->size, opts->size, 4, img, opts->size * 4);
 #else
 		printf("Creating \"%s\" using LodePNG.\n", filename);
-		lodepng_encode32_file(filename, img, opts->size, opts->size);
+		identicon_encoder_t *encoder = new_identicon_encoder();
+		identicon_encoder_encode_file(encoder, img, opts->size, filename);
+		free_identicon_encoder(encoder);
 #endif
-
-		free(img);
 	}
 
-	free(opts);
+	free_identicon_ctx(ctx);
 
 	return 0;
 }
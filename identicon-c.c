@@ -25,29 +25,97 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 // Hash functions
-#if defined(USE_SODIUM)
-#include <sodium.h>
-#elif defined(USE_OPENSSL)
-#include <openssl/md5.h>
-#include <openssl/sha.h>
-#else
 #include "md5.h"
 #include "sha1.h"
 #include "sha256.h"
 #include "sha512.h"
+#if defined(USE_SODIUM)
+#include <sodium.h>
 #endif
+#if defined(USE_OPENSSL)
+#include <pthread.h>
+#include <openssl/evp.h>
+#endif
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+#include "blake3.h"
+#include "blake2b.h"
 
 #include "identicon-c.h"
+#include "identicon-c_private.h"
 #if defined(HAVE_LIBPNG)
 #include "identicon-c_libpng.h"
 #endif
 
+// Biggest digest produced by checksum() (SHA512)
+#define MAX_DIGEST_SIZE IDENTICON_MAX_DIGEST_SIZE
+
+// Number of keys of a batch hashed at once
+#define BATCH_CHUNK_SIZE 64
+
+// Number of hash types provided by the hash backends (MD5 to SHA512)
+#define BACKEND_HASH_TYPES (IDENTICON_HASH_SHA512 + 1)
+
+// Hash backend used until identicon_set_hash_backend() is called (the one chosen at build time)
+#if defined(USE_SODIUM)
+#define DEFAULT_HASH_BACKEND IDENTICON_BACKEND_SODIUM
+#elif defined(USE_OPENSSL)
+#define DEFAULT_HASH_BACKEND IDENTICON_BACKEND_OPENSSL
+#else
+#define DEFAULT_HASH_BACKEND IDENTICON_BACKEND_BUILTIN
+#endif
+
+// Self-benchmark of the auto backend: best of BENCH_RUNS runs of BENCH_ROUNDS hashes of a BENCH_KEY_SIZE key
+#define BENCH_RUNS 3
+#define BENCH_ROUNDS 64
+#define BENCH_KEY_SIZE 32
+
+// Checksum function of a hash backend
+typedef size_t (*checksum_fn_t)(unsigned char *hash, const unsigned char *str, size_t str_len,
+		const unsigned char *salt, size_t salt_len, identicon_hash_t hash_type);
+
+// Hash backend of each hash type provided by the backends
+static identicon_hash_backend_t hash_backend[BACKEND_HASH_TYPES] = {
+	DEFAULT_HASH_BACKEND, DEFAULT_HASH_BACKEND, DEFAULT_HASH_BACKEND, DEFAULT_HASH_BACKEND
+};
+
+#if defined(USE_OPENSSL)
+// Digests fetched once per process (indexed by hash type) and key of the per-thread context
+static const EVP_MD *openssl_md[BACKEND_HASH_TYPES];
+static pthread_once_t openssl_once = PTHREAD_ONCE_INIT;
+static pthread_key_t openssl_ctx_key;
+static bool openssl_ctx_key_valid = false;
+#endif
+
+// Upper bounds of the SVG output: fixed text plus one subpath per cell (32 bit numbers)
+#define SVG_FIXED_SIZE 256
+#define SVG_CELL_SIZE 64
+
+// Number of geometries remembered by the per-thread plan cache
+#define PLAN_CACHE_SIZE 4
+
+
+// Text buffer used by the SVG writer
+typedef struct svg_buffer_t {
+	char *buf;
+	size_t size;
+	size_t len;
+	bool overflow;
+} svg_buffer_t;
+
 
 /**
  * Convert "Hue Saturation Lightness" to "Red Green Blue" color space.
@@ -79,376 +147,2142 @@ static identicon_RGB_t hsl2rgb(double h, double s, double b) {
 
 
 /**
- * Convert a bytes array to its hexadecimal representation and then to its decimal representation.
+ * Extract the hue seed from a digest.
  *
- * @param[in] str The array of bytes.
+ * The original code ran strlen() on the binary digest and parsed the hexadecimal
+ * representation of the 7 bytes preceding its first NUL byte: this gives the same
+ * value as the big endian number made of those bytes, a digest without NUL bytes is
+ * used in full and one with a NUL byte among its first 7 bytes gives 0.
  *
- * @return The decimal representation of input bytes array or 0 if an error occurred.
+ * @param[in] hash The digest.
+ * @param[in] len  The length of the digest.
+ *
+ * @return The hue seed (a 56 bit value).
  */
-static unsigned long hex2int(unsigned char *str) {
-	unsigned char *buf = NULL;
-	unsigned long ret;
-	size_t len, i;
+static uint64_t digest_hue(const unsigned char *hash, size_t len) {
+	const unsigned char *end = memchr(hash, 0, len);
+	uint64_t ret = 0;
+	size_t i;
+
+	if (end != NULL)
+		len = end - hash;
 
-	if (str == NULL)
+	if (len < 7)
 		return 0;
 
-	len = strlen((char *)str);
+	for (i = len - 7; i < len; i++)
+		ret = (ret << 8) | hash[i];
+
+	return ret;
+}
+
 
-	if (len > 10)
-		len = 10;
+/**
+ * Check if a cell of the identicon has to be painted.
+ *
+ * The original code parsed the hexadecimal representation of the i-th byte of the
+ * digest and painted the cell if the result was even (a NUL byte gives 0).
+ *
+ * @param[in] hash The digest.
+ * @param[in] i    The cell index (between 0 and 14).
+ *
+ * @return True if the cell is painted with the foreground color.
+ */
+static inline bool digest_cell(const unsigned char *hash, int i) {
+	return (hash[i] & 1) == 0;
+}
 
-	buf = malloc((sizeof(unsigned char) * len * 2) + sizeof(unsigned char));
 
-	for (i = 0; i < len; i++)
-		snprintf((char *)&buf[i*2], 3, "%02x", str[i]);
+#if defined(USE_OPENSSL)
+/**
+ * Free the digest context of a thread (called at thread exit).
+ *
+ * @param[in] ctx The context.
+ */
+static void openssl_free_context(void *ctx) {
+	EVP_MD_CTX_free(ctx);
+}
+
 
-	buf[(i*2)+1] = '\0';
-	ret = strtoul((char *)buf, NULL, 16);
-	free(buf);
+/**
+ * Fetch the digests and create the key of the per-thread contexts (run once per process).
+ */
+static void openssl_init(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	// The implicit fetch of EVP_md5() and friends would look the provider up on every init
+	openssl_md[IDENTICON_HASH_MD5] = EVP_MD_fetch(NULL, "MD5", NULL);
+	openssl_md[IDENTICON_HASH_SHA1] = EVP_MD_fetch(NULL, "SHA1", NULL);
+	openssl_md[IDENTICON_HASH_SHA256] = EVP_MD_fetch(NULL, "SHA256", NULL);
+	openssl_md[IDENTICON_HASH_SHA512] = EVP_MD_fetch(NULL, "SHA512", NULL);
+#else
+	openssl_md[IDENTICON_HASH_MD5] = EVP_md5();
+	openssl_md[IDENTICON_HASH_SHA1] = EVP_sha1();
+	openssl_md[IDENTICON_HASH_SHA256] = EVP_sha256();
+	openssl_md[IDENTICON_HASH_SHA512] = EVP_sha512();
+#endif
 
-	return ret;
+	openssl_ctx_key_valid = (pthread_key_create(&openssl_ctx_key, openssl_free_context) == 0);
 }
 
+
 /**
- * Calculate string hash.
+ * Get the digest of a hash type and the digest context of the calling thread.
  *
- * @param[in] str       The string of which calculating hash.
- * @param[in] salt      An (optional) additional string appended to the main string.
- * @param[in] hash_type The hash algorithm to use.
+ * @param[in]  hash_type The hash algorithm to use.
+ * @param[out] md        The digest.
  *
- * @return The hash of the string (plus the optional salt) or NULL if an error occurred.
+ * @return The context (reused by every call from the same thread) or NULL if OpenSSL
+ *         doesn't provide the hash type or an error occurred.
  */
-static unsigned char *checksum(unsigned char *str, unsigned char *salt, identicon_hash_t hash_type) {
-	unsigned char *hash = NULL;
+static EVP_MD_CTX *openssl_context(identicon_hash_t hash_type, const EVP_MD **md) {
+	EVP_MD_CTX *ctx;
+
+	pthread_once(&openssl_once, openssl_init);
+
+	if (((unsigned int)hash_type >= BACKEND_HASH_TYPES) || !openssl_ctx_key_valid)
+		return NULL;
 
-	if (str == NULL)
+	*md = openssl_md[hash_type];
+	if (*md == NULL)
 		return NULL;
 
+	ctx = pthread_getspecific(openssl_ctx_key);
+	if (ctx == NULL) {
+		ctx = EVP_MD_CTX_new();
+		if (ctx == NULL)
+			return NULL;
+
+		if (pthread_setspecific(openssl_ctx_key, ctx) != 0) {
+			EVP_MD_CTX_free(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+
+/**
+ * Calculate string hash with an OpenSSL digest context.
+ *
+ * @param[in]  ctx      The context.
+ * @param[in]  md       The digest.
+ * @param[out] hash     The hash of the string (at least MAX_DIGEST_SIZE bytes).
+ * @param[in]  str      The string of which calculating hash.
+ * @param[in]  str_len  The length of the string.
+ * @param[in]  salt     An (optional) additional string appended to the main string.
+ * @param[in]  salt_len The length of the salt.
+ *
+ * @return The length of the hash written or 0 if an error occurred.
+ */
+static size_t openssl_digest(EVP_MD_CTX *ctx, const EVP_MD *md, unsigned char *hash, const unsigned char *str,
+		size_t str_len, const unsigned char *salt, size_t salt_len) {
+	unsigned int len = 0;
+
+	// Only the context and the digest are reused: OpenSSL 3 frees and allocates the provider
+	// state of the digest on every init (EVP_MD_CTX_copy_ex() duplicates it as well)
+	if (!EVP_DigestInit_ex(ctx, md, NULL) || !EVP_DigestUpdate(ctx, str, str_len))
+		return 0;
+
+	if ((salt != NULL) && !EVP_DigestUpdate(ctx, salt, salt_len))
+		return 0;
+
+	if (!EVP_DigestFinal_ex(ctx, hash, &len))
+		return 0;
+
+	return len;
+}
+
+
+/**
+ * Calculate string hash with OpenSSL.
+ *
+ * @param[out] hash      The hash of the string (at least MAX_DIGEST_SIZE bytes).
+ * @param[in]  str       The string of which calculating hash.
+ * @param[in]  str_len   The length of the string.
+ * @param[in]  salt      An (optional) additional string appended to the main string.
+ * @param[in]  salt_len  The length of the salt.
+ * @param[in]  hash_type The hash algorithm to use.
+ *
+ * @return The length of the hash written or 0 if an error occurred.
+ */
+static size_t openssl_checksum(unsigned char *hash, const unsigned char *str, size_t str_len,
+		const unsigned char *salt, size_t salt_len, identicon_hash_t hash_type) {
+	const EVP_MD *md;
+	EVP_MD_CTX *ctx = openssl_context(hash_type, &md);
+
+	if (ctx == NULL)
+		return 0;
+
+	return openssl_digest(ctx, md, hash, str, str_len, salt, salt_len);
+}
+#endif
+
+
+/**
+ * Calculate string hash with the hash functions of coreutils.
+ *
+ * @param[out] hash      The hash of the string (at least MAX_DIGEST_SIZE bytes).
+ * @param[in]  str       The string of which calculating hash.
+ * @param[in]  str_len   The length of the string.
+ * @param[in]  salt      An (optional) additional string appended to the main string.
+ * @param[in]  salt_len  The length of the salt.
+ * @param[in]  hash_type The hash algorithm to use.
+ *
+ * @return The length of the hash written or 0 if an error occurred.
+ */
+static size_t builtin_checksum(unsigned char *hash, const unsigned char *str, size_t str_len,
+		const unsigned char *salt, size_t salt_len, identicon_hash_t hash_type) {
+	size_t len = 0;
+
 	switch (hash_type) {
 		case IDENTICON_HASH_MD5: {
-#if defined(USE_SODIUM)
-			crypto_generichash_state state;
-			hash = malloc(sizeof(unsigned char) * 16);
-			crypto_generichash_init(&state, NULL, 0, 16);
-			crypto_generichash_update(&state, str, strlen((char *)str));
-			if (salt != NULL)
-				crypto_generichash_update(&state, salt, strlen((char *)salt));
-			crypto_generichash_final(&state, hash, 16);
-#elif defined(USE_OPENSSL)
-			MD5_CTX ctx;
-			hash = malloc(sizeof(unsigned char) * MD5_DIGEST_LENGTH);
-			MD5_Init(&ctx);
-			MD5_Update(&ctx, str, strlen((char *)str));
-			if (salt != NULL)
-				MD5_Update(&ctx, salt, strlen((char *)salt));
-			MD5_Final(hash, &ctx);
-#else
 			struct md5_ctx ctx;
-			hash = malloc(sizeof(unsigned char) * MD5_DIGEST_SIZE);
+			len = MD5_DIGEST_SIZE;
 			md5_init_ctx(&ctx);
-			md5_process_bytes(str, strlen((char *)str), &ctx);
+			md5_process_bytes(str, str_len, &ctx);
 			if (salt != NULL)
-				md5_process_bytes(salt, strlen((char *)salt), &ctx);
+				md5_process_bytes(salt, salt_len, &ctx);
 			md5_finish_ctx(&ctx, hash);
-#endif
 			break;
 		}
 		case IDENTICON_HASH_SHA1: {
-#if defined(USE_SODIUM)
-			crypto_generichash_state state;
-			hash = malloc(sizeof(unsigned char) * 20);
-			crypto_generichash_init(&state, NULL, 0, 20);
-			crypto_generichash_update(&state, str, strlen((char *)str));
-			if (salt != NULL)
-				crypto_generichash_update(&state, salt, strlen((char *)salt));
-			crypto_generichash_final(&state, hash, 20);
-#elif defined(USE_OPENSSL)
-			SHA_CTX ctx;
-			hash = malloc(sizeof(unsigned char) * SHA_DIGEST_LENGTH);
-			SHA1_Init(&ctx);
-			SHA1_Update(&ctx, str, strlen((char *)str));
-			if (salt != NULL)
-				SHA1_Update(&ctx, salt, strlen((char *)salt));
-			SHA1_Final(hash, &ctx);
-#else
 			struct sha1_ctx ctx;
-			hash = malloc(sizeof(unsigned char) * SHA1_DIGEST_SIZE);
+			len = SHA1_DIGEST_SIZE;
 			sha1_init_ctx(&ctx);
-			sha1_process_bytes(str, strlen((char *)str), &ctx);
+			sha1_process_bytes(str, str_len, &ctx);
 			if (salt != NULL)
-				sha1_process_bytes(salt, strlen((char *)salt), &ctx);
+				sha1_process_bytes(salt, salt_len, &ctx);
 			sha1_finish_ctx(&ctx, hash);
-#endif
 			break;
 		}
 		case IDENTICON_HASH_SHA256: {
-#if defined(USE_SODIUM)
-			crypto_hash_sha256_state state;
-			hash = malloc(sizeof(unsigned char) * crypto_hash_sha256_BYTES);
-			crypto_hash_sha256_init(&state);
-			crypto_hash_sha256_update(&state, str, strlen((char *)str));
-			if (salt != NULL)
-				crypto_hash_sha256_update(&state, salt, strlen((char *)salt));
-			crypto_hash_sha256_final(&state, hash);
-#elif defined(USE_OPENSSL)
-			SHA256_CTX ctx;
-			hash = malloc(sizeof(unsigned char) * SHA256_DIGEST_LENGTH);
-			SHA256_Init(&ctx);
-			SHA256_Update(&ctx, str, strlen((char *)str));
-			if (salt != NULL)
-				SHA256_Update(&ctx, salt, strlen((char *)salt));
-			SHA256_Final(hash, &ctx);
-#else
 			struct sha256_ctx ctx;
-			hash = malloc(sizeof(unsigned char) * SHA256_DIGEST_SIZE);
+			len = SHA256_DIGEST_SIZE;
 			sha256_init_ctx(&ctx);
-			sha256_process_bytes(str, strlen((char *)str), &ctx);
+			sha256_process_bytes(str, str_len, &ctx);
 			if (salt != NULL)
-				sha256_process_bytes(salt, strlen((char *)salt), &ctx);
+				sha256_process_bytes(salt, salt_len, &ctx);
 			sha256_finish_ctx(&ctx, hash);
-#endif
 			break;
 		}
 		case IDENTICON_HASH_SHA512: {
-#if defined(USE_SODIUM)
-			crypto_hash_sha512_state state;
-			hash = malloc(sizeof(unsigned char) * crypto_hash_sha512_BYTES);
-			crypto_hash_sha512_init(&state);
-			crypto_hash_sha512_update(&state, str, strlen((char *)str));
-			if (salt != NULL)
-				crypto_hash_sha512_update(&state, salt, strlen((char *)salt));
-			crypto_hash_sha512_final(&state, hash);
-#elif defined(USE_OPENSSL)
-			SHA512_CTX ctx;
-			hash = malloc(sizeof(unsigned char) * SHA512_DIGEST_LENGTH);
-			SHA512_Init(&ctx);
-			SHA512_Update(&ctx, str, strlen((char *)str));
-			if (salt != NULL)
-				SHA512_Update(&ctx, salt, strlen((char *)salt));
-			SHA512_Final(hash, &ctx);
-#else
 			struct sha512_ctx ctx;
-			hash = malloc(sizeof(unsigned char) * SHA512_DIGEST_SIZE);
+			len = SHA512_DIGEST_SIZE;
 			sha512_init_ctx(&ctx);
-			sha512_process_bytes(str, strlen((char *)str), &ctx);
+			sha512_process_bytes(str, str_len, &ctx);
 			if (salt != NULL)
-				sha512_process_bytes(salt, strlen((char *)salt), &ctx);
+				sha512_process_bytes(salt, salt_len, &ctx);
 			sha512_finish_ctx(&ctx, hash);
-#endif
 			break;
 		}
 		default: break;
 	}
 
-	return hash;
+	return len;
 }
 
 
+#if defined(USE_SODIUM)
 /**
- * Draw a rectangular portion of the final image.
+ * Calculate string hash with libsodium.
+ *
+ * libsodium doesn't have MD5 and SHA1, crypto_generichash (BLAKE2b) with the same
+ * digest length is used instead (so the identicons are different).
  *
- * @param[in,out] img      The image (already allocated).
- * @param[in]     x        The rectangle top-left corner X coordinate.
- * @param[in]     y        The rectangle top-left corner Y coordinate.
- * @param[in]     width    The rectangle width.
- * @param[in]     height   The rectangle height.
- * @param[in]     color    The color used to paint (as RGB).
- * @param[in]     opts     The identicon options.
- * @param[in]     paint_fg True if we are painting the foreground.
+ * @param[out] hash      The hash of the string (at least MAX_DIGEST_SIZE bytes).
+ * @param[in]  str       The string of which calculating hash.
+ * @param[in]  str_len   The length of the string.
+ * @param[in]  salt      An (optional) additional string appended to the main string.
+ * @param[in]  salt_len  The length of the salt.
+ * @param[in]  hash_type The hash algorithm to use.
+ *
+ * @return The length of the hash written or 0 if an error occurred.
  */
-static void draw_rectangle(unsigned char *img, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
-		identicon_RGB_t color, identicon_options_t *opts, bool paint_fg) {
-	uint32_t i, j, idx;
-
-	if ((img == NULL) || (opts == NULL) || (opts->transparent && !paint_fg))
-		return;
+static size_t sodium_checksum(unsigned char *hash, const unsigned char *str, size_t str_len,
+		const unsigned char *salt, size_t salt_len, identicon_hash_t hash_type) {
+	size_t len = 0;
 
-	if (opts->stroke && paint_fg) {
-		if ((x >= opts->stroke_size) && (width <= opts->size - (2 * opts->stroke_size))) {
-			x -= opts->stroke_size;
-			width += (2 * opts->stroke_size);
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5:
+		case IDENTICON_HASH_SHA1: {
+			crypto_generichash_state state;
+			len = (hash_type == IDENTICON_HASH_MD5) ? 16 : 20;
+			crypto_generichash_init(&state, NULL, 0, len);
+			crypto_generichash_update(&state, str, str_len);
+			if (salt != NULL)
+				crypto_generichash_update(&state, salt, salt_len);
+			crypto_generichash_final(&state, hash, len);
+			break;
 		}
-		if ((y >= opts->stroke_size) && (height <= opts->size - (2 * opts->stroke_size))) {
-			y -= opts->stroke_size;
-			height += (2 * opts->stroke_size);
+		case IDENTICON_HASH_SHA256: {
+			crypto_hash_sha256_state state;
+			len = crypto_hash_sha256_BYTES;
+			crypto_hash_sha256_init(&state);
+			crypto_hash_sha256_update(&state, str, str_len);
+			if (salt != NULL)
+				crypto_hash_sha256_update(&state, salt, salt_len);
+			crypto_hash_sha256_final(&state, hash);
+			break;
 		}
-	}
-
-	for (i = 0; i < width; i++) {
-		if (i + x >= opts->size) // opts->size intended as image width
+		case IDENTICON_HASH_SHA512: {
+			crypto_hash_sha512_state state;
+			len = crypto_hash_sha512_BYTES;
+			crypto_hash_sha512_init(&state);
+			crypto_hash_sha512_update(&state, str, str_len);
+			if (salt != NULL)
+				crypto_hash_sha512_update(&state, salt, salt_len);
+			crypto_hash_sha512_final(&state, hash);
 			break;
-
-		for (j = 0; j < height; j++) {
-			if (j + y >= opts->size) // opts->size intended as image height
-				break;
-
-			idx = 4 * opts->size * (j + y); // opts->size intended as image width
-			idx += 4 * (i + x);
-			img[idx] = color.red;
-			img[idx+1] = color.green;
-			img[idx+2] = color.blue;
-			img[idx+3] = 255;
 		}
+		default: break;
 	}
+
+	return len;
 }
+#endif
+
+
+// Checksum functions of the hash backends (NULL if not built in)
+static const checksum_fn_t backend_checksum[IDENTICON_BACKEND_SODIUM + 1] = {
+	[IDENTICON_BACKEND_BUILTIN] = builtin_checksum,
+#if defined(USE_OPENSSL)
+	[IDENTICON_BACKEND_OPENSSL] = openssl_checksum,
+#endif
+#if defined(USE_SODIUM)
+	[IDENTICON_BACKEND_SODIUM] = sodium_checksum,
+#endif
+};
 
 
 /**
- * Draw the image.
+ * Check if a hash backend gives the standard digest of a hash type.
  *
- * @param[in,out] img  The image (already allocated).
- * @param[in]     opts The identicon options.
+ * @param[in] backend   The hash backend.
+ * @param[in] hash_type The hash type.
+ *
+ * @return False if the backend substitutes another hash function (libsodium for MD5
+ *         and SHA1), true otherwise.
  */
-static void draw_identicon(unsigned char *img, identicon_options_t *opts) {
-	int i;
-	double h;
-	unsigned char c[2];
-	unsigned char *hash = NULL;
-	double base_margin = floor(opts->size * opts->margin);
-	double cell = floor((opts->size - (base_margin * 2)) / 5);
-	double margin = floor((opts->size - (cell * 5)) / 2);
-	identicon_RGB_t background, foreground;
-
-	if ((img == NULL) || (opts == NULL))
-		return;
-
-	hash = checksum((unsigned char *)opts->str, (unsigned char *)opts->salt, opts->hash_type);
-
-	if (hash == NULL)
-		return;
-
-	memset(c, 0, 2);
-
-	// Background color
-	background.red = 240;
-	background.green = 240;
-	background.blue = 240;
+static bool backend_is_standard(identicon_hash_backend_t backend, identicon_hash_t hash_type) {
+	return (backend != IDENTICON_BACKEND_SODIUM) ||
+		((hash_type != IDENTICON_HASH_MD5) && (hash_type != IDENTICON_HASH_SHA1));
+}
 
-	if (!opts->transparent)
-		draw_rectangle(img, 0, 0, opts->size, opts->size, background, opts, false);
 
-	// Foreground color
-	h = (double)hex2int(&hash[strlen((char *)hash) - 7]);
-	foreground = hsl2rgb(h / 0xfffffff, 0.5, 0.7);
+/**
+ * Get the hash backend currently used for a hash type.
+ *
+ * @param[in] hash_type The hash type.
+ *
+ * @return The hash backend (IDENTICON_BACKEND_BUILTIN for the hash types that are
+ *         always built in).
+ */
+static identicon_hash_backend_t current_backend(identicon_hash_t hash_type) {
+	if ((unsigned int)hash_type >= BACKEND_HASH_TYPES)
+		return IDENTICON_BACKEND_BUILTIN;
 
-	// The first 15 characters of the hash control the pixels (even/odd)
-	// they are drawn down the middle first, then mirrored outwards
-	for (i = 0; i < 15; i++) {
-		c[0] = hash[i];
-
-		if ((hex2int(c) % 2) == 0) {
-			if (i < 5) {
-				draw_rectangle(img, 2 * cell + margin, i * cell + margin, cell, cell, foreground, opts, true);
-			} else if (i < 10) {
-				draw_rectangle(img, 1 * cell + margin, (i - 5) * cell + margin, cell, cell, foreground, opts, true);
-				draw_rectangle(img, 3 * cell + margin, (i - 5) * cell + margin, cell, cell, foreground, opts, true);
-			} else if (i < 15) {
-				draw_rectangle(img, 0 * cell + margin, (i - 10) * cell + margin, cell, cell, foreground, opts, true);
-				draw_rectangle(img, 4 * cell + margin, (i - 10) * cell + margin, cell, cell, foreground, opts, true);
-			}
-		}
-	}
+	return __atomic_load_n(&hash_backend[hash_type], __ATOMIC_RELAXED);
 }
 
 
 /**
- * Create a new set of default options.
+ * Prepare a hash backend for use.
  *
- * @return A new variable containing the default options or NULL if an error occurred.
+ * @param[in] backend The hash backend.
+ *
+ * @return True if the backend is built in and usable, false otherwise.
  */
-identicon_options_t *new_default_identicon_options() {
-	identicon_options_t *opts = malloc(sizeof(identicon_options_t));
+static bool backend_init(identicon_hash_backend_t backend) {
+	if (((unsigned int)backend > IDENTICON_BACKEND_SODIUM) || (backend_checksum[backend] == NULL))
+		return false;
 
-	if (opts != NULL) {
-		memset(opts->str, 0, IDENTICON_MAX_STRING_LENGTH);
-		memset(opts->salt, 0, IDENTICON_MAX_SALT_LENGTH);
-		opts->size = 64;
-		opts->margin = 0.08;
-		opts->transparent = true;
-		opts->stroke = true;
-		opts->stroke_size = 1;
-		opts->hash_type = IDENTICON_HASH_MD5;
-	}
+#if defined(USE_SODIUM)
+	// Picks the fastest implementations for the CPU (safe to call more than once)
+	if ((backend == IDENTICON_BACKEND_SODIUM) && (sodium_init() < 0))
+		return false;
+#endif
 
-	return opts;
+	return true;
 }
 
 
 /**
- * Create a new identicon.
+ * Find the fastest hash backend for a hash type with a short self-benchmark.
  *
- * @param[in] opts The identicon options.
+ * Only backends giving the standard digest of the hash type are considered.
  *
- * @return A new variable containing the identicon or NULL if an error occurred.
+ * @param[in] hash_type The hash type.
+ *
+ * @return The fastest hash backend.
  */
-unsigned char *new_identicon(identicon_options_t *opts) {
-	unsigned char *img = NULL;
+static identicon_hash_backend_t fastest_backend(identicon_hash_t hash_type) {
+	unsigned char hash[MAX_DIGEST_SIZE], key[BENCH_KEY_SIZE];
+	identicon_hash_backend_t backend, best = IDENTICON_BACKEND_BUILTIN;
+	double elapsed, best_elapsed = HUGE_VAL;
+	struct timespec start, end;
+	int run, i;
 
-	if (opts == NULL)
-		return NULL;
+	memset(key, 'k', sizeof(key));
 
-	img = malloc(sizeof(unsigned char) * opts->size * opts->size * 4);
-	draw_identicon(img, opts);
+	for (backend = IDENTICON_BACKEND_BUILTIN; backend <= IDENTICON_BACKEND_SODIUM; backend++) {
+		if (!backend_is_standard(backend, hash_type) || !backend_init(backend))
+			continue;
 
-	return img;
-}
+		// Warm up (and skip backends failing to compute the hash)
+		if (backend_checksum[backend](hash, key, sizeof(key), NULL, 0, hash_type) == 0)
+			continue;
 
+		for (run = 0; run < BENCH_RUNS; run++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < BENCH_ROUNDS; i++) {
+				key[0] = i;
+				backend_checksum[backend](hash, key, sizeof(key), NULL, 0, hash_type);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			elapsed = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+			if (elapsed < best_elapsed) {
+				best_elapsed = elapsed;
+				best = backend;
+			}
+		}
+	}
+
+	return best;
+}
 
-#if defined(HAVE_LIBPNG)
 /**
- * Convert identicon array image to png_byte (facility for libpng).
+ * Calculate string hash.
  *
- * @param[in] img  The image (already allocated).
- * @param[in] opts The identicon options.
+ * @param[out] hash      The hash of the string (at least MAX_DIGEST_SIZE bytes).
+ * @param[in]  str       The string of which calculating hash.
+ * @param[in]  str_len   The length of the string.
+ * @param[in]  salt      An (optional) additional string appended to the main string.
+ * @param[in]  salt_len  The length of the salt.
+ * @param[in]  hash_type The hash algorithm to use.
  *
- * @return A new variable containing the identicon or NULL if an error occurred.
+ * @return The length of the hash written or 0 if an error occurred.
  */
-png_byte **png_new_identicon_from_array(unsigned char *img, identicon_options_t *opts) {
-	uint32_t x, y;
-	unsigned char *pixel = NULL;
-	png_byte **row_pointers = NULL;
+static size_t checksum(unsigned char *hash, const unsigned char *str, size_t str_len, const unsigned char *salt,
+		size_t salt_len, identicon_hash_t hash_type) {
+	size_t len = 0;
 
-	if ((img == NULL) || (opts == NULL))
-		return NULL;
+	if ((hash == NULL) || (str == NULL))
+		return 0;
 
-	row_pointers = malloc(sizeof(png_byte *) * opts->size);
-	for (y = 0; y < opts->size; y++) {
-		row_pointers[y] = malloc(sizeof(png_byte) * opts->size * 4);
-		for (x = 0; x < opts->size; x++) {
-			pixel = img + (y * opts->size * 4) + (x * 4);
-			memcpy(&row_pointers[y][x * 4], pixel, 4);
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5:
+		case IDENTICON_HASH_SHA1:
+		case IDENTICON_HASH_SHA256:
+		case IDENTICON_HASH_SHA512:
+			len = backend_checksum[current_backend(hash_type)](hash, str, str_len, salt, salt_len, hash_type);
+			break;
+		case IDENTICON_HASH_XXH3_128: {
+			XXH3_state_t state;
+			XXH128_canonical_t canonical;
+			len = sizeof(canonical.digest);
+			if ((salt == NULL) || (salt_len == 0)) {
+				XXH128_canonicalFromHash(&canonical, XXH3_128bits(str, str_len));
+			} else {
+				XXH3_128bits_reset(&state);
+				XXH3_128bits_update(&state, str, str_len);
+				XXH3_128bits_update(&state, salt, salt_len);
+				XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(&state));
+			}
+			memcpy(hash, canonical.digest, len);
+			break;
+		}
+		case IDENTICON_HASH_BLAKE3: {
+			struct blake3_hasher hasher;
+			len = BLAKE3_OUT_LEN;
+			blake3_hasher_init(&hasher);
+			blake3_hasher_update(&hasher, str, str_len);
+			if (salt != NULL)
+				blake3_hasher_update(&hasher, salt, salt_len);
+			blake3_hasher_finalize(&hasher, hash, BLAKE3_OUT_LEN);
+			break;
+		}
+		case IDENTICON_HASH_BLAKE2B_128:
+		case IDENTICON_HASH_BLAKE2B_160: {
+			struct blake2b_ctx ctx;
+			len = (hash_type == IDENTICON_HASH_BLAKE2B_128) ? 16 : 20;
+			blake2b_init_ctx(&ctx, len);
+			blake2b_process_bytes(str, str_len, &ctx);
+			if (salt != NULL)
+				blake2b_process_bytes(salt, salt_len, &ctx);
+			blake2b_finish_ctx(&ctx, hash);
+			break;
 		}
+		default: break;
 	}
 
-	return row_pointers;
+	return len;
 }
 
 
 /**
- * Create a new identicon (facility for libpng).
+ * Calculate the hashes of many strings.
  *
- * @param[in] opts The identicon options.
+ * Keys sharing long prefixes resume from the hash context saved after the shared
+ * blocks (built in backend), other keys are hashed in SIMD lanes when the hash
+ * function allows it, otherwise back to back (with the same OpenSSL context when
+ * the OpenSSL backend provides the hash).
  *
- * @return A new variable containing the identicon or NULL if an error occurred.
+ * @param[out] hashes    The hashes of the keys (keys with a NULL string are skipped).
+ * @param[in]  keys      The keys.
+ * @param[in]  count     The number of keys.
+ * @param[in]  salt      An (optional) additional string appended to every key.
+ * @param[in]  salt_len  The length of the salt.
+ * @param[in]  hash_type The hash algorithm to use.
+ *
+ * @return The length of the hashes written or 0 if an error occurred.
  */
-png_byte **png_new_identicon(identicon_options_t *opts) {
-	unsigned char *img = NULL;
-	png_byte **row_pointers = NULL;
+static size_t checksum_batch(unsigned char (*hashes)[MAX_DIGEST_SIZE], const identicon_key_t *keys, size_t count,
+		const unsigned char *salt, size_t salt_len, identicon_hash_t hash_type) {
+	size_t i, len = 0;
+#if defined(USE_OPENSSL)
+	const EVP_MD *md;
+	EVP_MD_CTX *ctx;
+#endif
 
-	if (opts == NULL)
-		return NULL;
+	// The saved contexts are the ones of the built in hash functions
+	if (current_backend(hash_type) == IDENTICON_BACKEND_BUILTIN) {
+		len = identicon_prefix_hash(hash_type, keys, count, salt, salt_len, hashes);
+		if (len != 0)
+			return len;
+	}
 
-	img = malloc(sizeof(unsigned char) * opts->size * opts->size * 4);
-	draw_identicon(img, opts);
+	// The multi-buffer kernels give the standard digests
+	if (backend_is_standard(current_backend(hash_type), hash_type)) {
+		len = identicon_multihash(hash_type, keys, count, salt, salt_len, hashes);
+		if (len != 0)
+			return len;
+	}
 
-	if (img == NULL)
-		return NULL;
+#if defined(USE_OPENSSL)
+	ctx = (current_backend(hash_type) == IDENTICON_BACKEND_OPENSSL) ? openssl_context(hash_type, &md) : NULL;
+	if (ctx != NULL) {
+		for (i = 0; i < count; i++) {
+			if (keys[i].str == NULL)
+				continue;
+
+			len = openssl_digest(ctx, md, hashes[i], (const unsigned char *)keys[i].str, keys[i].len, salt,
+					salt_len);
+			if (len == 0)
+				return 0;
+		}
+
+		return len;
+	}
+#endif
 
-	row_pointers = png_new_identicon_from_array(img, opts);
+	for (i = 0; i < count; i++) {
+		if (keys[i].str == NULL)
+			continue;
 
-	free(img);
+		len = checksum(hashes[i], (const unsigned char *)keys[i].str, keys[i].len, salt, salt_len, hash_type);
+		if (len == 0)
+			return 0;
+	}
 
-	return row_pointers;
+	return len;
+}
+
+/**
+ * Fill a span of pixels with the same value (portable version).
+ *
+ * @param[out] dst   The first pixel of the span.
+ * @param[in]  pixel The pixel value (RGBA bytes as stored in memory).
+ * @param[in]  count The number of pixels.
+ */
+static void fill_span_generic(unsigned char *dst, uint32_t pixel, size_t count) {
+	for (; count > 0; count--, dst += 4)
+		memcpy(dst, &pixel, 4);
+}
+
+
+#if defined(HAVE_X86_SIMD)
+/**
+ * Fill a span of pixels with the same value (SSE2 version).
+ *
+ * @param[out] dst   The first pixel of the span.
+ * @param[in]  pixel The pixel value (RGBA bytes as stored in memory).
+ * @param[in]  count The number of pixels.
+ */
+__attribute__((target("sse2")))
+static void fill_span_sse2(unsigned char *dst, uint32_t pixel, size_t count) {
+	__m128i v = _mm_set1_epi32(pixel);
+
+	for (; count >= 4; count -= 4, dst += 16)
+		_mm_storeu_si128((__m128i *)dst, v);
+
+	fill_span_generic(dst, pixel, count);
+}
+
+
+/**
+ * Fill a span of pixels with the same value (AVX2 version).
+ *
+ * @param[out] dst   The first pixel of the span.
+ * @param[in]  pixel The pixel value (RGBA bytes as stored in memory).
+ * @param[in]  count The number of pixels.
+ */
+__attribute__((target("avx2")))
+static void fill_span_avx2(unsigned char *dst, uint32_t pixel, size_t count) {
+	__m256i v = _mm256_set1_epi32(pixel);
+
+	for (; count >= 8; count -= 8, dst += 32)
+		_mm256_storeu_si256((__m256i *)dst, v);
+
+	if (count >= 4) {
+		_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(v));
+		count -= 4;
+		dst += 16;
+	}
+
+	fill_span_generic(dst, pixel, count);
+}
+
+
+/**
+ * Fill a span of pixels with the same value (AVX-512 version).
+ *
+ * @param[out] dst   The first pixel of the span.
+ * @param[in]  pixel The pixel value (RGBA bytes as stored in memory).
+ * @param[in]  count The number of pixels.
+ */
+__attribute__((target("avx512f")))
+static void fill_span_avx512(unsigned char *dst, uint32_t pixel, size_t count) {
+	__m512i v = _mm512_set1_epi32(pixel);
+
+	for (; count >= 16; count -= 16, dst += 64)
+		_mm512_storeu_si512((void *)dst, v);
+
+	if (count > 0)
+		_mm512_mask_storeu_epi32((void *)dst, (__mmask16)((1U << count) - 1), v);
+}
+#endif
+
+
+/**
+ * Get the span fill implementations supported by the CPU.
+ *
+ * @param[out] impls The implementations, from the slowest to the fastest.
+ *
+ * @return The number of implementations (at least 1, the portable one).
+ */
+size_t identicon_fill_span_impls(identicon_fill_span_impl_t impls[IDENTICON_FILL_SPAN_IMPLS]) {
+	size_t n = 0;
+
+	impls[n].name = "generic";
+	impls[n++].fill = fill_span_generic;
+#if defined(HAVE_X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		impls[n].name = "sse2";
+		impls[n++].fill = fill_span_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		impls[n].name = "avx2";
+		impls[n++].fill = fill_span_avx2;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		impls[n].name = "avx512";
+		impls[n++].fill = fill_span_avx512;
+	}
+#endif
+
+	return n;
+}
+
+
+/**
+ * Fill a span of pixels with the same value using the best implementation
+ * supported by the CPU (chosen on first use).
+ *
+ * @param[out] dst   The first pixel of the span.
+ * @param[in]  pixel The pixel value (RGBA bytes as stored in memory).
+ * @param[in]  count The number of pixels.
+ */
+static void fill_span(unsigned char *dst, uint32_t pixel, size_t count) {
+	static identicon_fill_span_t impl = NULL;
+	identicon_fill_span_t fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+	identicon_fill_span_impl_t impls[IDENTICON_FILL_SPAN_IMPLS];
+
+	if (fn == NULL) {
+		fn = impls[identicon_fill_span_impls(impls) - 1].fill;
+		__atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+	}
+
+	fn(dst, pixel, count);
+}
+
+
+/**
+ * Pack a color into a pixel value.
+ *
+ * @param[in] color The color (as RGB).
+ * @param[in] alpha The alpha channel.
+ *
+ * @return The pixel value (RGBA bytes as stored in memory).
+ */
+static inline uint32_t pack_pixel(identicon_RGB_t color, uint8_t alpha) {
+	unsigned char rgba[4] = { color.red, color.green, color.blue, alpha };
+	uint32_t pixel;
+
+	memcpy(&pixel, rgba, 4);
+
+	return pixel;
+}
+
+
+/**
+ * Compute the pixels covered by a row (or a column) of cells.
+ *
+ * This follows exactly what draw_rectangle() does to a foreground rectangle:
+ * the cell is widened by opts->stroke_size on both sides when possible and
+ * then clipped to the image.
+ *
+ * @param[in]  opts  The identicon options.
+ * @param[in]  pos   The first pixel of the cell.
+ * @param[in]  len   The size (in pixels) of the cell.
+ * @param[out] start The first pixel covered.
+ * @param[out] end   The pixel after the last one covered.
+ */
+static void cell_span(const identicon_opts2_t *opts, uint32_t pos, uint32_t len, uint32_t *start, uint32_t *end) {
+	if (opts->stroke && (pos >= opts->stroke_size) && (len <= opts->size - (2 * opts->stroke_size))) {
+		pos -= opts->stroke_size;
+		len += (2 * opts->stroke_size);
+	}
+
+	*start = (pos < opts->size) ? pos : opts->size;
+	*end = (len < opts->size - *start) ? *start + len : opts->size;
+}
+
+
+/**
+ * Check if a cell of the 5x5 grid is painted.
+ *
+ * @param[in] pattern The cell pattern of a descriptor.
+ * @param[in] col     The grid column.
+ * @param[in] row     The grid row.
+ *
+ * @return True if the cell is painted with the foreground color.
+ */
+static inline bool grid_cell(uint16_t pattern, int col, int row) {
+	static const int first_bit[5] = { 10, 5, 0, 5, 10 };
+
+	return (pattern >> (first_bit[col] + row)) & 1;
+}
+
+
+/**
+ * Compute the descriptor of a digest.
+ *
+ * @param[out] desc The descriptor.
+ * @param[in]  hash The digest.
+ * @param[in]  len  The length of the digest.
+ */
+void identicon_digest_descriptor(identicon_descriptor_t *desc, const unsigned char *hash, size_t len) {
+	double h;
+	int i;
+
+	// Foreground color
+	h = (double)digest_hue(hash, len);
+	desc->foreground = hsl2rgb(h / 0xfffffff, 0.5, 0.7);
+
+	// The first 15 characters of the hash control the pixels (even/odd)
+	desc->pattern = 0;
+	for (i = 0; i < 15; i++) {
+		if (digest_cell(hash, i))
+			desc->pattern |= 1 << i;
+	}
+}
+
+
+/**
+ * Compute the descriptor of an identicon.
+ *
+ * @param[out] desc The descriptor.
+ * @param[in]  opts The identicon options.
+ *
+ * @return True if the descriptor has been computed, false if an error occurred.
+ */
+static bool compute_descriptor(identicon_descriptor_t *desc, const identicon_opts2_t *opts) {
+	size_t hash_len;
+	unsigned char hash[MAX_DIGEST_SIZE];
+
+	if ((desc == NULL) || (opts == NULL) || ((opts->key == NULL) && (opts->key_len != 0)) ||
+			((opts->salt == NULL) && (opts->salt_len != 0)))
+		return false;
+
+	// An empty key may come without a buffer
+	hash_len = checksum(hash, (opts->key != NULL) ? opts->key : "", opts->key_len, opts->salt, opts->salt_len,
+			opts->hash_type);
+
+	if (hash_len == 0)
+		return false;
+
+	identicon_digest_descriptor(desc, hash, hash_len);
+
+	return true;
+}
+
+
+/**
+ * Compute the foreground runs of a row of the image.
+ *
+ * @param[in]  start The first pixel covered by each column of cells.
+ * @param[in]  end   The pixel after the last one covered by each column of cells.
+ * @param[in]  cols  The painted columns of cells (bit c set if column c is painted).
+ * @param[out] runs  The sorted and disjoint foreground runs (start, end).
+ *
+ * @return The number of runs.
+ */
+static int row_runs(const uint32_t start[5], const uint32_t end[5], unsigned int cols, uint32_t runs[5][2]) {
+	int c, i, n = 0;
+	uint32_t s, e;
+
+	for (c = 0; c < 5; c++) {
+		if (!(cols & (1 << c)) || (start[c] >= end[c]))
+			continue;
+
+		// Insert sorted by start (cells widened by a big stroke may be out of order)
+		for (i = n; (i > 0) && (runs[i-1][0] > start[c]); i--) {
+			runs[i][0] = runs[i-1][0];
+			runs[i][1] = runs[i-1][1];
+		}
+		runs[i][0] = start[c];
+		runs[i][1] = end[c];
+		n++;
+	}
+
+	// Merge overlapping and adjacent runs
+	for (i = 0, c = 0; i < n; i++) {
+		s = runs[i][0];
+		e = runs[i][1];
+
+		if ((c > 0) && (s <= runs[c-1][1])) {
+			if (e > runs[c-1][1])
+				runs[c-1][1] = e;
+		} else {
+			runs[c][0] = s;
+			runs[c][1] = e;
+			c++;
+		}
+	}
+
+	return c;
+}
+
+
+/**
+ * Draw a row of the image, writing every pixel once.
+ *
+ * @param[out] row         The first pixel of the row.
+ * @param[in]  width       The row width (in pixels).
+ * @param[in]  runs        The foreground runs.
+ * @param[in]  n           The number of runs.
+ * @param[in]  fg          The foreground pixel value.
+ * @param[in]  bg          The background pixel value.
+ * @param[in]  transparent True if background pixels must be left untouched.
+ */
+static void draw_row(unsigned char *row, uint32_t width, const uint32_t runs[][2], int n, uint32_t fg, uint32_t bg,
+		bool transparent) {
+	uint32_t x = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!transparent)
+			fill_span(row + (4 * (size_t)x), bg, runs[i][0] - x);
+
+		fill_span(row + (4 * (size_t)runs[i][0]), fg, runs[i][1] - runs[i][0]);
+		x = runs[i][1];
+	}
+
+	if (!transparent)
+		fill_span(row + (4 * (size_t)x), bg, width - x);
+}
+
+
+/**
+ * Build the draw plan of a geometry.
+ *
+ * This is the only place where the geometry is computed with floating point
+ * math: drawing an identicon with a plan only picks and fills integer spans.
+ *
+ * @param[out] plan The draw plan.
+ * @param[in]  opts The identicon options (only the geometry is used).
+ */
+static void build_plan(identicon_plan_t *plan, const identicon_opts2_t *opts) {
+	static const unsigned int columns[3] = { 1 << 2, (1 << 1) | (1 << 3), (1 << 0) | (1 << 4) };
+	uint32_t cell, margin, y, next;
+	unsigned int rows, cols;
+	int i, g;
+
+	memset(plan, 0, sizeof(identicon_plan_t));
+	plan->size = opts->size;
+	plan->margin = opts->margin;
+	plan->transparent = opts->transparent;
+	plan->stroke = opts->stroke;
+	plan->stroke_size = opts->stroke_size;
+
+	cell = floor((opts->size - (floor(opts->size * opts->margin) * 2)) / 5);
+	margin = floor((opts->size - (cell * 5.0)) / 2);
+
+	// Rows and columns of cells share the same geometry
+	for (i = 0; i < 5; i++)
+		cell_span(opts, i * cell + margin, cell, &plan->start[i], &plan->end[i]);
+
+	// Foreground runs of every combination of mirrored columns
+	for (g = 0; g < 8; g++) {
+		cols = 0;
+		for (i = 0; i < 3; i++) {
+			if (g & (1 << i))
+				cols |= columns[i];
+		}
+
+		plan->run_count[g] = row_runs(plan->start, plan->end, cols, plan->runs[g]);
+	}
+
+	// Bands of pixel rows covered by the same rows of cells
+	for (y = 0; y < opts->size; y = next) {
+		rows = 0;
+		next = opts->size;
+		for (i = 0; i < 5; i++) {
+			if ((plan->start[i] <= y) && (y < plan->end[i])) {
+				rows |= 1 << i;
+				next = (plan->end[i] < next) ? plan->end[i] : next;
+			} else if ((plan->start[i] > y) && (plan->start[i] < next)) {
+				next = plan->start[i];
+			}
+		}
+
+		plan->bands[plan->band_count].y = y;
+		plan->bands[plan->band_count].height = next - y;
+		plan->bands[plan->band_count].rows = rows;
+		plan->band_count++;
+	}
+}
+
+
+/**
+ * Get the draw plan of a geometry from the per-thread plan cache.
+ *
+ * @param[in] opts The identicon options (only the geometry is used).
+ *
+ * @return The draw plan (valid until the next call from the same thread).
+ */
+const identicon_plan_t *identicon_cached_plan(const identicon_opts2_t *opts) {
+	static _Thread_local identicon_plan_t cache[PLAN_CACHE_SIZE];
+	static _Thread_local unsigned int cache_used = 0, cache_next = 0;
+	identicon_plan_t *plan;
+	unsigned int i;
+
+	for (i = 0; i < cache_used; i++) {
+		plan = &cache[i];
+		if ((plan->size == opts->size) && (plan->margin == opts->margin) &&
+				(plan->transparent == opts->transparent) && (plan->stroke == opts->stroke) &&
+				(plan->stroke_size == opts->stroke_size))
+			return plan;
+	}
+
+	plan = &cache[cache_next];
+	cache_next = (cache_next + 1) % PLAN_CACHE_SIZE;
+	if (cache_used < PLAN_CACHE_SIZE)
+		cache_used++;
+
+	build_plan(plan, opts);
+
+	return plan;
+}
+
+
+/**
+ * Draw the image described by a descriptor.
+ *
+ * The image is split in bands of rows covered by the same rows of cells: the
+ * foreground runs of a band are picked from the plan, its first row is drawn
+ * and the others are copies of it, so that every pixel is written exactly once.
+ *
+ * @param[in,out] img    The image (already allocated), pointing to its top-left pixel.
+ * @param[in]     stride The distance (in bytes) between two rows of the image.
+ * @param[in]     desc   The identicon descriptor.
+ * @param[in]     plan   The draw plan of the geometry.
+ */
+static void draw_plan(unsigned char *img, size_t stride, const identicon_descriptor_t *desc,
+		const identicon_plan_t *plan) {
+	static const identicon_RGB_t background = { 240, 240, 240 };
+	unsigned int g;
+	uint32_t y, fg, bg, b;
+	unsigned char *first;
+
+	if ((img == NULL) || (desc == NULL) || (plan == NULL))
+		return;
+
+	bg = pack_pixel(background, 255);
+	fg = pack_pixel(desc->foreground, 255);
+
+	for (b = 0; b < plan->band_count; b++) {
+		g = identicon_band_columns(plan, b, desc->pattern);
+
+		y = plan->bands[b].y;
+		first = img + ((size_t)y * stride);
+		draw_row(first, plan->size, plan->runs[g], plan->run_count[g], fg, bg, plan->transparent);
+
+		// The background is not ours to copy when the image is transparent
+		for (y++; y < plan->bands[b].y + plan->bands[b].height; y++) {
+			if (plan->transparent)
+				draw_row(img + ((size_t)y * stride), plan->size, plan->runs[g], plan->run_count[g], fg, bg, true);
+			else
+				memcpy(img + ((size_t)y * stride), first, 4 * (size_t)plan->size);
+		}
+	}
+}
+
+
+/**
+ * Draw the image described by a descriptor.
+ *
+ * @param[in,out] img    The image (already allocated), pointing to its top-left pixel.
+ * @param[in]     stride The distance (in bytes) between two rows of the image.
+ * @param[in]     desc   The identicon descriptor.
+ * @param[in]     opts   The identicon options (only the geometry is used).
+ */
+static void draw_descriptor(unsigned char *img, size_t stride, const identicon_descriptor_t *desc,
+		const identicon_opts2_t *opts) {
+	if ((img == NULL) || (desc == NULL) || (opts == NULL))
+		return;
+
+	draw_plan(img, stride, desc, identicon_cached_plan(opts));
+}
+
+
+/**
+ * Draw the image.
+ *
+ * @param[in,out] img    The image (already allocated), pointing to its top-left pixel.
+ * @param[in]     stride The distance (in bytes) between two rows of the image.
+ * @param[in]     opts   The identicon options.
+ *
+ * @return True if the image has been drawn, false if an error occurred (e.g. an invalid hash type).
+ */
+static bool draw_identicon(unsigned char *img, size_t stride, const identicon_opts2_t *opts) {
+	identicon_descriptor_t desc;
+
+	if ((img == NULL) || (opts == NULL))
+		return false;
+
+	if (!compute_descriptor(&desc, opts))
+		return false;
+
+	draw_descriptor(img, stride, &desc, opts);
+
+	return true;
+}
+
+
+/**
+ * Append formatted text to an SVG buffer.
+ *
+ * @param[in,out] svg The SVG buffer.
+ * @param[in]     fmt The format string (printf-like).
+ */
+static void svg_append(svg_buffer_t *svg, const char *fmt, ...) {
+	va_list args;
+	int ret;
+
+	if (svg->overflow)
+		return;
+
+	va_start(args, fmt);
+	if (svg->buf == NULL)
+		ret = vsnprintf(NULL, 0, fmt, args);
+	else
+		ret = vsnprintf(svg->buf + svg->len, svg->size - svg->len, fmt, args);
+	va_end(args);
+
+	if ((ret < 0) || ((svg->buf != NULL) && ((size_t)ret >= svg->size - svg->len)))
+		svg->overflow = true;
+	else
+		svg->len += ret;
+}
+
+
+/**
+ * Create a new set of default options.
+ *
+ * @return A new variable containing the default options or NULL if an error occurred.
+ */
+identicon_options_t *new_default_identicon_options() {
+	identicon_options_t *opts = identicon_malloc(sizeof(identicon_options_t));
+
+	if (opts != NULL) {
+		memset(opts->str, 0, IDENTICON_MAX_STRING_LENGTH);
+		memset(opts->salt, 0, IDENTICON_MAX_SALT_LENGTH);
+		opts->size = 64;
+		opts->margin = 0.08;
+		opts->transparent = true;
+		opts->stroke = true;
+		opts->stroke_size = 1;
+		opts->hash_type = IDENTICON_HASH_MD5;
+	}
+
+	return opts;
+}
+
+
+/**
+ * Set compact options to the defaults (empty key and salt).
+ *
+ * @param[out] opts The options.
+ */
+void identicon_opts2_init(identicon_opts2_t *opts) {
+	if (opts == NULL)
+		return;
+
+	opts->key = NULL;
+	opts->key_len = 0;
+	opts->salt = NULL;
+	opts->salt_len = 0;
+	opts->size = 64;
+	opts->margin = 0.08;
+	opts->transparent = true;
+	opts->stroke = true;
+	opts->stroke_size = 1;
+	opts->hash_type = IDENTICON_HASH_MD5;
+}
+
+
+/**
+ * Get compact options pointing to the strings of legacy options.
+ *
+ * Nothing is copied: opts2 refers to opts->str and opts->salt, so opts must
+ * outlive it.
+ *
+ * @param[out] opts2 The compact options.
+ * @param[in]  opts  The legacy options.
+ *
+ * @return opts2 or NULL if opts is NULL.
+ */
+const identicon_opts2_t *identicon_opts2_from_options(identicon_opts2_t *opts2, const identicon_options_t *opts) {
+	if (opts == NULL)
+		return NULL;
+
+	opts2->key = opts->str;
+	opts2->key_len = strnlen(opts->str, IDENTICON_MAX_STRING_LENGTH);
+	opts2->salt = opts->salt;
+	opts2->salt_len = strnlen(opts->salt, IDENTICON_MAX_SALT_LENGTH);
+	opts2->size = opts->size;
+	opts2->margin = opts->margin;
+	opts2->transparent = opts->transparent;
+	opts2->stroke = opts->stroke;
+	opts2->stroke_size = opts->stroke_size;
+	opts2->hash_type = opts->hash_type;
+
+	return opts2;
+}
+
+
+/**
+ * Select the hash backend providing MD5, SHA1, SHA256 and SHA512.
+ *
+ * IDENTICON_BACKEND_AUTO runs a short self-benchmark and picks the fastest backend
+ * for each hash type, among the ones giving the standard digest (libsodium is never
+ * picked for MD5 and SHA1 that way). Until this is called, the backend chosen at build
+ * time is used.
+ *
+ * @param[in] backend The hash backend.
+ *
+ * @return True if the backend has been selected, false if it isn't built in.
+ */
+bool identicon_set_hash_backend(identicon_hash_backend_t backend) {
+	int i;
+
+	if (backend == IDENTICON_BACKEND_AUTO) {
+		for (i = 0; i < BACKEND_HASH_TYPES; i++)
+			__atomic_store_n(&hash_backend[i], fastest_backend(i), __ATOMIC_RELAXED);
+
+		return true;
+	}
+
+	if (!backend_init(backend))
+		return false;
+
+	for (i = 0; i < BACKEND_HASH_TYPES; i++)
+		__atomic_store_n(&hash_backend[i], backend, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+
+/**
+ * Get the hash backend used for a hash type.
+ *
+ * @param[in] hash_type The hash type.
+ *
+ * @return The hash backend (IDENTICON_BACKEND_BUILTIN for the hash types that only
+ *         have a built in implementation).
+ */
+identicon_hash_backend_t identicon_get_hash_backend(identicon_hash_t hash_type) {
+	return current_backend(hash_type);
+}
+
+/**
+ * Create a new identicon.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return A new variable containing the identicon or NULL if an error occurred.
+ */
+unsigned char *new_identicon(identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return new_identicon2(identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Create a new identicon from compact options.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return A new variable containing the identicon or NULL if an error occurred.
+ */
+unsigned char *new_identicon2(const identicon_opts2_t *opts) {
+	unsigned char *img = NULL;
+
+	if (opts == NULL)
+		return NULL;
+
+	img = identicon_calloc(identicon_image_size2(opts), sizeof(unsigned char));
+	if (!draw_identicon(img, (size_t)opts->size * 4, opts)) {
+		identicon_free(img);
+		return NULL;
+	}
+
+	return img;
+}
+
+
+/**
+ * Draw an identicon into an existing buffer without any heap allocation.
+ *
+ * The buffer is RGBA and must hold at least (y + opts->size) rows of stride bytes;
+ * pixels outside the identicon are left untouched, as well as the background
+ * ones if opts->transparent is true. The one allocation is the state of the
+ * digest that OpenSSL 3 allocates when it is the hash backend.
+ *
+ * @param[in,out] buf    The destination buffer.
+ * @param[in]     stride The distance (in bytes) between two rows of the buffer.
+ * @param[in]     x      The X coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     y      The Y coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     opts   The identicon options.
+ *
+ * @return True if the identicon has been drawn, false if an error occurred.
+ */
+bool identicon_render_into(unsigned char *buf, size_t stride, uint32_t x, uint32_t y, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_render_into2(buf, stride, x, y, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Draw an identicon into an existing buffer from compact options.
+ *
+ * Same as identicon_render_into().
+ *
+ * @param[in,out] buf    The destination buffer.
+ * @param[in]     stride The distance (in bytes) between two rows of the buffer.
+ * @param[in]     x      The X coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     y      The Y coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     opts   The identicon options.
+ *
+ * @return True if the identicon has been drawn, false if an error occurred.
+ */
+bool identicon_render_into2(unsigned char *buf, size_t stride, uint32_t x, uint32_t y, const identicon_opts2_t *opts) {
+	if ((buf == NULL) || (opts == NULL))
+		return false;
+
+	if (stride / 4 < (size_t)x + opts->size)
+		return false;
+
+	return draw_identicon(buf + ((size_t)y * stride) + ((size_t)x * 4), stride, opts);
+}
+
+
+/**
+ * Compute the descriptor of an identicon (the only part depending on the hash).
+ *
+ * @param[in]  opts The identicon options (the geometry is not used).
+ * @param[out] desc The descriptor.
+ *
+ * @return True if the descriptor has been computed, false if an error occurred.
+ */
+bool identicon_compute_descriptor(identicon_options_t *opts, identicon_descriptor_t *desc) {
+	identicon_opts2_t opts2;
+
+	return compute_descriptor(desc, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Compute the descriptor of an identicon from compact options.
+ *
+ * @param[in]  opts The identicon options (the geometry is not used).
+ * @param[out] desc The descriptor.
+ *
+ * @return True if the descriptor has been computed, false if an error occurred.
+ */
+bool identicon_compute_descriptor2(const identicon_opts2_t *opts, identicon_descriptor_t *desc) {
+	return compute_descriptor(desc, opts);
+}
+
+
+/**
+ * Compute the descriptors of many identicons.
+ *
+ * The keys are hashed in groups, so this is faster than calling
+ * identicon_compute_descriptor() for each of them.
+ *
+ * @param[in]  keys  The keys (opts->str is ignored, keys with a NULL string are skipped).
+ * @param[in]  count The number of keys.
+ * @param[in]  opts  The identicon options (the geometry is not used).
+ * @param[out] descs The descriptors (one per key).
+ *
+ * @return True if the descriptors have been computed, false if an error occurred.
+ */
+bool identicon_compute_descriptors(const identicon_key_t *keys, size_t count, identicon_options_t *opts,
+		identicon_descriptor_t *descs) {
+	identicon_opts2_t opts2;
+
+	return identicon_compute_descriptors2(keys, count, identicon_opts2_from_options(&opts2, opts), descs);
+}
+
+
+/**
+ * Compute the descriptors of many identicons from compact options.
+ *
+ * Same as identicon_compute_descriptors().
+ *
+ * @param[in]  keys  The keys (opts->key is ignored, keys with a NULL string are skipped).
+ * @param[in]  count The number of keys.
+ * @param[in]  opts  The identicon options (the geometry is not used).
+ * @param[out] descs The descriptors (one per key).
+ *
+ * @return True if the descriptors have been computed, false if an error occurred.
+ */
+bool identicon_compute_descriptors2(const identicon_key_t *keys, size_t count, const identicon_opts2_t *opts,
+		identicon_descriptor_t *descs) {
+	unsigned char hashes[BATCH_CHUNK_SIZE][MAX_DIGEST_SIZE];
+	size_t i, j, n, hash_len;
+
+	if ((keys == NULL) || (opts == NULL) || (descs == NULL) || ((opts->salt == NULL) && (opts->salt_len != 0)))
+		return false;
+
+	for (i = 0; i < count; i += n) {
+		n = ((count - i) < BATCH_CHUNK_SIZE) ? count - i : BATCH_CHUNK_SIZE;
+
+		hash_len = checksum_batch(hashes, keys + i, n, opts->salt, opts->salt_len, opts->hash_type);
+
+		for (j = 0; j < n; j++) {
+			if (keys[i + j].str == NULL)
+				continue;
+
+			if (hash_len == 0)
+				return false;
+
+			identicon_digest_descriptor(&descs[i + j], hashes[j], hash_len);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Draw the identicon described by a descriptor into an existing buffer.
+ *
+ * Same as identicon_render_into(), but no hash is computed: only the geometry
+ * in the options is used, so one descriptor can be drawn at any size.
+ *
+ * @param[in,out] buf    The destination buffer.
+ * @param[in]     stride The distance (in bytes) between two rows of the buffer.
+ * @param[in]     x      The X coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     y      The Y coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     desc   The identicon descriptor.
+ * @param[in]     opts   The identicon options (only the geometry is used).
+ *
+ * @return True if the identicon has been drawn, false if an error occurred.
+ */
+bool identicon_render_descriptor(unsigned char *buf, size_t stride, uint32_t x, uint32_t y,
+		const identicon_descriptor_t *desc, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_render_descriptor2(buf, stride, x, y, desc, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Draw the identicon described by a descriptor into an existing buffer from compact options.
+ *
+ * Same as identicon_render_descriptor().
+ *
+ * @param[in,out] buf    The destination buffer.
+ * @param[in]     stride The distance (in bytes) between two rows of the buffer.
+ * @param[in]     x      The X coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     y      The Y coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     desc   The identicon descriptor.
+ * @param[in]     opts   The identicon options (only the geometry is used).
+ *
+ * @return True if the identicon has been drawn, false if an error occurred.
+ */
+bool identicon_render_descriptor2(unsigned char *buf, size_t stride, uint32_t x, uint32_t y,
+		const identicon_descriptor_t *desc, const identicon_opts2_t *opts) {
+	if ((buf == NULL) || (desc == NULL) || (opts == NULL))
+		return false;
+
+	if (stride / 4 < (size_t)x + opts->size)
+		return false;
+
+	draw_descriptor(buf + ((size_t)y * stride) + ((size_t)x * 4), stride, desc, opts);
+
+	return true;
+}
+
+
+/**
+ * Build the draw plan of a geometry.
+ *
+ * A plan holds the integer spans shared by every identicon drawn with the same
+ * size, margin, stroke and transparency: keeping one around makes drawing only
+ * pick spans by the pattern bits and fill them.
+ *
+ * @param[out] plan The draw plan.
+ * @param[in]  opts The identicon options (only the geometry is used).
+ *
+ * @return True if the plan has been built, false if an error occurred.
+ */
+bool identicon_plan_init(identicon_plan_t *plan, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_plan_init2(plan, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Build the draw plan of a geometry from compact options.
+ *
+ * @param[out] plan The draw plan.
+ * @param[in]  opts The identicon options (only the geometry is used).
+ *
+ * @return True if the plan has been built, false if an error occurred.
+ */
+bool identicon_plan_init2(identicon_plan_t *plan, const identicon_opts2_t *opts) {
+	if ((plan == NULL) || (opts == NULL))
+		return false;
+
+	build_plan(plan, opts);
+
+	return true;
+}
+
+
+/**
+ * Draw the identicon described by a descriptor using a draw plan.
+ *
+ * Same as identicon_render_descriptor(), with the geometry taken from the plan.
+ *
+ * @param[in,out] buf    The destination buffer.
+ * @param[in]     stride The distance (in bytes) between two rows of the buffer.
+ * @param[in]     x      The X coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     y      The Y coordinate (in pixels) of the identicon top-left corner.
+ * @param[in]     desc   The identicon descriptor.
+ * @param[in]     plan   The draw plan.
+ *
+ * @return True if the identicon has been drawn, false if an error occurred.
+ */
+bool identicon_render_plan(unsigned char *buf, size_t stride, uint32_t x, uint32_t y,
+		const identicon_descriptor_t *desc, const identicon_plan_t *plan) {
+	if ((buf == NULL) || (desc == NULL) || (plan == NULL))
+		return false;
+
+	if (stride / 4 < (size_t)x + plan->size)
+		return false;
+
+	draw_plan(buf + ((size_t)y * stride) + ((size_t)x * 4), stride, desc, plan);
+
+	return true;
+}
+
+
+/**
+ * Render an identicon one row at a time into a single reusable row buffer.
+ *
+ * row_cb is called for every row, from top to bottom, with the same buffer of
+ * 4 * opts->size RGBA bytes (e.g. to hand it to png_write_row()). The rows of
+ * a band of cells are all equal, so the buffer is only redrawn when a band
+ * starts and is left unchanged between the calls of a band. The background is
+ * fully transparent (all zeroes) if opts->transparent is true.
+ *
+ * @param[in] opts   The identicon options.
+ * @param[in] row_cb The row callback (returning false stops the rendering).
+ * @param[in] user   The user data passed to row_cb.
+ *
+ * @return True if all the rows have been rendered, false if an error occurred
+ *         or row_cb stopped the rendering.
+ */
+bool identicon_render_rows(identicon_options_t *opts, identicon_row_callback_t row_cb, void *user) {
+	identicon_opts2_t opts2;
+
+	return identicon_render_rows2(identicon_opts2_from_options(&opts2, opts), row_cb, user);
+}
+
+
+/**
+ * Render an identicon one row at a time from compact options.
+ *
+ * Same as identicon_render_rows().
+ *
+ * @param[in] opts   The identicon options.
+ * @param[in] row_cb The row callback (returning false stops the rendering).
+ * @param[in] user   The user data passed to row_cb.
+ *
+ * @return True if all the rows have been rendered, false if an error occurred
+ *         or row_cb stopped the rendering.
+ */
+bool identicon_render_rows2(const identicon_opts2_t *opts, identicon_row_callback_t row_cb, void *user) {
+	unsigned char *row;
+	bool ok;
+
+	if ((opts == NULL) || (row_cb == NULL) || (opts->size == 0))
+		return false;
+
+	row = identicon_malloc(4 * (size_t)opts->size);
+	if (row == NULL)
+		return false;
+
+	ok = identicon_render_rows_buffer(opts, row, row_cb, user);
+
+	identicon_free(row);
+
+	return ok;
+}
+
+
+/**
+ * Render an identicon one row at a time into a given row buffer.
+ *
+ * Same as identicon_render_rows2(), without any heap allocation.
+ *
+ * @param[in]     opts   The identicon options.
+ * @param[in,out] row    The row buffer (4 * opts->size bytes).
+ * @param[in]     row_cb The row callback (returning false stops the rendering).
+ * @param[in]     user   The user data passed to row_cb.
+ *
+ * @return True if all the rows have been rendered, false if an error occurred
+ *         or row_cb stopped the rendering.
+ */
+bool identicon_render_rows_buffer(const identicon_opts2_t *opts, unsigned char *row, identicon_row_callback_t row_cb,
+		void *user) {
+	static const identicon_RGB_t background = { 240, 240, 240 };
+	identicon_descriptor_t desc;
+	identicon_plan_t plan;
+	uint32_t b, y, fg, bg;
+	unsigned int g;
+	bool ok = true;
+
+	if ((opts == NULL) || (row == NULL) || (row_cb == NULL) || (opts->size == 0))
+		return false;
+
+	if (!compute_descriptor(&desc, opts))
+		return false;
+
+	// A copy, as row_cb may draw other identicons and evict the cached plan
+	plan = *identicon_cached_plan(opts);
+
+	bg = opts->transparent ? 0 : pack_pixel(background, 255);
+	fg = pack_pixel(desc.foreground, 255);
+
+	for (b = 0; ok && (b < plan.band_count); b++) {
+		g = identicon_band_columns(&plan, b, desc.pattern);
+		draw_row(row, plan.size, plan.runs[g], plan.run_count[g], fg, bg, false);
+
+		for (y = plan.bands[b].y; ok && (y < plan.bands[b].y + plan.bands[b].height); y++)
+			ok = row_cb(row, y, user);
+	}
+
+	return ok;
+}
+
+
+/**
+ * Serialize a descriptor into IDENTICON_DESCRIPTOR_SIZE bytes.
+ *
+ * @param[in]  desc The identicon descriptor.
+ * @param[out] buf  The serialized descriptor.
+ */
+void identicon_descriptor_pack(const identicon_descriptor_t *desc, uint8_t buf[IDENTICON_DESCRIPTOR_SIZE]) {
+	if ((desc == NULL) || (buf == NULL))
+		return;
+
+	buf[0] = desc->pattern & 0xff;
+	buf[1] = (desc->pattern >> 8) & 0x7f;
+	buf[2] = desc->foreground.red;
+	buf[3] = desc->foreground.green;
+	buf[4] = desc->foreground.blue;
+}
+
+
+/**
+ * Deserialize a descriptor from IDENTICON_DESCRIPTOR_SIZE bytes.
+ *
+ * @param[out] desc The identicon descriptor.
+ * @param[in]  buf  The serialized descriptor.
+ */
+void identicon_descriptor_unpack(identicon_descriptor_t *desc, const uint8_t buf[IDENTICON_DESCRIPTOR_SIZE]) {
+	if ((desc == NULL) || (buf == NULL))
+		return;
+
+	desc->pattern = buf[0] | ((buf[1] & 0x7f) << 8);
+	desc->foreground.red = buf[2];
+	desc->foreground.green = buf[3];
+	desc->foreground.blue = buf[4];
+}
+
+
+/**
+ * Get the size (in bytes) of a single identicon image.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return The size of the RGBA image described by the options or 0 if an error occurred.
+ */
+size_t identicon_image_size(identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_image_size2(identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Get the size (in bytes) of a single identicon image from compact options.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return The size of the RGBA image described by the options or 0 if an error occurred.
+ */
+size_t identicon_image_size2(const identicon_opts2_t *opts) {
+	if (opts == NULL)
+		return 0;
+
+	return (size_t)opts->size * opts->size * 4;
+}
+
+
+/**
+ * Render many identicons into a single contiguous arena.
+ *
+ * Image i is written at offset i * identicon_image_size(opts) of the arena;
+ * all the images share the same geometry, salt and hash type. Keys are
+ * hashed several at a time in SIMD lanes (see identicon-c_multihash.c).
+ *
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->str is ignored).
+ * @param[in,out] arena The destination arena (count * identicon_image_size(opts) bytes)
+ *                      or NULL to let the library allocate a zeroed one.
+ *
+ * @return The arena containing the identicons (to be freed by the caller if
+ *         allocated by the library) or NULL if an error occurred.
+ */
+unsigned char *identicon_render_batch(const identicon_key_t *keys, size_t count, identicon_options_t *opts,
+		unsigned char *arena) {
+	identicon_opts2_t opts2;
+
+	return identicon_render_batch2(keys, count, identicon_opts2_from_options(&opts2, opts), arena);
+}
+
+
+/**
+ * Render many identicons into a single contiguous arena from compact options.
+ *
+ * Same as identicon_render_batch().
+ *
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->key is ignored).
+ * @param[in,out] arena The destination arena (count * identicon_image_size2(opts) bytes)
+ *                      or NULL to let the library allocate a zeroed one.
+ *
+ * @return The arena containing the identicons (to be freed by the caller if
+ *         allocated by the library) or NULL if an error occurred.
+ */
+unsigned char *identicon_render_batch2(const identicon_key_t *keys, size_t count, const identicon_opts2_t *opts,
+		unsigned char *arena) {
+	unsigned char hashes[BATCH_CHUNK_SIZE][MAX_DIGEST_SIZE];
+	identicon_descriptor_t desc;
+	unsigned char *img = NULL;
+	size_t i, j, n, img_size, hash_len;
+
+	if ((keys == NULL) || (opts == NULL) || (count == 0) || ((opts->salt == NULL) && (opts->salt_len != 0)))
+		return NULL;
+
+	img_size = identicon_image_size2(opts);
+
+	if ((img_size == 0) || (count > SIZE_MAX / img_size))
+		return NULL;
+
+	img = arena;
+	if (img == NULL)
+		img = identicon_calloc(count, img_size);
+
+	if (img == NULL)
+		return NULL;
+
+	for (i = 0; i < count; i += n) {
+		n = ((count - i) < BATCH_CHUNK_SIZE) ? count - i : BATCH_CHUNK_SIZE;
+
+		hash_len = checksum_batch(hashes, keys + i, n, opts->salt, opts->salt_len, opts->hash_type);
+
+		for (j = 0; j < n; j++) {
+			if (keys[i + j].str == NULL)
+				continue;
+
+			// A chunk of keys with NULL strings only has no hash length
+			if (hash_len == 0) {
+				if (arena == NULL)
+					identicon_free(img);
+				return NULL;
+			}
+
+			identicon_digest_descriptor(&desc, hashes[j], hash_len);
+			draw_descriptor(img + ((i + j) * img_size), (size_t)opts->size * 4, &desc, opts);
+		}
+	}
+
+	return img;
+}
+
+
+/**
+ * Get an upper bound of the size of an SVG identicon.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return The number of bytes (including the terminating NUL byte) that is always
+ *         enough for identicon_write_svg() or 0 if an error occurred.
+ */
+size_t identicon_svg_size_bound(identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_svg_size_bound2(identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Get an upper bound of the size of an SVG identicon from compact options.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return The number of bytes (including the terminating NUL byte) that is always
+ *         enough for identicon_write_svg2() or 0 if an error occurred.
+ */
+size_t identicon_svg_size_bound2(const identicon_opts2_t *opts) {
+	if (opts == NULL)
+		return 0;
+
+	return SVG_FIXED_SIZE + (25 * SVG_CELL_SIZE);
+}
+
+
+/**
+ * Write the identicon described by a descriptor as an SVG image.
+ *
+ * Adjacent cells are merged into as few rectangles as possible and all of
+ * them are drawn by a single path element.
+ *
+ * @param[in]  desc     The identicon descriptor.
+ * @param[in]  opts     The identicon options (only the geometry is used).
+ * @param[out] buf      The destination buffer or NULL to only get the needed size.
+ * @param[in]  buf_size The size of the destination buffer.
+ *
+ * @return The length of the SVG image (excluding the terminating NUL byte) if buf
+ *         is not NULL, the size needed to store it (including the terminating NUL
+ *         byte) if buf is NULL, or 0 if an error occurred (or buf is too small).
+ */
+size_t identicon_write_svg(const identicon_descriptor_t *desc, identicon_options_t *opts, char *buf,
+		size_t buf_size) {
+	identicon_opts2_t opts2;
+
+	return identicon_write_svg2(desc, identicon_opts2_from_options(&opts2, opts), buf, buf_size);
+}
+
+
+/**
+ * Write the identicon described by a descriptor as an SVG image from compact options.
+ *
+ * Same as identicon_write_svg().
+ *
+ * @param[in]  desc     The identicon descriptor.
+ * @param[in]  opts     The identicon options (only the geometry is used).
+ * @param[out] buf      The destination buffer or NULL to only get the needed size.
+ * @param[in]  buf_size The size of the destination buffer.
+ *
+ * @return The length of the SVG image (excluding the terminating NUL byte) if buf
+ *         is not NULL, the size needed to store it (including the terminating NUL
+ *         byte) if buf is NULL, or 0 if an error occurred (or buf is too small).
+ */
+size_t identicon_write_svg2(const identicon_descriptor_t *desc, const identicon_opts2_t *opts, char *buf,
+		size_t buf_size) {
+	int col, row, c, r, col_end, row_end;
+	uint32_t x0, x1, y0, y1;
+	const identicon_plan_t *plan;
+	bool used[5][5];
+	bool painted;
+	svg_buffer_t svg;
+
+	if ((desc == NULL) || (opts == NULL) || ((buf != NULL) && (buf_size == 0)))
+		return 0;
+
+	// A NULL buffer only measures the output
+	svg.buf = buf;
+	svg.size = buf_size;
+	svg.len = 0;
+	svg.overflow = false;
+
+	plan = identicon_cached_plan(opts);
+
+	svg_append(&svg, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" height=\"%u\" "
+			"viewBox=\"0 0 %u %u\" shape-rendering=\"crispEdges\">", opts->size, opts->size, opts->size, opts->size);
+
+	if (!opts->transparent)
+		svg_append(&svg, "<rect width=\"%u\" height=\"%u\" fill=\"#f0f0f0\"/>", opts->size, opts->size);
+
+	// Greedily merge painted cells into rectangles: extend right first, then down
+	memset(used, 0, sizeof(used));
+	painted = false;
+	for (row = 0; row < 5; row++) {
+		for (col = 0; col < 5; col++) {
+			if (used[col][row] || !grid_cell(desc->pattern, col, row))
+				continue;
+
+			for (col_end = col + 1; col_end < 5; col_end++) {
+				if (used[col_end][row] || !grid_cell(desc->pattern, col_end, row))
+					break;
+			}
+
+			for (row_end = row + 1; row_end < 5; row_end++) {
+				for (c = col; c < col_end; c++) {
+					if (used[c][row_end] || !grid_cell(desc->pattern, c, row_end))
+						break;
+				}
+				if (c < col_end)
+					break;
+			}
+
+			// The union of the (widened) cells of a block is a rectangle
+			x0 = y0 = opts->size;
+			x1 = y1 = 0;
+			for (c = col; c < col_end; c++) {
+				x0 = (plan->start[c] < x0) ? plan->start[c] : x0;
+				x1 = (plan->end[c] > x1) ? plan->end[c] : x1;
+			}
+			for (r = row; r < row_end; r++) {
+				y0 = (plan->start[r] < y0) ? plan->start[r] : y0;
+				y1 = (plan->end[r] > y1) ? plan->end[r] : y1;
+
+				for (c = col; c < col_end; c++)
+					used[c][r] = true;
+			}
+
+			if ((x0 >= x1) || (y0 >= y1))
+				continue;
+
+			if (!painted) {
+				svg_append(&svg, "<path fill=\"#%02x%02x%02x\" d=\"", desc->foreground.red,
+						desc->foreground.green, desc->foreground.blue);
+				painted = true;
+			}
+
+			svg_append(&svg, "M%u %uh%uv%uh-%uz", x0, y0, x1 - x0, y1 - y0, x1 - x0);
+		}
+	}
+
+	if (painted)
+		svg_append(&svg, "\"/>");
+
+	svg_append(&svg, "</svg>");
+
+	if (svg.overflow)
+		return 0;
+
+	return (buf == NULL) ? svg.len + 1 : svg.len;
+}
+
+
+#if defined(HAVE_LIBPNG)
+/**
+ * Get row pointers into an identicon array image (facility for libpng).
+ *
+ * Nothing is copied: the row pointers alias img, so only the returned array
+ * must be freed (with identicon_free()) and img must outlive it.
+ *
+ * @param[in] img  The image (already allocated).
+ * @param[in] opts The identicon options.
+ *
+ * @return A new array of opts->size row pointers or NULL if an error occurred.
+ */
+png_byte **png_new_identicon_from_array(unsigned char *img, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return png_new_identicon_from_array2(img, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Get row pointers into an identicon array image from compact options (facility for libpng).
+ *
+ * Same as png_new_identicon_from_array().
+ *
+ * @param[in] img  The image (already allocated).
+ * @param[in] opts The identicon options.
+ *
+ * @return A new array of opts->size row pointers or NULL if an error occurred.
+ */
+png_byte **png_new_identicon_from_array2(unsigned char *img, const identicon_opts2_t *opts) {
+	png_byte **row_pointers = NULL;
+	uint32_t y;
+
+	if ((img == NULL) || (opts == NULL) || (opts->size == 0))
+		return NULL;
+
+	row_pointers = identicon_malloc(sizeof(png_byte *) * opts->size);
+	if (row_pointers == NULL)
+		return NULL;
+
+	for (y = 0; y < opts->size; y++)
+		row_pointers[y] = img + ((size_t)y * opts->size * 4);
+
+	return row_pointers;
+}
+
+
+/**
+ * Create a new identicon (facility for libpng).
+ *
+ * The row pointers and the image are allocated as a single block, so the
+ * whole identicon is freed with a single identicon_free() of the returned array.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return A new variable containing the identicon or NULL if an error occurred.
+ */
+png_byte **png_new_identicon(identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return png_new_identicon2(identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Create a new identicon from compact options (facility for libpng).
+ *
+ * Same as png_new_identicon().
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return A new variable containing the identicon or NULL if an error occurred.
+ */
+png_byte **png_new_identicon2(const identicon_opts2_t *opts) {
+	png_byte **row_pointers = NULL;
+	unsigned char *img;
+	size_t img_size;
+	uint32_t y;
+
+	if (opts == NULL)
+		return NULL;
+
+	img_size = identicon_image_size2(opts);
+	if ((img_size == 0) || (img_size > SIZE_MAX - (sizeof(png_byte *) * opts->size)))
+		return NULL;
+
+	row_pointers = identicon_calloc((sizeof(png_byte *) * opts->size) + img_size, 1);
+	if (row_pointers == NULL)
+		return NULL;
+
+	img = (unsigned char *)(row_pointers + opts->size);
+	if (!draw_identicon(img, (size_t)opts->size * 4, opts)) {
+		identicon_free(row_pointers);
+		return NULL;
+	}
+
+	for (y = 0; y < opts->size; y++)
+		row_pointers[y] = img + ((size_t)y * opts->size * 4);
+
+	return row_pointers;
+}
+
+
+/**
+ * Pack a row of the image as 1 bit palette indices (1 for the foreground).
+ *
+ * @param[out] row   The packed row ((width + 7) / 8 bytes, leftmost pixel in the most significant bit).
+ * @param[in]  width The row width (in pixels).
+ * @param[in]  runs  The foreground runs.
+ * @param[in]  n     The number of runs.
+ */
+static void pack_row(unsigned char *row, uint32_t width, const uint32_t runs[][2], int n) {
+	uint32_t x;
+	int i;
+
+	memset(row, 0, ((size_t)width + 7) / 8);
+
+	for (i = 0; i < n; i++) {
+		for (x = runs[i][0]; x < runs[i][1]; x++)
+			row[x / 8] |= 0x80 >> (x % 8);
+	}
+}
+
+
+/**
+ * Write an identicon as a 1 bit palette image with libpng (facility for libpng).
+ *
+ * Only the image chunks are set by this function (IHDR, PLTE and tRNS if
+ * transparent): other chunks can be set in info_ptr before calling it. Rows
+ * are streamed from a single packed row buffer, without any RGBA frame.
+ * The caller must have set the error jump buffer of png_ptr (setjmp()): a
+ * libpng error is passed on to it after freeing the row buffer.
+ *
+ * @param[in] png_ptr  The libpng write structure (with its output set).
+ * @param[in] info_ptr The libpng info structure.
+ * @param[in] opts     The identicon options.
+ *
+ * @return True if the identicon has been written, false if an error occurred.
+ */
+bool png_write_identicon(png_structp png_ptr, png_infop info_ptr, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return png_write_identicon2(png_ptr, info_ptr, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Write an identicon as a 1 bit palette image with libpng from compact options (facility for libpng).
+ *
+ * Same as png_write_identicon().
+ *
+ * @param[in] png_ptr  The libpng write structure (with its output set).
+ * @param[in] info_ptr The libpng info structure.
+ * @param[in] opts     The identicon options.
+ *
+ * @return True if the identicon has been written, false if an error occurred.
+ */
+bool png_write_identicon2(png_structp png_ptr, png_infop info_ptr, const identicon_opts2_t *opts) {
+	identicon_descriptor_t desc;
+	identicon_plan_t plan;
+	png_color palette[2];
+	png_byte alpha = 0;
+	unsigned char *row;
+	jmp_buf saved;
+	uint32_t b, y;
+	unsigned int g;
+
+	if ((png_ptr == NULL) || (info_ptr == NULL) || (opts == NULL) || (opts->size == 0) ||
+			(opts->size > PNG_UINT_31_MAX))
+		return false;
+
+	if (!compute_descriptor(&desc, opts))
+		return false;
+
+	plan = *identicon_cached_plan(opts);
+
+	row = identicon_malloc(((size_t)plan.size + 7) / 8);
+	if (row == NULL)
+		return false;
+
+	memcpy(saved, png_jmpbuf(png_ptr), sizeof(jmp_buf));
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		identicon_free(row);
+		memcpy(png_jmpbuf(png_ptr), saved, sizeof(jmp_buf));
+		png_longjmp(png_ptr, 1);
+	}
+
+	palette[0].red = opts->transparent ? 0 : 240;
+	palette[0].green = opts->transparent ? 0 : 240;
+	palette[0].blue = opts->transparent ? 0 : 240;
+	palette[1].red = desc.foreground.red;
+	palette[1].green = desc.foreground.green;
+	palette[1].blue = desc.foreground.blue;
+
+	png_set_IHDR(png_ptr, info_ptr, plan.size, plan.size, 1, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(png_ptr, info_ptr, palette, 2);
+	if (opts->transparent)
+		png_set_tRNS(png_ptr, info_ptr, &alpha, 1, NULL);
+
+	// Filters do not help a palette image whose rows repeat, long matches do
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+	png_set_compression_level(png_ptr, 9);
+
+	png_write_info(png_ptr, info_ptr);
+
+	for (b = 0; b < plan.band_count; b++) {
+		g = identicon_band_columns(&plan, b, desc.pattern);
+		pack_row(row, plan.size, plan.runs[g], plan.run_count[g]);
+
+		for (y = 0; y < plan.bands[b].height; y++)
+			png_write_row(png_ptr, row);
+	}
+
+	png_write_end(png_ptr, info_ptr);
+
+	memcpy(png_jmpbuf(png_ptr), saved, sizeof(jmp_buf));
+	identicon_free(row);
+
+	return true;
+}
+
+
+/**
+ * Allocate memory for libpng with the allocator given to png_create_write_struct_2().
+ *
+ * @param[in] png_ptr The libpng write structure.
+ * @param[in] size    The number of bytes.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+static png_voidp png_identicon_malloc(png_structp png_ptr, png_alloc_size_t size) {
+	return identicon_malloc_with(png_get_mem_ptr(png_ptr), size);
+}
+
+
+/**
+ * Free memory of libpng with the allocator given to png_create_write_struct_2().
+ *
+ * @param[in] png_ptr The libpng write structure.
+ * @param[in] ptr     The memory (may be NULL).
+ */
+static void png_identicon_free(png_structp png_ptr, png_voidp ptr) {
+	identicon_free_with(png_get_mem_ptr(png_ptr), ptr);
+}
+
+
+/**
+ * Create a libpng write structure whose allocations go through the allocator of the library.
+ *
+ * The allocator is the one of the calling thread when the structure is
+ * created; the structure is freed as usual with png_destroy_write_struct().
+ *
+ * @param[in] error_ptr The user data of the error functions (may be NULL).
+ * @param[in] error_fn  The error function (NULL for the default one).
+ * @param[in] warn_fn   The warning function (NULL for the default one).
+ *
+ * @return The write structure or NULL if an error occurred.
+ */
+png_structp png_create_identicon_write_struct(png_voidp error_ptr, png_error_ptr error_fn, png_error_ptr warn_fn) {
+	return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, error_ptr, error_fn, warn_fn,
+			(png_voidp)identicon_allocator(), png_identicon_malloc, png_identicon_free);
 }
 #endif
@@ -19,11 +19,15 @@
 #ifndef IDENTICON_H
 #define IDENTICON_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #define IDENTICON_MAX_STRING_LENGTH 4096
 #define IDENTICON_MAX_SALT_LENGTH 1024
+#define IDENTICON_DESCRIPTOR_SIZE 5
+#define IDENTICON_PNG_SEGMENTS 4
+#define IDENTICON_PNG_PALETTE_SIZE 31
 
 
 // RGB color space
@@ -33,15 +37,27 @@ typedef struct identicon_RGB_t {
 	uint8_t blue;
 } identicon_RGB_t;
 
-// Hash type
+// Hash type (XXH3_128 and BLAKE3 are faster but give different identicons than the other types for the same string)
 typedef enum identicon_hash_t {
 	IDENTICON_HASH_MD5,
 	IDENTICON_HASH_SHA1,
 	IDENTICON_HASH_SHA256,
 	IDENTICON_HASH_SHA512,
+	IDENTICON_HASH_XXH3_128, // Non-cryptographic, 16-byte canonical (big-endian) digest
+	IDENTICON_HASH_BLAKE3, // 32-byte digest
+	IDENTICON_HASH_BLAKE2B_128, // Same identicons as IDENTICON_HASH_MD5 in a libsodium build
+	IDENTICON_HASH_BLAKE2B_160, // Same identicons as IDENTICON_HASH_SHA1 in a libsodium build
 } identicon_hash_t;
 
-// Identicon options
+// Hash backend (provider of MD5, SHA1, SHA256 and SHA512)
+typedef enum identicon_hash_backend_t {
+	IDENTICON_BACKEND_AUTO, // Fastest backend giving the standard digest, for each hash type
+	IDENTICON_BACKEND_BUILTIN, // coreutils (always available)
+	IDENTICON_BACKEND_OPENSSL, // Built with USE_OPENSSL
+	IDENTICON_BACKEND_SODIUM, // Built with USE_SODIUM, MD5 and SHA1 are BLAKE2b-128/160 (different identicons)
+} identicon_hash_backend_t;
+
+// Identicon options (fixed size strings, kept for compatibility with identicon_opts2_t)
 typedef struct identicon_options_t {
 	char str[IDENTICON_MAX_STRING_LENGTH];
 	char salt[IDENTICON_MAX_SALT_LENGTH];
@@ -53,11 +69,391 @@ typedef struct identicon_options_t {
 	identicon_hash_t hash_type;
 } identicon_options_t;
 
+// Compact identicon options (key and salt are borrowed, binary-safe and of any length)
+typedef struct identicon_opts2_t {
+	const void *key;
+	size_t key_len;
+	const void *salt; // May be NULL if salt_len is 0
+	size_t salt_len;
+	uint32_t size;
+	double margin;
+	bool transparent;
+	bool stroke;
+	uint32_t stroke_size;
+	identicon_hash_t hash_type;
+} identicon_opts2_t;
+
+// Identicon descriptor (all that the hash contributes to an identicon)
+typedef struct identicon_descriptor_t {
+	uint16_t pattern; // Bit i set if cell i is painted (0-4 middle column, 5-9 and 10-14 mirrored outwards)
+	identicon_RGB_t foreground;
+} identicon_descriptor_t;
+
+// Draw plan of a geometry (integer spans shared by every identicon with that geometry)
+typedef struct identicon_plan_t {
+	uint32_t size;
+	double margin;
+	bool transparent;
+	bool stroke;
+	uint32_t stroke_size;
+	uint32_t start[5]; // First pixel covered by each row (and column) of cells
+	uint32_t end[5]; // Pixel after the last one covered by each row (and column) of cells
+	uint32_t runs[8][5][2]; // Foreground runs of each combination of mirrored columns
+	int run_count[8];
+	struct {
+		uint32_t y;
+		uint32_t height;
+		unsigned int rows; // Rows of cells covering the band
+	} bands[11];
+	uint32_t band_count;
+} identicon_plan_t;
+
+// Row callback of identicon_render_rows() (return false to stop)
+typedef bool (*identicon_row_callback_t)(const unsigned char *row, uint32_t y, void *user);
+
+// PNG template cache of a geometry
+typedef struct identicon_png_cache_t identicon_png_cache_t;
+
+// Pool of worker threads for batches
+typedef struct identicon_pool_t identicon_pool_t;
+
+// Memory allocator (user is given back to every function)
+typedef struct identicon_allocator_t {
+	void *(*malloc)(size_t size, void *user);
+	void *(*realloc)(void *ptr, size_t size, void *user); // Like realloc(), ptr may be NULL
+	void (*free)(void *ptr, void *user); // ptr is never NULL
+	void *user;
+} identicon_allocator_t;
+
+// Bump arena allocator (one thread at a time)
+typedef struct identicon_arena_t identicon_arena_t;
+
+// Reusable scratch state (one thread at a time)
+typedef struct identicon_ctx_t identicon_ctx_t;
+
+// Reusable lodepng encoder (one thread at a time)
+typedef struct identicon_encoder_t identicon_encoder_t;
+
+// Stages of a pipeline
+typedef enum identicon_stage_t {
+	IDENTICON_STAGE_HASH,
+	IDENTICON_STAGE_RENDER, // Only used with an encoder callback
+	IDENTICON_STAGE_ENCODE,
+	IDENTICON_STAGE_WRITE,
+	IDENTICON_STAGES
+} identicon_stage_t;
+
+// Multi-stage pipeline for bulk jobs
+typedef struct identicon_pipeline_t identicon_pipeline_t;
+
+// Encoder callback of a pipeline or a pool (returns an identicon_malloc()ed image and sets its length, NULL on error)
+// Its threads use the allocator current when the pipeline was created, which must then be thread safe
+typedef unsigned char *(*identicon_encode_callback_t)(const unsigned char *img, uint32_t size, size_t *len,
+		void *user);
+
+// Output callback of a pipeline (called in input order, return false to stop)
+typedef bool (*identicon_output_callback_t)(size_t index, const unsigned char *data, size_t len, void *user);
+
+// Configuration of a pipeline
+typedef struct identicon_pipeline_config_t {
+	unsigned int workers[IDENTICON_STAGES]; // Threads of each stage (the write stage is the calling thread)
+	size_t chunk_size; // Keys of an item
+	size_t items; // Items in flight (bounds the memory of the pipeline)
+	size_t queue_depth; // Capacity of the queue in front of each stage
+	identicon_encode_callback_t encode; // NULL for the built-in PNG writer (no render stage)
+	void *encode_user;
+	identicon_output_callback_t output;
+	void *output_user;
+} identicon_pipeline_config_t;
+
+// Statistics of a stage of a pipeline
+typedef struct identicon_stage_stats_t {
+	unsigned int workers;
+	uint64_t items; // Items processed
+	size_t queue_depth; // Items waiting in the queue of the stage (free items for the hash stage)
+	size_t queue_max_depth;
+	uint64_t wait_ns; // Time spent waiting for an item
+	uint64_t stall_ns; // Time spent waiting for room in the next queue (back-pressure)
+} identicon_stage_stats_t;
+
+// Part of an output (data and length, as in a struct iovec)
+typedef struct identicon_segment_t {
+	const unsigned char *data;
+	size_t len;
+} identicon_segment_t;
+
+// Parts of a PNG identicon (head, PLTE, IDAT and IEND chunks)
+typedef struct identicon_png_parts_t {
+	identicon_segment_t segments[IDENTICON_PNG_SEGMENTS];
+	unsigned char palette[IDENTICON_PNG_PALETTE_SIZE];
+} identicon_png_parts_t;
+
+// Key of a batch rendering (not necessarily NUL terminated)
+typedef struct identicon_key_t {
+	const char *str;
+	size_t len;
+} identicon_key_t;
+
+// Statistics of the batch functions (since the last reset)
+typedef struct identicon_batch_stats_t {
+	uint64_t prefix_keys; // Keys hashed resuming from the context of a shared prefix (or from scratch before one)
+	uint64_t prefix_blocks; // Blocks compressed for those keys
+	uint64_t prefix_blocks_saved; // Blocks of shared prefixes not compressed again
+} identicon_batch_stats_t;
+
+
+// Set the allocator of the library and of the bundled encoders (NULL for the system one, before any allocation)
+bool identicon_set_allocator(const identicon_allocator_t *allocator);
+
+// Allocate, resize and free memory with the allocator of the calling thread (free what the library returns)
+void *identicon_malloc(size_t size);
+void *identicon_calloc(size_t count, size_t size);
+void *identicon_realloc(void *ptr, size_t size);
+void identicon_free(void *ptr);
+
+// Create a bump arena (its blocks come from the current allocator, size 0 for a default first block)
+identicon_arena_t *new_identicon_arena(size_t size);
+
+// Free a bump arena and everything allocated from it
+void free_identicon_arena(identicon_arena_t *arena);
+
+// Free everything allocated from a bump arena at once (e.g. after each image)
+void identicon_arena_reset(identicon_arena_t *arena);
+
+// Get the allocator of a bump arena
+const identicon_allocator_t *identicon_arena_allocator(const identicon_arena_t *arena);
+
+// Get the number of bytes used in a bump arena since the last reset (and the peak)
+size_t identicon_arena_used(const identicon_arena_t *arena, size_t *peak);
 
 // Create a new set of default options
 identicon_options_t *new_default_identicon_options();
 
+// Set compact options to the defaults (no allocation)
+void identicon_opts2_init(identicon_opts2_t *opts);
+
+// Select the hash backend (IDENTICON_BACKEND_AUTO picks the fastest one for each hash type)
+// OpenSSL 3 allocates (with its own allocator) for every digest, the other backends never allocate
+bool identicon_set_hash_backend(identicon_hash_backend_t backend);
+
+// Get the hash backend used for a hash type
+identicon_hash_backend_t identicon_get_hash_backend(identicon_hash_t hash_type);
+
 // Create a new identicon
 unsigned char *new_identicon(identicon_options_t *opts);
+unsigned char *new_identicon2(const identicon_opts2_t *opts);
+
+// Draw an identicon into an existing RGBA buffer at (x, y) (no heap allocation, but see the OpenSSL backend)
+bool identicon_render_into(unsigned char *buf, size_t stride, uint32_t x, uint32_t y, identicon_options_t *opts);
+bool identicon_render_into2(unsigned char *buf, size_t stride, uint32_t x, uint32_t y, const identicon_opts2_t *opts);
+
+// Compute the descriptor of an identicon (hash only, no drawing)
+bool identicon_compute_descriptor(identicon_options_t *opts, identicon_descriptor_t *desc);
+bool identicon_compute_descriptor2(const identicon_opts2_t *opts, identicon_descriptor_t *desc);
+
+// Compute the descriptors of many identicons (keys are hashed back to back or in SIMD lanes)
+bool identicon_compute_descriptors(const identicon_key_t *keys, size_t count, identicon_options_t *opts,
+		identicon_descriptor_t *descs);
+bool identicon_compute_descriptors2(const identicon_key_t *keys, size_t count, const identicon_opts2_t *opts,
+		identicon_descriptor_t *descs);
+
+// Draw a descriptor into an existing RGBA buffer at (x, y) using the geometry in opts
+bool identicon_render_descriptor(unsigned char *buf, size_t stride, uint32_t x, uint32_t y,
+		const identicon_descriptor_t *desc, identicon_options_t *opts);
+bool identicon_render_descriptor2(unsigned char *buf, size_t stride, uint32_t x, uint32_t y,
+		const identicon_descriptor_t *desc, const identicon_opts2_t *opts);
+
+// Build the draw plan of a geometry
+bool identicon_plan_init(identicon_plan_t *plan, identicon_options_t *opts);
+bool identicon_plan_init2(identicon_plan_t *plan, const identicon_opts2_t *opts);
+
+// Draw a descriptor into an existing RGBA buffer at (x, y) using a draw plan
+bool identicon_render_plan(unsigned char *buf, size_t stride, uint32_t x, uint32_t y,
+		const identicon_descriptor_t *desc, const identicon_plan_t *plan);
+
+// Render an identicon one row at a time into a single reusable RGBA row buffer (O(size) memory)
+bool identicon_render_rows(identicon_options_t *opts, identicon_row_callback_t row_cb, void *user);
+bool identicon_render_rows2(const identicon_opts2_t *opts, identicon_row_callback_t row_cb, void *user);
+
+// Serialize a descriptor into IDENTICON_DESCRIPTOR_SIZE bytes
+void identicon_descriptor_pack(const identicon_descriptor_t *desc, uint8_t buf[IDENTICON_DESCRIPTOR_SIZE]);
+
+// Deserialize a descriptor from IDENTICON_DESCRIPTOR_SIZE bytes
+void identicon_descriptor_unpack(identicon_descriptor_t *desc, const uint8_t buf[IDENTICON_DESCRIPTOR_SIZE]);
+
+// Get an upper bound of the size of an SVG identicon (including the terminating NUL byte)
+size_t identicon_svg_size_bound(identicon_options_t *opts);
+size_t identicon_svg_size_bound2(const identicon_opts2_t *opts);
+
+// Write a descriptor as an SVG image (buf == NULL returns the needed size)
+size_t identicon_write_svg(const identicon_descriptor_t *desc, identicon_options_t *opts, char *buf,
+		size_t buf_size);
+size_t identicon_write_svg2(const identicon_descriptor_t *desc, const identicon_opts2_t *opts, char *buf,
+		size_t buf_size);
+
+// Get an upper bound of the size of a PNG identicon
+size_t identicon_png_size_bound(identicon_options_t *opts);
+size_t identicon_png_size_bound2(const identicon_opts2_t *opts);
+
+// Write a descriptor as a 1 bit palette PNG image (buf == NULL returns the needed size)
+size_t identicon_write_png(const identicon_descriptor_t *desc, identicon_options_t *opts, unsigned char *buf,
+		size_t buf_size);
+size_t identicon_write_png2(const identicon_descriptor_t *desc, const identicon_opts2_t *opts, unsigned char *buf,
+		size_t buf_size);
+
+// Create the PNG template cache of a geometry (IDAT chunks of every cell pattern, filled lazily)
+identicon_png_cache_t *new_identicon_png_cache(identicon_options_t *opts);
+identicon_png_cache_t *new_identicon_png_cache2(const identicon_opts2_t *opts);
+
+// Free a PNG template cache
+void free_identicon_png_cache(identicon_png_cache_t *cache);
+
+// Encode the IDAT chunks of all the cell patterns of a PNG template cache
+bool identicon_png_cache_fill(identicon_png_cache_t *cache);
+
+// Get the parts of a PNG identicon from a template cache (for writev() style output)
+size_t identicon_png_cache_parts(identicon_png_cache_t *cache, const identicon_descriptor_t *desc,
+		identicon_png_parts_t *parts);
+
+// Write a PNG identicon from a template cache (buf == NULL returns the needed size)
+size_t identicon_png_cache_write(identicon_png_cache_t *cache, const identicon_descriptor_t *desc,
+		unsigned char *buf, size_t buf_size);
+
+// Get the size (in bytes) of a single identicon image
+size_t identicon_image_size(identicon_options_t *opts);
+size_t identicon_image_size2(const identicon_opts2_t *opts);
+
+// Render many identicons into a single arena (one image every identicon_image_size() bytes)
+unsigned char *identicon_render_batch(const identicon_key_t *keys, size_t count, identicon_options_t *opts,
+		unsigned char *arena);
+unsigned char *identicon_render_batch2(const identicon_key_t *keys, size_t count, const identicon_opts2_t *opts,
+		unsigned char *arena);
+
+// Get the statistics of the batch functions
+void identicon_get_batch_stats(identicon_batch_stats_t *stats);
+
+// Reset the statistics of the batch functions
+void identicon_reset_batch_stats(void);
+
+// Create a pool of worker threads (0 for one per online CPU, the calling thread is one of them)
+identicon_pool_t *new_identicon_pool(unsigned int threads);
+
+// Free a pool of worker threads
+void free_identicon_pool(identicon_pool_t *pool);
+
+// Get the number of threads of a pool
+unsigned int identicon_pool_threads(const identicon_pool_t *pool);
+
+// Render many identicons into a single arena with the threads of a pool (same layout as identicon_render_batch())
+unsigned char *identicon_pool_render_batch(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts, unsigned char *arena);
+unsigned char *identicon_pool_render_batch2(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts, unsigned char *arena);
+
+// Write many PNG identicons with the threads of a pool (one every identicon_png_size_bound() bytes, in input order)
+unsigned char *identicon_pool_write_png(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts, identicon_png_cache_t *cache, unsigned char *out, size_t *lens);
+unsigned char *identicon_pool_write_png2(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts, identicon_png_cache_t *cache, unsigned char *out, size_t *lens);
+
+// Encode many identicons with the threads of a pool (each worker draws into its own buffer and calls encode with
+// users[worker index], NULL encode for a lodepng encoder per worker; images in input order, freed with identicon_free())
+bool identicon_pool_encode(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts, identicon_encode_callback_t encode, void *const *users, unsigned char **images,
+		size_t *lens);
+bool identicon_pool_encode2(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts, identicon_encode_callback_t encode, void *const *users, unsigned char **images,
+		size_t *lens);
+
+// Set the configuration of a pipeline to the defaults
+void identicon_pipeline_config_init(identicon_pipeline_config_t *config);
+
+// Create a multi-stage pipeline (all of its memory is allocated here)
+identicon_pipeline_t *new_identicon_pipeline(const identicon_opts2_t *opts, const identicon_pipeline_config_t *config);
+
+// Free a multi-stage pipeline
+void free_identicon_pipeline(identicon_pipeline_t *pipeline);
+
+// Generate the identicons of many keys with a pipeline (output in input order)
+bool identicon_pipeline_run(identicon_pipeline_t *pipeline, const identicon_key_t *keys, size_t count);
+
+// Get the statistics of the stages of a pipeline (IDENTICON_STAGES elements)
+void identicon_pipeline_get_stats(identicon_pipeline_t *pipeline, identicon_stage_stats_t *stats);
+
+// Create a context holding reusable scratch state (use one per thread)
+identicon_ctx_t *new_identicon_ctx(void);
+
+// Free a context
+void free_identicon_ctx(identicon_ctx_t *ctx);
+
+// Get the number of allocations made by a context (stops growing once warmed up)
+uint64_t identicon_ctx_allocations(const identicon_ctx_t *ctx);
+
+// Set the allocator used while the functions of a context run (NULL for the one of the calling thread)
+void identicon_ctx_set_allocator(identicon_ctx_t *ctx, const identicon_allocator_t *allocator);
+
+// Use a bump arena while the functions of a context run, reset when the next one starts (NULL for none)
+void identicon_ctx_set_arena(identicon_ctx_t *ctx, identicon_arena_t *arena);
+
+// Make the allocator of a context the one of the calling thread (e.g. around an external encoder)
+void identicon_ctx_enter(identicon_ctx_t *ctx);
+void identicon_ctx_leave(identicon_ctx_t *ctx);
+
+// Create a new identicon in a context (valid until the next call with the same context)
+unsigned char *identicon_ctx_render(identicon_ctx_t *ctx, identicon_options_t *opts);
+unsigned char *identicon_ctx_render2(identicon_ctx_t *ctx, const identicon_opts2_t *opts);
+
+// Render an identicon one row at a time into the row buffer of a context
+bool identicon_ctx_render_rows(identicon_ctx_t *ctx, identicon_options_t *opts, identicon_row_callback_t row_cb,
+		void *user);
+bool identicon_ctx_render_rows2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, identicon_row_callback_t row_cb,
+		void *user);
+
+// Compute the descriptors of many identicons into a context
+const identicon_descriptor_t *identicon_ctx_compute_descriptors(identicon_ctx_t *ctx, const identicon_key_t *keys,
+		size_t count, identicon_options_t *opts);
+const identicon_descriptor_t *identicon_ctx_compute_descriptors2(identicon_ctx_t *ctx, const identicon_key_t *keys,
+		size_t count, const identicon_opts2_t *opts);
+
+// Render many identicons into the arena of a context (same layout as identicon_render_batch())
+unsigned char *identicon_ctx_render_batch(identicon_ctx_t *ctx, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts);
+unsigned char *identicon_ctx_render_batch2(identicon_ctx_t *ctx, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts);
+
+// Write an identicon as a 1 bit palette PNG image into the output buffer of a context
+const unsigned char *identicon_ctx_write_png(identicon_ctx_t *ctx, identicon_options_t *opts, size_t *len);
+const unsigned char *identicon_ctx_write_png2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len);
+
+// Write an identicon as an SVG image into the output buffer of a context
+const char *identicon_ctx_write_svg(identicon_ctx_t *ctx, identicon_options_t *opts, size_t *len);
+const char *identicon_ctx_write_svg2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len);
+
+// Empty the output buffer of a context (and clear an error of identicon_ctx_write_func())
+void identicon_ctx_reset_output(identicon_ctx_t *ctx);
+
+// Append bytes to the output buffer of a context (a stbi_write_func for stbi_write_png_to_func())
+void identicon_ctx_write_func(void *ctx, void *data, int size);
+
+// Get the output buffer of a context (NULL if identicon_ctx_write_func() has dropped bytes since the last reset)
+const unsigned char *identicon_ctx_output(const identicon_ctx_t *ctx, size_t *len);
+
+// Encode an identicon with the lodepng encoder of a context into its output buffer (same bytes as lodepng_encode32())
+const unsigned char *identicon_ctx_encode(identicon_ctx_t *ctx, identicon_options_t *opts, size_t *len);
+const unsigned char *identicon_ctx_encode2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len);
+
+// Create a PNG encoder keeping the lodepng state and the deflate hash chains between images (use one per thread)
+identicon_encoder_t *new_identicon_encoder(void);
+
+// Free a PNG encoder
+void free_identicon_encoder(identicon_encoder_t *encoder);
+
+// Encode an RGBA identicon as a PNG image (same bytes as lodepng_encode32(), freed with identicon_free())
+unsigned char *identicon_encoder_encode(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size,
+		size_t *len);
+
+// Encode an RGBA identicon as a PNG file (same bytes as lodepng_encode32_file())
+bool identicon_encoder_encode_file(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size,
+		const char *filename);
 
 #endif
@@ -0,0 +1,588 @@
+/**
+ * identicon-c_alloc.c - Functions to route the allocations of the library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * Every allocation of the library (and of the bundled encoders, through
+ * their allocation hooks) goes through the allocator of the calling thread:
+ * the one of the context whose function is running, if it has one, or the
+ * global one set by identicon_set_allocator(). Objects that outlive a call
+ * (caches, pools, pipelines, contexts) remember the allocator they were
+ * created with and free their memory with it.
+ *
+ * The bump arena hands out memory from large blocks and frees everything at
+ * once when it is reset, e.g. after each image.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+// Alignment of the allocations of an arena
+#define ARENA_ALIGNMENT 16
+
+// Size of the first block of an arena if none is given
+#define ARENA_DEFAULT_SIZE 65536
+
+
+// Block of an arena
+typedef struct arena_block_t {
+	struct arena_block_t *next;
+	size_t size;
+	size_t used;
+	size_t last; // Offset of the last allocation (the only one that can grow in place)
+	_Alignas(ARENA_ALIGNMENT) unsigned char data[];
+} arena_block_t;
+
+// Header of an allocation of an arena
+typedef struct arena_header_t {
+	_Alignas(ARENA_ALIGNMENT) size_t size;
+} arena_header_t;
+
+// Bump arena
+struct identicon_arena_t {
+	identicon_allocator_t parent; // Allocator of the blocks
+	identicon_allocator_t allocator;
+	arena_block_t *blocks; // Newest first
+	size_t capacity;
+	size_t used;
+	size_t peak;
+};
+
+
+/**
+ * Allocate memory with the system allocator.
+ *
+ * @param[in] size The number of bytes.
+ * @param[in] user Unused.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+static void *system_malloc(size_t size, void *user) {
+	(void)user;
+
+	return malloc(size);
+}
+
+
+/**
+ * Resize memory with the system allocator.
+ *
+ * @param[in] ptr  The memory (may be NULL).
+ * @param[in] size The new number of bytes.
+ * @param[in] user Unused.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+static void *system_realloc(void *ptr, size_t size, void *user) {
+	(void)user;
+
+	return realloc(ptr, size);
+}
+
+
+/**
+ * Free memory with the system allocator.
+ *
+ * @param[in] ptr  The memory (may be NULL).
+ * @param[in] user Unused.
+ */
+static void system_free(void *ptr, void *user) {
+	(void)user;
+
+	free(ptr);
+}
+
+
+// Allocator used when no other one is set
+static const identicon_allocator_t system_allocator = { system_malloc, system_realloc, system_free, NULL };
+
+// Global allocator and allocator of the running context function (per thread)
+static identicon_allocator_t global_allocator = { system_malloc, system_realloc, system_free, NULL };
+static _Thread_local const identicon_allocator_t *thread_allocator = NULL;
+
+
+/**
+ * Set the global allocator of the library.
+ *
+ * It must be set before the library allocates anything (and not while
+ * other threads use the library): memory is freed by the allocator that
+ * allocated it.
+ *
+ * @param[in] allocator The allocator (copied) or NULL for the system one.
+ *
+ * @return True if the allocator has been set, false if one of its functions is missing.
+ */
+bool identicon_set_allocator(const identicon_allocator_t *allocator) {
+	if (allocator == NULL) {
+		global_allocator = system_allocator;
+		return true;
+	}
+
+	if ((allocator->malloc == NULL) || (allocator->realloc == NULL) || (allocator->free == NULL))
+		return false;
+
+	global_allocator = *allocator;
+
+	return true;
+}
+
+
+/**
+ * Get the allocator of the calling thread.
+ *
+ * @return The allocator of the running context function or the global one.
+ */
+const identicon_allocator_t *identicon_allocator(void) {
+	return (thread_allocator != NULL) ? thread_allocator : &global_allocator;
+}
+
+
+/**
+ * Make an allocator the one of the calling thread.
+ *
+ * @param[in] allocator The allocator (must stay valid until identicon_allocator_pop()).
+ *
+ * @return The previous allocator of the thread (for identicon_allocator_pop()).
+ */
+const identicon_allocator_t *identicon_allocator_push(const identicon_allocator_t *allocator) {
+	const identicon_allocator_t *previous = thread_allocator;
+
+	thread_allocator = allocator;
+
+	return previous;
+}
+
+
+/**
+ * Restore the allocator of the calling thread.
+ *
+ * @param[in] previous The value returned by identicon_allocator_push().
+ */
+void identicon_allocator_pop(const identicon_allocator_t *previous) {
+	thread_allocator = previous;
+}
+
+
+/**
+ * Allocate memory with an allocator.
+ *
+ * @param[in] allocator The allocator.
+ * @param[in] size      The number of bytes.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+void *identicon_malloc_with(const identicon_allocator_t *allocator, size_t size) {
+	return allocator->malloc(size, allocator->user);
+}
+
+
+/**
+ * Allocate zeroed memory with an allocator.
+ *
+ * @param[in] allocator The allocator.
+ * @param[in] count     The number of elements.
+ * @param[in] size      The size of an element.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+void *identicon_calloc_with(const identicon_allocator_t *allocator, size_t count, size_t size) {
+	void *ptr;
+
+	if ((size != 0) && (count > SIZE_MAX / size))
+		return NULL;
+
+	ptr = allocator->malloc(count * size, allocator->user);
+	if (ptr != NULL)
+		memset(ptr, 0, count * size);
+
+	return ptr;
+}
+
+
+/**
+ * Resize memory with an allocator.
+ *
+ * @param[in] allocator The allocator.
+ * @param[in] ptr       The memory (may be NULL).
+ * @param[in] size      The new number of bytes.
+ *
+ * @return The memory or NULL if an error occurred (ptr is left untouched).
+ */
+void *identicon_realloc_with(const identicon_allocator_t *allocator, void *ptr, size_t size) {
+	return allocator->realloc(ptr, size, allocator->user);
+}
+
+
+/**
+ * Free memory with an allocator.
+ *
+ * @param[in] allocator The allocator.
+ * @param[in] ptr       The memory (may be NULL).
+ */
+void identicon_free_with(const identicon_allocator_t *allocator, void *ptr) {
+	if (ptr != NULL)
+		allocator->free(ptr, allocator->user);
+}
+
+
+/**
+ * Allocate memory with the allocator of the calling thread.
+ *
+ * @param[in] size The number of bytes.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+void *identicon_malloc(size_t size) {
+	return identicon_malloc_with(identicon_allocator(), size);
+}
+
+
+/**
+ * Allocate zeroed memory with the allocator of the calling thread.
+ *
+ * @param[in] count The number of elements.
+ * @param[in] size  The size of an element.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+void *identicon_calloc(size_t count, size_t size) {
+	return identicon_calloc_with(identicon_allocator(), count, size);
+}
+
+
+/**
+ * Resize memory with the allocator of the calling thread.
+ *
+ * @param[in] ptr  The memory (may be NULL).
+ * @param[in] size The new number of bytes.
+ *
+ * @return The memory or NULL if an error occurred (ptr is left untouched).
+ */
+void *identicon_realloc(void *ptr, size_t size) {
+	return identicon_realloc_with(identicon_allocator(), ptr, size);
+}
+
+
+/**
+ * Free memory with the allocator of the calling thread (e.g. what the library returns).
+ *
+ * @param[in] ptr The memory (may be NULL).
+ */
+void identicon_free(void *ptr) {
+	identicon_free_with(identicon_allocator(), ptr);
+}
+
+
+/**
+ * Allocation hooks of the bundled lodepng (built with LODEPNG_NO_COMPILE_ALLOCATORS).
+ *
+ * Like the rest of the bundled lodepng, they are not exported by the shared
+ * library, so that they cannot clash with the ones of another lodepng.
+ */
+IDENTICON_HIDDEN void *lodepng_malloc(size_t size) {
+	return identicon_malloc(size);
+}
+
+IDENTICON_HIDDEN void *lodepng_realloc(void *ptr, size_t new_size) {
+	return identicon_realloc(ptr, new_size);
+}
+
+IDENTICON_HIDDEN void lodepng_free(void *ptr) {
+	identicon_free(ptr);
+}
+
+
+/**
+ * Round a size up to the alignment of an arena.
+ *
+ * @param[in] size The size.
+ *
+ * @return The rounded size or 0 if it overflows.
+ */
+static inline size_t arena_round(size_t size) {
+	if (size > SIZE_MAX - (ARENA_ALIGNMENT - 1))
+		return 0;
+
+	return (size + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+
+/**
+ * Add a block to an arena.
+ *
+ * @param[in,out] arena The arena.
+ * @param[in]     size  The minimum size of the block.
+ *
+ * @return The block or NULL if an error occurred.
+ */
+static arena_block_t *arena_grow(identicon_arena_t *arena, size_t size) {
+	arena_block_t *block;
+
+	if ((arena->blocks != NULL) && (size < arena->blocks->size * 2) && (arena->blocks->size <= SIZE_MAX / 4))
+		size = arena->blocks->size * 2;
+
+	if (size > SIZE_MAX - sizeof(arena_block_t))
+		return NULL;
+
+	block = identicon_malloc_with(&arena->parent, sizeof(arena_block_t) + size);
+	if (block == NULL)
+		return NULL;
+
+	block->next = arena->blocks;
+	block->size = size;
+	block->used = 0;
+	block->last = SIZE_MAX;
+	arena->blocks = block;
+	arena->capacity += size;
+
+	return block;
+}
+
+
+/**
+ * Allocate memory from an arena.
+ *
+ * @param[in] size The number of bytes.
+ * @param[in] user The arena.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+static void *arena_malloc(size_t size, void *user) {
+	identicon_arena_t *arena = user;
+	arena_block_t *block = arena->blocks;
+	arena_header_t *header;
+	size_t need = arena_round(size);
+
+	if ((need == 0 && size != 0) || (need > SIZE_MAX - sizeof(arena_header_t)))
+		return NULL;
+
+	need += sizeof(arena_header_t);
+
+	if ((block == NULL) || (block->size - block->used < need)) {
+		block = arena_grow(arena, need);
+		if (block == NULL)
+			return NULL;
+	}
+
+	header = (arena_header_t *)(block->data + block->used);
+	header->size = size;
+	block->last = block->used;
+	block->used += need;
+
+	arena->used += need;
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+
+	return header + 1;
+}
+
+
+/**
+ * Resize memory of an arena (in place if it is the last allocation of the current block).
+ *
+ * @param[in] ptr  The memory (may be NULL).
+ * @param[in] size The new number of bytes.
+ * @param[in] user The arena.
+ *
+ * @return The memory or NULL if an error occurred.
+ */
+static void *arena_realloc(void *ptr, size_t size, void *user) {
+	identicon_arena_t *arena = user;
+	arena_block_t *block = arena->blocks;
+	arena_header_t *header;
+	size_t old_need, need;
+	void *copy;
+
+	if (ptr == NULL)
+		return arena_malloc(size, user);
+
+	header = (arena_header_t *)ptr - 1;
+	if (size <= header->size) {
+		header->size = size;
+		return ptr;
+	}
+
+	need = arena_round(size);
+	old_need = arena_round(header->size);
+	if ((need != 0) && (block != NULL) && ((unsigned char *)header == block->data + block->last) &&
+			(need - old_need <= block->size - block->used)) {
+		block->used += need - old_need;
+		arena->used += need - old_need;
+		if (arena->used > arena->peak)
+			arena->peak = arena->used;
+		header->size = size;
+		return ptr;
+	}
+
+	copy = arena_malloc(size, user);
+	if (copy != NULL)
+		memcpy(copy, ptr, header->size);
+
+	return copy;
+}
+
+
+/**
+ * Free memory of an arena (only the last allocation of the current block is given back before a reset).
+ *
+ * @param[in] ptr  The memory.
+ * @param[in] user The arena.
+ */
+static void arena_free(void *ptr, void *user) {
+	identicon_arena_t *arena = user;
+	arena_block_t *block = arena->blocks;
+	arena_header_t *header = (arena_header_t *)ptr - 1;
+	size_t need;
+
+	if ((block == NULL) || ((unsigned char *)header != block->data + block->last))
+		return;
+
+	need = block->used - block->last;
+	block->used = block->last;
+	block->last = SIZE_MAX;
+	arena->used -= need;
+}
+
+
+/**
+ * Create a bump arena.
+ *
+ * Its blocks are allocated with the allocator of the calling thread. An arena is not
+ * locked: it can be used by one thread at a time.
+ *
+ * @param[in] size The size of the first block (0 for a default size).
+ *
+ * @return The arena or NULL if an error occurred.
+ */
+identicon_arena_t *new_identicon_arena(size_t size) {
+	const identicon_allocator_t *parent = identicon_allocator();
+	identicon_arena_t *arena;
+
+	arena = identicon_calloc_with(parent, 1, sizeof(identicon_arena_t));
+	if (arena == NULL)
+		return NULL;
+
+	arena->parent = *parent;
+	arena->allocator.malloc = arena_malloc;
+	arena->allocator.realloc = arena_realloc;
+	arena->allocator.free = arena_free;
+	arena->allocator.user = arena;
+
+	if (arena_grow(arena, (size != 0) ? arena_round(size) : ARENA_DEFAULT_SIZE) == NULL) {
+		identicon_free_with(parent, arena);
+		return NULL;
+	}
+
+	return arena;
+}
+
+
+/**
+ * Free a bump arena (and everything allocated from it).
+ *
+ * @param[in] arena The arena (may be NULL).
+ */
+void free_identicon_arena(identicon_arena_t *arena) {
+	arena_block_t *block, *next;
+	identicon_allocator_t parent;
+
+	if (arena == NULL)
+		return;
+
+	parent = arena->parent;
+
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		identicon_free_with(&parent, block);
+	}
+
+	identicon_free_with(&parent, arena);
+}
+
+
+/**
+ * Free everything allocated from a bump arena.
+ *
+ * If the arena had to grow, its blocks are replaced by a single one as big
+ * as all of them, so that the next image fits in it.
+ *
+ * @param[in,out] arena The arena.
+ */
+void identicon_arena_reset(identicon_arena_t *arena) {
+	arena_block_t *block, *next;
+	size_t capacity;
+
+	if (arena == NULL)
+		return;
+
+	if ((arena->blocks != NULL) && (arena->blocks->next != NULL)) {
+		capacity = arena->capacity;
+
+		for (block = arena->blocks; block != NULL; block = next) {
+			next = block->next;
+			identicon_free_with(&arena->parent, block);
+		}
+
+		arena->blocks = NULL;
+		arena->capacity = 0;
+		arena_grow(arena, capacity);
+	}
+
+	if (arena->blocks != NULL) {
+		arena->blocks->used = 0;
+		arena->blocks->last = SIZE_MAX;
+	}
+
+	arena->used = 0;
+}
+
+
+/**
+ * Get the allocator of a bump arena.
+ *
+ * @param[in] arena The arena.
+ *
+ * @return The allocator (valid as long as the arena) or NULL if arena is NULL.
+ */
+const identicon_allocator_t *identicon_arena_allocator(const identicon_arena_t *arena) {
+	if (arena == NULL)
+		return NULL;
+
+	return &arena->allocator;
+}
+
+
+/**
+ * Get the number of bytes used in a bump arena.
+ *
+ * @param[in]  arena The arena.
+ * @param[out] peak  The biggest number of bytes used since the arena was created (may be NULL).
+ *
+ * @return The number of bytes used since the last reset.
+ */
+size_t identicon_arena_used(const identicon_arena_t *arena, size_t *peak) {
+	if (arena == NULL)
+		return 0;
+
+	if (peak != NULL)
+		*peak = arena->peak;
+
+	return arena->used;
+}
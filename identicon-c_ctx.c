@@ -0,0 +1,811 @@
+/**
+ * identicon-c_ctx.c - Functions to generate identicons with reusable scratch state.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * A context owns the buffers that the other functions allocate on every
+ * call: the image, the row buffer, the descriptors of a batch and the output
+ * of the writers, as well as a lodepng encoder (identicon_encoder_t) created
+ * the first time identicon_ctx_encode() needs it. Buffers only grow, so once they have reached the size of
+ * the biggest identicon (or batch) a context is used for, no function here
+ * allocates any more. Hash contexts and digests live on the stack, so they
+ * never need any allocation, except with the OpenSSL backend: its contexts
+ * are kept per thread, but OpenSSL 3 allocates the state of every digest
+ * (with its own allocator, not the one of the context).
+ *
+ * A context is not locked: it can be used by one thread at a time, so every
+ * thread should have its own. What a function returns points into the
+ * context and is valid until the next call with the same context.
+ *
+ * The buffers come from the allocator current when the context is created.
+ * Everything else allocated while a function of the context runs (or between
+ * identicon_ctx_enter() and identicon_ctx_leave(), e.g. around an encoder)
+ * comes from the allocator of the context: its bump arena, reset when the
+ * next one of these calls starts, or its own allocator.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+
+// Buffer of a context (only grows)
+typedef struct ctx_buffer_t {
+	unsigned char *data;
+	size_t size;
+	size_t len;
+} ctx_buffer_t;
+
+// Reusable scratch state
+struct identicon_ctx_t {
+	ctx_buffer_t image; // RGBA image (or batch arena)
+	ctx_buffer_t row; // Row buffer of identicon_ctx_render_rows()
+	ctx_buffer_t descs; // Descriptors of a batch
+	ctx_buffer_t out; // Output of the writers and of the encoders
+	bool out_error; // identicon_ctx_write_func() has dropped bytes since the output was last reset
+	identicon_encoder_t *encoder; // Encoder of identicon_ctx_encode() (created on first use)
+	uint64_t allocations;
+	identicon_allocator_t allocator; // Allocator of the buffers
+	identicon_allocator_t override; // Allocator while the context runs (if has_override)
+	bool has_override;
+	identicon_arena_t *arena; // Takes precedence over override
+	unsigned int depth; // Nested identicon_ctx_enter() calls
+	const identicon_allocator_t *previous; // Allocator of the thread before the outermost one
+};
+
+
+/**
+ * Make sure that a buffer of a context holds at least some bytes.
+ *
+ * The buffer at least doubles, so appending to it allocates O(log n) times.
+ *
+ * @param[in,out] ctx    The context (counting the allocations).
+ * @param[in,out] buffer The buffer.
+ * @param[in]     size   The needed size.
+ *
+ * @return True if the buffer is big enough, false if an error occurred.
+ */
+static bool ctx_reserve(identicon_ctx_t *ctx, ctx_buffer_t *buffer, size_t size) {
+	unsigned char *data;
+	size_t new_size;
+
+	if (size <= buffer->size)
+		return true;
+
+	new_size = (buffer->size > SIZE_MAX / 2) ? SIZE_MAX : buffer->size * 2;
+	if (new_size < size)
+		new_size = size;
+
+	data = identicon_realloc_with(&ctx->allocator, buffer->data, new_size);
+	if (data == NULL)
+		return false;
+
+	buffer->data = data;
+	buffer->size = new_size;
+	ctx->allocations++;
+
+	return true;
+}
+
+
+/**
+ * Create a context holding reusable scratch state.
+ *
+ * @return The context (to be used by one thread at a time) or NULL if an error occurred.
+ */
+identicon_ctx_t *new_identicon_ctx(void) {
+	const identicon_allocator_t *allocator = identicon_allocator();
+	identicon_ctx_t *ctx;
+
+	ctx = identicon_calloc_with(allocator, 1, sizeof(identicon_ctx_t));
+	if (ctx != NULL)
+		ctx->allocator = *allocator;
+
+	return ctx;
+}
+
+
+/**
+ * Free a context.
+ *
+ * @param[in] ctx The context (may be NULL).
+ */
+void free_identicon_ctx(identicon_ctx_t *ctx) {
+	if (ctx == NULL)
+		return;
+
+	identicon_free_with(&ctx->allocator, ctx->image.data);
+	identicon_free_with(&ctx->allocator, ctx->row.data);
+	identicon_free_with(&ctx->allocator, ctx->descs.data);
+	identicon_free_with(&ctx->allocator, ctx->out.data);
+	free_identicon_encoder(ctx->encoder);
+	identicon_free_with(&ctx->allocator, ctx);
+}
+
+
+/**
+ * Get the number of allocations made by a context (to check that it has warmed up).
+ *
+ * @param[in] ctx The context.
+ *
+ * @return The number of times a buffer of the context has grown.
+ */
+uint64_t identicon_ctx_allocations(const identicon_ctx_t *ctx) {
+	if (ctx == NULL)
+		return 0;
+
+	return ctx->allocations;
+}
+
+
+/**
+ * Set the allocator used while the functions of a context run.
+ *
+ * @param[in,out] ctx       The context (not between identicon_ctx_enter() and identicon_ctx_leave()).
+ * @param[in]     allocator The allocator (copied) or NULL for the one of the calling thread.
+ */
+void identicon_ctx_set_allocator(identicon_ctx_t *ctx, const identicon_allocator_t *allocator) {
+	if ((ctx == NULL) || (ctx->depth != 0))
+		return;
+
+	ctx->has_override = (allocator != NULL) && (allocator->malloc != NULL) && (allocator->realloc != NULL) &&
+			(allocator->free != NULL);
+	if (ctx->has_override)
+		ctx->override = *allocator;
+}
+
+
+/**
+ * Use a bump arena while the functions of a context run.
+ *
+ * The arena is reset whenever the outermost function of the context (or
+ * identicon_ctx_enter()) starts, so what has been allocated from it is only
+ * valid until then.
+ *
+ * @param[in,out] ctx   The context (not between identicon_ctx_enter() and identicon_ctx_leave()).
+ * @param[in]     arena The arena (must outlive its use by ctx) or NULL for none.
+ */
+void identicon_ctx_set_arena(identicon_ctx_t *ctx, identicon_arena_t *arena) {
+	if ((ctx == NULL) || (ctx->depth != 0))
+		return;
+
+	ctx->arena = arena;
+}
+
+
+/**
+ * Make the allocator of a context the one of the calling thread.
+ *
+ * Calls nest: only the outermost one resets the arena of the context and
+ * switches the allocator, until the matching identicon_ctx_leave().
+ *
+ * @param[in,out] ctx The context.
+ */
+void identicon_ctx_enter(identicon_ctx_t *ctx) {
+	const identicon_allocator_t *allocator;
+
+	if ((ctx == NULL) || (ctx->depth++ != 0))
+		return;
+
+	if (ctx->arena != NULL) {
+		identicon_arena_reset(ctx->arena);
+		allocator = identicon_arena_allocator(ctx->arena);
+	} else if (ctx->has_override) {
+		allocator = &ctx->override;
+	} else {
+		allocator = identicon_allocator();
+	}
+
+	ctx->previous = identicon_allocator_push(allocator);
+}
+
+
+/**
+ * Restore the allocator that the calling thread had before identicon_ctx_enter().
+ *
+ * @param[in,out] ctx The context.
+ */
+void identicon_ctx_leave(identicon_ctx_t *ctx) {
+	if ((ctx == NULL) || (ctx->depth == 0) || (--ctx->depth != 0))
+		return;
+
+	identicon_allocator_pop(ctx->previous);
+}
+
+
+/**
+ * Create a new identicon in the image buffer of a context.
+ *
+ * Same as new_identicon(), but the image belongs to the context.
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ *
+ * @return The RGBA image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+unsigned char *identicon_ctx_render(identicon_ctx_t *ctx, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_render2(ctx, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Create a new identicon in the image buffer of a context (body of identicon_ctx_render2()).
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ *
+ * @return The RGBA image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+static unsigned char *ctx_render(identicon_ctx_t *ctx, const identicon_opts2_t *opts) {
+	identicon_descriptor_t desc;
+	size_t img_size;
+
+	if ((ctx == NULL) || (opts == NULL))
+		return NULL;
+
+	img_size = identicon_image_size2(opts);
+
+	if ((img_size == 0) || !ctx_reserve(ctx, &ctx->image, img_size) || !identicon_compute_descriptor2(opts, &desc))
+		return NULL;
+
+	// Pixels left untouched by a transparent identicon are zero, as in new_identicon()
+	if (opts->transparent)
+		memset(ctx->image.data, 0, img_size);
+
+	identicon_render_descriptor2(ctx->image.data, (size_t)opts->size * 4, 0, 0, &desc, opts);
+	ctx->image.len = img_size;
+
+	return ctx->image.data;
+}
+
+
+/**
+ * Create a new identicon in the image buffer of a context from compact options.
+ *
+ * Same as identicon_ctx_render().
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ *
+ * @return The RGBA image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+unsigned char *identicon_ctx_render2(identicon_ctx_t *ctx, const identicon_opts2_t *opts) {
+	unsigned char *img;
+
+	identicon_ctx_enter(ctx);
+	img = ctx_render(ctx, opts);
+	identicon_ctx_leave(ctx);
+
+	return img;
+}
+
+
+/**
+ * Render an identicon one row at a time into the row buffer of a context.
+ *
+ * Same as identicon_render_rows(), without any allocation once warmed up.
+ *
+ * @param[in,out] ctx    The context.
+ * @param[in]     opts   The identicon options.
+ * @param[in]     row_cb The row callback (returning false stops the rendering).
+ * @param[in]     user   The user data passed to row_cb.
+ *
+ * @return True if all the rows have been rendered, false if an error occurred
+ *         or row_cb stopped the rendering.
+ */
+bool identicon_ctx_render_rows(identicon_ctx_t *ctx, identicon_options_t *opts, identicon_row_callback_t row_cb,
+		void *user) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_render_rows2(ctx, identicon_opts2_from_options(&opts2, opts), row_cb, user);
+}
+
+
+/**
+ * Render an identicon one row at a time (body of identicon_ctx_render_rows2()).
+ *
+ * @param[in,out] ctx    The context.
+ * @param[in]     opts   The identicon options.
+ * @param[in]     row_cb The row callback (returning false stops the rendering).
+ * @param[in]     user   The user data passed to row_cb.
+ *
+ * @return True if all the rows have been rendered, false if an error occurred
+ *         or row_cb stopped the rendering.
+ */
+static bool ctx_render_rows(identicon_ctx_t *ctx, const identicon_opts2_t *opts, identicon_row_callback_t row_cb,
+		void *user) {
+	if ((ctx == NULL) || (opts == NULL) || (opts->size == 0) || !ctx_reserve(ctx, &ctx->row, 4 * (size_t)opts->size))
+		return false;
+
+	return identicon_render_rows_buffer(opts, ctx->row.data, row_cb, user);
+}
+
+
+/**
+ * Render an identicon one row at a time into the row buffer of a context from compact options.
+ *
+ * Same as identicon_ctx_render_rows().
+ *
+ * @param[in,out] ctx    The context.
+ * @param[in]     opts   The identicon options.
+ * @param[in]     row_cb The row callback (returning false stops the rendering).
+ * @param[in]     user   The user data passed to row_cb.
+ *
+ * @return True if all the rows have been rendered, false if an error occurred
+ *         or row_cb stopped the rendering.
+ */
+bool identicon_ctx_render_rows2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, identicon_row_callback_t row_cb,
+		void *user) {
+	bool done;
+
+	identicon_ctx_enter(ctx);
+	done = ctx_render_rows(ctx, opts, row_cb, user);
+	identicon_ctx_leave(ctx);
+
+	return done;
+}
+
+
+/**
+ * Compute the descriptors of many identicons into a context.
+ *
+ * Same as identicon_compute_descriptors(), but the descriptors belong to the context.
+ *
+ * @param[in,out] ctx   The context.
+ * @param[in]     keys  The keys (opts->str is ignored, keys with a NULL string are skipped).
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options (the geometry is not used).
+ *
+ * @return The descriptors (valid until the next call with ctx) or NULL if an error occurred.
+ */
+const identicon_descriptor_t *identicon_ctx_compute_descriptors(identicon_ctx_t *ctx, const identicon_key_t *keys,
+		size_t count, identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_compute_descriptors2(ctx, keys, count, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Compute the descriptors of many identicons (body of identicon_ctx_compute_descriptors2()).
+ *
+ * @param[in,out] ctx   The context.
+ * @param[in]     keys  The keys (opts->key is ignored, keys with a NULL string are skipped).
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options (the geometry is not used).
+ *
+ * @return The descriptors (valid until the next call with ctx) or NULL if an error occurred.
+ */
+static const identicon_descriptor_t *ctx_compute_descriptors(identicon_ctx_t *ctx, const identicon_key_t *keys,
+		size_t count, const identicon_opts2_t *opts) {
+	identicon_descriptor_t *descs;
+
+	if ((ctx == NULL) || (count == 0) || (count > SIZE_MAX / sizeof(identicon_descriptor_t)) ||
+			!ctx_reserve(ctx, &ctx->descs, count * sizeof(identicon_descriptor_t)))
+		return NULL;
+
+	descs = (identicon_descriptor_t *)ctx->descs.data;
+
+	if (!identicon_compute_descriptors2(keys, count, opts, descs))
+		return NULL;
+
+	ctx->descs.len = count * sizeof(identicon_descriptor_t);
+
+	return descs;
+}
+
+
+/**
+ * Compute the descriptors of many identicons into a context from compact options.
+ *
+ * Same as identicon_ctx_compute_descriptors().
+ *
+ * @param[in,out] ctx   The context.
+ * @param[in]     keys  The keys (opts->key is ignored, keys with a NULL string are skipped).
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options (the geometry is not used).
+ *
+ * @return The descriptors (valid until the next call with ctx) or NULL if an error occurred.
+ */
+const identicon_descriptor_t *identicon_ctx_compute_descriptors2(identicon_ctx_t *ctx, const identicon_key_t *keys,
+		size_t count, const identicon_opts2_t *opts) {
+	const identicon_descriptor_t *descs;
+
+	identicon_ctx_enter(ctx);
+	descs = ctx_compute_descriptors(ctx, keys, count, opts);
+	identicon_ctx_leave(ctx);
+
+	return descs;
+}
+
+
+/**
+ * Render many identicons into the image buffer of a context.
+ *
+ * Same as identicon_render_batch(), but the arena belongs to the context.
+ *
+ * @param[in,out] ctx   The context.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->str is ignored).
+ *
+ * @return The arena (valid until the next call with ctx) or NULL if an error occurred.
+ */
+unsigned char *identicon_ctx_render_batch(identicon_ctx_t *ctx, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_render_batch2(ctx, keys, count, identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Render many identicons into the image buffer (body of identicon_ctx_render_batch2()).
+ *
+ * @param[in,out] ctx   The context.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->key is ignored).
+ *
+ * @return The arena (valid until the next call with ctx) or NULL if an error occurred.
+ */
+static unsigned char *ctx_render_batch(identicon_ctx_t *ctx, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts) {
+	size_t img_size;
+
+	if ((ctx == NULL) || (opts == NULL) || (count == 0))
+		return NULL;
+
+	img_size = identicon_image_size2(opts);
+
+	if ((img_size == 0) || (count > SIZE_MAX / img_size) || !ctx_reserve(ctx, &ctx->image, count * img_size))
+		return NULL;
+
+	// The arena of identicon_render_batch() is zeroed when the library allocates it
+	memset(ctx->image.data, 0, count * img_size);
+	ctx->image.len = count * img_size;
+
+	return identicon_render_batch2(keys, count, opts, ctx->image.data);
+}
+
+
+/**
+ * Render many identicons into the image buffer of a context from compact options.
+ *
+ * Same as identicon_ctx_render_batch().
+ *
+ * @param[in,out] ctx   The context.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->key is ignored).
+ *
+ * @return The arena (valid until the next call with ctx) or NULL if an error occurred.
+ */
+unsigned char *identicon_ctx_render_batch2(identicon_ctx_t *ctx, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts) {
+	unsigned char *img;
+
+	identicon_ctx_enter(ctx);
+	img = ctx_render_batch(ctx, keys, count, opts);
+	identicon_ctx_leave(ctx);
+
+	return img;
+}
+
+
+/**
+ * Write an identicon as a 1 bit palette PNG image into the output buffer of a context.
+ *
+ * Same as identicon_write_png(), with the descriptor computed from the options.
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The size of the PNG image.
+ *
+ * @return The PNG image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+const unsigned char *identicon_ctx_write_png(identicon_ctx_t *ctx, identicon_options_t *opts, size_t *len) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_write_png2(ctx, identicon_opts2_from_options(&opts2, opts), len);
+}
+
+
+/**
+ * Write a PNG image into the output buffer (body of identicon_ctx_write_png2()).
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The size of the PNG image.
+ *
+ * @return The PNG image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+static const unsigned char *ctx_write_png(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len) {
+	identicon_descriptor_t desc;
+	size_t bound;
+
+	if ((ctx == NULL) || (len == NULL))
+		return NULL;
+
+	bound = identicon_png_size_bound2(opts);
+
+	if ((bound == 0) || !ctx_reserve(ctx, &ctx->out, bound) || !identicon_compute_descriptor2(opts, &desc))
+		return NULL;
+
+	ctx->out.len = identicon_write_png2(&desc, opts, ctx->out.data, ctx->out.size);
+	ctx->out_error = false;
+	*len = ctx->out.len;
+
+	return (ctx->out.len != 0) ? ctx->out.data : NULL;
+}
+
+
+/**
+ * Write an identicon as a 1 bit palette PNG image into the output buffer of a context from compact options.
+ *
+ * Same as identicon_ctx_write_png().
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The size of the PNG image.
+ *
+ * @return The PNG image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+const unsigned char *identicon_ctx_write_png2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len) {
+	const unsigned char *png;
+
+	identicon_ctx_enter(ctx);
+	png = ctx_write_png(ctx, opts, len);
+	identicon_ctx_leave(ctx);
+
+	return png;
+}
+
+
+/**
+ * Write an identicon as an SVG image into the output buffer of a context.
+ *
+ * Same as identicon_write_svg(), with the descriptor computed from the options.
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The length of the SVG image (without the terminating NUL byte).
+ *
+ * @return The SVG image (NUL terminated, valid until the next call with ctx) or NULL if an error occurred.
+ */
+const char *identicon_ctx_write_svg(identicon_ctx_t *ctx, identicon_options_t *opts, size_t *len) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_write_svg2(ctx, identicon_opts2_from_options(&opts2, opts), len);
+}
+
+
+/**
+ * Write an SVG image into the output buffer (body of identicon_ctx_write_svg2()).
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The length of the SVG image (without the terminating NUL byte).
+ *
+ * @return The SVG image (NUL terminated, valid until the next call with ctx) or NULL if an error occurred.
+ */
+static const char *ctx_write_svg(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len) {
+	identicon_descriptor_t desc;
+	size_t bound, svg_len;
+
+	if ((ctx == NULL) || (len == NULL))
+		return NULL;
+
+	bound = identicon_svg_size_bound2(opts);
+
+	if ((bound == 0) || !ctx_reserve(ctx, &ctx->out, bound) || !identicon_compute_descriptor2(opts, &desc))
+		return NULL;
+
+	svg_len = identicon_write_svg2(&desc, opts, (char *)ctx->out.data, ctx->out.size);
+	if (svg_len == 0)
+		return NULL;
+
+	ctx->out.len = svg_len;
+	ctx->out_error = false;
+	*len = svg_len;
+
+	return (const char *)ctx->out.data;
+}
+
+
+/**
+ * Write an identicon as an SVG image into the output buffer of a context from compact options.
+ *
+ * Same as identicon_ctx_write_svg().
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The length of the SVG image (without the terminating NUL byte).
+ *
+ * @return The SVG image (NUL terminated, valid until the next call with ctx) or NULL if an error occurred.
+ */
+const char *identicon_ctx_write_svg2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len) {
+	const char *svg;
+
+	identicon_ctx_enter(ctx);
+	svg = ctx_write_svg(ctx, opts, len);
+	identicon_ctx_leave(ctx);
+
+	return svg;
+}
+
+
+/**
+ * Empty the output buffer of a context (before an encoder appends to it).
+ *
+ * @param[in,out] ctx The context.
+ */
+void identicon_ctx_reset_output(identicon_ctx_t *ctx) {
+	if (ctx == NULL)
+		return;
+
+	ctx->out.len = 0;
+	ctx->out_error = false;
+}
+
+
+/**
+ * Append bytes to the output buffer of a context.
+ *
+ * The arguments are the ones of stbi_write_func, so that stb can write its
+ * images straight into the context (stbi_write_png_to_func()). A callback
+ * cannot report an error, so when the buffer cannot grow the bytes are
+ * dropped and identicon_ctx_output() fails until the output is reset.
+ *
+ * @param[in,out] ctx  The context (identicon_ctx_t).
+ * @param[in]     data The bytes.
+ * @param[in]     size The number of bytes.
+ */
+void identicon_ctx_write_func(void *ctx, void *data, int size) {
+	identicon_ctx_t *c = ctx;
+
+	if ((c == NULL) || (data == NULL) || (size <= 0) || c->out_error)
+		return;
+
+	if (!ctx_reserve(c, &c->out, c->out.len + (size_t)size)) {
+		c->out_error = true;
+		return;
+	}
+
+	memcpy(c->out.data + c->out.len, data, size);
+	c->out.len += size;
+}
+
+
+/**
+ * Get the output buffer of a context.
+ *
+ * @param[in]  ctx The context.
+ * @param[out] len The number of bytes in the buffer.
+ *
+ * @return The output of the last writer or encoder (valid until the next call with ctx) or NULL if an error
+ *         occurred (identicon_ctx_write_func() could not append some bytes).
+ */
+const unsigned char *identicon_ctx_output(const identicon_ctx_t *ctx, size_t *len) {
+	if ((ctx == NULL) || (len == NULL) || ctx->out_error)
+		return NULL;
+
+	*len = ctx->out.len;
+
+	return ctx->out.data;
+}
+
+
+/**
+ * Encode an identicon with lodepng into the output buffer of a context.
+ *
+ * Same as identicon_ctx_encode2().
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The size of the PNG image.
+ *
+ * @return The PNG image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+const unsigned char *identicon_ctx_encode(identicon_ctx_t *ctx, identicon_options_t *opts, size_t *len) {
+	identicon_opts2_t opts2;
+
+	return identicon_ctx_encode2(ctx, identicon_opts2_from_options(&opts2, opts), len);
+}
+
+
+/**
+ * Encode an identicon with lodepng into the output buffer (body of identicon_ctx_encode2()).
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The size of the PNG image.
+ *
+ * @return The PNG image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+static const unsigned char *ctx_encode(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len) {
+	const identicon_allocator_t *previous;
+	const unsigned char *img;
+	unsigned char *png;
+	size_t png_len;
+	bool copied;
+
+	if ((ctx == NULL) || (len == NULL))
+		return NULL;
+
+	img = ctx_render(ctx, opts);
+	if (img == NULL)
+		return NULL;
+
+	// The encoder lives as long as the context, so it comes from the allocator of the buffers (not from the arena)
+	if (ctx->encoder == NULL) {
+		previous = identicon_allocator_push(&ctx->allocator);
+		ctx->encoder = new_identicon_encoder();
+		identicon_allocator_pop(previous);
+
+		if (ctx->encoder == NULL)
+			return NULL;
+
+		ctx->allocations++;
+	}
+
+	png = identicon_encoder_encode(ctx->encoder, img, opts->size, &png_len);
+	if (png == NULL)
+		return NULL;
+
+	copied = ctx_reserve(ctx, &ctx->out, png_len);
+	if (copied) {
+		memcpy(ctx->out.data, png, png_len);
+		ctx->out.len = png_len;
+		ctx->out_error = false;
+		*len = png_len;
+	}
+
+	identicon_free(png);
+
+	return copied ? ctx->out.data : NULL;
+}
+
+
+/**
+ * Encode an identicon with lodepng into the output buffer of a context from compact options.
+ *
+ * The image is rendered into the image buffer of the context and encoded by
+ * its reusable encoder, so the PNG image is the same as lodepng_encode32() of
+ * new_identicon2(). The PNG image that lodepng allocates comes from the
+ * allocator of the context (e.g. its arena) before being copied to the
+ * output buffer.
+ *
+ * @param[in,out] ctx  The context.
+ * @param[in]     opts The identicon options.
+ * @param[out]    len  The size of the PNG image.
+ *
+ * @return The PNG image (valid until the next call with ctx) or NULL if an error occurred.
+ */
+const unsigned char *identicon_ctx_encode2(identicon_ctx_t *ctx, const identicon_opts2_t *opts, size_t *len) {
+	const unsigned char *png;
+
+	identicon_ctx_enter(ctx);
+	png = ctx_encode(ctx, opts, len);
+	identicon_ctx_leave(ctx);
+
+	return png;
+}
@@ -0,0 +1,399 @@
+/**
+ * identicon-c_encoder.c - Functions to encode identicons with a reusable lodepng encoder.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * lodepng_encode32() builds a LodePNGState and allocates and initializes the
+ * LZ77 hash chains of deflate (about 300 KiB with the default window) for
+ * every image, which costs more than encoding a small identicon. An encoder
+ * keeps both: the state is set up once, and the hash chains are given to the
+ * deflate of lodepng as a custom one (lodepng_deflate_reuse()), which only
+ * clears the positions the previous image has used.
+ *
+ * lodepng also scans every image for its colour profile to choose the PNG
+ * colour mode, and converts the image to that mode through a colour tree.
+ * The choice only depends on the distinct colours of the image, in order of
+ * appearance, and on its number of pixels, which only matters up to 16 of
+ * them. Above that, the encoder makes the choice from a small image with the
+ * same colours (an identicon has at most two of them). The choice is kept
+ * while the colours stay the same, and for images of up to 16 pixels while
+ * the size stays the same too. When the mode is a palette, the encoder packs
+ * the palette indices itself and gives them to lodepng as the raw image,
+ * which then needs no conversion. Apart from the colour mode, that lodepng
+ * would have chosen anyway, the settings are the ones of lodepng_encode32(),
+ * so the images are byte for byte the same.
+ *
+ * An encoder is not locked: it can be used by one thread at a time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+#include "lodepng.h"
+
+
+// Pixels of the image from which the colour mode is chosen (more than 16, as in an identicon)
+#define ENCODER_SAMPLE_PIXELS 32
+
+// Reusable lodepng encoder
+struct identicon_encoder_t {
+	LodePNGState state;
+	LodePNGDeflateHash *hash;
+	identicon_allocator_t allocator; // Allocator of the state and of the hash chains
+	bool mode_cached; // state.info_png.color is the mode chosen for these colours and size
+	unsigned int colors_len;
+	uint32_t colors[2];
+	uint32_t size;
+	bool packed; // The raw image is made of the palette indices of the colours
+	unsigned int indices[2];
+	unsigned char *raw;
+	size_t raw_size;
+};
+
+
+/**
+ * Get the distinct colours of an RGBA image, in order of appearance.
+ *
+ * @param[in]  img    The RGBA image.
+ * @param[in]  pixels The number of pixels.
+ * @param[out] colors The first two colours (as read from memory).
+ *
+ * @return The number of colours (1 or 2) or 3 if there are more.
+ */
+static unsigned int encoder_colors(const unsigned char *img, size_t pixels, uint32_t colors[2]) {
+	unsigned int len = 1;
+	uint32_t pixel;
+	size_t i;
+
+	memcpy(&colors[0], img, sizeof(uint32_t));
+
+	for (i = 1; i < pixels; i++) {
+		memcpy(&pixel, img + (i * 4), sizeof(uint32_t));
+		if ((pixel == colors[0]) || ((len == 2) && (pixel == colors[1])))
+			continue;
+		if (len == 2)
+			return 3;
+		colors[len++] = pixel;
+	}
+
+	return len;
+}
+
+
+/**
+ * Copy a colour mode into the state of an encoder.
+ *
+ * The palette of the copy outlives the call, so it comes from the allocator
+ * of the encoder, and an existing one is reused (lodepng palettes always
+ * have room for 256 colours).
+ *
+ * @param[in,out] encoder The encoder.
+ * @param[out]    dest    The colour mode of the state.
+ * @param[in]     src     The colour mode.
+ *
+ * @return True if the mode has been copied, false if an error occurred.
+ */
+static bool encoder_copy_mode(identicon_encoder_t *encoder, LodePNGColorMode *dest, const LodePNGColorMode *src) {
+	const identicon_allocator_t *previous;
+	unsigned char *palette = dest->palette;
+	unsigned error;
+
+	if ((palette != NULL) && (src->palette != NULL)) {
+		*dest = *src;
+		dest->palette = palette;
+		memcpy(palette, src->palette, src->palettesize * 4);
+		return true;
+	}
+
+	previous = identicon_allocator_push(&encoder->allocator);
+	error = lodepng_color_mode_copy(dest, src);
+	identicon_allocator_pop(previous);
+
+	return (error == 0);
+}
+
+
+/**
+ * Set the raw colour mode of an encoder.
+ *
+ * It is the palette mode of the PNG image if both colours are in the
+ * palette (the encoder then packs their indices), RGBA otherwise.
+ *
+ * @param[in,out] encoder The encoder (with the colour mode chosen).
+ *
+ * @return True if the mode has been set, false if an error occurred.
+ */
+static bool encoder_set_raw(identicon_encoder_t *encoder) {
+	const LodePNGColorMode *mode = &encoder->state.info_png.color;
+	LodePNGColorMode rgba;
+	unsigned int i;
+	size_t k;
+
+	encoder->packed = (mode->colortype == LCT_PALETTE) && (mode->bitdepth == 1);
+
+	// Unused index of a single colour image
+	encoder->indices[1] = 0;
+
+	for (i = 0; (i < encoder->colors_len) && encoder->packed; i++) {
+		for (k = 0; (k < mode->palettesize) && (memcmp(mode->palette + (k * 4), &encoder->colors[i], 4) != 0); k++)
+			;
+		encoder->indices[i] = k;
+		encoder->packed = (k < mode->palettesize);
+	}
+
+	if (encoder->packed)
+		return encoder_copy_mode(encoder, &encoder->state.info_raw, mode);
+
+	lodepng_color_mode_init(&rgba);
+
+	return encoder_copy_mode(encoder, &encoder->state.info_raw, &rgba);
+}
+
+
+/**
+ * Set the PNG colour mode of an encoder for an image.
+ *
+ * @param[in,out] encoder The encoder.
+ * @param[in]     img     The RGBA image.
+ * @param[in]     size    The width and height of the image.
+ *
+ * @return True if the mode has been set, false if an error occurred.
+ */
+static bool encoder_set_mode(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size) {
+	unsigned char sample[ENCODER_SAMPLE_PIXELS * 4];
+	LodePNGColorMode rgba, mode;
+	uint32_t colors[2];
+	unsigned int len, i;
+	bool done;
+
+	len = encoder_colors(img, (size_t)size * size, colors);
+
+	// lodepng compares the number of pixels with 16 and with twice the number of colours
+	if (encoder->mode_cached && (len == encoder->colors_len) &&
+			((size > 4) ? (encoder->size > 4) : (size == encoder->size)) &&
+			(memcmp(colors, encoder->colors, len * sizeof(uint32_t)) == 0)) {
+		encoder->size = size;
+		return true;
+	}
+
+	encoder->mode_cached = false;
+	encoder->packed = false;
+
+	lodepng_color_mode_init(&rgba);
+
+	if (len > 2) {
+		// Any other image is converted automatically
+		encoder->state.encoder.auto_convert = 1;
+		return encoder_copy_mode(encoder, &encoder->state.info_raw, &rgba) &&
+				encoder_copy_mode(encoder, &encoder->state.info_png.color, &rgba);
+	}
+
+	// Only the sequence of distinct colours matters to the profile, and above 16 pixels the size does not matter
+	if (size > 4) {
+		for (i = 0; i < ENCODER_SAMPLE_PIXELS; i++)
+			memcpy(sample + (i * 4), &colors[(i == 0) ? 0 : len - 1], 4);
+	}
+
+	lodepng_color_mode_init(&mode);
+	done = (((size > 4) ? lodepng_auto_choose_color(&mode, sample, ENCODER_SAMPLE_PIXELS, 1, &rgba) :
+			lodepng_auto_choose_color(&mode, img, size, size, &rgba)) == 0) &&
+			encoder_copy_mode(encoder, &encoder->state.info_png.color, &mode);
+	lodepng_color_mode_cleanup(&mode);
+
+	if (!done)
+		return false;
+
+	encoder->state.encoder.auto_convert = 0;
+	encoder->colors_len = len;
+	memcpy(encoder->colors, colors, len * sizeof(uint32_t));
+	encoder->size = size;
+
+	if (!encoder_set_raw(encoder))
+		return false;
+
+	encoder->mode_cached = true;
+
+	return true;
+}
+
+
+/**
+ * Pack the palette indices of an image into the raw image of an encoder.
+ *
+ * @param[in,out] encoder The encoder (with packed set).
+ * @param[in]     img     The RGBA image.
+ * @param[in]     size    The width and height of the image.
+ *
+ * @return The raw image or NULL if an error occurred.
+ */
+static const unsigned char *encoder_pack(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size) {
+	size_t pixels = (size_t)size * size, bytes = (pixels + 7) / 8, i;
+	unsigned char *raw;
+	uint32_t pixel;
+
+	if (bytes > encoder->raw_size) {
+		raw = identicon_realloc_with(&encoder->allocator, encoder->raw, bytes);
+		if (raw == NULL)
+			return NULL;
+		encoder->raw = raw;
+		encoder->raw_size = bytes;
+	}
+
+	// Pixels packed most significant bit first, rows not padded (as lodepng_convert())
+	memset(encoder->raw, 0, bytes);
+	for (i = 0; i < pixels; i++) {
+		memcpy(&pixel, img + (i * 4), sizeof(uint32_t));
+		if (encoder->indices[(pixel == encoder->colors[0]) ? 0 : 1])
+			encoder->raw[i / 8] |= 0x80 >> (i % 8);
+	}
+
+	return encoder->raw;
+}
+
+
+/**
+ * Create a reusable PNG encoder.
+ *
+ * The state and the hash chains are allocated with the allocator of the
+ * calling thread; the images are allocated with the one current when they
+ * are encoded.
+ *
+ * @return The encoder (to be used by one thread at a time) or NULL if an error occurred.
+ */
+identicon_encoder_t *new_identicon_encoder(void) {
+	const identicon_allocator_t *allocator = identicon_allocator();
+	const identicon_allocator_t *previous;
+	identicon_encoder_t *encoder;
+
+	encoder = identicon_calloc_with(allocator, 1, sizeof(identicon_encoder_t));
+	if (encoder == NULL)
+		return NULL;
+
+	encoder->allocator = *allocator;
+
+	// Same settings as lodepng_encode32()
+	lodepng_state_init(&encoder->state);
+	encoder->state.info_raw.colortype = LCT_RGBA;
+	encoder->state.info_raw.bitdepth = 8;
+	encoder->state.info_png.color.colortype = LCT_RGBA;
+	encoder->state.info_png.color.bitdepth = 8;
+
+	previous = identicon_allocator_push(&encoder->allocator);
+	encoder->hash = lodepng_deflate_hash_new(encoder->state.encoder.zlibsettings.windowsize);
+	identicon_allocator_pop(previous);
+
+	if (encoder->hash == NULL) {
+		free_identicon_encoder(encoder);
+		return NULL;
+	}
+
+	encoder->state.encoder.zlibsettings.custom_deflate = lodepng_deflate_reuse;
+	encoder->state.encoder.zlibsettings.custom_context = encoder->hash;
+
+	return encoder;
+}
+
+
+/**
+ * Free a reusable PNG encoder.
+ *
+ * @param[in] encoder The encoder (may be NULL).
+ */
+void free_identicon_encoder(identicon_encoder_t *encoder) {
+	const identicon_allocator_t *previous;
+
+	if (encoder == NULL)
+		return;
+
+	previous = identicon_allocator_push(&encoder->allocator);
+	lodepng_deflate_hash_delete(encoder->hash);
+	lodepng_state_cleanup(&encoder->state);
+	identicon_allocator_pop(previous);
+
+	identicon_free_with(&encoder->allocator, encoder->raw);
+	identicon_free_with(&encoder->allocator, encoder);
+}
+
+
+/**
+ * Encode an identicon as a PNG image with a reusable encoder.
+ *
+ * The image is the same as the one of lodepng_encode32().
+ *
+ * @param[in,out] encoder The encoder.
+ * @param[in]     img     The RGBA image.
+ * @param[in]     size    The width and height of the image.
+ * @param[out]    len     The size of the PNG image.
+ *
+ * @return The PNG image (to be freed with identicon_free()) or NULL if an error occurred.
+ */
+unsigned char *identicon_encoder_encode(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size,
+		size_t *len) {
+	const unsigned char *raw;
+	unsigned char *png = NULL;
+	size_t png_len = 0;
+
+	if ((encoder == NULL) || (img == NULL) || (size == 0) || (len == NULL) || !encoder_set_mode(encoder, img, size))
+		return NULL;
+
+	raw = encoder->packed ? encoder_pack(encoder, img, size) : img;
+	if (raw == NULL)
+		return NULL;
+
+	if (lodepng_encode(&png, &png_len, raw, size, size, &encoder->state) != 0) {
+		identicon_free(png);
+		return NULL;
+	}
+
+	*len = png_len;
+
+	return png;
+}
+
+
+/**
+ * Encode an identicon as a PNG file with a reusable encoder.
+ *
+ * The file is the same as the one of lodepng_encode32_file().
+ *
+ * @param[in,out] encoder  The encoder.
+ * @param[in]     img      The RGBA image.
+ * @param[in]     size     The width and height of the image.
+ * @param[in]     filename The name of the file.
+ *
+ * @return True if the file has been written, false if an error occurred.
+ */
+bool identicon_encoder_encode_file(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size,
+		const char *filename) {
+	unsigned char *png;
+	size_t len;
+	bool saved;
+
+	if (filename == NULL)
+		return false;
+
+	png = identicon_encoder_encode(encoder, img, size, &len);
+	if (png == NULL)
+		return false;
+
+	saved = (lodepng_save_file(png, len, filename) == 0);
+	identicon_free(png);
+
+	return saved;
+}
@@ -23,10 +23,19 @@
 #include <identicon-c.h>
 
 
-// Convert identicon array image to png_byte (facility for libpng)
+// Get row pointers into an identicon array image, without copying it (facility for libpng)
 png_byte **png_new_identicon_from_array(unsigned char *img, identicon_options_t *opts);
+png_byte **png_new_identicon_from_array2(unsigned char *img, const identicon_opts2_t *opts);
 
-// Create a new identicon (facility for libpng)
+// Create a new identicon as row pointers and image in a single block freed with identicon_free() (facility for libpng)
 png_byte **png_new_identicon(identicon_options_t *opts);
+png_byte **png_new_identicon2(const identicon_opts2_t *opts);
+
+// Write an identicon as a 1 bit palette image, streaming its rows (facility for libpng)
+bool png_write_identicon(png_structp png_ptr, png_infop info_ptr, identicon_options_t *opts);
+bool png_write_identicon2(png_structp png_ptr, png_infop info_ptr, const identicon_opts2_t *opts);
+
+// Create a libpng write structure allocating through the allocator of the library (facility for libpng)
+png_structp png_create_identicon_write_struct(png_voidp error_ptr, png_error_ptr error_fn, png_error_ptr warn_fn);
 
 #endif
@@ -0,0 +1,431 @@
+/**
+ * identicon-c_multihash.c - Functions to hash many keys at once in SIMD lanes.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * Short keys are a single block or two, so hashing them one at a time leaves
+ * most of a SIMD unit idle. Here the keys of a batch are grouped by their
+ * number of padded blocks and every group is hashed in vector lanes: 4 with
+ * SSE2, 8 with AVX2 and 16 with AVX-512 (half as many for SHA-512).
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+#if defined(__GNUC__)
+
+// Block sizes of the hash functions
+#define MD5_BLOCK_SIZE 64
+#define SHA1_BLOCK_SIZE 64
+#define SHA256_BLOCK_SIZE 64
+#define SHA512_BLOCK_SIZE 128
+
+// Largest number of lanes of the kernels
+#define MB_MAX_LANES 16
+
+// Number of keys sorted by number of blocks at once
+#define MB_CHUNK_SIZE 256
+
+// Rotations (of scalars or vectors)
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+
+// Padding of a hash function
+typedef struct mb_padding_t {
+	size_t block_size;
+	size_t length_size;
+	bool little_endian;
+} mb_padding_t;
+
+// Kernel hashing messages of the same number of blocks in vector lanes
+typedef void (*mb_kernel_t)(const identicon_key_t *const *keys, int active, const unsigned char *salt,
+		size_t salt_len, size_t blocks, unsigned char *const *hashes);
+
+// Kernels of an instruction set (lanes counts 32 bit lanes, SHA-512 uses half of them)
+typedef struct mb_impl_t {
+	int lanes;
+	mb_kernel_t md5;
+	mb_kernel_t sha1;
+	mb_kernel_t sha256;
+	mb_kernel_t sha512;
+} mb_impl_t;
+
+// Key of the batch and its number of blocks
+typedef struct mb_order_t {
+	size_t blocks;
+	size_t index;
+} mb_order_t;
+
+
+static const mb_padding_t mb_md5 = { MD5_BLOCK_SIZE, 8, true };
+static const mb_padding_t mb_sha1 = { SHA1_BLOCK_SIZE, 8, false };
+static const mb_padding_t mb_sha256 = { SHA256_BLOCK_SIZE, 8, false };
+static const mb_padding_t mb_sha512 = { SHA512_BLOCK_SIZE, 16, false };
+
+// MD5 constants (RFC 1321)
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+static const uint8_t md5_shift[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+static const uint8_t md5_index[64] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+	5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+	0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+};
+
+// SHA-256 constants (FIPS 180-4)
+static const uint32_t sha256_h[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// SHA-512 constants (FIPS 180-4)
+static const uint64_t sha512_h[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+
+static inline uint32_t load_le32(const unsigned char *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t load_be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t load_be64(const unsigned char *p) {
+	return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static inline void store_le32(unsigned char *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline void store_be32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void store_be64(unsigned char *p, uint64_t v) {
+	store_be32(p, v >> 32);
+	store_be32(p + 4, v);
+}
+
+
+/**
+ * Get the number of padded blocks of a message.
+ *
+ * @param[in] len     The length of the message.
+ * @param[in] padding The padding of the hash function.
+ *
+ * @return The number of blocks.
+ */
+static inline size_t mb_blocks(size_t len, const mb_padding_t *padding) {
+	return (len + 1 + padding->length_size + padding->block_size - 1) / padding->block_size;
+}
+
+
+/**
+ * Build a padded block of a message (a key followed by the salt).
+ *
+ * @param[in]  key      The key.
+ * @param[in]  salt     The salt.
+ * @param[in]  salt_len The length of the salt.
+ * @param[in]  index    The index of the block.
+ * @param[in]  blocks   The number of blocks of the message.
+ * @param[in]  padding  The padding of the hash function.
+ * @param[out] block    The block.
+ */
+static void mb_block(const identicon_key_t *key, const unsigned char *salt, size_t salt_len, size_t index,
+		size_t blocks, const mb_padding_t *padding, unsigned char *block) {
+	size_t start = index * padding->block_size, end = start + padding->block_size;
+	size_t total = key->len + salt_len, lo, hi;
+	uint64_t bits = (uint64_t)total * 8;
+	unsigned char *p;
+	int i;
+
+	memset(block, 0, padding->block_size);
+
+	// Bytes of the key, then of the salt
+	hi = (key->len < end) ? key->len : end;
+	if (start < hi)
+		memcpy(block, key->str + start, hi - start);
+
+	lo = (start > key->len) ? start : key->len;
+	hi = (total < end) ? total : end;
+	if (lo < hi)
+		memcpy(block + (lo - start), salt + (lo - key->len), hi - lo);
+
+	if ((total >= start) && (total < end))
+		block[total - start] = 0x80;
+
+	if (index == blocks - 1) {
+		p = block + padding->block_size - 8;
+		for (i = 0; i < 8; i++)
+			p[i] = padding->little_endian ? (bits >> (8 * i)) : (bits >> (56 - (8 * i)));
+
+		if (padding->length_size == 16)
+			p[-1] = (uint64_t)total >> 61;
+	}
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MB_LANES 4
+#define MB_SUFFIX sse2
+#define MB_TARGET __attribute__((target("sse2")))
+#include "identicon-c_multihash_lanes.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+
+#define MB_LANES 8
+#define MB_SUFFIX avx2
+#define MB_TARGET __attribute__((target("avx2")))
+#include "identicon-c_multihash_lanes.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+
+#define MB_LANES 16
+#define MB_SUFFIX avx512
+#define MB_TARGET __attribute__((target("avx512f")))
+#include "identicon-c_multihash_lanes.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+#endif
+
+#define MB_LANES 4
+#define MB_SUFFIX generic
+#define MB_TARGET
+#include "identicon-c_multihash_lanes.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+
+
+/**
+ * Get the kernels of the best instruction set supported by the CPU (chosen on first use).
+ *
+ * @return The kernels.
+ */
+static const mb_impl_t *mb_select(void) {
+	static const mb_impl_t *impl = NULL;
+	const mb_impl_t *selected = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+	if (selected == NULL) {
+		selected = &mb_impl_generic;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			selected = &mb_impl_avx512;
+		else if (__builtin_cpu_supports("avx2"))
+			selected = &mb_impl_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			selected = &mb_impl_sse2;
+#endif
+		__atomic_store_n(&impl, selected, __ATOMIC_RELAXED);
+	}
+
+	return selected;
+}
+
+
+/**
+ * Sort the keys of a batch by number of blocks.
+ *
+ * Insertion sort: the keys of a batch are usually of similar length, so they
+ * are mostly sorted already (if not all in the same group).
+ *
+ * @param[in,out] order The keys.
+ * @param[in]     count The number of keys.
+ */
+static void mb_sort(mb_order_t *order, size_t count) {
+	mb_order_t key;
+	size_t i, j;
+
+	for (i = 1; i < count; i++) {
+		key = order[i];
+		for (j = i; (j > 0) && (order[j - 1].blocks > key.blocks); j--)
+			order[j] = order[j - 1];
+		order[j] = key;
+	}
+}
+
+
+/**
+ * Hash a batch of keys (each one followed by the salt) in SIMD lanes.
+ *
+ * Keys whose string is NULL are skipped (their hash is left untouched).
+ *
+ * @param[in]  hash_type The hash algorithm to use.
+ * @param[in]  keys      The keys.
+ * @param[in]  count     The number of keys.
+ * @param[in]  salt      The salt (may be NULL).
+ * @param[in]  salt_len  The length of the salt.
+ * @param[out] hashes    The hashes of the keys.
+ *
+ * @return The length of the hashes or 0 if the hash algorithm has no
+ *         multi-buffer kernel (the keys must then be hashed one at a time).
+ */
+size_t identicon_multihash(identicon_hash_t hash_type, const identicon_key_t *keys, size_t count,
+		const unsigned char *salt, size_t salt_len, unsigned char (*hashes)[IDENTICON_MAX_DIGEST_SIZE]) {
+	const mb_impl_t *impl = mb_select();
+	const identicon_key_t *lane_keys[MB_MAX_LANES];
+	unsigned char *lane_hashes[MB_MAX_LANES];
+	const mb_padding_t *padding;
+	mb_order_t order[MB_CHUNK_SIZE];
+	size_t start, n, m, i, j, hash_len;
+	mb_kernel_t kernel;
+	int lanes, group;
+
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5:
+			kernel = impl->md5;
+			lanes = impl->lanes;
+			padding = &mb_md5;
+			hash_len = 16;
+			break;
+		case IDENTICON_HASH_SHA1:
+			kernel = impl->sha1;
+			lanes = impl->lanes;
+			padding = &mb_sha1;
+			hash_len = 20;
+			break;
+		case IDENTICON_HASH_SHA256:
+			kernel = impl->sha256;
+			lanes = impl->lanes;
+			padding = &mb_sha256;
+			hash_len = 32;
+			break;
+		case IDENTICON_HASH_SHA512:
+			kernel = impl->sha512;
+			lanes = impl->lanes / 2;
+			padding = &mb_sha512;
+			hash_len = 64;
+			break;
+		default:
+			return 0;
+	}
+
+	if ((keys == NULL) || (hashes == NULL))
+		return 0;
+
+	if (salt == NULL)
+		salt_len = 0;
+
+	for (start = 0; start < count; start += n) {
+		n = ((count - start) < MB_CHUNK_SIZE) ? count - start : MB_CHUNK_SIZE;
+
+		for (i = 0, m = 0; i < n; i++) {
+			if (keys[start + i].str == NULL)
+				continue;
+
+			order[m].blocks = mb_blocks(keys[start + i].len + salt_len, padding);
+			order[m].index = start + i;
+			m++;
+		}
+
+		mb_sort(order, m);
+
+		// Lanes of a group share their number of blocks
+		for (i = 0; i < m; i += group) {
+			for (group = 1; (i + group < m) && (group < lanes) && (order[i + group].blocks == order[i].blocks);
+					group++);
+
+			for (j = 0; j < (size_t)group; j++) {
+				lane_keys[j] = &keys[order[i + j].index];
+				lane_hashes[j] = hashes[order[i + j].index];
+			}
+
+			kernel(lane_keys, group, salt, salt_len, order[i].blocks, lane_hashes);
+		}
+	}
+
+	return hash_len;
+}
+
+#else
+
+size_t identicon_multihash(identicon_hash_t hash_type, const identicon_key_t *keys, size_t count,
+		const unsigned char *salt, size_t salt_len, unsigned char (*hashes)[IDENTICON_MAX_DIGEST_SIZE]) {
+	(void)hash_type;
+	(void)keys;
+	(void)count;
+	(void)salt;
+	(void)salt_len;
+	(void)hashes;
+
+	return 0;
+}
+
+#endif
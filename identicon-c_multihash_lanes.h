@@ -0,0 +1,331 @@
+/**
+ * identicon-c_multihash_lanes.h - Multi-buffer hash kernels (one instance per instruction set).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * This file is included by identicon-c_multihash.c once per instruction set,
+ * with these macros defined:
+ *
+ * - MB_LANES:  the number of 32 bit lanes of a vector (SHA-512 uses half as many 64 bit lanes)
+ * - MB_SUFFIX: the suffix of the names of the kernels
+ * - MB_TARGET: the target attribute of the kernels (may be empty)
+ *
+ * Lane l of every vector holds the state of message l: the kernels are plain
+ * C on GCC vector types, so the compiler emits the instructions of MB_TARGET.
+ */
+
+#define MB_CAT_(a, b) a##_##b
+#define MB_CAT(a, b) MB_CAT_(a, b)
+#define MB_NAME(name) MB_CAT(name, MB_SUFFIX)
+
+typedef uint32_t MB_NAME(v32_t) __attribute__((vector_size(MB_LANES * 4)));
+typedef uint64_t MB_NAME(v64_t) __attribute__((vector_size(MB_LANES * 4)));
+
+
+/**
+ * Hash up to MB_LANES messages of the same number of blocks with MD5.
+ *
+ * @param[in]  keys     The messages (followed by the salt).
+ * @param[in]  active   The number of messages.
+ * @param[in]  salt     The salt.
+ * @param[in]  salt_len The length of the salt.
+ * @param[in]  blocks   The number of (padded) blocks of every message.
+ * @param[out] hashes   The digests of the messages.
+ */
+MB_TARGET
+static void MB_NAME(md5_lanes)(const identicon_key_t *const *keys, int active, const unsigned char *salt,
+		size_t salt_len, size_t blocks, unsigned char *const *hashes) {
+	unsigned char block[MB_LANES][MD5_BLOCK_SIZE];
+	MB_NAME(v32_t) m[16], s[4], a, b, c, d, f, t;
+	size_t n;
+	int i, l;
+
+	s[0] = (MB_NAME(v32_t)){ 0 } + 0x67452301;
+	s[1] = (MB_NAME(v32_t)){ 0 } + 0xefcdab89;
+	s[2] = (MB_NAME(v32_t)){ 0 } + 0x98badcfe;
+	s[3] = (MB_NAME(v32_t)){ 0 } + 0x10325476;
+
+	for (n = 0; n < blocks; n++) {
+		for (i = 0; i < 16; i++)
+			m[i] = (MB_NAME(v32_t)){ 0 };
+
+		for (l = 0; l < active; l++) {
+			mb_block(keys[l], salt, salt_len, n, blocks, &mb_md5, block[l]);
+			for (i = 0; i < 16; i++)
+				m[i][l] = load_le32(block[l] + (4 * i));
+		}
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+
+		for (i = 0; i < 64; i++) {
+			if (i < 16)
+				f = d ^ (b & (c ^ d));
+			else if (i < 32)
+				f = c ^ (d & (b ^ c));
+			else if (i < 48)
+				f = b ^ c ^ d;
+			else
+				f = c ^ (b | ~d);
+
+			t = d;
+			d = c;
+			c = b;
+			b = b + ROTL32(a + f + md5_k[i] + m[md5_index[i]], md5_shift[i]);
+			a = t;
+		}
+
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+	}
+
+	for (l = 0; l < active; l++) {
+		for (i = 0; i < 4; i++)
+			store_le32(hashes[l] + (4 * i), s[i][l]);
+	}
+}
+
+
+/**
+ * Hash up to MB_LANES messages of the same number of blocks with SHA-1.
+ *
+ * @param[in]  keys     The messages (followed by the salt).
+ * @param[in]  active   The number of messages.
+ * @param[in]  salt     The salt.
+ * @param[in]  salt_len The length of the salt.
+ * @param[in]  blocks   The number of (padded) blocks of every message.
+ * @param[out] hashes   The digests of the messages.
+ */
+MB_TARGET
+static void MB_NAME(sha1_lanes)(const identicon_key_t *const *keys, int active, const unsigned char *salt,
+		size_t salt_len, size_t blocks, unsigned char *const *hashes) {
+	unsigned char block[MB_LANES][SHA1_BLOCK_SIZE];
+	MB_NAME(v32_t) w[16], s[5], a, b, c, d, e, f, t;
+	uint32_t k;
+	size_t n;
+	int i, l;
+
+	s[0] = (MB_NAME(v32_t)){ 0 } + 0x67452301;
+	s[1] = (MB_NAME(v32_t)){ 0 } + 0xefcdab89;
+	s[2] = (MB_NAME(v32_t)){ 0 } + 0x98badcfe;
+	s[3] = (MB_NAME(v32_t)){ 0 } + 0x10325476;
+	s[4] = (MB_NAME(v32_t)){ 0 } + 0xc3d2e1f0;
+
+	for (n = 0; n < blocks; n++) {
+		for (i = 0; i < 16; i++)
+			w[i] = (MB_NAME(v32_t)){ 0 };
+
+		for (l = 0; l < active; l++) {
+			mb_block(keys[l], salt, salt_len, n, blocks, &mb_sha1, block[l]);
+			for (i = 0; i < 16; i++)
+				w[i][l] = load_be32(block[l] + (4 * i));
+		}
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+
+		for (i = 0; i < 80; i++) {
+			if (i >= 16)
+				w[i & 15] = ROTL32(w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^ w[i & 15], 1);
+
+			if (i < 20) {
+				f = d ^ (b & (c ^ d));
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (d & (b | c));
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			t = ROTL32(a, 5) + f + e + k + w[i & 15];
+			e = d;
+			d = c;
+			c = ROTL32(b, 30);
+			b = a;
+			a = t;
+		}
+
+		s[0] += a;
+		s[1] += b;
+		s[2] += c;
+		s[3] += d;
+		s[4] += e;
+	}
+
+	for (l = 0; l < active; l++) {
+		for (i = 0; i < 5; i++)
+			store_be32(hashes[l] + (4 * i), s[i][l]);
+	}
+}
+
+
+/**
+ * Hash up to MB_LANES messages of the same number of blocks with SHA-256.
+ *
+ * @param[in]  keys     The messages (followed by the salt).
+ * @param[in]  active   The number of messages.
+ * @param[in]  salt     The salt.
+ * @param[in]  salt_len The length of the salt.
+ * @param[in]  blocks   The number of (padded) blocks of every message.
+ * @param[out] hashes   The digests of the messages.
+ */
+MB_TARGET
+static void MB_NAME(sha256_lanes)(const identicon_key_t *const *keys, int active, const unsigned char *salt,
+		size_t salt_len, size_t blocks, unsigned char *const *hashes) {
+	unsigned char block[MB_LANES][SHA256_BLOCK_SIZE];
+	MB_NAME(v32_t) w[16], s[8], v[8], t1, t2, s0, s1;
+	size_t n;
+	int i, l;
+
+	for (i = 0; i < 8; i++)
+		s[i] = (MB_NAME(v32_t)){ 0 } + sha256_h[i];
+
+	for (n = 0; n < blocks; n++) {
+		for (i = 0; i < 16; i++)
+			w[i] = (MB_NAME(v32_t)){ 0 };
+
+		for (l = 0; l < active; l++) {
+			mb_block(keys[l], salt, salt_len, n, blocks, &mb_sha256, block[l]);
+			for (i = 0; i < 16; i++)
+				w[i][l] = load_be32(block[l] + (4 * i));
+		}
+
+		for (i = 0; i < 8; i++)
+			v[i] = s[i];
+
+		for (i = 0; i < 64; i++) {
+			if (i >= 16) {
+				s0 = ROTR32(w[(i - 15) & 15], 7) ^ ROTR32(w[(i - 15) & 15], 18) ^ (w[(i - 15) & 15] >> 3);
+				s1 = ROTR32(w[(i - 2) & 15], 17) ^ ROTR32(w[(i - 2) & 15], 19) ^ (w[(i - 2) & 15] >> 10);
+				w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+			}
+
+			t1 = v[7] + (ROTR32(v[4], 6) ^ ROTR32(v[4], 11) ^ ROTR32(v[4], 25)) +
+					(v[6] ^ (v[4] & (v[5] ^ v[6]))) + sha256_k[i] + w[i & 15];
+			t2 = (ROTR32(v[0], 2) ^ ROTR32(v[0], 13) ^ ROTR32(v[0], 22)) +
+					((v[0] & v[1]) | (v[2] & (v[0] | v[1])));
+
+			v[7] = v[6];
+			v[6] = v[5];
+			v[5] = v[4];
+			v[4] = v[3] + t1;
+			v[3] = v[2];
+			v[2] = v[1];
+			v[1] = v[0];
+			v[0] = t1 + t2;
+		}
+
+		for (i = 0; i < 8; i++)
+			s[i] += v[i];
+	}
+
+	for (l = 0; l < active; l++) {
+		for (i = 0; i < 8; i++)
+			store_be32(hashes[l] + (4 * i), s[i][l]);
+	}
+}
+
+
+/**
+ * Hash up to MB_LANES / 2 messages of the same number of blocks with SHA-512.
+ *
+ * @param[in]  keys     The messages (followed by the salt).
+ * @param[in]  active   The number of messages.
+ * @param[in]  salt     The salt.
+ * @param[in]  salt_len The length of the salt.
+ * @param[in]  blocks   The number of (padded) blocks of every message.
+ * @param[out] hashes   The digests of the messages.
+ */
+MB_TARGET
+static void MB_NAME(sha512_lanes)(const identicon_key_t *const *keys, int active, const unsigned char *salt,
+		size_t salt_len, size_t blocks, unsigned char *const *hashes) {
+	unsigned char block[MB_LANES / 2][SHA512_BLOCK_SIZE];
+	MB_NAME(v64_t) w[16], s[8], v[8], t1, t2, s0, s1;
+	size_t n;
+	int i, l;
+
+	for (i = 0; i < 8; i++)
+		s[i] = (MB_NAME(v64_t)){ 0 } + sha512_h[i];
+
+	for (n = 0; n < blocks; n++) {
+		for (i = 0; i < 16; i++)
+			w[i] = (MB_NAME(v64_t)){ 0 };
+
+		for (l = 0; l < active; l++) {
+			mb_block(keys[l], salt, salt_len, n, blocks, &mb_sha512, block[l]);
+			for (i = 0; i < 16; i++)
+				w[i][l] = load_be64(block[l] + (8 * i));
+		}
+
+		for (i = 0; i < 8; i++)
+			v[i] = s[i];
+
+		for (i = 0; i < 80; i++) {
+			if (i >= 16) {
+				s0 = ROTR64(w[(i - 15) & 15], 1) ^ ROTR64(w[(i - 15) & 15], 8) ^ (w[(i - 15) & 15] >> 7);
+				s1 = ROTR64(w[(i - 2) & 15], 19) ^ ROTR64(w[(i - 2) & 15], 61) ^ (w[(i - 2) & 15] >> 6);
+				w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+			}
+
+			t1 = v[7] + (ROTR64(v[4], 14) ^ ROTR64(v[4], 18) ^ ROTR64(v[4], 41)) +
+					(v[6] ^ (v[4] & (v[5] ^ v[6]))) + sha512_k[i] + w[i & 15];
+			t2 = (ROTR64(v[0], 28) ^ ROTR64(v[0], 34) ^ ROTR64(v[0], 39)) +
+					((v[0] & v[1]) | (v[2] & (v[0] | v[1])));
+
+			v[7] = v[6];
+			v[6] = v[5];
+			v[5] = v[4];
+			v[4] = v[3] + t1;
+			v[3] = v[2];
+			v[2] = v[1];
+			v[1] = v[0];
+			v[0] = t1 + t2;
+		}
+
+		for (i = 0; i < 8; i++)
+			s[i] += v[i];
+	}
+
+	for (l = 0; l < active; l++) {
+		for (i = 0; i < 8; i++)
+			store_be64(hashes[l] + (8 * i), s[i][l]);
+	}
+}
+
+
+// Kernels of this instruction set
+static const mb_impl_t MB_NAME(mb_impl) = {
+	MB_LANES,
+	MB_NAME(md5_lanes),
+	MB_NAME(sha1_lanes),
+	MB_NAME(sha256_lanes),
+	MB_NAME(sha512_lanes)
+};
+
+#undef MB_NAME
+#undef MB_CAT
+#undef MB_CAT_
@@ -0,0 +1,800 @@
+/**
+ * identicon-c_pipeline.c - Functions to generate identicons in a multi-stage pipeline.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * Keys go through four stages: hash (descriptors), render (RGBA images, only
+ * with an encoder callback), encode (PNG images) and write (output callback).
+ * Every stage has its own threads and takes items (chunks of keys) from a
+ * bounded lock-free MPMC queue filled by the stage before it.
+ *
+ * Memory is bounded by a fixed set of items allocated with the pipeline: the
+ * hash stage has to take a free item before it claims the next chunk, so a
+ * slow stage stops the ones before it as soon as the items run out or its
+ * queue is full. The write stage runs in the calling thread and keeps the
+ * items that arrive early in a reorder buffer, so the output callback sees
+ * the keys in input order.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+// Default number of keys of an item and of items in flight
+#define PIPELINE_CHUNK_SIZE 16
+#define PIPELINE_ITEMS 64
+
+// Default capacity of the queue in front of each stage
+#define PIPELINE_QUEUE_DEPTH 16
+
+// Biggest number of threads of a stage
+#define PIPELINE_MAX_WORKERS 256
+
+// Size of a cache line (queue positions and stage statistics never share one)
+#define PIPELINE_CACHE_LINE 64
+
+// Waits spinning and yielding before sleeping
+#define PIPELINE_SPINS 64
+#define PIPELINE_YIELDS 128
+#define PIPELINE_SLEEP_NS 20000
+
+// States of a run
+#define PIPELINE_WAIT 0
+#define PIPELINE_RUN 1
+#define PIPELINE_ABORT 2
+
+
+// Chunk of keys going through the pipeline
+typedef struct pipeline_item_t {
+	size_t seq; // Index of the chunk
+	size_t first; // Index of its first key
+	size_t count;
+	identicon_descriptor_t *descs;
+	unsigned char *images; // RGBA images (only with an encoder callback)
+	unsigned char *out; // PNG images of the built-in writer
+	unsigned char **encoded; // Images of the encoder callback
+	size_t *lens;
+} pipeline_item_t;
+
+// Cell of a queue
+typedef struct pipeline_cell_t {
+	size_t seq;
+	pipeline_item_t *item;
+} pipeline_cell_t;
+
+// Bounded MPMC queue (Vyukov): the sequence of a cell tells if it can be written or read
+typedef struct pipeline_queue_t {
+	_Alignas(PIPELINE_CACHE_LINE) size_t enqueue_pos;
+	_Alignas(PIPELINE_CACHE_LINE) size_t dequeue_pos;
+	_Alignas(PIPELINE_CACHE_LINE) size_t mask;
+	pipeline_cell_t *cells;
+	size_t max_depth;
+} pipeline_queue_t;
+
+// Statistics of a stage
+typedef struct pipeline_stats_t {
+	_Alignas(PIPELINE_CACHE_LINE) uint64_t items;
+	uint64_t wait_ns;
+	uint64_t stall_ns;
+	size_t taken; // Items taken from the input queue in this run
+} pipeline_stats_t;
+
+// Thread of a stage
+typedef struct pipeline_worker_t {
+	identicon_pipeline_t *pipeline;
+	identicon_stage_t stage;
+	pthread_t thread;
+} pipeline_worker_t;
+
+// Multi-stage pipeline
+struct identicon_pipeline_t {
+	identicon_opts2_t opts;
+	identicon_pipeline_config_t config;
+	size_t img_size;
+	size_t png_size;
+	pipeline_item_t *items;
+	pipeline_item_t **reorder;
+	pipeline_queue_t free_items; // Input of the hash stage
+	pipeline_queue_t queues[IDENTICON_STAGES]; // Input of the other stages
+	pipeline_stats_t stats[IDENTICON_STAGES];
+	const identicon_key_t *keys;
+	size_t count;
+	size_t chunks;
+	int state; // Threads of a run wait for PIPELINE_RUN
+	_Alignas(PIPELINE_CACHE_LINE) size_t next_chunk;
+	bool failed;
+	identicon_allocator_t allocator; // Also the one of the threads of a run
+};
+
+
+/**
+ * Get a monotonic time.
+ *
+ * @return The time in nanoseconds.
+ */
+static uint64_t pipeline_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+
+/**
+ * Wait a little before trying again (spin, then yield, then sleep).
+ *
+ * @param[in,out] tries The number of tries so far.
+ */
+static void pipeline_backoff(unsigned int *tries) {
+	struct timespec ts = { 0, PIPELINE_SLEEP_NS };
+
+	if (*tries < PIPELINE_SPINS)
+		__asm__ __volatile__("" ::: "memory");
+	else if (*tries < PIPELINE_YIELDS)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+
+	(*tries)++;
+}
+
+
+/**
+ * Create a queue.
+ *
+ * @param[out] queue    The queue.
+ * @param[in]  capacity The minimum capacity (rounded up to a power of 2).
+ *
+ * @return True if the queue has been created, false if an error occurred.
+ */
+static bool queue_init(pipeline_queue_t *queue, const identicon_allocator_t *allocator, size_t capacity) {
+	size_t size = 2, i;
+
+	while (size < capacity)
+		size *= 2;
+
+	queue->cells = identicon_malloc_with(allocator, size * sizeof(pipeline_cell_t));
+	if (queue->cells == NULL)
+		return false;
+
+	for (i = 0; i < size; i++)
+		queue->cells[i].seq = i;
+
+	queue->mask = size - 1;
+	queue->enqueue_pos = 0;
+	queue->dequeue_pos = 0;
+	queue->max_depth = 0;
+
+	return true;
+}
+
+
+/**
+ * Get the number of items in a queue.
+ *
+ * @param[in] queue The queue.
+ *
+ * @return The number of items (a snapshot, the queue may be in use).
+ */
+static size_t queue_depth(pipeline_queue_t *queue) {
+	size_t dequeue_pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	size_t enqueue_pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
+	return (enqueue_pos > dequeue_pos) ? enqueue_pos - dequeue_pos : 0;
+}
+
+
+/**
+ * Add an item to a queue.
+ *
+ * @param[in,out] queue The queue.
+ * @param[in]     item  The item.
+ *
+ * @return True if the item has been added, false if the queue is full.
+ */
+static bool queue_push(pipeline_queue_t *queue, pipeline_item_t *item) {
+	size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	size_t depth, max_depth;
+	pipeline_cell_t *cell;
+	intptr_t diff;
+
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->item = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	depth = queue_depth(queue);
+	max_depth = __atomic_load_n(&queue->max_depth, __ATOMIC_RELAXED);
+	while ((depth > max_depth) && !__atomic_compare_exchange_n(&queue->max_depth, &max_depth, depth, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+
+/**
+ * Take an item from a queue.
+ *
+ * @param[in,out] queue The queue.
+ *
+ * @return The item or NULL if the queue is empty.
+ */
+static pipeline_item_t *queue_pop(pipeline_queue_t *queue) {
+	size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	pipeline_item_t *item;
+	pipeline_cell_t *cell;
+	intptr_t diff;
+
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	item = cell->item;
+	__atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+
+/**
+ * Add an item to a queue, waiting while it is full (back-pressure).
+ *
+ * @param[in,out] queue The queue.
+ * @param[in]     item  The item.
+ * @param[in,out] stats The statistics of the stage pushing the item (stall time).
+ */
+static void pipeline_push(pipeline_queue_t *queue, pipeline_item_t *item, pipeline_stats_t *stats) {
+	unsigned int tries = 0;
+	uint64_t start;
+
+	if (queue_push(queue, item))
+		return;
+
+	start = pipeline_now();
+	while (!queue_push(queue, item))
+		pipeline_backoff(&tries);
+
+	__atomic_fetch_add(&stats->stall_ns, pipeline_now() - start, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Take an item from the input queue of a stage, waiting while it is empty.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in]     stage    The stage.
+ *
+ * @return The item or NULL if the stage has already taken every chunk of the run.
+ */
+static pipeline_item_t *pipeline_pop(identicon_pipeline_t *pipeline, identicon_stage_t stage) {
+	pipeline_stats_t *stats = &pipeline->stats[stage];
+	pipeline_queue_t *queue = &pipeline->queues[stage];
+	pipeline_item_t *item;
+	unsigned int tries = 0;
+	uint64_t start = 0;
+
+	while ((item = queue_pop(queue)) == NULL) {
+		if (__atomic_load_n(&stats->taken, __ATOMIC_ACQUIRE) >= pipeline->chunks)
+			break;
+
+		if (start == 0)
+			start = pipeline_now();
+		pipeline_backoff(&tries);
+	}
+
+	if (item != NULL)
+		__atomic_fetch_add(&stats->taken, 1, __ATOMIC_RELEASE);
+
+	if (start != 0)
+		__atomic_fetch_add(&stats->wait_ns, pipeline_now() - start, __ATOMIC_RELAXED);
+
+	return item;
+}
+
+
+/**
+ * Run the hash stage: take a free item, claim the next chunk of keys and compute their descriptors.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+static void pipeline_hash(identicon_pipeline_t *pipeline) {
+	pipeline_stats_t *stats = &pipeline->stats[IDENTICON_STAGE_HASH];
+	pipeline_queue_t *next;
+	pipeline_item_t *item;
+	unsigned int tries;
+	uint64_t start;
+	size_t seq;
+
+	// Without an encoder callback there is nothing to render
+	next = &pipeline->queues[(pipeline->config.encode != NULL) ? IDENTICON_STAGE_RENDER : IDENTICON_STAGE_ENCODE];
+
+	for (;;) {
+		// The item is taken first, so that every claimed chunk has an item (see the reorder buffer)
+		tries = 0;
+		start = 0;
+		while ((item = queue_pop(&pipeline->free_items)) == NULL) {
+			if (start == 0)
+				start = pipeline_now();
+			pipeline_backoff(&tries);
+		}
+		if (start != 0)
+			__atomic_fetch_add(&stats->stall_ns, pipeline_now() - start, __ATOMIC_RELAXED);
+
+		seq = __atomic_fetch_add(&pipeline->next_chunk, 1, __ATOMIC_RELAXED);
+		if (seq >= pipeline->chunks) {
+			queue_push(&pipeline->free_items, item);
+			break;
+		}
+
+		item->seq = seq;
+		item->first = seq * pipeline->config.chunk_size;
+		item->count = ((pipeline->count - item->first) < pipeline->config.chunk_size) ?
+				pipeline->count - item->first : pipeline->config.chunk_size;
+
+		if (!__atomic_load_n(&pipeline->failed, __ATOMIC_RELAXED) &&
+				!identicon_compute_descriptors2(pipeline->keys + item->first, item->count, &pipeline->opts,
+				item->descs))
+			__atomic_store_n(&pipeline->failed, true, __ATOMIC_RELAXED);
+
+		__atomic_fetch_add(&stats->items, 1, __ATOMIC_RELAXED);
+		pipeline_push(next, item, stats);
+	}
+}
+
+
+/**
+ * Run the render stage: draw the RGBA images of the items (for the encoder callback).
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+static void pipeline_render(identicon_pipeline_t *pipeline) {
+	pipeline_stats_t *stats = &pipeline->stats[IDENTICON_STAGE_RENDER];
+	const identicon_key_t *keys = pipeline->keys;
+	pipeline_item_t *item;
+	size_t i;
+
+	while ((item = pipeline_pop(pipeline, IDENTICON_STAGE_RENDER)) != NULL) {
+		for (i = 0; (i < item->count) && !__atomic_load_n(&pipeline->failed, __ATOMIC_RELAXED); i++) {
+			if (keys[item->first + i].str == NULL)
+				continue;
+
+			// The background of a transparent identicon is left untouched (as in a new image)
+			if (pipeline->opts.transparent)
+				memset(item->images + (i * pipeline->img_size), 0, pipeline->img_size);
+
+			identicon_render_descriptor2(item->images + (i * pipeline->img_size), (size_t)pipeline->opts.size * 4,
+					0, 0, &item->descs[i], &pipeline->opts);
+		}
+
+		__atomic_fetch_add(&stats->items, 1, __ATOMIC_RELAXED);
+		pipeline_push(&pipeline->queues[IDENTICON_STAGE_ENCODE], item, stats);
+	}
+}
+
+
+/**
+ * Run the encode stage: write the PNG images of the items.
+ *
+ * The encoder callback gets the RGBA images if there is one, otherwise the
+ * built-in writer encodes the descriptors.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+static void pipeline_encode(identicon_pipeline_t *pipeline) {
+	pipeline_stats_t *stats = &pipeline->stats[IDENTICON_STAGE_ENCODE];
+	const identicon_pipeline_config_t *config = &pipeline->config;
+	const identicon_key_t *keys = pipeline->keys;
+	pipeline_item_t *item;
+	size_t i;
+
+	while ((item = pipeline_pop(pipeline, IDENTICON_STAGE_ENCODE)) != NULL) {
+		for (i = 0; i < item->count; i++) {
+			item->lens[i] = 0;
+			item->encoded[i] = NULL;
+
+			if ((keys[item->first + i].str == NULL) || __atomic_load_n(&pipeline->failed, __ATOMIC_RELAXED))
+				continue;
+
+			if (config->encode != NULL)
+				item->encoded[i] = config->encode(item->images + (i * pipeline->img_size), pipeline->opts.size,
+						&item->lens[i], config->encode_user);
+			else
+				item->lens[i] = identicon_write_png2(&item->descs[i], &pipeline->opts,
+						item->out + (i * pipeline->png_size), pipeline->png_size);
+
+			if ((item->lens[i] == 0) || ((config->encode != NULL) && (item->encoded[i] == NULL))) {
+				identicon_free_with(&pipeline->allocator, item->encoded[i]);
+				item->encoded[i] = NULL;
+				item->lens[i] = 0;
+				__atomic_store_n(&pipeline->failed, true, __ATOMIC_RELAXED);
+			}
+		}
+
+		__atomic_fetch_add(&stats->items, 1, __ATOMIC_RELAXED);
+		pipeline_push(&pipeline->queues[IDENTICON_STAGE_WRITE], item, stats);
+	}
+}
+
+
+/**
+ * Give the images of an item to the output callback and free the item.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in,out] item     The item.
+ */
+static void pipeline_output(identicon_pipeline_t *pipeline, pipeline_item_t *item) {
+	const identicon_pipeline_config_t *config = &pipeline->config;
+	const unsigned char *data;
+	size_t i;
+
+	for (i = 0; i < item->count; i++) {
+		data = (config->encode != NULL) ? item->encoded[i] : item->out + (i * pipeline->png_size);
+
+		if ((item->lens[i] != 0) && !__atomic_load_n(&pipeline->failed, __ATOMIC_RELAXED) &&
+				!config->output(item->first + i, data, item->lens[i], config->output_user))
+			__atomic_store_n(&pipeline->failed, true, __ATOMIC_RELAXED);
+
+		if (config->encode != NULL)
+			identicon_free_with(&pipeline->allocator, item->encoded[i]);
+	}
+
+	// The free queue can hold every item, so this never fails
+	queue_push(&pipeline->free_items, item);
+}
+
+
+/**
+ * Run the write stage: give the items to the output callback in input order.
+ *
+ * An item has a chunk in [next, next + items), so slot seq % items of the
+ * reorder buffer is always free for it.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+static void pipeline_write(identicon_pipeline_t *pipeline) {
+	pipeline_stats_t *stats = &pipeline->stats[IDENTICON_STAGE_WRITE];
+	size_t items = pipeline->config.items;
+	pipeline_item_t *item;
+	size_t next = 0;
+
+	while ((item = pipeline_pop(pipeline, IDENTICON_STAGE_WRITE)) != NULL) {
+		pipeline->reorder[item->seq % items] = item;
+
+		while ((next < pipeline->chunks) && ((item = pipeline->reorder[next % items]) != NULL) &&
+				(item->seq == next)) {
+			pipeline->reorder[next % items] = NULL;
+			pipeline_output(pipeline, item);
+			__atomic_fetch_add(&stats->items, 1, __ATOMIC_RELAXED);
+			next++;
+		}
+	}
+}
+
+
+/**
+ * Main function of the threads of a pipeline.
+ *
+ * @param[in] arg The worker.
+ *
+ * @return Always NULL.
+ */
+static void *pipeline_thread(void *arg) {
+	pipeline_worker_t *worker = arg;
+	unsigned int tries = 0;
+	int state;
+
+	while ((state = __atomic_load_n(&worker->pipeline->state, __ATOMIC_ACQUIRE)) == PIPELINE_WAIT)
+		pipeline_backoff(&tries);
+
+	if (state == PIPELINE_ABORT)
+		return NULL;
+
+	identicon_allocator_push(&worker->pipeline->allocator);
+
+	switch (worker->stage) {
+		case IDENTICON_STAGE_HASH: pipeline_hash(worker->pipeline); break;
+		case IDENTICON_STAGE_RENDER: pipeline_render(worker->pipeline); break;
+		case IDENTICON_STAGE_ENCODE: pipeline_encode(worker->pipeline); break;
+		default: break;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Set the configuration of a pipeline to the defaults.
+ *
+ * One thread per stage, PIPELINE_ITEMS items of PIPELINE_CHUNK_SIZE keys in
+ * flight, queues of PIPELINE_QUEUE_DEPTH items and the built-in PNG writer.
+ *
+ * @param[out] config The configuration.
+ */
+void identicon_pipeline_config_init(identicon_pipeline_config_t *config) {
+	int i;
+
+	if (config == NULL)
+		return;
+
+	memset(config, 0, sizeof(identicon_pipeline_config_t));
+
+	for (i = 0; i < IDENTICON_STAGES; i++)
+		config->workers[i] = 1;
+
+	config->chunk_size = PIPELINE_CHUNK_SIZE;
+	config->items = PIPELINE_ITEMS;
+	config->queue_depth = PIPELINE_QUEUE_DEPTH;
+}
+
+
+/**
+ * Create a multi-stage pipeline.
+ *
+ * All the memory of the pipeline (items * chunk_size images) is allocated
+ * here. The options are copied, but the salt is borrowed: it must stay valid
+ * as long as the pipeline.
+ *
+ * @param[in] opts   The identicon options shared by every image (opts->key is ignored).
+ * @param[in] config The configuration (config->output is mandatory).
+ *
+ * @return The pipeline or NULL if an error occurred.
+ */
+identicon_pipeline_t *new_identicon_pipeline(const identicon_opts2_t *opts, const identicon_pipeline_config_t *config) {
+	const identicon_allocator_t *allocator = identicon_allocator();
+	identicon_pipeline_t *pipeline;
+	pipeline_item_t *item;
+	size_t i, chunk, item_size;
+	int s;
+
+	if ((opts == NULL) || (config == NULL) || (config->output == NULL) ||
+			((opts->salt == NULL) && (opts->salt_len != 0)) || (opts->size == 0) || (opts->size > INT32_MAX))
+		return NULL;
+
+	pipeline = identicon_calloc_with(allocator, 1, sizeof(identicon_pipeline_t));
+	if (pipeline == NULL)
+		return NULL;
+
+	pipeline->allocator = *allocator;
+	pipeline->opts = *opts;
+	pipeline->opts.key = NULL;
+	pipeline->opts.key_len = 0;
+	pipeline->config = *config;
+
+	if (pipeline->config.chunk_size == 0)
+		pipeline->config.chunk_size = PIPELINE_CHUNK_SIZE;
+	if (pipeline->config.items == 0)
+		pipeline->config.items = PIPELINE_ITEMS;
+	if (pipeline->config.queue_depth == 0)
+		pipeline->config.queue_depth = PIPELINE_QUEUE_DEPTH;
+
+	for (s = 0; s < IDENTICON_STAGES; s++) {
+		if (pipeline->config.workers[s] == 0)
+			pipeline->config.workers[s] = 1;
+		else if (pipeline->config.workers[s] > PIPELINE_MAX_WORKERS)
+			pipeline->config.workers[s] = PIPELINE_MAX_WORKERS;
+	}
+
+	// The write stage is the calling thread (output order)
+	pipeline->config.workers[IDENTICON_STAGE_WRITE] = 1;
+
+	chunk = pipeline->config.chunk_size;
+	pipeline->img_size = (config->encode != NULL) ? identicon_image_size2(opts) : 0;
+	pipeline->png_size = (config->encode != NULL) ? 0 : identicon_png_size_bound2(opts);
+	item_size = chunk * (sizeof(identicon_descriptor_t) + sizeof(size_t) + sizeof(unsigned char *) +
+			pipeline->img_size + pipeline->png_size);
+
+	pipeline->items = identicon_calloc_with(allocator, pipeline->config.items, sizeof(pipeline_item_t));
+	pipeline->reorder = identicon_calloc_with(allocator, pipeline->config.items, sizeof(pipeline_item_t *));
+
+	if ((pipeline->items == NULL) || (pipeline->reorder == NULL) ||
+			!queue_init(&pipeline->free_items, allocator, pipeline->config.items)) {
+		free_identicon_pipeline(pipeline);
+		return NULL;
+	}
+
+	for (s = IDENTICON_STAGE_RENDER; s < IDENTICON_STAGES; s++) {
+		if (!queue_init(&pipeline->queues[s], allocator, pipeline->config.queue_depth)) {
+			free_identicon_pipeline(pipeline);
+			return NULL;
+		}
+	}
+
+	// One block per item: lens, encoded, descriptors and images (pointers first for alignment)
+	for (i = 0; i < pipeline->config.items; i++) {
+		item = &pipeline->items[i];
+		item->lens = identicon_malloc_with(allocator, item_size);
+		if (item->lens == NULL) {
+			free_identicon_pipeline(pipeline);
+			return NULL;
+		}
+
+		item->encoded = (unsigned char **)(item->lens + chunk);
+		item->descs = (identicon_descriptor_t *)(item->encoded + chunk);
+		item->images = (unsigned char *)(item->descs + chunk);
+		item->out = item->images + (chunk * pipeline->img_size);
+
+		queue_push(&pipeline->free_items, item);
+	}
+
+	return pipeline;
+}
+
+
+/**
+ * Free a multi-stage pipeline.
+ *
+ * @param[in] pipeline The pipeline (may be NULL).
+ */
+void free_identicon_pipeline(identicon_pipeline_t *pipeline) {
+	size_t i;
+	int s;
+
+	if (pipeline == NULL)
+		return;
+
+	if (pipeline->items != NULL) {
+		for (i = 0; i < pipeline->config.items; i++)
+			identicon_free_with(&pipeline->allocator, pipeline->items[i].lens);
+	}
+
+	for (s = 0; s < IDENTICON_STAGES; s++)
+		identicon_free_with(&pipeline->allocator, pipeline->queues[s].cells);
+
+	identicon_free_with(&pipeline->allocator, pipeline->free_items.cells);
+	identicon_free_with(&pipeline->allocator, pipeline->reorder);
+	identicon_free_with(&pipeline->allocator, pipeline->items);
+	identicon_free_with(&pipeline->allocator, pipeline);
+}
+
+
+/**
+ * Generate the identicons of many keys with a pipeline.
+ *
+ * The threads of the hash, render and encode stages are started for the run;
+ * the write stage runs in the calling thread, which gets back once every key
+ * has been given to the output callback (in input order, keys with a NULL
+ * string are skipped). After an error the remaining keys are drained without
+ * any work.
+ *
+ * @param[in,out] pipeline The pipeline (one run at a time).
+ * @param[in]     keys     The keys.
+ * @param[in]     count    The number of keys.
+ *
+ * @return True if every identicon has been written, false if an error occurred.
+ */
+bool identicon_pipeline_run(identicon_pipeline_t *pipeline, const identicon_key_t *keys, size_t count) {
+	pipeline_worker_t *workers;
+	size_t n = 0, started = 0, i = 0;
+	unsigned int j;
+	int s;
+
+	if ((pipeline == NULL) || (keys == NULL))
+		return false;
+
+	if (count == 0)
+		return true;
+
+	for (s = IDENTICON_STAGE_HASH; s < IDENTICON_STAGE_WRITE; s++)
+		n += pipeline->config.workers[s];
+
+	workers = identicon_calloc_with(&pipeline->allocator, n, sizeof(pipeline_worker_t));
+	if (workers == NULL)
+		return false;
+
+	pipeline->keys = keys;
+	pipeline->count = count;
+	pipeline->chunks = (count + pipeline->config.chunk_size - 1) / pipeline->config.chunk_size;
+	pipeline->next_chunk = 0;
+	pipeline->failed = false;
+	pipeline->state = PIPELINE_WAIT;
+	memset(pipeline->stats, 0, sizeof(pipeline->stats));
+	for (s = 0; s < IDENTICON_STAGES; s++)
+		pipeline->queues[s].max_depth = 0;
+	pipeline->free_items.max_depth = 0;
+
+	// Without an encoder callback the render stage has no work and no thread
+	if (pipeline->config.encode == NULL)
+		pipeline->stats[IDENTICON_STAGE_RENDER].taken = pipeline->chunks;
+
+	for (s = IDENTICON_STAGE_HASH; (s < IDENTICON_STAGE_WRITE) && (started == i); s++) {
+		if ((s == IDENTICON_STAGE_RENDER) && (pipeline->config.encode == NULL))
+			continue;
+
+		for (j = 0, i = started; (j < pipeline->config.workers[s]) && (started == i); j++, i++) {
+			workers[i].pipeline = pipeline;
+			workers[i].stage = s;
+			if (pthread_create(&workers[i].thread, NULL, pipeline_thread, &workers[i]) == 0)
+				started++;
+		}
+	}
+
+	// Every stage needs all of its threads before any work starts, otherwise the run could not end
+	if (started == i) {
+		__atomic_store_n(&pipeline->state, PIPELINE_RUN, __ATOMIC_RELEASE);
+		pipeline_write(pipeline);
+	} else {
+		pipeline->failed = true;
+		__atomic_store_n(&pipeline->state, PIPELINE_ABORT, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	identicon_free_with(&pipeline->allocator, workers);
+
+	return !pipeline->failed;
+}
+
+
+/**
+ * Get the statistics of the stages of a pipeline (for the current or last run).
+ *
+ * The queue of a stage is the one it takes items from: for the hash stage it
+ * holds the free items, so a full one means that the stages after it are slow.
+ *
+ * @param[in]  pipeline The pipeline.
+ * @param[out] stats    The statistics (IDENTICON_STAGES elements, indexed by identicon_stage_t).
+ */
+void identicon_pipeline_get_stats(identicon_pipeline_t *pipeline, identicon_stage_stats_t *stats) {
+	pipeline_queue_t *queue;
+	int s;
+
+	if ((pipeline == NULL) || (stats == NULL))
+		return;
+
+	for (s = 0; s < IDENTICON_STAGES; s++) {
+		queue = (s == IDENTICON_STAGE_HASH) ? &pipeline->free_items : &pipeline->queues[s];
+
+		stats[s].workers = ((s == IDENTICON_STAGE_RENDER) && (pipeline->config.encode == NULL)) ? 0 :
+				pipeline->config.workers[s];
+		stats[s].items = __atomic_load_n(&pipeline->stats[s].items, __ATOMIC_RELAXED);
+		stats[s].queue_depth = (queue->cells != NULL) ? queue_depth(queue) : 0;
+		stats[s].queue_max_depth = __atomic_load_n(&queue->max_depth, __ATOMIC_RELAXED);
+		stats[s].wait_ns = __atomic_load_n(&pipeline->stats[s].wait_ns, __ATOMIC_RELAXED);
+		stats[s].stall_ns = __atomic_load_n(&pipeline->stats[s].stall_ns, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,1193 @@
+/**
+ * identicon-c_png.c - Functions to write an identicon as a PNG image.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * An identicon only has two colors, so it is written as a 1 bit palette PNG
+ * straight from its descriptor and draw plan, without any RGBA buffer.
+ *
+ * The zlib stream is a single deflate block: every row is run length encoded
+ * (matches at distance 1) and the other rows of a band, which are all equal to
+ * the first one, become matches at a distance of one row.
+ *
+ * The IDAT chunk does not depend on the colors, so a template cache can keep
+ * the one of every cell pattern of a geometry and only the PLTE chunk is
+ * written for each identicon.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+// Deflate match limits
+#define DEFLATE_MIN_LENGTH 3
+#define DEFLATE_MAX_LENGTH 258
+#define DEFLATE_MAX_DISTANCE 32768
+
+// Number of deflate literal/length and distance codes
+#define DEFLATE_LIT_CODES 288
+#define DEFLATE_DIST_CODES 30
+
+// Adler-32 modulus
+#define ADLER_BASE 65521
+
+// Size of the fixed PNG chunks
+#define PNG_SIGNATURE_SIZE 8
+#define PNG_CHUNK_OVERHEAD 12
+#define PNG_IHDR_SIZE 13
+#define PNG_HEAD_SIZE (PNG_SIGNATURE_SIZE + PNG_CHUNK_OVERHEAD + PNG_IHDR_SIZE)
+#define PNG_PALETTE_SIZE IDENTICON_PNG_PALETTE_SIZE
+
+// Number of cell patterns of an identicon
+#define PNG_PATTERN_COUNT (1 << 15)
+
+
+// Output buffer (a NULL buffer only measures the output)
+typedef struct out_buffer_t {
+	unsigned char *buf;
+	size_t size;
+	size_t len;
+	uint32_t bits;
+	int bit_count;
+	bool overflow;
+} out_buffer_t;
+
+// Deflate encoder (counting symbols when out is NULL, codes are bit reversed)
+typedef struct deflate_t {
+	out_buffer_t *out;
+	uint32_t lit_freq[DEFLATE_LIT_CODES];
+	uint32_t dist_freq[DEFLATE_DIST_CODES];
+	uint64_t extra_bits;
+	uint16_t lit_code[DEFLATE_LIT_CODES];
+	uint8_t lit_len[DEFLATE_LIT_CODES];
+	uint16_t dist_code[DEFLATE_DIST_CODES];
+	uint8_t dist_len[DEFLATE_DIST_CODES];
+	bool fixed;
+} deflate_t;
+
+// Cached IDAT chunk of a cell pattern
+typedef struct png_cache_entry_t {
+	size_t len;
+	unsigned char data[];
+} png_cache_entry_t;
+
+// PNG template cache of a geometry (the IDAT chunks are filled lazily, entries never change once set)
+struct identicon_png_cache_t {
+	identicon_plan_t plan;
+	bool transparent;
+	unsigned char head[PNG_HEAD_SIZE];
+	size_t idat_bound;
+	png_cache_entry_t *entries[PNG_PATTERN_COUNT];
+	identicon_allocator_t allocator;
+};
+
+
+// CRC-32 table (polynomial 0xedb88320)
+static const uint32_t crc_table[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+// IEND chunk (it has no data, so it never changes)
+static const unsigned char png_iend[PNG_CHUNK_OVERHEAD] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+
+// Deflate length codes (257-285) and distance codes (0-29)
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+
+/**
+ * Update a CRC-32.
+ *
+ * @param[in] crc The current CRC (0xffffffff at start, complemented at the end).
+ * @param[in] buf The data.
+ * @param[in] len The length of the data.
+ *
+ * @return The updated CRC.
+ */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+
+/**
+ * Initialize an output buffer.
+ *
+ * @param[out] out      The output buffer.
+ * @param[in]  buf      The destination buffer or NULL to only measure the output.
+ * @param[in]  buf_size The size of the destination buffer.
+ */
+static void out_init(out_buffer_t *out, unsigned char *buf, size_t buf_size) {
+	out->buf = buf;
+	out->size = buf_size;
+	out->len = 0;
+	out->bits = 0;
+	out->bit_count = 0;
+	out->overflow = false;
+}
+
+
+/**
+ * Append bytes to the output buffer.
+ *
+ * @param[in,out] out  The output buffer.
+ * @param[in]     data The bytes to append.
+ * @param[in]     len  The number of bytes.
+ */
+static void put_bytes(out_buffer_t *out, const void *data, size_t len) {
+	if (out->buf != NULL) {
+		if (out->overflow || (len > out->size - out->len)) {
+			out->overflow = true;
+			return;
+		}
+		memcpy(out->buf + out->len, data, len);
+	}
+
+	out->len += len;
+}
+
+
+/**
+ * Append a big endian 32 bit number to the output buffer.
+ *
+ * @param[in,out] out   The output buffer.
+ * @param[in]     value The number.
+ */
+static void put_u32(out_buffer_t *out, uint32_t value) {
+	unsigned char buf[4] = { value >> 24, value >> 16, value >> 8, value };
+
+	put_bytes(out, buf, 4);
+}
+
+
+/**
+ * Append bits to the output buffer (least significant bit first).
+ *
+ * @param[in,out] out   The output buffer.
+ * @param[in]     value The bits.
+ * @param[in]     count The number of bits (at most 24).
+ */
+static void put_bits(out_buffer_t *out, uint32_t value, int count) {
+	unsigned char byte;
+
+	out->bits |= value << out->bit_count;
+	out->bit_count += count;
+
+	while (out->bit_count >= 8) {
+		byte = out->bits & 0xff;
+		put_bytes(out, &byte, 1);
+		out->bits >>= 8;
+		out->bit_count -= 8;
+	}
+}
+
+
+/**
+ * Flush the pending bits to the output buffer (padding the last byte with zeroes).
+ *
+ * @param[in,out] out The output buffer.
+ */
+static void flush_bits(out_buffer_t *out) {
+	if (out->bit_count > 0)
+		put_bits(out, 0, 8 - out->bit_count);
+}
+
+
+/**
+ * Reverse the bits of a Huffman code (deflate writes them most significant bit first).
+ *
+ * @param[in] code  The code.
+ * @param[in] count The length of the code.
+ *
+ * @return The reversed code.
+ */
+static uint16_t reverse_bits(uint16_t code, int count) {
+	uint16_t reversed = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		reversed |= ((code >> i) & 1) << (count - 1 - i);
+
+	return reversed;
+}
+
+
+/**
+ * Start a PNG chunk.
+ *
+ * @param[in,out] out  The output buffer.
+ * @param[in]     type The chunk type.
+ *
+ * @return The offset of the chunk in the output buffer.
+ */
+static size_t chunk_begin(out_buffer_t *out, const char *type) {
+	size_t start = out->len;
+
+	put_u32(out, 0);
+	put_bytes(out, type, 4);
+
+	return start;
+}
+
+
+/**
+ * Finish a PNG chunk, writing its length and CRC.
+ *
+ * @param[in,out] out   The output buffer.
+ * @param[in]     start The offset of the chunk in the output buffer.
+ */
+static void chunk_end(out_buffer_t *out, size_t start) {
+	uint32_t len = out->len - start - 8;
+	uint32_t crc = 0;
+
+	if ((out->buf != NULL) && !out->overflow) {
+		out->buf[start] = len >> 24;
+		out->buf[start+1] = len >> 16;
+		out->buf[start+2] = len >> 8;
+		out->buf[start+3] = len;
+		crc = crc32_update(0xffffffff, out->buf + start + 4, len + 4) ^ 0xffffffff;
+	}
+
+	put_u32(out, crc);
+}
+
+
+/**
+ * Compute length limited Huffman code lengths.
+ *
+ * Frequencies are halved until the longest code fits the limit, which is
+ * plenty for the handful of symbols used by an identicon.
+ *
+ * @param[in]  freq    The symbol frequencies.
+ * @param[in]  n       The number of symbols (at most DEFLATE_LIT_CODES).
+ * @param[in]  limit   The maximum code length.
+ * @param[out] lengths The code lengths (0 for unused symbols).
+ */
+static void huffman_lengths(const uint32_t *freq, int n, int limit, uint8_t *lengths) {
+	uint32_t weight[2 * DEFLATE_LIT_CODES], scaled[DEFLATE_LIT_CODES];
+	int parent[2 * DEFLATE_LIT_CODES], leaves[DEFLATE_LIT_CODES];
+	int i, j, m, node, leaf, inner, pick[2], depth, max_depth;
+
+	for (i = 0; i < n; i++)
+		scaled[i] = freq[i];
+
+	for (;;) {
+		// Used symbols sorted by weight (insertion sort, there are few of them)
+		m = 0;
+		for (i = 0; i < n; i++) {
+			if (scaled[i] == 0)
+				continue;
+			for (j = m; (j > 0) && (scaled[leaves[j-1]] > scaled[i]); j--)
+				leaves[j] = leaves[j-1];
+			leaves[j] = i;
+			m++;
+		}
+
+		memset(lengths, 0, n);
+		if (m == 1) {
+			lengths[leaves[0]] = 1;
+			return;
+		}
+
+		// Two queues: sorted leaves and inner nodes (created in weight order)
+		for (i = 0; i < m; i++)
+			weight[i] = scaled[leaves[i]];
+
+		leaf = 0;
+		inner = m;
+		for (node = m; node < (2 * m) - 1; node++) {
+			for (j = 0; j < 2; j++) {
+				if ((leaf < m) && ((inner >= node) || (weight[leaf] <= weight[inner])))
+					pick[j] = leaf++;
+				else
+					pick[j] = inner++;
+			}
+
+			weight[node] = weight[pick[0]] + weight[pick[1]];
+			parent[pick[0]] = node;
+			parent[pick[1]] = node;
+		}
+
+		max_depth = 0;
+		for (i = 0; i < m; i++) {
+			for (depth = 0, node = i; node != (2 * m) - 2; node = parent[node])
+				depth++;
+
+			lengths[leaves[i]] = depth;
+			max_depth = (depth > max_depth) ? depth : max_depth;
+		}
+
+		if (max_depth <= limit)
+			return;
+
+		for (i = 0; i < n; i++)
+			scaled[i] = (scaled[i] == 0) ? 0 : (scaled[i] >> 1) | 1;
+	}
+}
+
+
+/**
+ * Compute the canonical Huffman codes of a set of code lengths.
+ *
+ * @param[in]  lengths The code lengths.
+ * @param[in]  n       The number of symbols.
+ * @param[out] codes   The codes (bit reversed, ready for put_bits()).
+ */
+static void huffman_codes(const uint8_t *lengths, int n, uint16_t *codes) {
+	uint16_t count[16], next[16];
+	uint16_t code = 0;
+	int i;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[lengths[i]]++;
+	count[0] = 0;
+
+	for (i = 1; i < 16; i++) {
+		code = (code + count[i-1]) << 1;
+		next[i] = code;
+	}
+
+	for (i = 0; i < n; i++)
+		codes[i] = (lengths[i] != 0) ? reverse_bits(next[lengths[i]]++, lengths[i]) : 0;
+}
+
+
+/**
+ * Get a code of the fixed Huffman literal/length code of deflate.
+ *
+ * @param[in]  symbol The symbol (0-287).
+ * @param[out] length The length of the code.
+ *
+ * @return The code (bit reversed, ready for put_bits()).
+ */
+static uint16_t fixed_code(unsigned int symbol, uint8_t *length) {
+	if (symbol < 144) {
+		*length = 8;
+		return reverse_bits(0x30 + symbol, 8);
+	} else if (symbol < 256) {
+		*length = 9;
+		return reverse_bits(0x190 + (symbol - 144), 9);
+	} else if (symbol < 280) {
+		*length = 7;
+		return reverse_bits(symbol - 256, 7);
+	}
+
+	*length = 8;
+	return reverse_bits(0xc0 + (symbol - 280), 8);
+}
+
+
+/**
+ * Emit a literal/length symbol.
+ *
+ * @param[in,out] d      The deflate encoder.
+ * @param[in]     symbol The symbol (0-285).
+ */
+static void emit_symbol(deflate_t *d, unsigned int symbol) {
+	uint16_t code;
+	uint8_t length;
+
+	if (d->out == NULL) {
+		d->lit_freq[symbol]++;
+	} else if (d->fixed) {
+		code = fixed_code(symbol, &length);
+		put_bits(d->out, code, length);
+	} else {
+		put_bits(d->out, d->lit_code[symbol], d->lit_len[symbol]);
+	}
+}
+
+
+/**
+ * Emit a deflate match.
+ *
+ * @param[in,out] d        The deflate encoder.
+ * @param[in]     length   The match length (3-258).
+ * @param[in]     distance The match distance (1-32768).
+ */
+static void emit_match(deflate_t *d, uint32_t length, uint32_t distance) {
+	int lcode, dcode;
+
+	for (lcode = 28; length_base[lcode] > length; lcode--);
+	for (dcode = 29; distance_base[dcode] > distance; dcode--);
+
+	if (d->out == NULL) {
+		d->lit_freq[257 + lcode]++;
+		d->dist_freq[dcode]++;
+		d->extra_bits += length_extra[lcode] + distance_extra[dcode];
+		return;
+	}
+
+	emit_symbol(d, 257 + lcode);
+	put_bits(d->out, length - length_base[lcode], length_extra[lcode]);
+	if (d->fixed)
+		put_bits(d->out, reverse_bits(dcode, 5), 5);
+	else
+		put_bits(d->out, d->dist_code[dcode], d->dist_len[dcode]);
+	put_bits(d->out, distance - distance_base[dcode], distance_extra[dcode]);
+}
+
+
+/**
+ * Emit a sequence of matches copying count bytes from distance bytes back.
+ *
+ * @param[in,out] d        The deflate encoder.
+ * @param[in]     count    The number of bytes (at least 3).
+ * @param[in]     distance The match distance (1-32768).
+ */
+static void emit_repeat(deflate_t *d, size_t count, uint32_t distance) {
+	size_t length;
+
+	while (count > 0) {
+		length = (count > DEFLATE_MAX_LENGTH) ? DEFLATE_MAX_LENGTH : count;
+
+		// Never leave less than a minimal match behind
+		if ((count - length > 0) && (count - length < DEFLATE_MIN_LENGTH))
+			length = count - DEFLATE_MIN_LENGTH;
+
+		emit_match(d, length, distance);
+		count -= length;
+	}
+}
+
+
+/**
+ * Get a byte of a packed 1 bit row (excluding the filter byte).
+ *
+ * @param[in] runs The foreground runs of the row.
+ * @param[in] n    The number of runs.
+ * @param[in] j    The byte index.
+ *
+ * @return The byte (the leftmost pixel is the most significant bit).
+ */
+static unsigned char row_byte(const uint32_t runs[][2], int n, size_t j) {
+	uint64_t x0 = (uint64_t)j * 8, x1 = x0 + 8, lo, hi;
+	unsigned int bits = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		lo = (runs[i][0] > x0) ? runs[i][0] : x0;
+		hi = (runs[i][1] < x1) ? runs[i][1] : x1;
+
+		if (lo < hi)
+			bits |= (0xff >> (lo - x0)) & ~(0xff >> (hi - x0));
+	}
+
+	return bits & 0xff;
+}
+
+
+/**
+ * Emit a row using run length encoding.
+ *
+ * @param[in,out] d         The deflate encoder.
+ * @param[in]     runs      The foreground runs of the row.
+ * @param[in]     n         The number of runs.
+ * @param[in]     row_bytes The size of the row (including the filter byte).
+ * @param[out]    sum       The sum of the bytes of the row.
+ * @param[out]    weighted  The sum of the bytes of the row weighted by their distance from its end.
+ */
+static void emit_row(deflate_t *d, const uint32_t runs[][2], int n, size_t row_bytes, uint64_t *sum,
+		uint64_t *weighted) {
+	size_t i, count;
+	unsigned char value;
+
+	*sum = 0;
+	*weighted = 0;
+
+	for (i = 0; i < row_bytes; i += count) {
+		// Byte 0 is the filter type (none)
+		value = (i == 0) ? 0 : row_byte(runs, n, i - 1);
+
+		for (count = 1; i + count < row_bytes; count++) {
+			if (row_byte(runs, n, i + count - 1) != value)
+				break;
+		}
+
+		*sum += (uint64_t)value * count;
+		*weighted += (uint64_t)value * (((row_bytes - i) * 2 - count + 1) * count / 2);
+
+		emit_symbol(d, value);
+		if (count - 1 >= DEFLATE_MIN_LENGTH) {
+			emit_repeat(d, count - 1, 1);
+		} else if (count > 1) {
+			emit_symbol(d, value);
+			if (count > 2)
+				emit_symbol(d, value);
+		}
+	}
+}
+
+
+/**
+ * Emit the image data of an identicon (ending the deflate block).
+ *
+ * @param[in,out] d       The deflate encoder.
+ * @param[in]     plan    The draw plan.
+ * @param[in]     pattern The cell pattern.
+ *
+ * @return The Adler-32 checksum of the image data.
+ */
+static uint32_t emit_image(deflate_t *d, const identicon_plan_t *plan, uint16_t pattern) {
+	size_t row_bytes = 1 + (((size_t)plan->size + 7) / 8);
+	uint64_t a = 1, b = 0, sum[8], weighted[8];
+	uint32_t band, y, height, last_row[8];
+	bool seen[8];
+	unsigned int g;
+
+	memset(seen, 0, sizeof(seen));
+
+	for (band = 0; band < plan->band_count; band++) {
+		g = identicon_band_columns(plan, band, pattern);
+		y = plan->bands[band].y;
+		height = plan->bands[band].height;
+
+		// A row already seen in a previous band is a match as well
+		if (seen[g] && (row_bytes >= DEFLATE_MIN_LENGTH) &&
+				((uint64_t)(y - last_row[g]) * row_bytes <= DEFLATE_MAX_DISTANCE)) {
+			emit_repeat(d, row_bytes, (y - last_row[g]) * row_bytes);
+		} else {
+			emit_row(d, plan->runs[g], plan->run_count[g], row_bytes, &sum[g], &weighted[g]);
+			seen[g] = true;
+		}
+		last_row[g] = y + height - 1;
+
+		// The other rows of the band are copies of the first one
+		if ((height > 1) && (row_bytes <= DEFLATE_MAX_DISTANCE) &&
+				((height - 1) * row_bytes >= DEFLATE_MIN_LENGTH)) {
+			emit_repeat(d, (height - 1) * row_bytes, row_bytes);
+		} else {
+			for (y = 1; y < height; y++)
+				emit_row(d, plan->runs[g], plan->run_count[g], row_bytes, &sum[g], &weighted[g]);
+		}
+
+		// Adler-32 of the band, appending the same row height times
+		for (y = 0; y < height; y++) {
+			b = (b + ((row_bytes % ADLER_BASE) * a) + (weighted[g] % ADLER_BASE)) % ADLER_BASE;
+			a = (a + (sum[g] % ADLER_BASE)) % ADLER_BASE;
+		}
+	}
+
+	// End of block
+	emit_symbol(d, 256);
+
+	return (b << 16) | a;
+}
+
+
+/**
+ * Build the code length sequence of a dynamic Huffman block header.
+ *
+ * @param[in]  d      The deflate encoder (with the dynamic code lengths set).
+ * @param[in]  hlit   The number of literal/length codes.
+ * @param[in]  hdist  The number of distance codes.
+ * @param[out] tokens The code length symbols (low byte) and their extra bits (high byte).
+ * @param[out] freq   The frequencies of the code length symbols.
+ *
+ * @return The number of tokens.
+ */
+static int header_tokens(const deflate_t *d, int hlit, int hdist, uint16_t *tokens, uint32_t freq[19]) {
+	uint8_t lengths[DEFLATE_LIT_CODES + DEFLATE_DIST_CODES];
+	int i, n, run, r, total = hlit + hdist;
+
+	memcpy(lengths, d->lit_len, hlit);
+	memcpy(lengths + hlit, d->dist_len, hdist);
+	memset(freq, 0, 19 * sizeof(uint32_t));
+
+	for (i = 0, n = 0; i < total; i += run) {
+		for (run = 1; (i + run < total) && (lengths[i + run] == lengths[i]); run++);
+
+		r = run;
+		if (lengths[i] == 0) {
+			// Runs of zeroes: 18 (11-138) and 17 (3-10)
+			while (r >= 11) {
+				int len = (r > 138) ? 138 : r;
+				tokens[n++] = 18 | ((len - 11) << 8);
+				freq[18]++;
+				r -= len;
+			}
+			if (r >= 3) {
+				tokens[n++] = 17 | ((r - 3) << 8);
+				freq[17]++;
+				r = 0;
+			}
+		} else {
+			// Repeats of the previous length: 16 (3-6)
+			tokens[n++] = lengths[i];
+			freq[lengths[i]]++;
+			r--;
+			while (r >= 3) {
+				int len = (r > 6) ? 6 : r;
+				tokens[n++] = 16 | ((len - 3) << 8);
+				freq[16]++;
+				r -= len;
+			}
+		}
+
+		for (; r > 0; r--) {
+			tokens[n++] = lengths[i];
+			freq[lengths[i]]++;
+		}
+	}
+
+	return n;
+}
+
+
+/**
+ * Write the zlib stream of an identicon.
+ *
+ * The symbols are generated twice: the first pass only counts them to choose
+ * between the fixed Huffman codes and dynamic ones, the second writes them.
+ *
+ * @param[in,out] out     The output buffer.
+ * @param[in]     plan    The draw plan.
+ * @param[in]     pattern The cell pattern.
+ */
+static void put_image_data(out_buffer_t *out, const identicon_plan_t *plan, uint16_t pattern) {
+	static const uint8_t clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	static const uint8_t clen_extra[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+	uint16_t tokens[DEFLATE_LIT_CODES + DEFLATE_DIST_CODES], clen_code[19];
+	uint32_t clen_freq[19];
+	uint8_t clen_len[19], length;
+	uint64_t fixed_bits, dynamic_bits;
+	int i, hlit, hdist, hclen, token_count, used;
+	uint32_t adler;
+	deflate_t d;
+
+	// First pass: count the symbols
+	memset(&d, 0, sizeof(deflate_t));
+	emit_image(&d, plan, pattern);
+
+	// A distance tree needs at least two codes to be complete
+	for (i = 0, used = 0; i < DEFLATE_DIST_CODES; i++)
+		used += (d.dist_freq[i] != 0);
+	for (i = 0; used < 2; i++) {
+		if (d.dist_freq[i] == 0) {
+			d.dist_freq[i] = 1;
+			used++;
+		}
+	}
+
+	fixed_bits = 3 + d.extra_bits;
+	for (i = 0; i < DEFLATE_LIT_CODES; i++) {
+		if (d.lit_freq[i] != 0) {
+			fixed_code(i, &length);
+			fixed_bits += (uint64_t)d.lit_freq[i] * length;
+		}
+	}
+	for (i = 0; i < DEFLATE_DIST_CODES; i++)
+		fixed_bits += (uint64_t)d.dist_freq[i] * 5;
+
+	huffman_lengths(d.lit_freq, DEFLATE_LIT_CODES, 15, d.lit_len);
+	huffman_lengths(d.dist_freq, DEFLATE_DIST_CODES, 15, d.dist_len);
+
+	for (hlit = DEFLATE_LIT_CODES; (hlit > 257) && (d.lit_len[hlit - 1] == 0); hlit--);
+	for (hdist = DEFLATE_DIST_CODES; (hdist > 1) && (d.dist_len[hdist - 1] == 0); hdist--);
+
+	token_count = header_tokens(&d, hlit, hdist, tokens, clen_freq);
+
+	// The code length tree needs at least two codes as well
+	for (i = 0, used = 0; i < 19; i++)
+		used += (clen_freq[i] != 0);
+	for (i = 0; used < 2; i++) {
+		if (clen_freq[i] == 0) {
+			clen_freq[i] = 1;
+			used++;
+		}
+	}
+
+	huffman_lengths(clen_freq, 19, 7, clen_len);
+	huffman_codes(clen_len, 19, clen_code);
+
+	for (hclen = 19; (hclen > 4) && (clen_len[clen_order[hclen - 1]] == 0); hclen--);
+
+	dynamic_bits = 3 + 5 + 5 + 4 + (3 * hclen) + d.extra_bits;
+	for (i = 0; i < token_count; i++)
+		dynamic_bits += clen_len[tokens[i] & 0xff] + clen_extra[tokens[i] & 0xff];
+	for (i = 0; i < DEFLATE_LIT_CODES; i++)
+		dynamic_bits += (uint64_t)d.lit_freq[i] * d.lit_len[i];
+	for (i = 0; i < DEFLATE_DIST_CODES; i++)
+		dynamic_bits += (uint64_t)d.dist_freq[i] * d.dist_len[i];
+
+	// zlib header (deflate, 32K window, fastest), then a single final block
+	put_bits(out, 0x78, 8);
+	put_bits(out, 0x01, 8);
+	put_bits(out, 1, 1);
+
+	if (dynamic_bits < fixed_bits) {
+		put_bits(out, 2, 2);
+		put_bits(out, hlit - 257, 5);
+		put_bits(out, hdist - 1, 5);
+		put_bits(out, hclen - 4, 4);
+		for (i = 0; i < hclen; i++)
+			put_bits(out, clen_len[clen_order[i]], 3);
+		for (i = 0; i < token_count; i++) {
+			put_bits(out, clen_code[tokens[i] & 0xff], clen_len[tokens[i] & 0xff]);
+			put_bits(out, tokens[i] >> 8, clen_extra[tokens[i] & 0xff]);
+		}
+
+		huffman_codes(d.lit_len, DEFLATE_LIT_CODES, d.lit_code);
+		huffman_codes(d.dist_len, DEFLATE_DIST_CODES, d.dist_code);
+	} else {
+		put_bits(out, 1, 2);
+		d.fixed = true;
+	}
+
+	// Second pass: write the symbols
+	d.out = out;
+	adler = emit_image(&d, plan, pattern);
+	flush_bits(out);
+
+	put_u32(out, adler);
+}
+
+
+/**
+ * Get an upper bound of the size of the IDAT chunk of an identicon.
+ *
+ * @param[in] size The width and height of the identicon.
+ *
+ * @return The number of bytes that is always enough for the IDAT chunk.
+ */
+static size_t idat_size_bound(uint32_t size) {
+	size_t row_bytes = 1 + (((size_t)size + 7) / 8);
+
+	// A fixed Huffman code never takes more than 9 bits per byte
+	return PNG_CHUNK_OVERHEAD + 2 + ((row_bytes * size * 9) / 8) + 3 + 4;
+}
+
+
+/**
+ * Get an upper bound of the size of a PNG identicon.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return The number of bytes that is always enough for identicon_write_png()
+ *         or 0 if an error occurred.
+ */
+size_t identicon_png_size_bound(identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return identicon_png_size_bound2(identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Get an upper bound of the size of a PNG identicon from compact options.
+ *
+ * @param[in] opts The identicon options.
+ *
+ * @return The number of bytes that is always enough for identicon_write_png2()
+ *         or 0 if an error occurred.
+ */
+size_t identicon_png_size_bound2(const identicon_opts2_t *opts) {
+	if ((opts == NULL) || (opts->size == 0) || (opts->size > INT32_MAX))
+		return 0;
+
+	return PNG_HEAD_SIZE + PNG_PALETTE_SIZE + idat_size_bound(opts->size) + PNG_CHUNK_OVERHEAD;
+}
+
+
+/**
+ * Write the PNG signature and the IHDR chunk of an identicon.
+ *
+ * @param[in,out] out  The output buffer.
+ * @param[in]     size The width and height of the identicon.
+ */
+static void put_header(out_buffer_t *out, uint32_t size) {
+	static const unsigned char signature[PNG_SIGNATURE_SIZE] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	size_t chunk;
+
+	put_bytes(out, signature, PNG_SIGNATURE_SIZE);
+
+	// Width, height, bit depth 1, color type 3 (palette), default compression, filter and interlace
+	chunk = chunk_begin(out, "IHDR");
+	put_u32(out, size);
+	put_u32(out, size);
+	put_bytes(out, "\x01\x03\x00\x00\x00", 5);
+	chunk_end(out, chunk);
+}
+
+
+/**
+ * Write the PLTE chunk of an identicon (and its tRNS chunk if transparent).
+ *
+ * @param[in,out] out         The output buffer.
+ * @param[in]     foreground  The foreground color.
+ * @param[in]     transparent Whether the background is transparent.
+ */
+static void put_palette(out_buffer_t *out, const identicon_RGB_t *foreground, bool transparent) {
+	unsigned char palette[6];
+	size_t chunk;
+
+	palette[0] = transparent ? 0 : 240;
+	palette[1] = transparent ? 0 : 240;
+	palette[2] = transparent ? 0 : 240;
+	palette[3] = foreground->red;
+	palette[4] = foreground->green;
+	palette[5] = foreground->blue;
+
+	chunk = chunk_begin(out, "PLTE");
+	put_bytes(out, palette, 6);
+	chunk_end(out, chunk);
+
+	if (transparent) {
+		chunk = chunk_begin(out, "tRNS");
+		put_bytes(out, "\x00", 1);
+		chunk_end(out, chunk);
+	}
+}
+
+
+/**
+ * Write the identicon described by a descriptor as a 1 bit palette PNG image.
+ *
+ * Palette entry 0 is the background (fully transparent if opts->transparent
+ * is true) and entry 1 the foreground.
+ *
+ * @param[in]  desc     The identicon descriptor.
+ * @param[in]  opts     The identicon options (only the geometry is used).
+ * @param[out] buf      The destination buffer or NULL to only get the needed size.
+ * @param[in]  buf_size The size of the destination buffer.
+ *
+ * @return The size of the PNG image or 0 if an error occurred (or buf is too small).
+ */
+size_t identicon_write_png(const identicon_descriptor_t *desc, identicon_options_t *opts, unsigned char *buf,
+		size_t buf_size) {
+	identicon_opts2_t opts2;
+
+	return identicon_write_png2(desc, identicon_opts2_from_options(&opts2, opts), buf, buf_size);
+}
+
+
+/**
+ * Write the identicon described by a descriptor as a 1 bit palette PNG image from compact options.
+ *
+ * Same as identicon_write_png().
+ *
+ * @param[in]  desc     The identicon descriptor.
+ * @param[in]  opts     The identicon options (only the geometry is used).
+ * @param[out] buf      The destination buffer or NULL to only get the needed size.
+ * @param[in]  buf_size The size of the destination buffer.
+ *
+ * @return The size of the PNG image or 0 if an error occurred (or buf is too small).
+ */
+size_t identicon_write_png2(const identicon_descriptor_t *desc, const identicon_opts2_t *opts, unsigned char *buf,
+		size_t buf_size) {
+	const identicon_plan_t *plan;
+	out_buffer_t out;
+	size_t chunk;
+
+	if ((desc == NULL) || (opts == NULL) || (opts->size == 0) || (opts->size > INT32_MAX))
+		return 0;
+
+	plan = identicon_cached_plan(opts);
+
+	out_init(&out, buf, buf_size);
+	put_header(&out, opts->size);
+	put_palette(&out, &desc->foreground, opts->transparent);
+
+	chunk = chunk_begin(&out, "IDAT");
+	put_image_data(&out, plan, desc->pattern);
+	chunk_end(&out, chunk);
+
+	put_bytes(&out, png_iend, PNG_CHUNK_OVERHEAD);
+
+	if (out.overflow)
+		return 0;
+
+	return out.len;
+}
+
+
+/**
+ * Create the PNG template cache of a geometry.
+ *
+ * The IDAT chunk of an identicon only depends on its cell pattern and
+ * geometry, so the cache keeps the one of every pattern and a PNG image is
+ * then assembled from constant chunks and a PLTE chunk with the foreground.
+ *
+ * @param[in] opts The identicon options (only the geometry is used).
+ *
+ * @return The cache or NULL if an error occurred.
+ */
+identicon_png_cache_t *new_identicon_png_cache(identicon_options_t *opts) {
+	identicon_opts2_t opts2;
+
+	return new_identicon_png_cache2(identicon_opts2_from_options(&opts2, opts));
+}
+
+
+/**
+ * Create the PNG template cache of a geometry from compact options.
+ *
+ * @param[in] opts The identicon options (only the geometry is used).
+ *
+ * @return The cache or NULL if an error occurred.
+ */
+identicon_png_cache_t *new_identicon_png_cache2(const identicon_opts2_t *opts) {
+	const identicon_allocator_t *allocator = identicon_allocator();
+	identicon_png_cache_t *cache;
+	out_buffer_t out;
+
+	if ((opts == NULL) || (opts->size == 0) || (opts->size > INT32_MAX))
+		return NULL;
+
+	cache = identicon_calloc_with(allocator, 1, sizeof(identicon_png_cache_t));
+	if (cache == NULL)
+		return NULL;
+
+	// Entries outlive any context function, so they use the allocator of the creation
+	cache->allocator = *allocator;
+
+	if (!identicon_plan_init2(&cache->plan, opts)) {
+		identicon_free_with(allocator, cache);
+		return NULL;
+	}
+
+	cache->transparent = opts->transparent;
+	cache->idat_bound = idat_size_bound(opts->size);
+
+	out_init(&out, cache->head, PNG_HEAD_SIZE);
+	put_header(&out, opts->size);
+
+	return cache;
+}
+
+
+/**
+ * Free a PNG template cache.
+ *
+ * @param[in] cache The cache (may be NULL).
+ */
+void free_identicon_png_cache(identicon_png_cache_t *cache) {
+	uint32_t i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < PNG_PATTERN_COUNT; i++)
+		identicon_free_with(&cache->allocator, cache->entries[i]);
+
+	identicon_free_with(&cache->allocator, cache);
+}
+
+
+/**
+ * Get the cached IDAT chunk of a cell pattern, encoding it on first use.
+ *
+ * Several threads may fill the same entry at once: the first one to publish
+ * it wins and the others free their copy.
+ *
+ * @param[in,out] cache   The cache.
+ * @param[in]     pattern The cell pattern.
+ *
+ * @return The entry or NULL if an error occurred.
+ */
+static png_cache_entry_t *png_cache_entry(identicon_png_cache_t *cache, uint16_t pattern) {
+	png_cache_entry_t *entry, *shrunk, *expected = NULL;
+	out_buffer_t out;
+	size_t chunk;
+
+	pattern &= PNG_PATTERN_COUNT - 1;
+
+	entry = __atomic_load_n(&cache->entries[pattern], __ATOMIC_ACQUIRE);
+	if (entry != NULL)
+		return entry;
+
+	entry = identicon_malloc_with(&cache->allocator, sizeof(png_cache_entry_t) + cache->idat_bound);
+	if (entry == NULL)
+		return NULL;
+
+	out_init(&out, entry->data, cache->idat_bound);
+	chunk = chunk_begin(&out, "IDAT");
+	put_image_data(&out, &cache->plan, pattern);
+	chunk_end(&out, chunk);
+	entry->len = out.len;
+
+	shrunk = identicon_realloc_with(&cache->allocator, entry, sizeof(png_cache_entry_t) + entry->len);
+	if (shrunk != NULL)
+		entry = shrunk;
+
+	if (!__atomic_compare_exchange_n(&cache->entries[pattern], &expected, entry, false, __ATOMIC_ACQ_REL,
+			__ATOMIC_ACQUIRE)) {
+		identicon_free_with(&cache->allocator, entry);
+		entry = expected;
+	}
+
+	return entry;
+}
+
+
+/**
+ * Encode the IDAT chunk of every cell pattern of a PNG template cache.
+ *
+ * @param[in,out] cache The cache.
+ *
+ * @return true if all the patterns are cached, false if an error occurred.
+ */
+bool identicon_png_cache_fill(identicon_png_cache_t *cache) {
+	uint32_t i;
+
+	if (cache == NULL)
+		return false;
+
+	for (i = 0; i < PNG_PATTERN_COUNT; i++) {
+		if (png_cache_entry(cache, i) == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Get the parts of a PNG identicon from a template cache (for writev() style output).
+ *
+ * The segments point into the cache and into parts->palette, so they stay
+ * valid as long as both of them do.
+ *
+ * @param[in,out] cache The cache.
+ * @param[in]     desc  The identicon descriptor.
+ * @param[out]    parts The parts of the PNG image.
+ *
+ * @return The size of the PNG image or 0 if an error occurred.
+ */
+size_t identicon_png_cache_parts(identicon_png_cache_t *cache, const identicon_descriptor_t *desc,
+		identicon_png_parts_t *parts) {
+	png_cache_entry_t *entry;
+	out_buffer_t out;
+
+	if ((cache == NULL) || (desc == NULL) || (parts == NULL))
+		return 0;
+
+	entry = png_cache_entry(cache, desc->pattern);
+	if (entry == NULL)
+		return 0;
+
+	out_init(&out, parts->palette, PNG_PALETTE_SIZE);
+	put_palette(&out, &desc->foreground, cache->transparent);
+
+	parts->segments[0].data = cache->head;
+	parts->segments[0].len = PNG_HEAD_SIZE;
+	parts->segments[1].data = parts->palette;
+	parts->segments[1].len = out.len;
+	parts->segments[2].data = entry->data;
+	parts->segments[2].len = entry->len;
+	parts->segments[3].data = png_iend;
+	parts->segments[3].len = PNG_CHUNK_OVERHEAD;
+
+	return PNG_HEAD_SIZE + out.len + entry->len + PNG_CHUNK_OVERHEAD;
+}
+
+
+/**
+ * Write a PNG identicon from a template cache.
+ *
+ * The output is the same as the one of identicon_write_png() with the
+ * options the cache was created with.
+ *
+ * @param[in,out] cache    The cache.
+ * @param[in]     desc     The identicon descriptor.
+ * @param[out]    buf      The destination buffer or NULL to only get the needed size.
+ * @param[in]     buf_size The size of the destination buffer.
+ *
+ * @return The size of the PNG image or 0 if an error occurred (or buf is too small).
+ */
+size_t identicon_png_cache_write(identicon_png_cache_t *cache, const identicon_descriptor_t *desc,
+		unsigned char *buf, size_t buf_size) {
+	identicon_png_parts_t parts;
+	size_t len, i;
+
+	len = identicon_png_cache_parts(cache, desc, &parts);
+	if ((len == 0) || (buf == NULL))
+		return len;
+
+	if (len > buf_size)
+		return 0;
+
+	for (i = 0, len = 0; i < IDENTICON_PNG_SEGMENTS; i++) {
+		memcpy(buf + len, parts.segments[i].data, parts.segments[i].len);
+		len += parts.segments[i].len;
+	}
+
+	return len;
+}
@@ -0,0 +1,734 @@
+/**
+ * identicon-c_pool.c - Functions to generate many identicons with several threads.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * A batch is split in chunks of POOL_CHUNK_SIZE keys and every worker gets a
+ * deque holding a contiguous range of them. A worker takes chunks from the
+ * front of its own deque; once it is empty, it steals the back half of the
+ * deque of another worker. Each chunk is hashed, drawn and (optionally)
+ * encoded by the same worker and written at the offset of its keys, so the
+ * results are in input order whatever worker produced them.
+ *
+ * Images given to an encoder callback are drawn into a buffer of the worker,
+ * and every worker has its own user data for the callback (or its own lodepng
+ * encoder), so encoders keeping state between images need no locking.
+ *
+ * The calling thread is worker 0, the other workers are started once with
+ * the pool and sleep between batches.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+// Number of keys taken at once by a worker (keys of a chunk are hashed together)
+#define POOL_CHUNK_SIZE 64
+
+// Size of a cache line (workers never share one)
+#define POOL_CACHE_LINE 64
+
+// Biggest number of threads of a pool
+#define POOL_MAX_THREADS 1024
+
+
+// Batch run by a pool
+typedef struct pool_job_t {
+	const identicon_key_t *keys;
+	size_t count;
+	const identicon_opts2_t *opts;
+	identicon_png_cache_t *cache;
+	bool png; // Write PNG images instead of RGBA ones
+	bool encoded; // Encode images with encode (or the lodepng encoder of each worker) into images
+	identicon_encode_callback_t encode;
+	void *const *users; // User data of encode for each worker (may be NULL)
+	unsigned char **images;
+	unsigned char *out;
+	size_t slot_size; // Bytes of the output of each key
+	size_t *lens;
+	bool failed;
+} pool_job_t;
+
+// Worker of a pool (the deque holds the chunks [head, tail) of the current job)
+typedef struct pool_worker_t {
+	_Alignas(POOL_CACHE_LINE) pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+	uint32_t seed; // Victim selection
+	unsigned int index;
+	identicon_pool_t *pool;
+	pthread_t thread;
+	identicon_descriptor_t descs[POOL_CHUNK_SIZE];
+	unsigned char *img; // Image given to the encoder
+	size_t img_size;
+	identicon_encoder_t *encoder; // Created on first use when no encoder callback is given
+} pool_worker_t;
+
+// Pool of worker threads
+struct identicon_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pthread_mutex_t job_lock; // One batch at a time
+	uint64_t generation;
+	unsigned int running; // Started threads still working on the current job
+	unsigned int started; // Started threads (threads - 1 once the pool is ready)
+	bool quit;
+	unsigned int threads;
+	pool_job_t job;
+	pool_worker_t *workers;
+	void *workers_block; // Allocation holding the aligned workers
+	identicon_allocator_t allocator;
+};
+
+
+/**
+ * Draw an identicon into the buffer of a worker and encode it.
+ *
+ * @param[in,out] worker The worker.
+ * @param[in,out] job    The job.
+ * @param[in]     index  The index of the key.
+ * @param[in]     desc   The descriptor of the key.
+ *
+ * @return True if the image has been encoded, false if an error occurred.
+ */
+static bool pool_encode(pool_worker_t *worker, const pool_job_t *job, size_t index,
+		const identicon_descriptor_t *desc) {
+	const identicon_opts2_t *opts = job->opts;
+	identicon_pool_t *pool = worker->pool;
+	const identicon_allocator_t *previous;
+	unsigned char *img, *png = NULL;
+	size_t len = 0;
+
+	if (worker->img_size < job->slot_size) {
+		img = identicon_realloc_with(&pool->allocator, worker->img, job->slot_size);
+		if (img == NULL)
+			return false;
+		worker->img = img;
+		worker->img_size = job->slot_size;
+	}
+
+	// The background of a transparent image is not drawn, so the last image must go
+	if (opts->transparent)
+		memset(worker->img, 0, job->slot_size);
+
+	identicon_render_descriptor2(worker->img, (size_t)opts->size * 4, 0, 0, desc, opts);
+
+	// Images and encoders come from the allocator of the pool, whatever thread runs the worker
+	previous = identicon_allocator_push(&pool->allocator);
+	if (job->encode != NULL) {
+		png = job->encode(worker->img, opts->size, &len, (job->users != NULL) ? job->users[worker->index] : NULL);
+	} else {
+		if (worker->encoder == NULL)
+			worker->encoder = new_identicon_encoder();
+		if (worker->encoder != NULL)
+			png = identicon_encoder_encode(worker->encoder, worker->img, opts->size, &len);
+	}
+	identicon_allocator_pop(previous);
+
+	job->images[index] = png;
+	job->lens[index] = (png != NULL) ? len : 0;
+
+	return png != NULL;
+}
+
+
+/**
+ * Process a chunk of keys.
+ *
+ * @param[in,out] worker The worker.
+ * @param[in,out] job    The job.
+ * @param[in]     chunk  The index of the chunk.
+ */
+static void pool_chunk(pool_worker_t *worker, pool_job_t *job, size_t chunk) {
+	const identicon_opts2_t *opts = job->opts;
+	size_t i, j, n, len;
+	unsigned char *slot;
+
+	i = chunk * POOL_CHUNK_SIZE;
+	n = ((job->count - i) < POOL_CHUNK_SIZE) ? job->count - i : POOL_CHUNK_SIZE;
+
+	if (!identicon_compute_descriptors2(job->keys + i, n, opts, worker->descs)) {
+		__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (j = 0; j < n; j++) {
+		slot = job->out + ((i + j) * job->slot_size);
+
+		if (job->keys[i + j].str == NULL) {
+			if (job->png || job->encoded)
+				job->lens[i + j] = 0;
+			if (job->encoded)
+				job->images[i + j] = NULL;
+			continue;
+		}
+
+		if (job->encoded) {
+			if (!pool_encode(worker, job, i + j, &worker->descs[j]))
+				__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (!job->png) {
+			identicon_render_descriptor2(slot, (size_t)opts->size * 4, 0, 0, &worker->descs[j], opts);
+			continue;
+		}
+
+		if (job->cache != NULL)
+			len = identicon_png_cache_write(job->cache, &worker->descs[j], slot, job->slot_size);
+		else
+			len = identicon_write_png2(&worker->descs[j], opts, slot, job->slot_size);
+
+		job->lens[i + j] = len;
+		if (len == 0)
+			__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+
+/**
+ * Take the first chunk of the deque of a worker.
+ *
+ * @param[in,out] worker The worker.
+ * @param[out]    chunk  The index of the chunk.
+ *
+ * @return True if a chunk has been taken, false if the deque is empty.
+ */
+static bool pool_pop(pool_worker_t *worker, size_t *chunk) {
+	bool found = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head < worker->tail) {
+		*chunk = worker->head++;
+		found = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return found;
+}
+
+
+/**
+ * Move the back half of the deque of another worker to the deque of a worker.
+ *
+ * @param[in,out] worker The worker (whose deque is empty).
+ *
+ * @return True if some chunks have been stolen, false if every deque is empty.
+ */
+static bool pool_steal(pool_worker_t *worker) {
+	identicon_pool_t *pool = worker->pool;
+	pool_worker_t *victim;
+	size_t head = 0, tail = 0, n;
+	unsigned int i, first;
+
+	// xorshift32, so that thieves don't all rob the same worker
+	worker->seed ^= worker->seed << 13;
+	worker->seed ^= worker->seed >> 17;
+	worker->seed ^= worker->seed << 5;
+	first = worker->seed % pool->threads;
+
+	for (i = 0; (i < pool->threads) && (head == tail); i++) {
+		victim = &pool->workers[(first + i) % pool->threads];
+		if (victim == worker)
+			continue;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail) {
+			n = (victim->tail - victim->head + 1) / 2;
+			tail = victim->tail;
+			head = tail - n;
+			victim->tail = head;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	if (head == tail)
+		return false;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->head = head;
+	worker->tail = tail;
+	pthread_mutex_unlock(&worker->lock);
+
+	return true;
+}
+
+
+/**
+ * Run the current job of a pool until no chunk is left.
+ *
+ * @param[in,out] worker The worker.
+ */
+static void pool_work(pool_worker_t *worker) {
+	pool_job_t *job = &worker->pool->job;
+	size_t chunk;
+
+	do {
+		while (pool_pop(worker, &chunk))
+			pool_chunk(worker, job, chunk);
+	} while (pool_steal(worker));
+}
+
+
+/**
+ * Main function of the started threads of a pool.
+ *
+ * @param[in] arg The worker.
+ *
+ * @return Always NULL.
+ */
+static void *pool_thread(void *arg) {
+	pool_worker_t *worker = arg;
+	identicon_pool_t *pool = worker->pool;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && (pool->generation == generation))
+			pthread_cond_wait(&pool->start, &pool->lock);
+
+		if (pool->quit)
+			break;
+
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(worker);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/**
+ * Run a job with all the workers of a pool.
+ *
+ * @param[in,out] pool The pool.
+ * @param[in]     job  The job.
+ *
+ * @return True if every key has been processed, false if an error occurred.
+ */
+static bool pool_run(identicon_pool_t *pool, const pool_job_t *job) {
+	size_t chunks = (job->count + POOL_CHUNK_SIZE - 1) / POOL_CHUNK_SIZE;
+	unsigned int i;
+	bool ret;
+
+	pthread_mutex_lock(&pool->job_lock);
+
+	// Workers are idle: deques can be set without locking them
+	pool->job = *job;
+	for (i = 0; i < pool->threads; i++) {
+		pool->workers[i].head = (chunks * i) / pool->threads;
+		pool->workers[i].tail = (chunks * (i + 1)) / pool->threads;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->generation++;
+	pool->running = pool->threads - 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(&pool->workers[0]);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	ret = !pool->job.failed;
+
+	pthread_mutex_unlock(&pool->job_lock);
+
+	return ret;
+}
+
+
+/**
+ * Create a pool of worker threads.
+ *
+ * The calling thread of the batch functions is one of the workers, so a pool
+ * of N threads starts N - 1 threads.
+ *
+ * @param[in] threads The number of threads (0 for one per online CPU).
+ *
+ * @return The pool or NULL if an error occurred.
+ */
+identicon_pool_t *new_identicon_pool(unsigned int threads) {
+	const identicon_allocator_t *allocator = identicon_allocator();
+	identicon_pool_t *pool;
+	unsigned int i;
+#if defined(_SC_NPROCESSORS_ONLN)
+	long cpus;
+
+	if (threads == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0) ? (unsigned int)cpus : 1;
+	}
+#else
+	if (threads == 0)
+		threads = 1;
+#endif
+
+	if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+
+	pool = identicon_calloc_with(allocator, 1, sizeof(identicon_pool_t));
+	if (pool == NULL)
+		return NULL;
+
+	// Allocators have no alignment parameter, so the workers are aligned by hand
+	pool->allocator = *allocator;
+	pool->workers_block = identicon_calloc_with(allocator, 1, threads * sizeof(pool_worker_t) + POOL_CACHE_LINE - 1);
+	if (pool->workers_block == NULL) {
+		identicon_free_with(allocator, pool);
+		return NULL;
+	}
+
+	pool->workers = (pool_worker_t *)(((uintptr_t)pool->workers_block + POOL_CACHE_LINE - 1)
+			& ~(uintptr_t)(POOL_CACHE_LINE - 1));
+	pool->threads = threads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pthread_mutex_init(&pool->job_lock, NULL);
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		pool->workers[i].seed = 2463534242u + i;
+		pool->workers[i].index = i;
+		pool->workers[i].pool = pool;
+	}
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, pool_thread, &pool->workers[i]) != 0) {
+			free_identicon_pool(pool);
+			return NULL;
+		}
+		pool->started++;
+	}
+
+	return pool;
+}
+
+
+/**
+ * Free a pool of worker threads (waiting for its threads to stop).
+ *
+ * @param[in] pool The pool (may be NULL).
+ */
+void free_identicon_pool(identicon_pool_t *pool) {
+	unsigned int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 1; i <= pool->started; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	for (i = 0; i < pool->threads; i++) {
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		free_identicon_encoder(pool->workers[i].encoder);
+		identicon_free_with(&pool->allocator, pool->workers[i].img);
+	}
+
+	pthread_mutex_destroy(&pool->job_lock);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+
+	identicon_free_with(&pool->allocator, pool->workers_block);
+	identicon_free_with(&pool->allocator, pool);
+}
+
+
+/**
+ * Get the number of threads of a pool.
+ *
+ * @param[in] pool The pool.
+ *
+ * @return The number of threads (including the calling one) or 0 if pool is NULL.
+ */
+unsigned int identicon_pool_threads(const identicon_pool_t *pool) {
+	if (pool == NULL)
+		return 0;
+
+	return pool->threads;
+}
+
+
+/**
+ * Render many identicons into a single contiguous arena with the threads of a pool.
+ *
+ * Same as identicon_render_batch(), but chunks of keys are hashed and drawn by
+ * all the threads of the pool.
+ *
+ * @param[in,out] pool  The pool.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->str is ignored).
+ * @param[in,out] arena The destination arena (count * identicon_image_size(opts) bytes)
+ *                      or NULL to let the library allocate a zeroed one.
+ *
+ * @return The arena containing the identicons (to be freed with identicon_free() if
+ *         allocated by the library) or NULL if an error occurred.
+ */
+unsigned char *identicon_pool_render_batch(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts, unsigned char *arena) {
+	identicon_opts2_t opts2;
+
+	return identicon_pool_render_batch2(pool, keys, count, identicon_opts2_from_options(&opts2, opts), arena);
+}
+
+
+/**
+ * Render many identicons into a single contiguous arena with the threads of a pool from compact options.
+ *
+ * Same as identicon_pool_render_batch().
+ *
+ * @param[in,out] pool  The pool.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->key is ignored).
+ * @param[in,out] arena The destination arena (count * identicon_image_size2(opts) bytes)
+ *                      or NULL to let the library allocate a zeroed one.
+ *
+ * @return The arena containing the identicons (to be freed with identicon_free() if
+ *         allocated by the library) or NULL if an error occurred.
+ */
+unsigned char *identicon_pool_render_batch2(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts, unsigned char *arena) {
+	pool_job_t job = { 0 };
+	size_t img_size;
+
+	if ((pool == NULL) || (keys == NULL) || (opts == NULL) || (count == 0) ||
+			((opts->salt == NULL) && (opts->salt_len != 0)))
+		return NULL;
+
+	img_size = identicon_image_size2(opts);
+
+	if ((img_size == 0) || (count > SIZE_MAX / img_size))
+		return NULL;
+
+	job.keys = keys;
+	job.count = count;
+	job.opts = opts;
+	job.slot_size = img_size;
+	job.out = arena;
+	if (job.out == NULL)
+		job.out = identicon_calloc(count, img_size);
+
+	if (job.out == NULL)
+		return NULL;
+
+	if (!pool_run(pool, &job)) {
+		if (arena == NULL)
+			identicon_free(job.out);
+		return NULL;
+	}
+
+	return job.out;
+}
+
+
+/**
+ * Write many identicons as PNG images with the threads of a pool.
+ *
+ * Every key is hashed, drawn and encoded by one thread of the pool (with
+ * identicon_write_png(), or from a PNG template cache if one is given). Image
+ * i is written at offset i * identicon_png_size_bound(opts) of the output and
+ * its length is stored in lens[i] (0 for keys with a NULL string).
+ *
+ * @param[in,out] pool  The pool.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->str is ignored).
+ * @param[in,out] cache The PNG template cache of the geometry in opts (may be NULL).
+ * @param[in,out] out   The destination buffer (count * identicon_png_size_bound(opts) bytes)
+ *                      or NULL to let the library allocate it.
+ * @param[out]    lens  The lengths of the images (count elements).
+ *
+ * @return The buffer containing the images (to be freed with identicon_free() if
+ *         allocated by the library) or NULL if an error occurred.
+ */
+unsigned char *identicon_pool_write_png(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts, identicon_png_cache_t *cache, unsigned char *out, size_t *lens) {
+	identicon_opts2_t opts2;
+
+	return identicon_pool_write_png2(pool, keys, count, identicon_opts2_from_options(&opts2, opts), cache, out,
+			lens);
+}
+
+
+/**
+ * Write many identicons as PNG images with the threads of a pool from compact options.
+ *
+ * Same as identicon_pool_write_png().
+ *
+ * @param[in,out] pool  The pool.
+ * @param[in]     keys  The strings of which drawing the identicons.
+ * @param[in]     count The number of keys.
+ * @param[in]     opts  The identicon options shared by every image (opts->key is ignored).
+ * @param[in,out] cache The PNG template cache of the geometry in opts (may be NULL).
+ * @param[in,out] out   The destination buffer (count * identicon_png_size_bound2(opts) bytes)
+ *                      or NULL to let the library allocate it.
+ * @param[out]    lens  The lengths of the images (count elements).
+ *
+ * @return The buffer containing the images (to be freed with identicon_free() if
+ *         allocated by the library) or NULL if an error occurred.
+ */
+unsigned char *identicon_pool_write_png2(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts, identicon_png_cache_t *cache, unsigned char *out, size_t *lens) {
+	pool_job_t job = { 0 };
+	size_t png_size;
+
+	if ((pool == NULL) || (keys == NULL) || (opts == NULL) || (lens == NULL) || (count == 0) ||
+			((opts->salt == NULL) && (opts->salt_len != 0)))
+		return NULL;
+
+	png_size = identicon_png_size_bound2(opts);
+
+	if ((png_size == 0) || (count > SIZE_MAX / png_size))
+		return NULL;
+
+	job.keys = keys;
+	job.count = count;
+	job.opts = opts;
+	job.cache = cache;
+	job.png = true;
+	job.slot_size = png_size;
+	job.lens = lens;
+	job.out = out;
+	if (job.out == NULL)
+		job.out = identicon_malloc(count * png_size);
+
+	if (job.out == NULL)
+		return NULL;
+
+	if (!pool_run(pool, &job)) {
+		if (out == NULL)
+			identicon_free(job.out);
+		return NULL;
+	}
+
+	return job.out;
+}
+
+
+/**
+ * Encode many identicons with the threads of a pool.
+ *
+ * Every key is hashed and drawn by one thread of the pool into a buffer of
+ * its worker, then given to encode along with users[w], w being the index of
+ * the worker (between 0 and identicon_pool_threads(pool) - 1): the state of
+ * an encoder can be kept per worker without locking. Without a callback,
+ * every worker encodes with its own identicon_encoder_t.
+ *
+ * Images are allocated with the allocator current when the pool was created;
+ * image i is stored in images[i] and its length in lens[i] (NULL and 0 for
+ * keys with a NULL string). Nothing is kept if an error occurred.
+ *
+ * @param[in,out] pool   The pool.
+ * @param[in]     keys   The strings of which drawing the identicons.
+ * @param[in]     count  The number of keys.
+ * @param[in]     opts   The identicon options shared by every image (opts->str is ignored).
+ * @param[in]     encode The encoder callback (NULL for a lodepng encoder per worker).
+ * @param[in]     users  The user data of encode for each worker (may be NULL).
+ * @param[out]    images The images (count elements, to be freed with identicon_free()).
+ * @param[out]    lens   The lengths of the images (count elements).
+ *
+ * @return True if every image has been encoded, false if an error occurred.
+ */
+bool identicon_pool_encode(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		identicon_options_t *opts, identicon_encode_callback_t encode, void *const *users, unsigned char **images,
+		size_t *lens) {
+	identicon_opts2_t opts2;
+
+	return identicon_pool_encode2(pool, keys, count, identicon_opts2_from_options(&opts2, opts), encode, users,
+			images, lens);
+}
+
+
+/**
+ * Encode many identicons with the threads of a pool from compact options.
+ *
+ * Same as identicon_pool_encode().
+ *
+ * @param[in,out] pool   The pool.
+ * @param[in]     keys   The strings of which drawing the identicons.
+ * @param[in]     count  The number of keys.
+ * @param[in]     opts   The identicon options shared by every image (opts->key is ignored).
+ * @param[in]     encode The encoder callback (NULL for a lodepng encoder per worker).
+ * @param[in]     users  The user data of encode for each worker (may be NULL).
+ * @param[out]    images The images (count elements, to be freed with identicon_free()).
+ * @param[out]    lens   The lengths of the images (count elements).
+ *
+ * @return True if every image has been encoded, false if an error occurred.
+ */
+bool identicon_pool_encode2(identicon_pool_t *pool, const identicon_key_t *keys, size_t count,
+		const identicon_opts2_t *opts, identicon_encode_callback_t encode, void *const *users, unsigned char **images,
+		size_t *lens) {
+	pool_job_t job = { 0 };
+	size_t img_size, i;
+
+	if ((pool == NULL) || (keys == NULL) || (opts == NULL) || (images == NULL) || (lens == NULL) || (count == 0) ||
+			((opts->salt == NULL) && (opts->salt_len != 0)))
+		return false;
+
+	img_size = identicon_image_size2(opts);
+
+	if (img_size == 0)
+		return false;
+
+	// Images of failed keys are NULL, the others are freed on error
+	memset(images, 0, count * sizeof(unsigned char *));
+
+	job.keys = keys;
+	job.count = count;
+	job.opts = opts;
+	job.encoded = true;
+	job.encode = encode;
+	job.users = users;
+	job.images = images;
+	job.slot_size = img_size;
+	job.lens = lens;
+
+	if (!pool_run(pool, &job)) {
+		for (i = 0; i < count; i++) {
+			identicon_free_with(&pool->allocator, images[i]);
+			images[i] = NULL;
+			lens[i] = 0;
+		}
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,275 @@
+/**
+ * identicon-c_prefix.c - Functions to hash many keys sharing long prefixes.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * Keys are often built as "tenant:user:..." and share long prefixes. Here the
+ * keys of a batch are sorted, so that keys sharing a prefix are next to each
+ * other, and the hash context is saved after every whole block of a key: the
+ * next key resumes from the context saved after the last whole block of the
+ * prefix it shares with the previous one, instead of compressing that prefix
+ * again. Digests are the same as when hashing every key on its own.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "md5.h"
+#include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
+
+#include "identicon-c.h"
+#include "identicon-c_private.h"
+
+// Number of keys sorted at once
+#define PREFIX_CHUNK_SIZE 256
+
+// Contexts saved per key (blocks of a shared prefix that can be skipped)
+#define PREFIX_MAX_DEPTH 16
+
+
+// Context of any of the hash functions
+typedef union prefix_ctx_t {
+	struct md5_ctx md5;
+	struct sha1_ctx sha1;
+	struct sha256_ctx sha256;
+	struct sha512_ctx sha512;
+} prefix_ctx_t;
+
+// Key of a batch in sorted order
+typedef struct prefix_order_t {
+	const identicon_key_t *key;
+	size_t index;
+	size_t reuse; // Blocks shared with the previous key
+} prefix_order_t;
+
+// Statistics (since the last reset)
+static uint64_t stats_keys = 0;
+static uint64_t stats_blocks = 0;
+static uint64_t stats_blocks_saved = 0;
+
+
+/**
+ * Compare two keys (in lexicographic byte order).
+ *
+ * @param[in] a The first key (prefix_order_t).
+ * @param[in] b The second key (prefix_order_t).
+ *
+ * @return A negative, zero or positive value if a is before, equal to or after b.
+ */
+static int prefix_compare(const void *a, const void *b) {
+	const identicon_key_t *ka = ((const prefix_order_t *)a)->key;
+	const identicon_key_t *kb = ((const prefix_order_t *)b)->key;
+	size_t len = (ka->len < kb->len) ? ka->len : kb->len;
+	int ret = memcmp(ka->str, kb->str, len);
+
+	if (ret != 0)
+		return ret;
+
+	return (ka->len > kb->len) - (ka->len < kb->len);
+}
+
+
+/**
+ * Get the length of the common prefix of two keys.
+ *
+ * @param[in] a The first key.
+ * @param[in] b The second key.
+ *
+ * @return The number of leading bytes shared by the keys.
+ */
+static size_t common_prefix(const identicon_key_t *a, const identicon_key_t *b) {
+	size_t len = (a->len < b->len) ? a->len : b->len;
+	size_t i;
+
+	for (i = 0; (i < len) && (a->str[i] == b->str[i]); i++);
+
+	return i;
+}
+
+
+/**
+ * Initialize a hash context.
+ *
+ * @param[out] ctx       The context.
+ * @param[in]  hash_type The hash algorithm.
+ */
+static void prefix_init(prefix_ctx_t *ctx, identicon_hash_t hash_type) {
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5: md5_init_ctx(&ctx->md5); break;
+		case IDENTICON_HASH_SHA1: sha1_init_ctx(&ctx->sha1); break;
+		case IDENTICON_HASH_SHA256: sha256_init_ctx(&ctx->sha256); break;
+		case IDENTICON_HASH_SHA512: sha512_init_ctx(&ctx->sha512); break;
+		default: break;
+	}
+}
+
+
+/**
+ * Add bytes to a hash context.
+ *
+ * @param[in,out] ctx       The context.
+ * @param[in]     hash_type The hash algorithm.
+ * @param[in]     buf       The bytes.
+ * @param[in]     len       The number of bytes.
+ */
+static void prefix_bytes(prefix_ctx_t *ctx, identicon_hash_t hash_type, const void *buf, size_t len) {
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5: md5_process_bytes(buf, len, &ctx->md5); break;
+		case IDENTICON_HASH_SHA1: sha1_process_bytes(buf, len, &ctx->sha1); break;
+		case IDENTICON_HASH_SHA256: sha256_process_bytes(buf, len, &ctx->sha256); break;
+		case IDENTICON_HASH_SHA512: sha512_process_bytes(buf, len, &ctx->sha512); break;
+		default: break;
+	}
+}
+
+
+/**
+ * Finish a hash context.
+ *
+ * @param[in,out] ctx       The context.
+ * @param[in]     hash_type The hash algorithm.
+ * @param[out]    hash      The digest.
+ */
+static void prefix_finish(prefix_ctx_t *ctx, identicon_hash_t hash_type, unsigned char *hash) {
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5: md5_finish_ctx(&ctx->md5, hash); break;
+		case IDENTICON_HASH_SHA1: sha1_finish_ctx(&ctx->sha1, hash); break;
+		case IDENTICON_HASH_SHA256: sha256_finish_ctx(&ctx->sha256, hash); break;
+		case IDENTICON_HASH_SHA512: sha512_finish_ctx(&ctx->sha512, hash); break;
+		default: break;
+	}
+}
+
+
+/**
+ * Hash a batch of keys (each one followed by the salt) sharing long prefixes.
+ *
+ * Keys whose string is NULL are skipped (their hash is left untouched). The
+ * keys are only hashed here if resuming from shared prefixes skips at least
+ * half of the blocks of the first PREFIX_CHUNK_SIZE keys, as other keys are
+ * hashed faster in SIMD lanes (see identicon-c_multihash.c).
+ *
+ * @param[in]  hash_type The hash algorithm to use (with the built in backend).
+ * @param[in]  keys      The keys.
+ * @param[in]  count     The number of keys.
+ * @param[in]  salt      The salt (may be NULL).
+ * @param[in]  salt_len  The length of the salt.
+ * @param[out] hashes    The hashes of the keys.
+ *
+ * @return The length of the hashes or 0 if the keys have not been hashed.
+ */
+size_t identicon_prefix_hash(identicon_hash_t hash_type, const identicon_key_t *keys, size_t count,
+		const unsigned char *salt, size_t salt_len, unsigned char (*hashes)[IDENTICON_MAX_DIGEST_SIZE]) {
+	prefix_ctx_t saved[PREFIX_MAX_DEPTH];
+	prefix_order_t order[PREFIX_CHUNK_SIZE];
+	prefix_ctx_t ctx;
+	size_t block_size, length_size, hash_len, start, n, m, i, j, depth, blocks, reused;
+	const identicon_key_t *key;
+
+	switch (hash_type) {
+		case IDENTICON_HASH_MD5: block_size = 64; length_size = 8; hash_len = 16; break;
+		case IDENTICON_HASH_SHA1: block_size = 64; length_size = 8; hash_len = 20; break;
+		case IDENTICON_HASH_SHA256: block_size = 64; length_size = 8; hash_len = 32; break;
+		case IDENTICON_HASH_SHA512: block_size = 128; length_size = 16; hash_len = 64; break;
+		default: return 0;
+	}
+
+	if ((keys == NULL) || (hashes == NULL))
+		return 0;
+
+	if (salt == NULL)
+		salt_len = 0;
+
+	for (start = 0; start < count; start += n) {
+		n = ((count - start) < PREFIX_CHUNK_SIZE) ? count - start : PREFIX_CHUNK_SIZE;
+
+		for (i = 0, m = 0, blocks = 0; i < n; i++) {
+			if (keys[start + i].str == NULL)
+				continue;
+
+			order[m].key = &keys[start + i];
+			order[m].index = start + i;
+			blocks += (keys[start + i].len + salt_len + length_size + block_size) / block_size;
+			m++;
+		}
+
+		qsort(order, m, sizeof(prefix_order_t), prefix_compare);
+
+		// Contexts saved for the previous key are valid for the blocks it shares with this one
+		for (i = 0, reused = 0; i < m; i++) {
+			depth = (i > 0) ? common_prefix(order[i - 1].key, order[i].key) / block_size : 0;
+			order[i].reuse = (depth < PREFIX_MAX_DEPTH) ? depth : PREFIX_MAX_DEPTH;
+			reused += order[i].reuse;
+		}
+
+		// The first chunk tells if the batch is worth it (nothing is hashed yet)
+		if ((start == 0) && ((reused == 0) || (2 * reused < blocks)))
+			return 0;
+
+		for (i = 0; i < m; i++) {
+			key = order[i].key;
+			depth = order[i].reuse;
+
+			if (depth > 0)
+				ctx = saved[depth - 1];
+			else
+				prefix_init(&ctx, hash_type);
+
+			for (j = depth; (j < PREFIX_MAX_DEPTH) && ((j + 1) * block_size <= key->len); j++) {
+				prefix_bytes(&ctx, hash_type, key->str + (j * block_size), block_size);
+				saved[j] = ctx;
+			}
+
+			prefix_bytes(&ctx, hash_type, key->str + (j * block_size), key->len - (j * block_size));
+			prefix_bytes(&ctx, hash_type, salt, salt_len);
+			prefix_finish(&ctx, hash_type, hashes[order[i].index]);
+		}
+
+		__atomic_fetch_add(&stats_keys, m, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats_blocks, blocks - reused, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats_blocks_saved, reused, __ATOMIC_RELAXED);
+	}
+
+	return hash_len;
+}
+
+
+/**
+ * Get the statistics of the batch functions.
+ *
+ * @param[out] stats The statistics (since the last reset).
+ */
+void identicon_get_batch_stats(identicon_batch_stats_t *stats) {
+	if (stats == NULL)
+		return;
+
+	stats->prefix_keys = __atomic_load_n(&stats_keys, __ATOMIC_RELAXED);
+	stats->prefix_blocks = __atomic_load_n(&stats_blocks, __ATOMIC_RELAXED);
+	stats->prefix_blocks_saved = __atomic_load_n(&stats_blocks_saved, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Reset the statistics of the batch functions.
+ */
+void identicon_reset_batch_stats(void) {
+	__atomic_store_n(&stats_keys, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats_blocks, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats_blocks_saved, 0, __ATOMIC_RELAXED);
+}
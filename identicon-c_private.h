@@ -0,0 +1,112 @@
+/**
+ * identicon-c_private.h - Declaration of functions and data types shared
+ * by the modules of the library (not installed).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDENTICON_PRIVATE_H
+#define IDENTICON_PRIVATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "identicon-c.h"
+
+// Functions shared by the modules of the library but not exported by the shared library (all the ones declared here)
+#if defined(__GNUC__)
+#define IDENTICON_HIDDEN __attribute__((visibility("hidden")))
+#else
+#define IDENTICON_HIDDEN
+#endif
+
+// Biggest digest of the hash functions (SHA512)
+#define IDENTICON_MAX_DIGEST_SIZE 64
+
+// Largest number of span fill implementations (generic, SSE2, AVX2, AVX-512)
+#define IDENTICON_FILL_SPAN_IMPLS 4
+
+
+// Function filling a span of RGBA pixels with the same value
+typedef void (*identicon_fill_span_t)(unsigned char *dst, uint32_t pixel, size_t count);
+
+// Span fill implementation
+typedef struct identicon_fill_span_impl_t {
+	const char *name;
+	identicon_fill_span_t fill;
+} identicon_fill_span_impl_t;
+
+
+// Get the allocator of the calling thread (the one of the running context function or the global one)
+IDENTICON_HIDDEN const identicon_allocator_t *identicon_allocator(void);
+
+// Make an allocator the one of the calling thread (returns the previous one for identicon_allocator_pop())
+IDENTICON_HIDDEN const identicon_allocator_t *identicon_allocator_push(const identicon_allocator_t *allocator);
+
+// Restore the allocator of the calling thread
+IDENTICON_HIDDEN void identicon_allocator_pop(const identicon_allocator_t *previous);
+
+// Allocate, resize and free memory with a given allocator
+IDENTICON_HIDDEN void *identicon_malloc_with(const identicon_allocator_t *allocator, size_t size);
+IDENTICON_HIDDEN void *identicon_calloc_with(const identicon_allocator_t *allocator, size_t count, size_t size);
+IDENTICON_HIDDEN void *identicon_realloc_with(const identicon_allocator_t *allocator, void *ptr, size_t size);
+IDENTICON_HIDDEN void identicon_free_with(const identicon_allocator_t *allocator, void *ptr);
+
+// Get compact options pointing to the strings of legacy options (NULL if opts is NULL)
+IDENTICON_HIDDEN const identicon_opts2_t *identicon_opts2_from_options(identicon_opts2_t *opts2,
+		const identicon_options_t *opts);
+
+// Compute the descriptor of a digest (hue seed and cell bits read straight from the digest bytes)
+IDENTICON_HIDDEN void identicon_digest_descriptor(identicon_descriptor_t *desc, const unsigned char *hash,
+		size_t len);
+
+// Get the span fill implementations supported by the CPU (the last one is the one used to draw)
+IDENTICON_HIDDEN size_t identicon_fill_span_impls(identicon_fill_span_impl_t impls[IDENTICON_FILL_SPAN_IMPLS]);
+
+// Get the draw plan of a geometry from the per-thread plan cache
+IDENTICON_HIDDEN const identicon_plan_t *identicon_cached_plan(const identicon_opts2_t *opts);
+
+// Render an identicon one row at a time into a given row buffer of 4 * opts->size bytes
+IDENTICON_HIDDEN bool identicon_render_rows_buffer(const identicon_opts2_t *opts, unsigned char *row,
+		identicon_row_callback_t row_cb, void *user);
+
+// Hash a batch of keys (each followed by the salt) in SIMD lanes (0 if the hash has no multi-buffer kernel)
+IDENTICON_HIDDEN size_t identicon_multihash(identicon_hash_t hash_type, const identicon_key_t *keys, size_t count,
+		const unsigned char *salt, size_t salt_len, unsigned char (*hashes)[IDENTICON_MAX_DIGEST_SIZE]);
+
+// Hash a batch of keys resuming from the contexts of shared prefixes (0 if not worth it or not a builtin hash)
+IDENTICON_HIDDEN size_t identicon_prefix_hash(identicon_hash_t hash_type, const identicon_key_t *keys, size_t count,
+		const unsigned char *salt, size_t salt_len, unsigned char (*hashes)[IDENTICON_MAX_DIGEST_SIZE]);
+
+
+// Get the mirrored columns painted in a row of cells (bit 0 middle, bit 1 inner pair, bit 2 outer pair)
+static inline unsigned int identicon_row_columns(uint16_t pattern, int row) {
+	return ((pattern >> row) & 1) | (((pattern >> (5 + row)) & 1) << 1) | (((pattern >> (10 + row)) & 1) << 2);
+}
+
+// Get the mirrored columns painted in a band of a draw plan (index of plan->runs)
+static inline unsigned int identicon_band_columns(const identicon_plan_t *plan, uint32_t band, uint16_t pattern) {
+	unsigned int cols = 0;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		if (plan->bands[band].rows & (1 << i))
+			cols |= identicon_row_columns(pattern, i);
+	}
+
+	return cols;
+}
+
+#endif
@@ -0,0 +1,318 @@
+/* blake2b.c - Functions to compute the BLAKE2b hash (message digest) of
+   memory blocks according to RFC 7693.
+
+   Written from RFC 7693 and the BLAKE2 reference implementation
+   (https://github.com/BLAKE2/BLAKE2), which is released into the public
+   domain under CC0 1.0.  This file is dedicated to the public domain in
+   the same way.
+
+   Only unkeyed hashing with the default parameter block is provided,
+   which is what libsodium's crypto_generichash computes without a key.
+   On x86_64 the compression function keeps the state rows in AVX2
+   registers when the processor has them.  */
+
+#include "blake2b.h"
+
+#include <string.h>
+
+#if defined __GNUC__ && defined __x86_64__
+# define HAVE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+static const uint64_t iv[8] =
+{
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+/* Order of the message words in each of the twelve rounds.  */
+static const uint8_t sigma[12][16] =
+{
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+  { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+  { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+  { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+  { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+  { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+  { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+  { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+static inline uint64_t
+load64 (const uint8_t *p)
+{
+  return (uint64_t) p[0] | ((uint64_t) p[1] << 8)
+         | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+         | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+         | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint64_t
+rotr64 (uint64_t w, unsigned int c)
+{
+  return (w >> c) | (w << (64 - c));
+}
+
+#define G(a, b, c, d, x, y)                     \
+  do                                            \
+    {                                           \
+      v[a] = v[a] + v[b] + (x);                 \
+      v[d] = rotr64 (v[d] ^ v[a], 32);          \
+      v[c] = v[c] + v[d];                       \
+      v[b] = rotr64 (v[b] ^ v[c], 24);          \
+      v[a] = v[a] + v[b] + (y);                 \
+      v[d] = rotr64 (v[d] ^ v[a], 16);          \
+      v[c] = v[c] + v[d];                       \
+      v[b] = rotr64 (v[b] ^ v[c], 63);          \
+    }                                           \
+  while (0)
+
+/* Compress BLOCK into H.  T0 and T1 are the byte counter including the
+   block, F0 is all ones for the last block.  */
+
+static void
+blake2b_compress_generic (uint64_t h[8], const uint8_t block[BLAKE2B_BLOCK_SIZE],
+                          uint64_t t0, uint64_t t1, uint64_t f0)
+{
+  uint64_t m[16], v[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load64 (block + 8 * i);
+
+  memcpy (v, h, 8 * sizeof (uint64_t));
+  memcpy (v + 8, iv, 8 * sizeof (uint64_t));
+  v[12] ^= t0;
+  v[13] ^= t1;
+  v[14] ^= f0;
+
+  for (i = 0; i < 12; i++)
+    {
+      const uint8_t *s = sigma[i];
+
+      G (0, 4, 8, 12, m[s[0]], m[s[1]]);
+      G (1, 5, 9, 13, m[s[2]], m[s[3]]);
+      G (2, 6, 10, 14, m[s[4]], m[s[5]]);
+      G (3, 7, 11, 15, m[s[6]], m[s[7]]);
+      G (0, 5, 10, 15, m[s[8]], m[s[9]]);
+      G (1, 6, 11, 12, m[s[10]], m[s[11]]);
+      G (2, 7, 8, 13, m[s[12]], m[s[13]]);
+      G (3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+
+  for (i = 0; i < 8; i++)
+    h[i] ^= v[i] ^ v[i + 8];
+}
+
+#undef G
+
+#ifdef HAVE_X86_SIMD
+/* 64-bit rotations: by 32 swaps the halves, by 24 and 16 move whole
+   bytes, by 63 is a left shift by one.  */
+# define ROTR32_AVX2(x) _mm256_shuffle_epi32 (x, _MM_SHUFFLE (2, 3, 0, 1))
+# define ROTR24_AVX2(x) _mm256_shuffle_epi8 (x, rot24)
+# define ROTR16_AVX2(x) _mm256_shuffle_epi8 (x, rot16)
+# define ROTR63_AVX2(x) \
+  _mm256_or_si256 (_mm256_srli_epi64 (x, 63), _mm256_add_epi64 (x, x))
+
+/* Quarter rounds on the four columns (or diagonals) of the state, one
+   per lane.  */
+# define G_AVX2(r0, r1, r2, r3, mx, my)                         \
+  do                                                            \
+    {                                                           \
+      r0 = _mm256_add_epi64 (_mm256_add_epi64 (r0, r1), mx);    \
+      r3 = ROTR32_AVX2 (_mm256_xor_si256 (r3, r0));             \
+      r2 = _mm256_add_epi64 (r2, r3);                           \
+      r1 = ROTR24_AVX2 (_mm256_xor_si256 (r1, r2));             \
+      r0 = _mm256_add_epi64 (_mm256_add_epi64 (r0, r1), my);    \
+      r3 = ROTR16_AVX2 (_mm256_xor_si256 (r3, r0));             \
+      r2 = _mm256_add_epi64 (r2, r3);                           \
+      r1 = ROTR63_AVX2 (_mm256_xor_si256 (r1, r2));             \
+    }                                                           \
+  while (0)
+
+/* Same as blake2b_compress_generic, keeping each row of the state in
+   an AVX2 register.  The diagonal step rotates rows 1-3 so that the
+   diagonals line up as columns.  */
+
+__attribute__ ((target ("avx2")))
+static void
+blake2b_compress_avx2 (uint64_t h[8], const uint8_t block[BLAKE2B_BLOCK_SIZE],
+                       uint64_t t0, uint64_t t1, uint64_t f0)
+{
+  const __m256i rot24 = _mm256_setr_epi8 (
+    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+  const __m256i rot16 = _mm256_setr_epi8 (
+    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+  uint64_t m[16];
+  __m256i r0, r1, r2, r3, h0, h1, mx, my;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load64 (block + 8 * i);
+
+  h0 = r0 = _mm256_loadu_si256 ((const __m256i *) &h[0]);
+  h1 = r1 = _mm256_loadu_si256 ((const __m256i *) &h[4]);
+  r2 = _mm256_loadu_si256 ((const __m256i *) &iv[0]);
+  r3 = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *) &iv[4]),
+                         _mm256_setr_epi64x (t0, t1, f0, 0));
+
+  for (i = 0; i < 12; i++)
+    {
+      const uint8_t *s = sigma[i];
+
+      mx = _mm256_setr_epi64x (m[s[0]], m[s[2]], m[s[4]], m[s[6]]);
+      my = _mm256_setr_epi64x (m[s[1]], m[s[3]], m[s[5]], m[s[7]]);
+      G_AVX2 (r0, r1, r2, r3, mx, my);
+
+      r1 = _mm256_permute4x64_epi64 (r1, _MM_SHUFFLE (0, 3, 2, 1));
+      r2 = _mm256_permute4x64_epi64 (r2, _MM_SHUFFLE (1, 0, 3, 2));
+      r3 = _mm256_permute4x64_epi64 (r3, _MM_SHUFFLE (2, 1, 0, 3));
+
+      mx = _mm256_setr_epi64x (m[s[8]], m[s[10]], m[s[12]], m[s[14]]);
+      my = _mm256_setr_epi64x (m[s[9]], m[s[11]], m[s[13]], m[s[15]]);
+      G_AVX2 (r0, r1, r2, r3, mx, my);
+
+      r1 = _mm256_permute4x64_epi64 (r1, _MM_SHUFFLE (2, 1, 0, 3));
+      r2 = _mm256_permute4x64_epi64 (r2, _MM_SHUFFLE (1, 0, 3, 2));
+      r3 = _mm256_permute4x64_epi64 (r3, _MM_SHUFFLE (0, 3, 2, 1));
+    }
+
+  h0 = _mm256_xor_si256 (h0, _mm256_xor_si256 (r0, r2));
+  h1 = _mm256_xor_si256 (h1, _mm256_xor_si256 (r1, r3));
+  _mm256_storeu_si256 ((__m256i *) &h[0], h0);
+  _mm256_storeu_si256 ((__m256i *) &h[4], h1);
+}
+
+# undef G_AVX2
+# undef ROTR63_AVX2
+# undef ROTR16_AVX2
+# undef ROTR24_AVX2
+# undef ROTR32_AVX2
+#endif
+
+/* Compress BLOCK into H with the fastest implementation supported by the
+   processor (chosen at first use).  */
+
+static void
+blake2b_compress (uint64_t h[8], const uint8_t block[BLAKE2B_BLOCK_SIZE],
+                  uint64_t t0, uint64_t t1, uint64_t f0)
+{
+#ifdef HAVE_X86_SIMD
+  typedef void (*compress_fn) (uint64_t *, const uint8_t *,
+                               uint64_t, uint64_t, uint64_t);
+  static compress_fn impl;
+  compress_fn fn = __atomic_load_n (&impl, __ATOMIC_RELAXED);
+
+  if (fn == NULL)
+    {
+      __builtin_cpu_init ();
+      fn = __builtin_cpu_supports ("avx2") ? blake2b_compress_avx2
+                                           : blake2b_compress_generic;
+      __atomic_store_n (&impl, fn, __ATOMIC_RELAXED);
+    }
+
+  fn (h, block, t0, t1, f0);
+#else
+  blake2b_compress_generic (h, block, t0, t1, f0);
+#endif
+}
+
+int
+blake2b_init_ctx (struct blake2b_ctx *ctx, size_t outlen)
+{
+  if (outlen == 0 || outlen > BLAKE2B_MAX_DIGEST_SIZE)
+    return -1;
+
+  memcpy (ctx->h, iv, sizeof ctx->h);
+  /* Parameter block: digest length, no key, fanout 1, depth 1.  */
+  ctx->h[0] ^= 0x01010000 ^ outlen;
+  ctx->t[0] = 0;
+  ctx->t[1] = 0;
+  ctx->buflen = 0;
+  ctx->outlen = outlen;
+  return 0;
+}
+
+static void
+blake2b_increment_counter (struct blake2b_ctx *ctx, uint64_t inc)
+{
+  ctx->t[0] += inc;
+  ctx->t[1] += ctx->t[0] < inc;
+}
+
+void
+blake2b_process_bytes (const void *buffer, size_t len,
+                       struct blake2b_ctx *ctx)
+{
+  const uint8_t *p = buffer;
+
+  /* The last block must be compressed with the final flag, so a full
+     buffer is only compressed once more input follows it.  */
+  while (len > 0)
+    {
+      size_t take;
+
+      if (ctx->buflen == BLAKE2B_BLOCK_SIZE)
+        {
+          blake2b_increment_counter (ctx, BLAKE2B_BLOCK_SIZE);
+          blake2b_compress (ctx->h, ctx->buffer, ctx->t[0], ctx->t[1], 0);
+          ctx->buflen = 0;
+        }
+
+      if (ctx->buflen == 0)
+        while (len > BLAKE2B_BLOCK_SIZE)
+          {
+            blake2b_increment_counter (ctx, BLAKE2B_BLOCK_SIZE);
+            blake2b_compress (ctx->h, p, ctx->t[0], ctx->t[1], 0);
+            p += BLAKE2B_BLOCK_SIZE;
+            len -= BLAKE2B_BLOCK_SIZE;
+          }
+
+      take = BLAKE2B_BLOCK_SIZE - ctx->buflen;
+      if (take > len)
+        take = len;
+      memcpy (ctx->buffer + ctx->buflen, p, take);
+      ctx->buflen += take;
+      p += take;
+      len -= take;
+    }
+}
+
+void *
+blake2b_finish_ctx (struct blake2b_ctx *ctx, void *resbuf)
+{
+  uint8_t *out = resbuf;
+  size_t i;
+
+  blake2b_increment_counter (ctx, ctx->buflen);
+  memset (ctx->buffer + ctx->buflen, 0, BLAKE2B_BLOCK_SIZE - ctx->buflen);
+  blake2b_compress (ctx->h, ctx->buffer, ctx->t[0], ctx->t[1], ~0ULL);
+
+  for (i = 0; i < ctx->outlen; i++)
+    out[i] = ctx->h[i / 8] >> (8 * (i % 8));
+
+  return resbuf;
+}
+
+void *
+blake2b_buffer (const void *buffer, size_t len, void *resblock,
+                size_t outlen)
+{
+  struct blake2b_ctx ctx;
+
+  if (blake2b_init_ctx (&ctx, outlen) != 0)
+    return NULL;
+
+  blake2b_process_bytes (buffer, len, &ctx);
+  return blake2b_finish_ctx (&ctx, resblock);
+}
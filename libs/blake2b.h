@@ -0,0 +1,54 @@
+/* Declarations of functions and data types used for the BLAKE2b hash
+   function (RFC 7693).
+
+   Written from RFC 7693 and the BLAKE2 reference implementation
+   (https://github.com/BLAKE2/BLAKE2), which is released into the public
+   domain under CC0 1.0.  This file is dedicated to the public domain in
+   the same way.  */
+
+#ifndef BLAKE2B_H
+# define BLAKE2B_H 1
+
+# include <stddef.h>
+# include <stdint.h>
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+enum { BLAKE2B_BLOCK_SIZE = 128 };
+enum { BLAKE2B_MAX_DIGEST_SIZE = 64 };
+
+/* Structure to save state of computation between the single steps.  */
+struct blake2b_ctx
+{
+  uint64_t h[8];
+  uint64_t t[2];
+  size_t buflen;
+  size_t outlen;
+  uint8_t buffer[BLAKE2B_BLOCK_SIZE];
+};
+
+/* Initialize structure containing state of computation, for a digest of
+   OUTLEN bytes (1 to BLAKE2B_MAX_DIGEST_SIZE) and no key.  Return 0 on
+   success, -1 if OUTLEN is out of range.  */
+extern int blake2b_init_ctx (struct blake2b_ctx *ctx, size_t outlen);
+
+/* Update the state with the next LEN bytes starting at BUFFER.  */
+extern void blake2b_process_bytes (const void *buffer, size_t len,
+                                   struct blake2b_ctx *ctx);
+
+/* Process the remaining bytes in the buffer and put the OUTLEN bytes
+   digest in RESBUF.  Return RESBUF.  */
+extern void *blake2b_finish_ctx (struct blake2b_ctx *ctx, void *resbuf);
+
+/* Compute the OUTLEN bytes BLAKE2b digest of LEN bytes beginning at
+   BUFFER.  Return RESBLOCK, or NULL if OUTLEN is out of range.  */
+extern void *blake2b_buffer (const void *buffer, size_t len, void *resblock,
+                             size_t outlen);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif
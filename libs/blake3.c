@@ -0,0 +1,598 @@
+/* blake3.c - Functions to compute the BLAKE3 hash (message digest) of
+   memory blocks according to the specification at
+   https://github.com/BLAKE3-team/BLAKE3-specs.
+
+   Written from the BLAKE3 specification and reference implementation
+   (https://github.com/BLAKE3-team/BLAKE3), which are released into the
+   public domain under CC0 1.0 and under the Apache License 2.0.  This
+   file is dedicated to the public domain in the same way.
+
+   Only the hashing and keyed hashing modes are provided.  A single
+   compression uses SSE2 row-wise on x86_64; runs of whole chunks are
+   compressed eight at a time in AVX2 lanes when the processor has it.  */
+
+#include "blake3.h"
+
+#include <string.h>
+
+#if defined __GNUC__ && defined __x86_64__
+# define HAVE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+enum
+{
+  CHUNK_START = 1 << 0,
+  CHUNK_END = 1 << 1,
+  PARENT = 1 << 2,
+  ROOT = 1 << 3,
+  KEYED_HASH = 1 << 4
+};
+
+static const uint32_t iv[8] =
+{
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* Order of the message words in each of the seven rounds.  */
+static const uint8_t msg_schedule[7][16] =
+{
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+  { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+  { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+static inline uint32_t
+load32 (const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8)
+         | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void
+store32 (uint8_t *p, uint32_t w)
+{
+  p[0] = w;
+  p[1] = w >> 8;
+  p[2] = w >> 16;
+  p[3] = w >> 24;
+}
+
+static inline uint32_t
+rotr32 (uint32_t w, unsigned int c)
+{
+  return (w >> c) | (w << (32 - c));
+}
+
+#ifndef HAVE_X86_SIMD
+# define G(a, b, c, d, x, y)                    \
+  do                                            \
+    {                                           \
+      v[a] = v[a] + v[b] + (x);                 \
+      v[d] = rotr32 (v[d] ^ v[a], 16);          \
+      v[c] = v[c] + v[d];                       \
+      v[b] = rotr32 (v[b] ^ v[c], 12);          \
+      v[a] = v[a] + v[b] + (y);                 \
+      v[d] = rotr32 (v[d] ^ v[a], 8);           \
+      v[c] = v[c] + v[d];                       \
+      v[b] = rotr32 (v[b] ^ v[c], 7);           \
+    }                                           \
+  while (0)
+
+/* Run the seven rounds of the compression function on BLOCK, leaving
+   the 16 words of the state (before the feed-forward) in V.  */
+
+static void
+compress_generic (uint32_t v[16], const uint32_t cv[8],
+                  const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+                  uint64_t counter, uint8_t flags)
+{
+  uint32_t m[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load32 (block + 4 * i);
+
+  memcpy (v, cv, 8 * sizeof (uint32_t));
+  memcpy (v + 8, iv, 4 * sizeof (uint32_t));
+  v[12] = counter;
+  v[13] = counter >> 32;
+  v[14] = block_len;
+  v[15] = flags;
+
+  for (i = 0; i < 7; i++)
+    {
+      const uint8_t *s = msg_schedule[i];
+
+      G (0, 4, 8, 12, m[s[0]], m[s[1]]);
+      G (1, 5, 9, 13, m[s[2]], m[s[3]]);
+      G (2, 6, 10, 14, m[s[4]], m[s[5]]);
+      G (3, 7, 11, 15, m[s[6]], m[s[7]]);
+      G (0, 5, 10, 15, m[s[8]], m[s[9]]);
+      G (1, 6, 11, 12, m[s[10]], m[s[11]]);
+      G (2, 7, 8, 13, m[s[12]], m[s[13]]);
+      G (3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+}
+
+# undef G
+# define compress_rounds compress_generic
+#else
+# define ROTR_SSE2(x, c) \
+  _mm_or_si128 (_mm_srli_epi32 (x, c), _mm_slli_epi32 (x, 32 - (c)))
+
+/* Quarter rounds on the four columns (or diagonals) of the state, one
+   per lane.  */
+# define G_SSE2(r0, r1, r2, r3, mx, my)                 \
+  do                                                    \
+    {                                                   \
+      r0 = _mm_add_epi32 (_mm_add_epi32 (r0, r1), mx);  \
+      r3 = ROTR_SSE2 (_mm_xor_si128 (r3, r0), 16);      \
+      r2 = _mm_add_epi32 (r2, r3);                      \
+      r1 = ROTR_SSE2 (_mm_xor_si128 (r1, r2), 12);      \
+      r0 = _mm_add_epi32 (_mm_add_epi32 (r0, r1), my);  \
+      r3 = ROTR_SSE2 (_mm_xor_si128 (r3, r0), 8);       \
+      r2 = _mm_add_epi32 (r2, r3);                      \
+      r1 = ROTR_SSE2 (_mm_xor_si128 (r1, r2), 7);       \
+    }                                                   \
+  while (0)
+
+/* Same as compress_generic, keeping each row of the state in an SSE2
+   register.  The diagonal step rotates rows 1-3 so that the diagonals
+   line up as columns.  */
+
+static void
+compress_sse2 (uint32_t v[16], const uint32_t cv[8],
+               const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+               uint64_t counter, uint8_t flags)
+{
+  uint32_t m[16];
+  __m128i r0, r1, r2, r3, mx, my;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load32 (block + 4 * i);
+
+  r0 = _mm_loadu_si128 ((const __m128i *) &cv[0]);
+  r1 = _mm_loadu_si128 ((const __m128i *) &cv[4]);
+  r2 = _mm_loadu_si128 ((const __m128i *) &iv[0]);
+  r3 = _mm_setr_epi32 ((uint32_t) counter, (uint32_t) (counter >> 32),
+                       block_len, flags);
+
+  for (i = 0; i < 7; i++)
+    {
+      const uint8_t *s = msg_schedule[i];
+
+      mx = _mm_setr_epi32 (m[s[0]], m[s[2]], m[s[4]], m[s[6]]);
+      my = _mm_setr_epi32 (m[s[1]], m[s[3]], m[s[5]], m[s[7]]);
+      G_SSE2 (r0, r1, r2, r3, mx, my);
+
+      r1 = _mm_shuffle_epi32 (r1, _MM_SHUFFLE (0, 3, 2, 1));
+      r2 = _mm_shuffle_epi32 (r2, _MM_SHUFFLE (1, 0, 3, 2));
+      r3 = _mm_shuffle_epi32 (r3, _MM_SHUFFLE (2, 1, 0, 3));
+
+      mx = _mm_setr_epi32 (m[s[8]], m[s[10]], m[s[12]], m[s[14]]);
+      my = _mm_setr_epi32 (m[s[9]], m[s[11]], m[s[13]], m[s[15]]);
+      G_SSE2 (r0, r1, r2, r3, mx, my);
+
+      r1 = _mm_shuffle_epi32 (r1, _MM_SHUFFLE (2, 1, 0, 3));
+      r2 = _mm_shuffle_epi32 (r2, _MM_SHUFFLE (1, 0, 3, 2));
+      r3 = _mm_shuffle_epi32 (r3, _MM_SHUFFLE (0, 3, 2, 1));
+    }
+
+  _mm_storeu_si128 ((__m128i *) &v[0], r0);
+  _mm_storeu_si128 ((__m128i *) &v[4], r1);
+  _mm_storeu_si128 ((__m128i *) &v[8], r2);
+  _mm_storeu_si128 ((__m128i *) &v[12], r3);
+}
+
+# undef G_SSE2
+# undef ROTR_SSE2
+
+# define HASH_MANY_LANES 8
+# define ROTR_AVX2(x, c) \
+  _mm256_or_si256 (_mm256_srli_epi32 (x, c), _mm256_slli_epi32 (x, 32 - (c)))
+# define G_AVX2(a, b, c, d, x, y)                                       \
+  do                                                                    \
+    {                                                                   \
+      v[a] = _mm256_add_epi32 (_mm256_add_epi32 (v[a], v[b]), x);       \
+      v[d] = ROTR_AVX2 (_mm256_xor_si256 (v[d], v[a]), 16);             \
+      v[c] = _mm256_add_epi32 (v[c], v[d]);                             \
+      v[b] = ROTR_AVX2 (_mm256_xor_si256 (v[b], v[c]), 12);             \
+      v[a] = _mm256_add_epi32 (_mm256_add_epi32 (v[a], v[b]), y);       \
+      v[d] = ROTR_AVX2 (_mm256_xor_si256 (v[d], v[a]), 8);              \
+      v[c] = _mm256_add_epi32 (v[c], v[d]);                             \
+      v[b] = ROTR_AVX2 (_mm256_xor_si256 (v[b], v[c]), 7);              \
+    }                                                                   \
+  while (0)
+
+/* Compute the chaining values of the HASH_MANY_LANES whole chunks
+   starting at INPUT, numbered from COUNTER, one chunk per AVX2 lane.
+   The message words of the lanes are gathered from memory 1024 bytes
+   apart.  */
+
+__attribute__ ((target ("avx2")))
+static void
+hash_chunks_avx2 (const uint8_t *input, const uint32_t key[8],
+                  uint64_t counter, uint8_t flags,
+                  uint32_t out[HASH_MANY_LANES][8])
+{
+  const __m256i stride = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i index = _mm256_mullo_epi32 (
+    stride, _mm256_set1_epi32 (BLAKE3_CHUNK_LEN / 4));
+  uint32_t lo[HASH_MANY_LANES], hi[HASH_MANY_LANES];
+  uint32_t words[8][HASH_MANY_LANES];
+  __m256i cv[8], v[16], m[16], ctr_lo, ctr_hi;
+  int b, i, l;
+
+  for (l = 0; l < HASH_MANY_LANES; l++)
+    {
+      lo[l] = (uint32_t) (counter + l);
+      hi[l] = (uint32_t) ((counter + l) >> 32);
+    }
+  ctr_lo = _mm256_loadu_si256 ((const __m256i *) lo);
+  ctr_hi = _mm256_loadu_si256 ((const __m256i *) hi);
+
+  for (i = 0; i < 8; i++)
+    cv[i] = _mm256_set1_epi32 (key[i]);
+
+  for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+    {
+      const uint8_t *block = input + b * BLAKE3_BLOCK_LEN;
+      uint8_t block_flags = flags;
+
+      if (b == 0)
+        block_flags |= CHUNK_START;
+      if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+        block_flags |= CHUNK_END;
+
+      for (i = 0; i < 16; i++)
+        m[i] = _mm256_i32gather_epi32 ((const int *) (block + 4 * i),
+                                       index, 4);
+
+      for (i = 0; i < 8; i++)
+        v[i] = cv[i];
+      for (i = 0; i < 4; i++)
+        v[8 + i] = _mm256_set1_epi32 (iv[i]);
+      v[12] = ctr_lo;
+      v[13] = ctr_hi;
+      v[14] = _mm256_set1_epi32 (BLAKE3_BLOCK_LEN);
+      v[15] = _mm256_set1_epi32 (block_flags);
+
+      for (i = 0; i < 7; i++)
+        {
+          const uint8_t *s = msg_schedule[i];
+
+          G_AVX2 (0, 4, 8, 12, m[s[0]], m[s[1]]);
+          G_AVX2 (1, 5, 9, 13, m[s[2]], m[s[3]]);
+          G_AVX2 (2, 6, 10, 14, m[s[4]], m[s[5]]);
+          G_AVX2 (3, 7, 11, 15, m[s[6]], m[s[7]]);
+          G_AVX2 (0, 5, 10, 15, m[s[8]], m[s[9]]);
+          G_AVX2 (1, 6, 11, 12, m[s[10]], m[s[11]]);
+          G_AVX2 (2, 7, 8, 13, m[s[12]], m[s[13]]);
+          G_AVX2 (3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+
+      for (i = 0; i < 8; i++)
+        cv[i] = _mm256_xor_si256 (v[i], v[i + 8]);
+    }
+
+  for (i = 0; i < 8; i++)
+    _mm256_storeu_si256 ((__m256i *) words[i], cv[i]);
+  for (l = 0; l < HASH_MANY_LANES; l++)
+    for (i = 0; i < 8; i++)
+      out[l][i] = words[i][l];
+}
+
+# undef G_AVX2
+# undef ROTR_AVX2
+
+/* Return true if the processor supports hash_chunks_avx2 (checked once,
+   at first use).  */
+
+static int
+have_avx2 (void)
+{
+  static int cached = -1;
+  int have = __atomic_load_n (&cached, __ATOMIC_RELAXED);
+
+  if (have < 0)
+    {
+      __builtin_cpu_init ();
+      have = __builtin_cpu_supports ("avx2") != 0;
+      __atomic_store_n (&cached, have, __ATOMIC_RELAXED);
+    }
+
+  return have;
+}
+
+# define compress_rounds compress_sse2
+#endif
+
+static void
+compress_in_place (uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                   uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+  uint32_t v[16];
+  int i;
+
+  compress_rounds (v, cv, block, block_len, counter, flags);
+  for (i = 0; i < 8; i++)
+    cv[i] = v[i] ^ v[i + 8];
+}
+
+static void
+compress_xof (const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+              uint8_t block_len, uint64_t counter, uint8_t flags,
+              uint8_t out[64])
+{
+  uint32_t v[16];
+  int i;
+
+  compress_rounds (v, cv, block, block_len, counter, flags);
+  for (i = 0; i < 8; i++)
+    {
+      store32 (out + 4 * i, v[i] ^ v[i + 8]);
+      store32 (out + 4 * (i + 8), v[i + 8] ^ cv[i]);
+    }
+}
+
+/* Input of the last compression of a node, kept so that the root can
+   produce any number of output bytes.  */
+struct output
+{
+  uint32_t input_cv[8];
+  uint64_t counter;
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint8_t block_len;
+  uint8_t flags;
+};
+
+static void
+output_chaining_value (const struct output *self, uint32_t cv[8])
+{
+  memcpy (cv, self->input_cv, sizeof self->input_cv);
+  compress_in_place (cv, self->block, self->block_len, self->counter,
+                     self->flags);
+}
+
+static void
+output_root_bytes (const struct output *self, uint8_t *out, size_t out_len)
+{
+  uint64_t output_block_counter = 0;
+  uint8_t wide[64];
+
+  while (out_len > 0)
+    {
+      size_t take = out_len < sizeof wide ? out_len : sizeof wide;
+
+      compress_xof (self->input_cv, self->block, self->block_len,
+                    output_block_counter++, self->flags | ROOT, wide);
+      memcpy (out, wide, take);
+      out += take;
+      out_len -= take;
+    }
+}
+
+static void
+parent_output (struct output *self, const uint32_t left[8],
+               const uint32_t right[8], const uint32_t key[8], uint8_t flags)
+{
+  int i;
+
+  memcpy (self->input_cv, key, sizeof self->input_cv);
+  for (i = 0; i < 8; i++)
+    {
+      store32 (self->block + 4 * i, left[i]);
+      store32 (self->block + 32 + 4 * i, right[i]);
+    }
+  self->counter = 0;
+  self->block_len = BLAKE3_BLOCK_LEN;
+  self->flags = flags | PARENT;
+}
+
+static void
+chunk_state_init (struct blake3_chunk_state *self, const uint32_t key[8],
+                  uint64_t chunk_counter, uint8_t flags)
+{
+  memcpy (self->cv, key, sizeof self->cv);
+  self->chunk_counter = chunk_counter;
+  memset (self->buf, 0, sizeof self->buf);
+  self->buf_len = 0;
+  self->blocks_compressed = 0;
+  self->flags = flags;
+}
+
+static size_t
+chunk_state_len (const struct blake3_chunk_state *self)
+{
+  return (size_t) BLAKE3_BLOCK_LEN * self->blocks_compressed + self->buf_len;
+}
+
+static uint8_t
+chunk_state_start_flag (const struct blake3_chunk_state *self)
+{
+  return self->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void
+chunk_state_update (struct blake3_chunk_state *self, const uint8_t *input,
+                    size_t len)
+{
+  while (len > 0)
+    {
+      size_t take;
+
+      /* The last block of a chunk stays buffered until the chunk is
+         finalized, as it needs the CHUNK_END flag.  */
+      if (self->buf_len == BLAKE3_BLOCK_LEN)
+        {
+          compress_in_place (self->cv, self->buf, BLAKE3_BLOCK_LEN,
+                             self->chunk_counter,
+                             self->flags | chunk_state_start_flag (self));
+          self->blocks_compressed++;
+          self->buf_len = 0;
+          memset (self->buf, 0, sizeof self->buf);
+        }
+
+      take = BLAKE3_BLOCK_LEN - self->buf_len;
+      if (take > len)
+        take = len;
+      memcpy (self->buf + self->buf_len, input, take);
+      self->buf_len += take;
+      input += take;
+      len -= take;
+    }
+}
+
+static void
+chunk_state_output (const struct blake3_chunk_state *self,
+                    struct output *out)
+{
+  memcpy (out->input_cv, self->cv, sizeof out->input_cv);
+  out->counter = self->chunk_counter;
+  memcpy (out->block, self->buf, sizeof out->block);
+  out->block_len = self->buf_len;
+  out->flags = self->flags | chunk_state_start_flag (self) | CHUNK_END;
+}
+
+static void
+hasher_init_internal (struct blake3_hasher *self, const uint32_t key[8],
+                      uint8_t flags)
+{
+  memcpy (self->key, key, sizeof self->key);
+  chunk_state_init (&self->chunk, key, 0, flags);
+  self->cv_stack_len = 0;
+}
+
+void
+blake3_hasher_init (struct blake3_hasher *self)
+{
+  hasher_init_internal (self, iv, 0);
+}
+
+void
+blake3_hasher_init_keyed (struct blake3_hasher *self,
+                          const uint8_t key[BLAKE3_KEY_LEN])
+{
+  uint32_t key_words[8];
+  int i;
+
+  for (i = 0; i < 8; i++)
+    key_words[i] = load32 (key + 4 * i);
+  hasher_init_internal (self, key_words, KEYED_HASH);
+}
+
+/* Push the chaining value of a completed chunk, merging completed
+   subtrees first: as many parents as trailing zero bits in
+   TOTAL_CHUNKS.  */
+
+static void
+hasher_add_chunk_cv (struct blake3_hasher *self, const uint32_t cv[8],
+                     uint64_t total_chunks)
+{
+  uint32_t new_cv[8];
+  struct output parent;
+
+  memcpy (new_cv, cv, sizeof new_cv);
+  while ((total_chunks & 1) == 0)
+    {
+      self->cv_stack_len--;
+      parent_output (&parent, self->cv_stack[self->cv_stack_len], new_cv,
+                     self->key, self->chunk.flags);
+      output_chaining_value (&parent, new_cv);
+      total_chunks >>= 1;
+    }
+  memcpy (self->cv_stack[self->cv_stack_len++], new_cv, sizeof new_cv);
+}
+
+void
+blake3_hasher_update (struct blake3_hasher *self, const void *input,
+                      size_t len)
+{
+  const uint8_t *p = input;
+
+  while (len > 0)
+    {
+      size_t take;
+
+      /* A full chunk is only finalized once more input shows that it
+         is not the root.  */
+      if (chunk_state_len (&self->chunk) == BLAKE3_CHUNK_LEN)
+        {
+          struct output out;
+          uint32_t cv[8];
+          uint64_t total_chunks = self->chunk.chunk_counter + 1;
+
+          chunk_state_output (&self->chunk, &out);
+          output_chaining_value (&out, cv);
+          hasher_add_chunk_cv (self, cv, total_chunks);
+          chunk_state_init (&self->chunk, self->key, total_chunks,
+                            self->chunk.flags);
+        }
+
+#ifdef HAVE_X86_SIMD
+      /* Whole chunks followed by more input can't be the root either,
+         so they are compressed side by side.  */
+      if (chunk_state_len (&self->chunk) == 0
+          && len > HASH_MANY_LANES * BLAKE3_CHUNK_LEN && have_avx2 ())
+        {
+          uint32_t cvs[HASH_MANY_LANES][8];
+          uint64_t counter = self->chunk.chunk_counter;
+          int l;
+
+          hash_chunks_avx2 (p, self->key, counter, self->chunk.flags, cvs);
+          for (l = 0; l < HASH_MANY_LANES; l++)
+            hasher_add_chunk_cv (self, cvs[l], counter + l + 1);
+          chunk_state_init (&self->chunk, self->key,
+                            counter + HASH_MANY_LANES, self->chunk.flags);
+          p += HASH_MANY_LANES * BLAKE3_CHUNK_LEN;
+          len -= HASH_MANY_LANES * BLAKE3_CHUNK_LEN;
+          continue;
+        }
+#endif
+
+      take = BLAKE3_CHUNK_LEN - chunk_state_len (&self->chunk);
+      if (take > len)
+        take = len;
+      chunk_state_update (&self->chunk, p, take);
+      p += take;
+      len -= take;
+    }
+}
+
+void
+blake3_hasher_finalize (const struct blake3_hasher *self, uint8_t *out,
+                        size_t out_len)
+{
+  struct output output;
+  size_t parent_nodes_remaining = self->cv_stack_len;
+
+  chunk_state_output (&self->chunk, &output);
+  while (parent_nodes_remaining > 0)
+    {
+      uint32_t right[8];
+
+      parent_nodes_remaining--;
+      output_chaining_value (&output, right);
+      parent_output (&output, self->cv_stack[parent_nodes_remaining], right,
+                     self->key, self->chunk.flags);
+    }
+  output_root_bytes (&output, out, out_len);
+}
+
+void *
+blake3_buffer (const void *buffer, size_t len, void *resblock)
+{
+  struct blake3_hasher hasher;
+
+  blake3_hasher_init (&hasher);
+  blake3_hasher_update (&hasher, buffer, len);
+  blake3_hasher_finalize (&hasher, resblock, BLAKE3_OUT_LEN);
+  return resblock;
+}
@@ -0,0 +1,69 @@
+/* Declarations of functions and data types used for the BLAKE3 hash
+   function.
+
+   Written from the BLAKE3 specification and reference implementation
+   (https://github.com/BLAKE3-team/BLAKE3), which are released into the
+   public domain under CC0 1.0 and under the Apache License 2.0.  This
+   file is dedicated to the public domain in the same way.  */
+
+#ifndef BLAKE3_H
+# define BLAKE3_H 1
+
+# include <stddef.h>
+# include <stdint.h>
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+enum { BLAKE3_KEY_LEN = 32 };
+enum { BLAKE3_OUT_LEN = 32 };
+enum { BLAKE3_BLOCK_LEN = 64 };
+enum { BLAKE3_CHUNK_LEN = 1024 };
+enum { BLAKE3_MAX_DEPTH = 54 };
+
+/* State of the chunk currently being compressed.  */
+struct blake3_chunk_state
+{
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t buf[BLAKE3_BLOCK_LEN];
+  uint8_t buf_len;
+  uint8_t blocks_compressed;
+  uint8_t flags;
+};
+
+/* Structure to save state of computation between the single steps.  */
+struct blake3_hasher
+{
+  uint32_t key[8];
+  struct blake3_chunk_state chunk;
+  uint8_t cv_stack_len;
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+};
+
+/* Initialize structure containing state of computation, in the default
+   hashing mode or in the keyed mode with a BLAKE3_KEY_LEN bytes KEY.  */
+extern void blake3_hasher_init (struct blake3_hasher *self);
+extern void blake3_hasher_init_keyed (struct blake3_hasher *self,
+                                      const uint8_t key[BLAKE3_KEY_LEN]);
+
+/* Update the state with the next LEN bytes starting at INPUT.  Runs of
+   whole chunks are compressed several at a time in SIMD lanes.  */
+extern void blake3_hasher_update (struct blake3_hasher *self,
+                                  const void *input, size_t len);
+
+/* Put the first OUT_LEN bytes of the extendable output in OUT.  The
+   state is not modified, so more input may be added afterwards.  */
+extern void blake3_hasher_finalize (const struct blake3_hasher *self,
+                                    uint8_t *out, size_t out_len);
+
+/* Compute the BLAKE3_OUT_LEN bytes BLAKE3 digest of LEN bytes beginning
+   at BUFFER.  Return RESBLOCK.  */
+extern void *blake3_buffer (const void *buffer, size_t len, void *resblock);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif
@@ -1382,9 +1382,20 @@ typedef struct Hash
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*initialize hash table*/
+static void hash_clear(Hash* hash, unsigned windowsize)
 {
   unsigned i;
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
+
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+}
+
+static unsigned hash_init(Hash* hash, unsigned windowsize)
+{
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1398,13 +1409,7 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
     return 83; /*alloc fail*/
   }
 
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+  hash_clear(hash, windowsize);
 
   return 0;
 }
@@ -2018,17 +2023,15 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*deflate with btype 1 or 2, using an initialized hash*/
+static unsigned deflateBlocks(ucvector* out, const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, Hash* hash)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   size_t bp = 0; /*the bit pointer*/
-  Hash hash;
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2040,9 +2043,6 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
-
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
     unsigned final = (i == numdeflateblocks - 1);
@@ -2050,10 +2050,27 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     size_t end = start + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, &bp, hash, in, start, end, settings, final);
+    else if(settings->btype == 2) error = deflateDynamic(out, &bp, hash, in, start, end, settings, final);
   }
 
+  return error;
+}
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  Hash hash;
+
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+
+  error = hash_init(&hash, settings->windowsize);
+  if(error) return error;
+
+  error = deflateBlocks(out, in, insize, settings, &hash);
+
   hash_cleanup(&hash);
 
   return error;
@@ -2072,6 +2089,89 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
+struct LodePNGDeflateHash
+{
+  Hash hash;
+  unsigned windowsize;
+  size_t used; /*positions of the circular buffers written since the hash was cleared*/
+};
+
+LodePNGDeflateHash* lodepng_deflate_hash_new(unsigned windowsize)
+{
+  LodePNGDeflateHash* reusable;
+
+  if(windowsize == 0 || windowsize > 32768 || (windowsize & (windowsize - 1)) != 0) return 0;
+
+  reusable = (LodePNGDeflateHash*)lodepng_malloc(sizeof(LodePNGDeflateHash));
+  if(!reusable) return 0;
+
+  if(hash_init(&reusable->hash, windowsize))
+  {
+    hash_cleanup(&reusable->hash);
+    lodepng_free(reusable);
+    return 0;
+  }
+  reusable->windowsize = windowsize;
+  reusable->used = 0;
+
+  return reusable;
+}
+
+void lodepng_deflate_hash_delete(LodePNGDeflateHash* reusable)
+{
+  if(!reusable) return;
+  hash_cleanup(&reusable->hash);
+  lodepng_free(reusable);
+}
+
+/*bring the hash back to the state of hash_init. If the input did not wrap around
+the window, each written position holds the hash value whose head may point to it,
+so only those are cleared instead of the whole tables*/
+static void lodepng_deflate_hash_clear(LodePNGDeflateHash* reusable)
+{
+  Hash* hash = &reusable->hash;
+  size_t i;
+
+  if(reusable->used >= reusable->windowsize) hash_clear(hash, reusable->windowsize);
+  else
+  {
+    for(i = 0; i != reusable->used; ++i)
+    {
+      if(hash->val[i] >= 0) hash->head[hash->val[i]] = -1;
+      hash->val[i] = -1;
+      hash->chain[i] = (unsigned short)i;
+      hash->chainz[i] = (unsigned short)i;
+    }
+    for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+  }
+
+  reusable->used = 0;
+}
+
+unsigned lodepng_deflate_reuse(unsigned char** out, size_t* outsize,
+                               const unsigned char* in, size_t insize,
+                               const LodePNGCompressSettings* settings)
+{
+  LodePNGDeflateHash* reusable = (LodePNGDeflateHash*)settings->custom_context;
+  unsigned error;
+  ucvector v;
+
+  if(!reusable || reusable->windowsize != settings->windowsize || settings->btype == 0 || settings->btype > 2)
+  {
+    return lodepng_deflate(out, outsize, in, insize, settings);
+  }
+
+  if(reusable->used) lodepng_deflate_hash_clear(reusable);
+
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = deflateBlocks(&v, in, insize, settings, &reusable->hash);
+  reusable->used = insize < reusable->windowsize ? insize : reusable->windowsize;
+  *out = v.data;
+  *outsize = v.size;
+
+  return error;
+}
+
 static unsigned deflate(unsigned char** out, size_t* outsize,
                         const unsigned char* in, size_t insize,
                         const LodePNGCompressSettings* settings)
@@ -307,6 +307,19 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+
+/*
+LZ77 hash chains kept between deflate calls, so that encoding many small images
+does not allocate and initialize them every time. Use it with custom_deflate set to
+lodepng_deflate_reuse and custom_context set to the hash (with the same windowsize):
+the output is the same as the one of the built in deflate. Not thread safe.
+*/
+typedef struct LodePNGDeflateHash LodePNGDeflateHash;
+LodePNGDeflateHash* lodepng_deflate_hash_new(unsigned windowsize); /*returns NULL on error*/
+void lodepng_deflate_hash_delete(LodePNGDeflateHash* reusable);
+unsigned lodepng_deflate_reuse(unsigned char** out, size_t* outsize,
+                               const unsigned char* in, size_t insize,
+                               const LodePNGCompressSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -28,6 +28,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+# define HAVE_X86_SHA 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
 #ifdef WORDS_BIGENDIAN
 # define SWAP(n) (n)
 #else
@@ -287,8 +293,9 @@ sha1_process_bytes (const void *buffer, size_t len, struct sha1_ctx *ctx)
    It is assumed that LEN % 64 == 0.
    Most of this code comes from GnuPG's cipher/sha1.c.  */
 
-void
-sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
+static void
+sha1_process_block_generic (const void *buffer, size_t len,
+                            struct sha1_ctx *ctx)
 {
   const uint32_t *words = buffer;
   size_t nwords = len / sizeof (uint32_t);
@@ -418,3 +425,136 @@ sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
       e = ctx->E += e;
     }
 }
+
+#ifdef HAVE_X86_SHA
+/* Same as sha1_process_block_generic, using the SHA extensions of x86
+   processors (SHA-NI).  */
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+sha1_process_block_shani (const void *buffer, size_t len,
+                          struct sha1_ctx *ctx)
+{
+  const unsigned char *p = buffer;
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e_save, e[2], m[4];
+  uint32_t lolen = len;
+
+  ctx->total[0] += lolen;
+  ctx->total[1] += (len >> 31 >> 1) + (ctx->total[0] < lolen);
+
+  abcd = _mm_set_epi32 (ctx->A, ctx->B, ctx->C, ctx->D);
+  e[0] = _mm_set_epi32 (ctx->E, 0, 0, 0);
+
+  for (; len >= 64; len -= 64, p += 64)
+    {
+      abcd_save = abcd;
+      e_save = e[0];
+
+      /* Four rounds per step, E alternating between two registers; the
+         message schedule runs three steps ahead of the rounds.  */
+#define STEP(G)                                                         \
+      do                                                                \
+        {                                                               \
+          if ((G) < 4)                                                  \
+            m[(G) & 3] = _mm_shuffle_epi8 (                             \
+              _mm_loadu_si128 ((const __m128i *) (p + 16 * (G))), mask); \
+          if ((G) == 0)                                                 \
+            e[0] = _mm_add_epi32 (e[0], m[0]);                          \
+          else                                                          \
+            e[(G) & 1] = _mm_sha1nexte_epu32 (e[(G) & 1], m[(G) & 3]);  \
+          e[((G) + 1) & 1] = abcd;                                      \
+          if ((G) >= 3 && (G) <= 18)                                    \
+            m[((G) + 1) & 3] = _mm_sha1msg2_epu32 (m[((G) + 1) & 3],    \
+                                                   m[(G) & 3]);         \
+          abcd = _mm_sha1rnds4_epu32 (abcd, e[(G) & 1], (G) / 5);       \
+          if ((G) >= 1 && (G) <= 16)                                    \
+            m[((G) - 1) & 3] = _mm_sha1msg1_epu32 (m[((G) - 1) & 3],    \
+                                                   m[(G) & 3]);         \
+          if ((G) >= 2 && (G) <= 17)                                    \
+            m[((G) - 2) & 3] = _mm_xor_si128 (m[((G) - 2) & 3],         \
+                                              m[(G) & 3]);              \
+        }                                                               \
+      while (0)
+
+      STEP (0); STEP (1); STEP (2); STEP (3); STEP (4);
+      STEP (5); STEP (6); STEP (7); STEP (8); STEP (9);
+      STEP (10); STEP (11); STEP (12); STEP (13); STEP (14);
+      STEP (15); STEP (16); STEP (17); STEP (18); STEP (19);
+#undef STEP
+
+      e[0] = _mm_sha1nexte_epu32 (e[0], e_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+    }
+
+  ctx->A = _mm_extract_epi32 (abcd, 3);
+  ctx->B = _mm_extract_epi32 (abcd, 2);
+  ctx->C = _mm_extract_epi32 (abcd, 1);
+  ctx->D = _mm_extract_epi32 (abcd, 0);
+  ctx->E = _mm_extract_epi32 (e[0], 3);
+}
+
+/* Return true if the processor has the SHA extensions (and the SSSE3
+   and SSE4.1 instructions used along with them).  */
+
+static int
+sha1_have_shani (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx)
+      || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return 0;
+
+  if (!__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+
+  return (ebx & bit_SHA) != 0;
+}
+#endif
+
+#ifdef HAVE_X86_SHA
+/* Implementation used by sha1_process_block (NULL until chosen).  */
+
+typedef void (*sha1_process_fn) (const void *, size_t, struct sha1_ctx *);
+static sha1_process_fn sha1_impl;
+#endif
+
+/* Make sha1_process_block use the portable implementation if FORCE is
+   nonzero, or go back to the fastest one supported by the processor.
+   This lets tests compare both on a machine having the SHA extensions.  */
+
+void
+sha1_force_generic (int force)
+{
+#ifdef HAVE_X86_SHA
+  __atomic_store_n (&sha1_impl, force ? sha1_process_block_generic : NULL,
+                    __ATOMIC_RELAXED);
+#else
+  (void) force;
+#endif
+}
+
+/* Process LEN bytes of BUFFER, accumulating context into CTX, with the
+   fastest implementation supported by the processor (chosen at first
+   use).  It is assumed that LEN % 64 == 0.  */
+
+void
+sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
+{
+#ifdef HAVE_X86_SHA
+  sha1_process_fn fn = __atomic_load_n (&sha1_impl, __ATOMIC_RELAXED);
+
+  if (fn == NULL)
+    {
+      fn = sha1_have_shani () ? sha1_process_block_shani
+                              : sha1_process_block_generic;
+      __atomic_store_n (&sha1_impl, fn, __ATOMIC_RELAXED);
+    }
+
+  fn (buffer, len, ctx);
+#else
+  sha1_process_block_generic (buffer, len, ctx);
+#endif
+}
@@ -52,6 +52,15 @@ extern void sha1_init_ctx (struct sha1_ctx *ctx);
 extern void sha1_process_block (const void *buffer, size_t len,
                                 struct sha1_ctx *ctx);
 
+/* Use the portable block function if FORCE is nonzero, the fastest one
+   supported by the processor otherwise (only meant for tests, so it is
+   not exported by the shared library).  */
+extern void sha1_force_generic (int force)
+#if defined __GNUC__
+  __attribute__ ((__visibility__ ("hidden")))
+#endif
+  ;
+
 /* Starting with the result of former calls of this function (or the
    initialization function update the context for the next LEN bytes
    starting at BUFFER.
@@ -27,6 +27,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+# define HAVE_X86_SHA 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
 #ifdef WORDS_BIGENDIAN
 # define SWAP(n) (n)
 #else
@@ -433,8 +439,9 @@ static const uint32_t sha256_round_constants[64] = {
    It is assumed that LEN % 64 == 0.
    Most of this code comes from GnuPG's cipher/sha1.c.  */
 
-void
-sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+static void
+sha256_process_block_generic (const void *buffer, size_t len,
+                              struct sha256_ctx *ctx)
 {
   const uint32_t *words = buffer;
   size_t nwords = len / sizeof (uint32_t);
@@ -561,3 +568,143 @@ sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
       h = ctx->state[7] += h;
     }
 }
+
+#ifdef HAVE_X86_SHA
+/* Same as sha256_process_block_generic, using the SHA extensions of
+   x86 processors (SHA-NI).  The state is kept as ABEF and CDGH words,
+   the layout expected by the sha256rnds2 instruction.  */
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+sha256_process_block_shani (const void *buffer, size_t len,
+                            struct sha256_ctx *ctx)
+{
+  const unsigned char *p = buffer;
+  const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp, m[4];
+  uint32_t lolen = len;
+
+  ctx->total[0] += lolen;
+  ctx->total[1] += (len >> 31 >> 1) + (ctx->total[0] < lolen);
+
+  tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &ctx->state[0]),
+                           0xb1);
+  state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &ctx->state[4]),
+                              0x1b);
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);
+  state1 = _mm_blend_epi16 (state1, tmp, 0xf0);
+
+  for (; len >= 64; len -= 64, p += 64)
+    {
+      abef = state0;
+      cdgh = state1;
+
+      /* Four rounds per step; the message schedule runs three steps
+         ahead of the rounds.  */
+#define STEP(G)                                                         \
+      do                                                                \
+        {                                                               \
+          if ((G) < 4)                                                  \
+            m[(G) & 3] = _mm_shuffle_epi8 (                             \
+              _mm_loadu_si128 ((const __m128i *) (p + 16 * (G))), mask); \
+          msg = _mm_add_epi32 (m[(G) & 3], _mm_loadu_si128 (            \
+                                 (const __m128i *) &K (4 * (G))));      \
+          state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);         \
+          if ((G) >= 3 && (G) <= 14)                                    \
+            {                                                           \
+              tmp = _mm_alignr_epi8 (m[(G) & 3], m[((G) - 1) & 3], 4);  \
+              m[((G) + 1) & 3] = _mm_add_epi32 (m[((G) + 1) & 3], tmp); \
+              m[((G) + 1) & 3] = _mm_sha256msg2_epu32 (m[((G) + 1) & 3], \
+                                                       m[(G) & 3]);     \
+            }                                                           \
+          msg = _mm_shuffle_epi32 (msg, 0x0e);                          \
+          state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);         \
+          if ((G) >= 1 && (G) <= 12)                                    \
+            m[((G) - 1) & 3] = _mm_sha256msg1_epu32 (m[((G) - 1) & 3],  \
+                                                     m[(G) & 3]);       \
+        }                                                               \
+      while (0)
+
+      STEP (0); STEP (1); STEP (2); STEP (3);
+      STEP (4); STEP (5); STEP (6); STEP (7);
+      STEP (8); STEP (9); STEP (10); STEP (11);
+      STEP (12); STEP (13); STEP (14); STEP (15);
+#undef STEP
+
+      state0 = _mm_add_epi32 (state0, abef);
+      state1 = _mm_add_epi32 (state1, cdgh);
+    }
+
+  tmp = _mm_shuffle_epi32 (state0, 0x1b);
+  state1 = _mm_shuffle_epi32 (state1, 0xb1);
+  state0 = _mm_blend_epi16 (tmp, state1, 0xf0);
+  state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+  _mm_storeu_si128 ((__m128i *) &ctx->state[0], state0);
+  _mm_storeu_si128 ((__m128i *) &ctx->state[4], state1);
+}
+
+/* Return true if the processor has the SHA extensions (and the SSSE3
+   and SSE4.1 instructions used along with them).  */
+
+static int
+sha256_have_shani (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx)
+      || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return 0;
+
+  if (!__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+
+  return (ebx & bit_SHA) != 0;
+}
+#endif
+
+#ifdef HAVE_X86_SHA
+/* Implementation used by sha256_process_block (NULL until chosen).  */
+
+typedef void (*sha256_process_fn) (const void *, size_t, struct sha256_ctx *);
+static sha256_process_fn sha256_impl;
+#endif
+
+/* Make sha256_process_block use the portable implementation if FORCE is
+   nonzero, or go back to the fastest one supported by the processor.
+   This lets tests compare both on a machine having the SHA extensions.  */
+
+void
+sha256_force_generic (int force)
+{
+#ifdef HAVE_X86_SHA
+  __atomic_store_n (&sha256_impl, force ? sha256_process_block_generic : NULL,
+                    __ATOMIC_RELAXED);
+#else
+  (void) force;
+#endif
+}
+
+/* Process LEN bytes of BUFFER, accumulating context into CTX, with the
+   fastest implementation supported by the processor (chosen at first
+   use).  It is assumed that LEN % 64 == 0.  */
+
+void
+sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+{
+#ifdef HAVE_X86_SHA
+  sha256_process_fn fn = __atomic_load_n (&sha256_impl, __ATOMIC_RELAXED);
+
+  if (fn == NULL)
+    {
+      fn = sha256_have_shani () ? sha256_process_block_shani
+                                : sha256_process_block_generic;
+      __atomic_store_n (&sha256_impl, fn, __ATOMIC_RELAXED);
+    }
+
+  fn (buffer, len, ctx);
+#else
+  sha256_process_block_generic (buffer, len, ctx);
+#endif
+}
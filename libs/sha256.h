@@ -49,6 +49,15 @@ extern void sha224_init_ctx (struct sha256_ctx *ctx);
 extern void sha256_process_block (const void *buffer, size_t len,
                                   struct sha256_ctx *ctx);
 
+/* Use the portable block function if FORCE is nonzero, the fastest one
+   supported by the processor otherwise (only meant for tests, so it is
+   not exported by the shared library).  */
+extern void sha256_force_generic (int force)
+#if defined __GNUC__
+  __attribute__ ((__visibility__ ("hidden")))
+#endif
+  ;
+
 /* Starting with the result of former calls of this function (or the
    initialization function update the context for the next LEN bytes
    starting at BUFFER.
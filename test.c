@@ -0,0 +1,1833 @@
+/**
+ * test.c - Checks of the library against the reference implementations it replaces and of its allocations.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "identicon-c.h"
+#if defined(HAVE_LIBPNG)
+#include "identicon-c_libpng.h"
+#endif
+#include "lodepng.h"
+#include "sha1.h"
+#include "sha256.h"
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+#include "blake3.h"
+#include "blake2b.h"
+
+
+/**
+ * Compare the PNG image of a reusable encoder with the one of lodepng_encode32().
+ *
+ * @param[in,out] encoder The encoder.
+ * @param[in]     img     The RGBA image.
+ * @param[in]     size    The width and height of the image.
+ *
+ * @return True if both images are the same.
+ */
+static bool same_png(identicon_encoder_t *encoder, const unsigned char *img, uint32_t size) {
+	unsigned char *expected = NULL, *png;
+	size_t expected_len = 0, len = 0;
+	bool same;
+
+	if (lodepng_encode32(&expected, &expected_len, img, size, size) != 0) {
+		identicon_free(expected);
+		return false;
+	}
+
+	png = identicon_encoder_encode(encoder, img, size, &len);
+	same = (png != NULL) && (len == expected_len) && (memcmp(png, expected, len) == 0);
+
+	identicon_free(png);
+	identicon_free(expected);
+
+	return same;
+}
+
+
+/**
+ * Check that one encoder gives the bytes of lodepng_encode32() across sizes (the colour mode is cached).
+ *
+ * @return True if every image is the same.
+ */
+static bool test_encoder_sizes(void) {
+	static const uint32_t sizes[] = { 3, 2, 1, 4, 5, 2, 64, 1, 3, 4, 17, 2, 1 };
+	identicon_encoder_t *encoder;
+	identicon_opts2_t options, *opts = &options;
+	unsigned char *img, single[2 * 2 * 4];
+	char key[32];
+	size_t i, j;
+	bool ok = true;
+
+	encoder = new_identicon_encoder();
+	if (encoder == NULL)
+		return false;
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	for (i = 0; i < 40; i++) {
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			opts->key_len = snprintf(key, sizeof(key), "user-%zu", i);
+			opts->size = sizes[j];
+			opts->transparent = (i % 2) != 0;
+			opts->margin = (i % 3) * 0.1;
+
+			img = new_identicon2(opts);
+			if ((img == NULL) || !same_png(encoder, img, opts->size)) {
+				printf("  encoder: key %zu size %u differs from lodepng_encode32()\n", i, opts->size);
+				ok = false;
+			}
+			identicon_free(img);
+		}
+	}
+
+	// A single colour at sizes of up to 16 pixels gets a different mode for each size
+	memset(single, 0x80, sizeof(single));
+	for (j = 2; j > 0; j--) {
+		if (!same_png(encoder, single, j)) {
+			printf("  encoder: single colour size %zu differs from lodepng_encode32()\n", j);
+			ok = false;
+		}
+	}
+
+	free_identicon_encoder(encoder);
+
+	return ok;
+}
+
+
+#if defined(__GLIBC__)
+// Allocation functions of glibc, under the names it exports them with as well
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+#endif
+
+// Allocations made by the whole process (libc, OpenSSL...) while counting
+static volatile bool libc_counting = false;
+static volatile size_t libc_allocations = 0;
+
+
+#if defined(__GLIBC__)
+/**
+ * Allocate memory (replaces the one of libc to count every allocation of the process).
+ *
+ * @param[in] size The size of the block.
+ *
+ * @return The block or NULL if it cannot be allocated.
+ */
+void *malloc(size_t size) {
+	if (libc_counting)
+		libc_allocations++;
+
+	return __libc_malloc(size);
+}
+
+
+/**
+ * Allocate zeroed memory (replaces the one of libc to count every allocation of the process).
+ *
+ * @param[in] count The number of elements.
+ * @param[in] size  The size of an element.
+ *
+ * @return The block or NULL if it cannot be allocated.
+ */
+void *calloc(size_t count, size_t size) {
+	if (libc_counting)
+		libc_allocations++;
+
+	return __libc_calloc(count, size);
+}
+
+
+/**
+ * Resize memory (replaces the one of libc to count every allocation of the process).
+ *
+ * @param[in] ptr  The block.
+ * @param[in] size The new size of the block.
+ *
+ * @return The block or NULL if it cannot be resized.
+ */
+void *realloc(void *ptr, size_t size) {
+	if (libc_counting)
+		libc_allocations++;
+
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+
+/**
+ * Allocation function counting its calls.
+ *
+ * @param[in] size The size of the block.
+ * @param[in] user The number of calls.
+ *
+ * @return The block or NULL if it cannot be allocated.
+ */
+static void *counting_malloc(size_t size, void *user) {
+	(*(size_t *)user)++;
+
+	return malloc(size);
+}
+
+
+/**
+ * Reallocation function counting its calls.
+ *
+ * @param[in] ptr  The block.
+ * @param[in] size The new size of the block.
+ * @param[in] user The number of calls.
+ *
+ * @return The block or NULL if it cannot be resized.
+ */
+static void *counting_realloc(void *ptr, size_t size, void *user) {
+	(*(size_t *)user)++;
+
+	return realloc(ptr, size);
+}
+
+
+/**
+ * Free function (frees are not counted).
+ *
+ * @param[in] ptr  The block.
+ * @param[in] user The number of calls.
+ */
+static void counting_free(void *ptr, void *user) {
+	(void)user;
+
+	free(ptr);
+}
+
+
+/**
+ * Check that going from options to pixels in a caller buffer allocates nothing.
+ *
+ * Every hash type is checked with every hash backend built in, except MD5 to
+ * SHA512 with OpenSSL: OpenSSL 3 allocates the state of each digest (see
+ * identicon_set_hash_backend()).
+ *
+ * @return True if no allocation has been made.
+ */
+static bool test_no_allocation(void) {
+	static const identicon_hash_backend_t backends[] = {
+		IDENTICON_BACKEND_BUILTIN, IDENTICON_BACKEND_OPENSSL, IDENTICON_BACKEND_SODIUM
+	};
+	static unsigned char buf[64 * 64 * 4];
+	identicon_allocator_t allocator = { counting_malloc, counting_realloc, counting_free, NULL };
+	identicon_hash_backend_t previous = identicon_get_hash_backend(IDENTICON_HASH_MD5);
+	identicon_opts2_t options, *opts = &options;
+	identicon_descriptor_t desc, descs[40];
+	identicon_key_t keys[40];
+	char strings[40][32];
+	size_t allocations = 0, i, b;
+	int hash_type;
+	bool ok = true;
+
+	for (i = 0; i < 40; i++) {
+		keys[i].str = strings[i];
+		keys[i].len = snprintf(strings[i], sizeof(strings[i]), "user-%zu@example.com", i);
+	}
+
+	allocator.user = &allocations;
+	if (!identicon_set_allocator(&allocator))
+		return false;
+
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		// Backends that are not built in are skipped
+		if (!identicon_set_hash_backend(backends[b]))
+			continue;
+
+		for (hash_type = IDENTICON_HASH_MD5; hash_type <= IDENTICON_HASH_BLAKE2B_160; hash_type++) {
+			if ((backends[b] == IDENTICON_BACKEND_OPENSSL) && (hash_type <= IDENTICON_HASH_SHA512))
+				continue;
+
+			identicon_opts2_init(opts);
+			opts->size = 64;
+			opts->salt = "salt";
+			opts->salt_len = 4;
+			opts->hash_type = hash_type;
+
+			libc_allocations = 0;
+			libc_counting = true;
+
+			for (i = 0; i < 40; i++) {
+				opts->key = keys[i].str;
+				opts->key_len = keys[i].len;
+
+				if (!identicon_compute_descriptor2(opts, &desc) ||
+						!identicon_render_descriptor2(buf, 64 * 4, 0, 0, &desc, opts) ||
+						!identicon_render_into2(buf, 64 * 4, 0, 0, opts))
+					ok = false;
+			}
+
+			if (!identicon_compute_descriptors2(keys, 40, opts, descs))
+				ok = false;
+
+			libc_counting = false;
+
+			if ((allocations != 0) || (libc_allocations != 0)) {
+				printf("  allocations: %zu (%zu from libc) with backend %d and hash type %d\n",
+						allocations + libc_allocations, libc_allocations, backends[b], hash_type);
+				allocations = 0;
+				ok = false;
+			}
+		}
+	}
+
+	identicon_set_allocator(NULL);
+	identicon_set_hash_backend(previous);
+
+	return ok;
+}
+
+
+/**
+ * Hash a buffer with SHA-1, SHA-224 and SHA-256, in one go and in uneven pieces.
+ *
+ * @param[out] out The 5 digests (one-shot and piecewise SHA-1 and SHA-256, SHA-224) back to back.
+ * @param[in]  buf The buffer.
+ * @param[in]  len The length of the buffer.
+ */
+static void sha_digests(unsigned char out[20 + 20 + 32 + 32 + 28], const unsigned char *buf, size_t len) {
+	struct sha1_ctx sha1;
+	struct sha256_ctx sha256;
+	size_t i, n;
+
+	sha1_buffer((const char *)buf, len, out);
+	sha256_buffer((const char *)buf, len, out + 40);
+	sha224_buffer((const char *)buf, len, out + 104);
+
+	sha1_init_ctx(&sha1);
+	sha256_init_ctx(&sha256);
+	for (i = 0, n = 1; i < len; i += n, n = n * 3 + 1) {
+		if (n > len - i)
+			n = len - i;
+		sha1_process_bytes(buf + i, n, &sha1);
+		sha256_process_bytes(buf + i, n, &sha256);
+	}
+	sha1_finish_ctx(&sha1, out + 20);
+	sha256_finish_ctx(&sha256, out + 72);
+}
+
+
+/**
+ * Check that the portable and the SHA extensions block functions give the same digests.
+ *
+ * @return True if every digest is the same (and the ones of "abc" are the known ones).
+ */
+static bool test_sha_paths(void) {
+	static const unsigned char abc_sha1[20] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+	};
+	static const unsigned char abc_sha256[32] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	static unsigned char buf[70000];
+	unsigned char fast[20 + 20 + 32 + 32 + 28], generic[sizeof(fast)];
+	size_t i, len;
+	bool ok = true;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i * 2654435761u) >> 24;
+
+	for (len = 0; len <= sizeof(buf); len = (len < 300) ? len + 1 : len * 2 + 37) {
+		sha1_force_generic(0);
+		sha256_force_generic(0);
+		sha_digests(fast, buf, len);
+
+		sha1_force_generic(1);
+		sha256_force_generic(1);
+		sha_digests(generic, buf, len);
+
+		if (memcmp(fast, generic, sizeof(fast)) != 0) {
+			printf("  sha: length %zu differs between the block functions\n", len);
+			ok = false;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		sha1_force_generic(i == 0);
+		sha256_force_generic(i == 0);
+		sha_digests(fast, (const unsigned char *)"abc", 3);
+
+		if ((memcmp(fast, abc_sha1, 20) != 0) || (memcmp(fast + 40, abc_sha256, 32) != 0)) {
+			printf("  sha: wrong digest of \"abc\" with the %s block function\n", (i == 0) ? "portable" : "fastest");
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+
+/**
+ * Encoder callback using the encoder given as user data.
+ *
+ * @param[in]  img  The RGBA image.
+ * @param[in]  size The width and height of the image.
+ * @param[out] len  The length of the PNG image.
+ * @param[in]  user The encoder.
+ *
+ * @return The PNG image or NULL if an error occurred.
+ */
+static unsigned char *encode_with(const unsigned char *img, uint32_t size, size_t *len, void *user) {
+	return identicon_encoder_encode(user, img, size, len);
+}
+
+
+/**
+ * Check that the encoders of the workers of a pool give the images of lodepng_encode32().
+ *
+ * @return True if every image is the same.
+ */
+static bool test_pool_encode(void) {
+	identicon_encoder_t *encoders[3];
+	identicon_opts2_t options, *opts = &options;
+	identicon_key_t keys[300];
+	identicon_pool_t *pool;
+	unsigned char *images[300], *img, *expected;
+	size_t lens[300], expected_len, i;
+	char strings[300][32];
+	int pass;
+	bool ok = true;
+
+	for (i = 0; i < 300; i++) {
+		keys[i].str = (i % 50 == 7) ? NULL : strings[i];
+		keys[i].len = snprintf(strings[i], sizeof(strings[i]), "user-%zu@example.com", i);
+	}
+
+	pool = new_identicon_pool(3);
+	for (i = 0; i < 3; i++)
+		encoders[i] = new_identicon_encoder();
+	if ((pool == NULL) || (identicon_pool_threads(pool) != 3) || (encoders[0] == NULL) || (encoders[1] == NULL) ||
+			(encoders[2] == NULL))
+		return false;
+
+	identicon_opts2_init(opts);
+	opts->size = 48;
+
+	// Built-in encoders, then a callback with an encoder per worker (transparent images reuse the buffers too)
+	for (pass = 0; pass < 4; pass++) {
+		opts->transparent = (pass % 2) != 0;
+
+		if (!identicon_pool_encode2(pool, keys, 300, opts, (pass < 2) ? NULL : encode_with,
+				(pass < 2) ? NULL : (void *const *)encoders, images, lens)) {
+			printf("  pool: cannot encode the images (pass %d)\n", pass);
+			ok = false;
+			continue;
+		}
+
+		for (i = 0; i < 300; i++) {
+			if (keys[i].str == NULL) {
+				if ((images[i] != NULL) || (lens[i] != 0))
+					ok = false;
+				continue;
+			}
+
+			opts->key = keys[i].str;
+			opts->key_len = keys[i].len;
+			img = new_identicon2(opts);
+			expected = NULL;
+			if ((img == NULL) || (lodepng_encode32(&expected, &expected_len, img, opts->size, opts->size) != 0) ||
+					(lens[i] != expected_len) || (memcmp(images[i], expected, expected_len) != 0)) {
+				printf("  pool: key %zu differs from lodepng_encode32() (pass %d)\n", i, pass);
+				ok = false;
+			}
+
+			identicon_free(expected);
+			identicon_free(img);
+			identicon_free(images[i]);
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		free_identicon_encoder(encoders[i]);
+	free_identicon_pool(pool);
+
+	return ok;
+}
+
+
+/**
+ * Check that the render functions fail on options that cannot be hashed.
+ *
+ * @return True if every call failed.
+ */
+static bool test_render_errors(void) {
+	static unsigned char buf[16 * 16 * 4];
+	identicon_opts2_t options, *opts = &options;
+	unsigned char *img;
+	bool ok = true;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		identicon_opts2_init(opts);
+		opts->size = 16;
+		opts->key = "key";
+		opts->key_len = 3;
+
+		// An invalid hash type, then a missing key of a non-zero length
+		if (pass == 0)
+			opts->hash_type = (identicon_hash_t)100;
+		else
+			opts->key = NULL;
+
+		if (identicon_render_into2(buf, 16 * 4, 0, 0, opts)) {
+			printf("  render: identicon_render_into2() succeeded (pass %d)\n", pass);
+			ok = false;
+		}
+
+		img = new_identicon2(opts);
+		if (img != NULL) {
+			printf("  render: new_identicon2() succeeded (pass %d)\n", pass);
+			identicon_free(img);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+
+/**
+ * Check that the batch renderers fail when the keys cannot be hashed.
+ *
+ * @return True if every call failed (and keys with NULL strings only are not an error).
+ */
+static bool test_batch_errors(void) {
+	static unsigned char arena[100 * 16 * 16 * 4];
+	identicon_opts2_t options, *opts = &options;
+	identicon_key_t keys[100];
+	identicon_ctx_t *ctx;
+	unsigned char *img;
+	size_t i;
+	bool ok = true;
+
+	for (i = 0; i < 100; i++) {
+		keys[i].str = "key";
+		keys[i].len = 3;
+	}
+
+	identicon_opts2_init(opts);
+	opts->size = 16;
+	opts->hash_type = (identicon_hash_t)100;
+
+	ctx = new_identicon_ctx();
+	if (ctx == NULL)
+		return false;
+
+	img = identicon_render_batch2(keys, 100, opts, NULL);
+	if (img != NULL) {
+		printf("  batch: identicon_render_batch2() succeeded\n");
+		identicon_free(img);
+		ok = false;
+	}
+
+	if (identicon_render_batch2(keys, 100, opts, arena) != NULL) {
+		printf("  batch: identicon_render_batch2() succeeded with an arena\n");
+		ok = false;
+	}
+
+	if (identicon_ctx_render_batch2(ctx, keys, 100, opts) != NULL) {
+		printf("  batch: identicon_ctx_render_batch2() succeeded\n");
+		ok = false;
+	}
+
+	// Nothing to hash is not an error
+	for (i = 0; i < 100; i++)
+		keys[i].str = NULL;
+
+	if (identicon_render_batch2(keys, 100, opts, arena) != arena) {
+		printf("  batch: keys with NULL strings only failed\n");
+		ok = false;
+	}
+
+	free_identicon_ctx(ctx);
+
+	return ok;
+}
+
+
+/**
+ * Compare a digest with its hexadecimal representation.
+ *
+ * @param[in] digest The digest.
+ * @param[in] len    The length of the digest.
+ * @param[in] hex    The expected digest (lowercase hexadecimal).
+ *
+ * @return True if the digest is the expected one.
+ */
+static bool same_hex(const unsigned char *digest, size_t len, const char *hex) {
+	char buf[2 * 64 + 1];
+	size_t i;
+
+	if ((len > 64) || (strlen(hex) != 2 * len))
+		return false;
+
+	for (i = 0; i < len; i++)
+		snprintf(&buf[i * 2], 3, "%02x", digest[i]);
+
+	return memcmp(buf, hex, 2 * len) == 0;
+}
+
+
+/**
+ * Fill the input of the known-answer tests (byte i is i % 251, as in the BLAKE3 test vectors).
+ *
+ * @return The input (102400 bytes).
+ */
+static const unsigned char *vector_input(void) {
+	static unsigned char input[102400];
+	size_t i;
+
+	for (i = 0; i < sizeof(input); i++)
+		input[i] = i % 251;
+
+	return input;
+}
+
+
+/**
+ * Check the BLAKE3 and XXH3-128 digests against known answers (in one go and in two pieces).
+ *
+ * @return True if every digest is the known one.
+ */
+static bool test_hash_vectors(void) {
+	static const struct {
+		size_t len;
+		const char *hex;
+	} blake3[] = {
+		{ 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+		{ 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+		{ 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+		{ 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+		{ 8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+		{ 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+	}, xxh3[] = {
+		{ 0, "99aa06d3014798d86001c324468d497f" },
+		{ 1, "a6cd5e9392000f6ac44bdff4074eecdb" },
+		{ 3, "e3b55f57945a17cf5f4299fc161c9cbb" },
+		{ 16, "72950631827607e2842812cc870dcae2" },
+		{ 17, "685bc458b37d057fc06e233df7729217" },
+		{ 128, "14792fc3af88dc6c05321a0b64d67b41" },
+		{ 129, "dd5e74ac6b45f54ebc30b63382b09a3b" },
+		{ 240, "65b5be86da5540e7c92b68e16f83bbb6" },
+		{ 241, "1da1cb61bcb8a2a102e8cd95421c6d02" },
+		{ 1024, "d0ac1f7b93bf57b9e5d78bafa45b2aa5" },
+		{ 102400, "ecd387d36185351b1428e17f1cac2837" },
+	};
+	const unsigned char *input = vector_input();
+	struct blake3_hasher hasher;
+	XXH3_state_t state;
+	XXH128_canonical_t canonical;
+	unsigned char digest[BLAKE3_OUT_LEN];
+	size_t i, len;
+	int pieces;
+	bool ok = true;
+
+	for (i = 0; i < sizeof(blake3) / sizeof(blake3[0]); i++) {
+		for (pieces = 1; pieces <= 2; pieces++) {
+			len = (pieces == 1) ? blake3[i].len : blake3[i].len / 3;
+			blake3_hasher_init(&hasher);
+			blake3_hasher_update(&hasher, input, len);
+			blake3_hasher_update(&hasher, input + len, blake3[i].len - len);
+			blake3_hasher_finalize(&hasher, digest, BLAKE3_OUT_LEN);
+
+			if (!same_hex(digest, BLAKE3_OUT_LEN, blake3[i].hex)) {
+				printf("  vectors: BLAKE3 of %zu bytes (%d pieces)\n", blake3[i].len, pieces);
+				ok = false;
+			}
+		}
+	}
+
+	for (i = 0; i < sizeof(xxh3) / sizeof(xxh3[0]); i++) {
+		XXH128_canonicalFromHash(&canonical, XXH3_128bits(input, xxh3[i].len));
+		if (!same_hex(canonical.digest, sizeof(canonical.digest), xxh3[i].hex)) {
+			printf("  vectors: XXH3-128 of %zu bytes\n", xxh3[i].len);
+			ok = false;
+		}
+
+		len = xxh3[i].len / 3;
+		XXH3_128bits_reset(&state);
+		XXH3_128bits_update(&state, input, len);
+		XXH3_128bits_update(&state, input + len, xxh3[i].len - len);
+		XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(&state));
+		if (!same_hex(canonical.digest, sizeof(canonical.digest), xxh3[i].hex)) {
+			printf("  vectors: XXH3-128 of %zu bytes (2 pieces)\n", xxh3[i].len);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+
+/**
+ * Check the BLAKE2b-128 and BLAKE2b-160 digests against known answers (the digests of libsodium's
+ * crypto_generichash() with no key and the same output length), in one go and in two pieces.
+ *
+ * @return True if every digest is the known one.
+ */
+static bool test_blake2b_vectors(void) {
+	static const struct {
+		size_t outlen;
+		size_t len;
+		const char *hex;
+	} vectors[] = {
+		{ 16, 0, "cae66941d9efbd404e4d88758ea67670" },
+		{ 16, 3, "a75c0b0d97360c1ba783496eb6a0395a" },
+		{ 16, 128, "a74787004ef589e31149183900d0294a" },
+		{ 16, 129, "aaf1b0371f6d4ee49ee4fb5ddd9c49ef" },
+		{ 16, 1000, "bca120dfd89cd95d82898473a5b01c90" },
+		{ 20, 0, "3345524abf6bbe1809449224b5972c41790b6cf2" },
+		{ 20, 3, "147420788d27f83264eb55bad410d304540a21d9" },
+		{ 20, 128, "e6992372ab022447b34f6d6032fbab707a11adef" },
+		{ 20, 129, "a7bf25f1599102ab631e3052e8303a2c097d1a7e" },
+		{ 20, 1000, "fc9a2426db78846a07219bc181a52bae9a62eacc" },
+	};
+	const unsigned char *input = vector_input();
+	struct blake2b_ctx ctx;
+	unsigned char digest[BLAKE2B_MAX_DIGEST_SIZE];
+	size_t i, len;
+	bool ok = true;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		if ((blake2b_buffer(input, vectors[i].len, digest, vectors[i].outlen) == NULL)
+				|| !same_hex(digest, vectors[i].outlen, vectors[i].hex)) {
+			printf("  vectors: BLAKE2b-%zu of %zu bytes\n", vectors[i].outlen * 8, vectors[i].len);
+			ok = false;
+		}
+
+		len = vectors[i].len / 3;
+		blake2b_init_ctx(&ctx, vectors[i].outlen);
+		blake2b_process_bytes(input, len, &ctx);
+		blake2b_process_bytes(input + len, vectors[i].len - len, &ctx);
+		blake2b_finish_ctx(&ctx, digest);
+		if (!same_hex(digest, vectors[i].outlen, vectors[i].hex)) {
+			printf("  vectors: BLAKE2b-%zu of %zu bytes (2 pieces)\n", vectors[i].outlen * 8, vectors[i].len);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+
+/**
+ * Allocation function failing while its user flag is set.
+ *
+ * @param[in] size The size of the block.
+ * @param[in] user The flag (bool).
+ *
+ * @return The block or NULL if it cannot be allocated.
+ */
+static void *failing_malloc(size_t size, void *user) {
+	return *(bool *)user ? NULL : malloc(size);
+}
+
+
+/**
+ * Reallocation function failing while its user flag is set.
+ *
+ * @param[in] ptr  The block.
+ * @param[in] size The new size of the block.
+ * @param[in] user The flag (bool).
+ *
+ * @return The block or NULL if it cannot be resized.
+ */
+static void *failing_realloc(void *ptr, size_t size, void *user) {
+	return *(bool *)user ? NULL : realloc(ptr, size);
+}
+
+
+/**
+ * Check that the encoder of a context gives the bytes of lodepng_encode32() without allocating once warmed up
+ * (with an arena), and that its output buffer reports the bytes that identicon_ctx_write_func() drops.
+ *
+ * @return True if the images are the same and the output fails after dropped bytes.
+ */
+static bool test_ctx_encode(void) {
+	static unsigned char data[4096];
+	identicon_allocator_t allocator = { failing_malloc, failing_realloc, counting_free, NULL };
+	identicon_opts2_t options, *opts = &options;
+	identicon_arena_t *arena;
+	identicon_ctx_t *ctx;
+	unsigned char *img, *expected;
+	const unsigned char *png;
+	char key[32];
+	size_t i, len, expected_len;
+	uint64_t allocations = 0;
+	bool failing = false;
+	int pass;
+	bool ok = true;
+
+	arena = new_identicon_arena(64 * 1024);
+	ctx = new_identicon_ctx();
+	if ((arena == NULL) || (ctx == NULL)) {
+		free_identicon_arena(arena);
+		free_identicon_ctx(ctx);
+		return false;
+	}
+
+	identicon_ctx_set_arena(ctx, arena);
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < 20; i++) {
+			opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i);
+			opts->size = 16 + 8 * (i % 4);
+
+			png = identicon_ctx_encode2(ctx, opts, &len);
+			img = new_identicon2(opts);
+			expected = NULL;
+			expected_len = 0;
+
+			if ((png == NULL) || (img == NULL) ||
+					(lodepng_encode32(&expected, &expected_len, img, opts->size, opts->size) != 0) ||
+					(len != expected_len) || (memcmp(png, expected, len) != 0)) {
+				printf("  ctx: key %zu differs from lodepng_encode32() (pass %d)\n", i, pass);
+				ok = false;
+			}
+
+			identicon_free(expected);
+			identicon_free(img);
+		}
+
+		// The first pass warms the context up
+		if (pass == 0) {
+			allocations = identicon_ctx_allocations(ctx);
+		} else if (identicon_ctx_allocations(ctx) != allocations) {
+			printf("  ctx: %llu allocations after warm up\n",
+					(unsigned long long)(identicon_ctx_allocations(ctx) - allocations));
+			ok = false;
+		}
+	}
+
+	free_identicon_ctx(ctx);
+	free_identicon_arena(arena);
+
+	// The buffers of a context come from the allocator current when it is created
+	allocator.user = &failing;
+	if (!identicon_set_allocator(&allocator))
+		return false;
+
+	ctx = new_identicon_ctx();
+	identicon_set_allocator(NULL);
+	if (ctx == NULL)
+		return false;
+
+	identicon_ctx_reset_output(ctx);
+	identicon_ctx_write_func(ctx, data, 16);
+
+	failing = true;
+	identicon_ctx_write_func(ctx, data, sizeof(data));
+	failing = false;
+	identicon_ctx_write_func(ctx, data, 16);
+
+	if (identicon_ctx_output(ctx, &len) != NULL) {
+		printf("  ctx: the output succeeded after dropped bytes\n");
+		ok = false;
+	}
+
+	identicon_ctx_reset_output(ctx);
+	identicon_ctx_write_func(ctx, data, sizeof(data));
+
+	if ((identicon_ctx_output(ctx, &len) == NULL) || (len != sizeof(data))) {
+		printf("  ctx: the output failed after a reset\n");
+		ok = false;
+	}
+
+	free_identicon_ctx(ctx);
+
+	return ok;
+}
+
+
+
+/**
+ * Check that descriptors survive packing and unpacking, and that drawing the descriptor of a key gives the image
+ * of new_identicon2() at any size and position.
+ *
+ * @return True if every descriptor and image is the same.
+ */
+static bool test_descriptor(void) {
+	static unsigned char buf[(64 + 3) * (64 + 5) * 4];
+	identicon_opts2_t options, *opts = &options;
+	identicon_descriptor_t desc, unpacked;
+	uint8_t packed[IDENTICON_DESCRIPTOR_SIZE];
+	unsigned char *img;
+	size_t stride = (64 + 3) * 4;
+	uint32_t pattern, y;
+	char key[32];
+	size_t i;
+	bool ok = true;
+
+	for (pattern = 0; pattern < 0x8000; pattern++) {
+		desc.pattern = pattern;
+		desc.foreground.red = pattern & 0xff;
+		desc.foreground.green = (pattern >> 3) & 0xff;
+		desc.foreground.blue = 255 - (pattern & 0xff);
+
+		memset(&unpacked, 0, sizeof(unpacked));
+		identicon_descriptor_pack(&desc, packed);
+		identicon_descriptor_unpack(&unpacked, packed);
+
+		if ((unpacked.pattern != desc.pattern) || (unpacked.foreground.red != desc.foreground.red) ||
+				(unpacked.foreground.green != desc.foreground.green) ||
+				(unpacked.foreground.blue != desc.foreground.blue)) {
+			printf("  descriptor: pattern %04x does not survive packing\n", pattern);
+			ok = false;
+			break;
+		}
+	}
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	// One hash, many sizes
+	for (i = 0; i < 20; i++) {
+		opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i);
+		opts->transparent = (i % 2) != 0;
+		opts->stroke = (i % 3) == 0;
+		opts->stroke_size = 2;
+		opts->size = 64;
+
+		if (!identicon_compute_descriptor2(opts, &desc)) {
+			ok = false;
+			continue;
+		}
+
+		for (opts->size = 1; opts->size <= 64; opts->size += 9) {
+			img = new_identicon2(opts);
+			memset(buf, 0, sizeof(buf));
+
+			if ((img == NULL) || !identicon_render_descriptor2(buf, stride, 3, 5, &desc, opts)) {
+				ok = false;
+			} else {
+				for (y = 0; y < opts->size; y++) {
+					if (memcmp(buf + (y + 5) * stride + 3 * 4, img + (size_t)y * opts->size * 4,
+							(size_t)opts->size * 4) != 0) {
+						printf("  descriptor: key %zu size %u differs from new_identicon2()\n", i, opts->size);
+						ok = false;
+						break;
+					}
+				}
+			}
+
+			identicon_free(img);
+		}
+	}
+
+	return ok;
+}
+
+
+
+/**
+ * Paint the rectangles of the path of an SVG identicon into a mask.
+ *
+ * Only the subpaths that identicon_write_svg() emits are understood: "Mx yhwvhh-wz".
+ *
+ * @param[in]  svg  The SVG image.
+ * @param[in]  size The width and height of the image.
+ * @param[out] mask One byte per pixel, set where the foreground is painted.
+ *
+ * @return True if the path has been understood.
+ */
+static bool svg_mask(const char *svg, uint32_t size, unsigned char *mask) {
+	const char *d = strstr(svg, " d=\"");
+	long x, y, w, h, back, i, j;
+	int n;
+
+	memset(mask, 0, (size_t)size * size);
+
+	if (d == NULL)
+		return strstr(svg, "<path") == NULL;
+
+	for (d += 4; *d == 'M'; d += n) {
+		if ((sscanf(d, "M%ld %ldh%ldv%ldh%ldz%n", &x, &y, &w, &h, &back, &n) != 5) || (back != -w) || (x < 0) ||
+				(y < 0) || (w <= 0) || (h <= 0) || (x + w > (long)size) || (y + h > (long)size))
+			return false;
+
+		for (j = y; j < y + h; j++) {
+			for (i = x; i < x + w; i++)
+				mask[j * size + i] = 1;
+		}
+	}
+
+	return *d == '"';
+}
+
+
+/**
+ * Check the SVG image of a known key, and that the rectangles of SVG images cover the foreground pixels of
+ * new_identicon2().
+ *
+ * @return True if the SVG images are the expected ones.
+ */
+static bool test_svg(void) {
+	static const char expected[] = "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"64\" height=\"64\" "
+			"viewBox=\"0 0 64 64\" shape-rendering=\"crispEdges\"><rect width=\"64\" height=\"64\" fill=\"#f0f0f0\"/>"
+			"<path fill=\"#d8d88c\" d=\"M6 6h12v12h-12zM46 6h12v12h-12zM6 26h12v12h-12zM46 26h12v12h-12z"
+			"M16 36h12v22h-12zM36 36h12v22h-12zM6 46h12v12h-12zM26 46h12v12h-12zM46 46h12v12h-12z\"/></svg>";
+	static char svg[4096];
+	static unsigned char mask[64 * 64];
+	identicon_opts2_t options, *opts = &options;
+	identicon_descriptor_t desc;
+	unsigned char *img, *pixel;
+	size_t len, needed, i, p;
+	char key[32];
+	bool ok = true;
+
+	identicon_opts2_init(opts);
+	opts->key = "test";
+	opts->key_len = 4;
+	opts->size = 64;
+	opts->transparent = false;
+
+	if (!identicon_compute_descriptor2(opts, &desc))
+		return false;
+
+	needed = identicon_write_svg2(&desc, opts, NULL, 0);
+	len = identicon_write_svg2(&desc, opts, svg, sizeof(svg));
+	if ((len != sizeof(expected) - 1) || (needed != len + 1) || (strcmp(svg, expected) != 0)) {
+		printf("  svg: unexpected image of \"test\"\n");
+		ok = false;
+	}
+
+	if (identicon_write_svg2(&desc, opts, svg, len) != 0) {
+		printf("  svg: written into a buffer without room for the NUL byte\n");
+		ok = false;
+	}
+
+	opts->key = key;
+
+	for (i = 0; i < 40; i++) {
+		opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i);
+		opts->size = 16 + 3 * (i % 17);
+		opts->transparent = (i % 2) != 0;
+		opts->margin = (i % 3) * 0.1;
+		opts->stroke = (i % 4) == 1;
+		opts->stroke_size = 1 + i % 3;
+
+		img = new_identicon2(opts);
+		len = 0;
+		if ((img == NULL) || !identicon_compute_descriptor2(opts, &desc) ||
+				((len = identicon_write_svg2(&desc, opts, svg, sizeof(svg))) == 0) ||
+				(len >= identicon_svg_size_bound2(opts)) || !svg_mask(svg, opts->size, mask)) {
+			printf("  svg: cannot write or parse the image of key %zu\n", i);
+			ok = false;
+			identicon_free(img);
+			continue;
+		}
+
+		// A pixel is foreground when it has the colour of the descriptor (the background is grey or transparent)
+		for (p = 0; p < (size_t)opts->size * opts->size; p++) {
+			pixel = img + p * 4;
+			if (mask[p] != ((pixel[3] == 255) && (pixel[0] == desc.foreground.red) &&
+					(pixel[1] == desc.foreground.green) && (pixel[2] == desc.foreground.blue))) {
+				printf("  svg: key %zu differs from new_identicon2() at pixel %zu\n", i, p);
+				ok = false;
+				break;
+			}
+		}
+
+		if (opts->transparent != (strstr(svg, "<rect") == NULL)) {
+			printf("  svg: background of key %zu\n", i);
+			ok = false;
+		}
+
+		identicon_free(img);
+	}
+
+	return ok;
+}
+
+
+
+/**
+ * Check that the PNG images of identicon_write_png2() decode to the pixels of new_identicon2(), at sizes up to
+ * identicon_png_size_bound2().
+ *
+ * @return True if every image decodes to the same pixels.
+ */
+static bool test_write_png(void) {
+	static unsigned char png[16384];
+	identicon_opts2_t options, *opts = &options;
+	identicon_descriptor_t desc;
+	unsigned char *img, *decoded;
+	unsigned int width, height;
+	size_t len, bound, i;
+	char key[32];
+	bool ok = true;
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	for (i = 0; i < 60; i++) {
+		opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i);
+		opts->size = 1 + 7 * (i % 19);
+		opts->transparent = (i % 2) != 0;
+		opts->margin = (i % 3) * 0.1;
+		opts->stroke = (i % 4) == 1;
+		opts->stroke_size = 1 + i % 3;
+
+		bound = identicon_png_size_bound2(opts);
+		img = new_identicon2(opts);
+		decoded = NULL;
+		len = 0;
+
+		if ((bound > sizeof(png)) || (img == NULL) || !identicon_compute_descriptor2(opts, &desc) ||
+				((len = identicon_write_png2(&desc, opts, png, sizeof(png))) == 0) || (len > bound) ||
+				(identicon_write_png2(&desc, opts, NULL, 0) != len) ||
+				(lodepng_decode32(&decoded, &width, &height, png, len) != 0) || (width != opts->size) ||
+				(height != opts->size) || (memcmp(decoded, img, (size_t)width * height * 4) != 0)) {
+			printf("  png: key %zu size %u does not decode to new_identicon2()\n", i, opts->size);
+			ok = false;
+		}
+
+		if ((len != 0) && (identicon_write_png2(&desc, opts, png, len - 1) != 0)) {
+			printf("  png: key %zu written into a buffer too small\n", i);
+			ok = false;
+		}
+
+		identicon_free(decoded);
+		identicon_free(img);
+	}
+
+	return ok;
+}
+
+
+
+/**
+ * Check that a PNG template cache gives the bytes of identicon_write_png2(), filled lazily or all at once, and
+ * as a whole or in parts.
+ *
+ * @return True if every image is the same.
+ */
+static bool test_png_cache(void) {
+	static unsigned char expected[16384], png[16384], joined[16384];
+	identicon_opts2_t options, *opts = &options;
+	identicon_png_cache_t *cache;
+	identicon_png_parts_t parts;
+	identicon_descriptor_t desc;
+	size_t expected_len, len, parts_len, joined_len, i, s;
+	char key[32];
+	int pass;
+	bool ok = true;
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	for (pass = 0; pass < 4; pass++) {
+		opts->size = (pass < 2) ? 48 : 17;
+		opts->transparent = (pass % 2) != 0;
+		opts->stroke = (pass == 2);
+		opts->stroke_size = 2;
+
+		cache = new_identicon_png_cache2(opts);
+		if ((cache == NULL) || ((pass == 1) && !identicon_png_cache_fill(cache))) {
+			free_identicon_png_cache(cache);
+			return false;
+		}
+
+		for (i = 0; i < 100; i++) {
+			opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i % 70);
+
+			if (!identicon_compute_descriptor2(opts, &desc) ||
+					((expected_len = identicon_write_png2(&desc, opts, expected, sizeof(expected))) == 0)) {
+				ok = false;
+				continue;
+			}
+
+			len = identicon_png_cache_write(cache, &desc, png, sizeof(png));
+			if ((len != expected_len) || (memcmp(png, expected, len) != 0) ||
+					(identicon_png_cache_write(cache, &desc, NULL, 0) != len)) {
+				printf("  cache: key %zu differs from identicon_write_png2() (pass %d)\n", i, pass);
+				ok = false;
+			}
+
+			parts_len = identicon_png_cache_parts(cache, &desc, &parts);
+			for (s = 0, joined_len = 0; s < IDENTICON_PNG_SEGMENTS; s++) {
+				if (parts.segments[s].len > sizeof(joined) - joined_len)
+					break;
+				memcpy(joined + joined_len, parts.segments[s].data, parts.segments[s].len);
+				joined_len += parts.segments[s].len;
+			}
+
+			if ((parts_len != expected_len) || (joined_len != expected_len) ||
+					(memcmp(joined, expected, joined_len) != 0)) {
+				printf("  cache: parts of key %zu differ from identicon_write_png2() (pass %d)\n", i, pass);
+				ok = false;
+			}
+		}
+
+		free_identicon_png_cache(cache);
+	}
+
+	return ok;
+}
+
+
+
+// Frame checked by compare_row()
+typedef struct row_check_t {
+	const unsigned char *img;
+	uint32_t size;
+	uint32_t next; // Next expected row
+	uint32_t stop; // Row after which the callback stops (size for none)
+	bool same;
+} row_check_t;
+
+
+/**
+ * Compare a row of identicon_render_rows2() with the one of the full frame (row callback).
+ *
+ * @param[in]     row  The RGBA row.
+ * @param[in]     y    The index of the row.
+ * @param[in,out] user The frame (row_check_t).
+ *
+ * @return False to stop after check->stop.
+ */
+static bool compare_row(const unsigned char *row, uint32_t y, void *user) {
+	row_check_t *check = user;
+
+	if ((y != check->next) || (y >= check->size) ||
+			(memcmp(row, check->img + (size_t)y * check->size * 4, (size_t)check->size * 4) != 0))
+		check->same = false;
+
+	check->next = y + 1;
+
+	return y != check->stop;
+}
+
+
+/**
+ * Check that the rows of identicon_render_rows2() (and of a context) are the ones of new_identicon2(), in order,
+ * and that a callback can stop them.
+ *
+ * @return True if every row is the same.
+ */
+static bool test_render_rows(void) {
+	identicon_opts2_t options, *opts = &options;
+	identicon_ctx_t *ctx;
+	row_check_t check;
+	char key[32];
+	size_t i;
+	int pass;
+	bool ok = true;
+
+	ctx = new_identicon_ctx();
+	if (ctx == NULL)
+		return false;
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	for (i = 0; i < 40; i++) {
+		opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i);
+		opts->size = 1 + 5 * (i % 23);
+		opts->transparent = (i % 2) != 0;
+		opts->margin = (i % 3) * 0.1;
+		opts->stroke = (i % 4) == 1;
+		opts->stroke_size = 1 + i % 3;
+
+		check.img = new_identicon2(opts);
+		check.size = opts->size;
+		if (check.img == NULL) {
+			ok = false;
+			continue;
+		}
+
+		for (pass = 0; pass < 3; pass++) {
+			check.next = 0;
+			check.stop = (pass == 2) ? opts->size / 2 : opts->size;
+			check.same = true;
+
+			if (((pass == 0) ? identicon_render_rows2(opts, compare_row, &check) :
+					identicon_ctx_render_rows2(ctx, opts, compare_row, &check)) != (pass != 2) ||
+					!check.same || (check.next != ((pass == 2) ? check.stop + 1 : opts->size))) {
+				printf("  rows: key %zu size %u differs from new_identicon2() (pass %d)\n", i, opts->size, pass);
+				ok = false;
+			}
+		}
+
+		identicon_free((void *)check.img);
+	}
+
+	free_identicon_ctx(ctx);
+
+	return ok;
+}
+
+
+
+#if defined(HAVE_LIBPNG)
+// PNG image written by libpng into memory
+typedef struct png_memory_t {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} png_memory_t;
+
+
+/**
+ * Append the output of libpng to a memory buffer (libpng write function).
+ *
+ * @param[in] png_ptr The libpng write structure (its io pointer is the png_memory_t).
+ * @param[in] data    The bytes.
+ * @param[in] len     The number of bytes.
+ */
+static void png_memory_write(png_structp png_ptr, png_bytep data, png_size_t len) {
+	png_memory_t *out = png_get_io_ptr(png_ptr);
+
+	if (len > out->size - out->len)
+		png_error(png_ptr, "output buffer too small");
+
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+
+/**
+ * Write an identicon with png_write_identicon2() into memory.
+ *
+ * @param[in]  opts The identicon options.
+ * @param[out] out  The PNG image.
+ *
+ * @return True if the identicon has been written, false if an error occurred.
+ */
+static bool png_write_memory(const identicon_opts2_t *opts, png_memory_t *out) {
+	png_structp png_ptr;
+	png_infop info_ptr;
+	volatile bool written = false;
+
+	out->len = 0;
+
+	png_ptr = png_create_identicon_write_struct(NULL, NULL, NULL);
+	if (png_ptr == NULL)
+		return false;
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if ((info_ptr != NULL) && !setjmp(png_jmpbuf(png_ptr))) {
+		png_set_write_fn(png_ptr, out, png_memory_write, NULL);
+		written = png_write_identicon2(png_ptr, info_ptr, opts);
+	}
+
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	return written;
+}
+
+
+/**
+ * Check that the images of png_write_identicon2() decode to the pixels of new_identicon2(), and that the row
+ * pointers of png_new_identicon2() and png_new_identicon_from_array2() alias one contiguous image.
+ *
+ * @return True if every image is the same.
+ */
+static bool test_libpng(void) {
+	static unsigned char data[16384];
+	png_memory_t out = { data, 0, sizeof(data) };
+	identicon_opts2_t options, *opts = &options;
+	png_byte **rows, **aliases;
+	unsigned char *img, *decoded;
+	unsigned int width, height;
+	uint32_t y;
+	char key[32];
+	size_t i, row_size;
+	bool ok = true;
+
+	identicon_opts2_init(opts);
+	opts->key = key;
+
+	for (i = 0; i < 40; i++) {
+		opts->key_len = snprintf(key, sizeof(key), "user-%zu@example.com", i);
+		opts->size = 1 + 7 * (i % 19);
+		opts->transparent = (i % 2) != 0;
+		opts->margin = (i % 3) * 0.1;
+		opts->stroke = (i % 4) == 1;
+		opts->stroke_size = 1 + i % 3;
+		row_size = (size_t)opts->size * 4;
+
+		img = new_identicon2(opts);
+		decoded = NULL;
+		if ((img == NULL) || !png_write_memory(opts, &out) ||
+				(lodepng_decode32(&decoded, &width, &height, out.data, out.len) != 0) || (width != opts->size) ||
+				(height != opts->size) || (memcmp(decoded, img, row_size * height) != 0)) {
+			printf("  libpng: key %zu size %u does not decode to new_identicon2()\n", i, opts->size);
+			ok = false;
+		}
+
+		identicon_free(decoded);
+
+		rows = png_new_identicon2(opts);
+		aliases = (img != NULL) ? png_new_identicon_from_array2(img, opts) : NULL;
+		if ((img == NULL) || (rows == NULL) || (aliases == NULL)) {
+			ok = false;
+		} else {
+			for (y = 0; y < opts->size; y++) {
+				if ((rows[y] != rows[0] + y * row_size) || (memcmp(rows[y], img + y * row_size, row_size) != 0) ||
+						(aliases[y] != img + y * row_size)) {
+					printf("  libpng: rows of key %zu size %u are not one image\n", i, opts->size);
+					ok = false;
+					break;
+				}
+			}
+		}
+
+		identicon_free(aliases);
+		identicon_free(rows);
+		identicon_free(img);
+	}
+
+	return ok;
+}
+#endif
+
+
+
+/**
+ * Compute the descriptor of a key and salt given with their lengths.
+ *
+ * @param[in]  opts     The identicon options (key and salt are replaced).
+ * @param[in]  key      The key.
+ * @param[in]  key_len  The length of the key.
+ * @param[in]  salt     The salt.
+ * @param[in]  salt_len The length of the salt.
+ * @param[out] desc     The descriptor.
+ *
+ * @return True if the descriptor has been computed.
+ */
+static bool descriptor_of(identicon_opts2_t *opts, const void *key, size_t key_len, const void *salt,
+		size_t salt_len, identicon_descriptor_t *desc) {
+	opts->key = key;
+	opts->key_len = key_len;
+	opts->salt = salt;
+	opts->salt_len = salt_len;
+
+	return identicon_compute_descriptor2(opts, desc);
+}
+
+
+/**
+ * Compare two descriptors.
+ *
+ * @param[in] a The first descriptor.
+ * @param[in] b The second descriptor.
+ *
+ * @return True if both descriptors are the same.
+ */
+static bool same_descriptor(const identicon_descriptor_t *a, const identicon_descriptor_t *b) {
+	return (a->pattern == b->pattern) && (a->foreground.red == b->foreground.red) &&
+			(a->foreground.green == b->foreground.green) && (a->foreground.blue == b->foreground.blue);
+}
+
+
+/**
+ * Check that compact options are binary safe (embedded NUL bytes, keys that are not NUL terminated or longer
+ * than IDENTICON_MAX_STRING_LENGTH) and give the identicons of identicon_options_t.
+ *
+ * @return True if every descriptor and image is the expected one.
+ */
+static bool test_opts2(void) {
+	static char long_key[3 * IDENTICON_MAX_STRING_LENGTH];
+	identicon_opts2_t options, *opts = &options;
+	identicon_options_t *old;
+	identicon_descriptor_t a, b;
+	unsigned char *img, *expected;
+	int hash_type;
+	bool ok = true;
+
+	memset(long_key, 'k', sizeof(long_key));
+
+	identicon_opts2_init(opts);
+
+	for (hash_type = IDENTICON_HASH_MD5; hash_type <= IDENTICON_HASH_BLAKE2B_160; hash_type++) {
+		opts->hash_type = hash_type;
+
+		// Bytes after a NUL byte count
+		if (!descriptor_of(opts, "a\0b", 3, NULL, 0, &a) || !descriptor_of(opts, "a\0c", 3, NULL, 0, &b) ||
+				same_descriptor(&a, &b)) {
+			printf("  opts2: bytes after a NUL byte of the key ignored (hash type %d)\n", hash_type);
+			ok = false;
+		}
+
+		if (!descriptor_of(opts, "a", 1, "\0b", 2, &a) || !descriptor_of(opts, "a", 1, "\0c", 2, &b) ||
+				same_descriptor(&a, &b)) {
+			printf("  opts2: bytes after a NUL byte of the salt ignored (hash type %d)\n", hash_type);
+			ok = false;
+		}
+
+		// The salt follows the key
+		if (!descriptor_of(opts, "x\0", 2, "y", 1, &a) || !descriptor_of(opts, "x", 1, "\0y", 2, &b) ||
+				!same_descriptor(&a, &b)) {
+			printf("  opts2: key and salt are not hashed back to back (hash type %d)\n", hash_type);
+			ok = false;
+		}
+
+		// Only key_len bytes are read
+		if (!descriptor_of(opts, "abcdef", 3, "saltier", 4, &a) || !descriptor_of(opts, "abc", 3, "salt", 4, &b) ||
+				!same_descriptor(&a, &b)) {
+			printf("  opts2: bytes past the lengths read (hash type %d)\n", hash_type);
+			ok = false;
+		}
+
+		// No length cap
+		long_key[sizeof(long_key) - 1] = 'k';
+		if (!descriptor_of(opts, long_key, sizeof(long_key), NULL, 0, &a)) {
+			ok = false;
+		} else {
+			long_key[sizeof(long_key) - 1] = 'l';
+			if (!descriptor_of(opts, long_key, sizeof(long_key), NULL, 0, &b) || same_descriptor(&a, &b)) {
+				printf("  opts2: long key truncated (hash type %d)\n", hash_type);
+				ok = false;
+			}
+		}
+	}
+
+	// identicon_options_t is a shim over the compact options
+	old = new_default_identicon_options();
+	if (old == NULL)
+		return false;
+
+	strcpy(old->str, "user@example.com");
+	strcpy(old->salt, "pepper");
+	old->size = 37;
+	old->stroke = true;
+	old->stroke_size = 2;
+	old->hash_type = IDENTICON_HASH_SHA256;
+
+	identicon_opts2_init(opts);
+	opts->key = "user@example.com";
+	opts->key_len = 16;
+	opts->salt = "pepper";
+	opts->salt_len = 6;
+	opts->size = 37;
+	opts->margin = old->margin;
+	opts->transparent = old->transparent;
+	opts->stroke = true;
+	opts->stroke_size = 2;
+	opts->hash_type = IDENTICON_HASH_SHA256;
+
+	img = new_identicon2(opts);
+	expected = new_identicon(old);
+	if ((img == NULL) || (expected == NULL) || (memcmp(img, expected, identicon_image_size2(opts)) != 0)) {
+		printf("  opts2: new_identicon2() differs from new_identicon()\n");
+		ok = false;
+	}
+
+	identicon_free(expected);
+	identicon_free(img);
+	identicon_free(old);
+
+	return ok;
+}
+
+
+
+/**
+ * Check that keys sharing long prefixes get the descriptors of the keys hashed on their own, and that the
+ * statistics count the blocks of the shared prefixes that have not been compressed again.
+ *
+ * The keys of two tenants are interleaved, with a prefix of 512 bytes each (whole blocks of every hash), and
+ * some keys are NULL.
+ *
+ * @return True if every descriptor and the statistics are the expected ones.
+ */
+static bool test_prefix_reuse(void) {
+	static char strings[300][512 + 16];
+	static identicon_key_t keys[300];
+	static identicon_descriptor_t descs[300];
+	identicon_hash_backend_t previous = identicon_get_hash_backend(IDENTICON_HASH_MD5);
+	identicon_opts2_t options, *opts = &options;
+	identicon_batch_stats_t stats;
+	identicon_descriptor_t desc;
+	uint64_t blocks, depth;
+	size_t block_size, length_size, i;
+	int hash_type;
+	bool ok = true;
+
+	for (i = 0; i < 300; i++) {
+		memset(strings[i], (i % 2) ? 'b' : 'a', 512);
+		keys[i].str = ((i == 5) || (i == 270)) ? NULL : strings[i];
+		keys[i].len = 512 + snprintf(strings[i] + 512, 16, ":user-%03zu", i);
+	}
+
+	if (!identicon_set_hash_backend(IDENTICON_BACKEND_BUILTIN))
+		return false;
+
+	identicon_opts2_init(opts);
+	opts->salt = "pepper";
+	opts->salt_len = 6;
+
+	for (hash_type = IDENTICON_HASH_MD5; hash_type <= IDENTICON_HASH_SHA512; hash_type++) {
+		opts->hash_type = hash_type;
+		block_size = (hash_type == IDENTICON_HASH_SHA512) ? 128 : 64;
+		length_size = (hash_type == IDENTICON_HASH_SHA512) ? 16 : 8;
+
+		identicon_reset_batch_stats();
+		if (!identicon_compute_descriptors2(keys, 300, opts, descs)) {
+			ok = false;
+			continue;
+		}
+		identicon_get_batch_stats(&stats);
+
+		for (i = 0; i < 300; i++) {
+			if (keys[i].str == NULL)
+				continue;
+
+			opts->key = keys[i].str;
+			opts->key_len = keys[i].len;
+			if (!identicon_compute_descriptor2(opts, &desc) || !same_descriptor(&desc, &descs[i])) {
+				printf("  prefix: key %zu differs from its own hash (hash type %d)\n", i, hash_type);
+				ok = false;
+				break;
+			}
+		}
+
+		for (i = 0, blocks = 0; i < 300; i++) {
+			if (keys[i].str != NULL)
+				blocks += (keys[i].len + opts->salt_len + length_size + block_size) / block_size;
+		}
+
+		// A key resuming after its prefix skips all of its blocks, and only the first keys of a tenant in each
+		// group of keys sorted together cannot (most keys resume, whatever the size of the groups)
+		depth = 512 / block_size;
+		if ((stats.prefix_keys != 298) || (stats.prefix_blocks + stats.prefix_blocks_saved != blocks) ||
+				(stats.prefix_blocks_saved % depth != 0) || (stats.prefix_blocks_saved / depth < 298 * 3 / 4)) {
+			printf("  prefix: %llu keys, %llu blocks and %llu saved out of %llu (hash type %d)\n",
+					(unsigned long long)stats.prefix_keys, (unsigned long long)stats.prefix_blocks,
+					(unsigned long long)stats.prefix_blocks_saved, (unsigned long long)blocks, hash_type);
+			ok = false;
+		}
+	}
+
+	identicon_set_hash_backend(previous);
+
+	return ok;
+}
+
+
+
+// Expected output of a pipeline, checked by compare_output()
+typedef struct output_check_t {
+	const identicon_key_t *keys;
+	size_t count;
+	identicon_opts2_t opts;
+	bool lodepng; // The images are the ones of lodepng_encode32(), not of identicon_write_png2()
+	size_t next; // Next key expected
+	size_t outputs;
+	size_t stop; // Outputs after which the callback stops (count for none)
+	bool same;
+} output_check_t;
+
+
+/**
+ * Encode an identicon with lodepng (encoder callback of a pipeline, thread safe).
+ *
+ * @param[in]  img  The RGBA image.
+ * @param[in]  size The width and height of the image.
+ * @param[out] len  The size of the PNG image.
+ * @param[in]  user Unused.
+ *
+ * @return The PNG image or NULL if an error occurred.
+ */
+static unsigned char *encode_lodepng(const unsigned char *img, uint32_t size, size_t *len, void *user) {
+	unsigned char *png = NULL;
+
+	(void)user;
+
+	if (lodepng_encode32(&png, len, img, size, size) != 0) {
+		identicon_free(png);
+		return NULL;
+	}
+
+	return png;
+}
+
+
+/**
+ * Compare an output of a pipeline with the image of its key encoded on its own (output callback).
+ *
+ * @param[in]     index The index of the key.
+ * @param[in]     data  The image.
+ * @param[in]     len   The size of the image.
+ * @param[in,out] user  The expected output (output_check_t).
+ *
+ * @return False to stop after check->stop outputs.
+ */
+static bool compare_output(size_t index, const unsigned char *data, size_t len, void *user) {
+	static unsigned char png[16384];
+	output_check_t *check = user;
+	identicon_descriptor_t desc;
+	unsigned char *img, *expected = NULL;
+	size_t expected_len = 0;
+
+	// Keys are given in input order, keys with a NULL string are skipped
+	while ((check->next < check->count) && (check->keys[check->next].str == NULL))
+		check->next++;
+
+	if (index != check->next++) {
+		check->same = false;
+		return false;
+	}
+
+	check->opts.key = check->keys[index].str;
+	check->opts.key_len = check->keys[index].len;
+
+	if (check->lodepng) {
+		img = new_identicon2(&check->opts);
+		if ((img == NULL) || (lodepng_encode32(&expected, &expected_len, img, check->opts.size,
+				check->opts.size) != 0) || (len != expected_len) || (memcmp(data, expected, len) != 0))
+			check->same = false;
+		identicon_free(expected);
+		identicon_free(img);
+	} else if (!identicon_compute_descriptor2(&check->opts, &desc) ||
+			((expected_len = identicon_write_png2(&desc, &check->opts, png, sizeof(png))) != len) ||
+			(memcmp(data, png, len) != 0)) {
+		check->same = false;
+	}
+
+	return ++check->outputs != check->stop;
+}
+
+
+/**
+ * Check that a pipeline with small bounds gives the images of its keys in input order, with the built-in PNG
+ * writer and with an encoder callback, that the queues never hold more than the items in flight and that the
+ * output callback can stop a run.
+ *
+ * @return True if every image is the expected one.
+ */
+static bool test_pipeline(void) {
+	static identicon_key_t keys[500];
+	static char strings[500][32];
+	identicon_pipeline_config_t config;
+	identicon_stage_stats_t stats[IDENTICON_STAGES];
+	identicon_opts2_t options, *opts = &options;
+	identicon_pipeline_t *pipeline;
+	output_check_t check;
+	size_t i, expected = 0;
+	int pass, s;
+	bool ok = true, done;
+
+	for (i = 0; i < 500; i++) {
+		keys[i].str = (i % 37 == 11) ? NULL : strings[i];
+		keys[i].len = snprintf(strings[i], sizeof(strings[i]), "user-%zu@example.com", i);
+		expected += (keys[i].str != NULL);
+	}
+
+	identicon_opts2_init(opts);
+	opts->size = 40;
+
+	for (pass = 0; pass < 4; pass++) {
+		memset(&check, 0, sizeof(check));
+		check.keys = keys;
+		check.count = 500;
+		check.opts = *opts;
+		check.lodepng = (pass % 2) != 0;
+		check.stop = (pass < 2) ? 500 : 100;
+		check.same = true;
+
+		identicon_pipeline_config_init(&config);
+		for (s = 0; s < IDENTICON_STAGES - 1; s++)
+			config.workers[s] = 2;
+		config.chunk_size = 3;
+		config.items = 2;
+		config.queue_depth = 1;
+		config.encode = check.lodepng ? encode_lodepng : NULL;
+		config.output = compare_output;
+		config.output_user = &check;
+
+		pipeline = new_identicon_pipeline(opts, &config);
+		if (pipeline == NULL)
+			return false;
+
+		done = identicon_pipeline_run(pipeline, keys, 500);
+		identicon_pipeline_get_stats(pipeline, stats);
+
+		if (!check.same || (done != (pass < 2)) || (check.outputs != ((pass < 2) ? expected : 100))) {
+			printf("  pipeline: %zu images, %s (pass %d)\n", check.outputs,
+					check.same ? "in order" : "not the expected ones", pass);
+			ok = false;
+		}
+
+		for (s = 0; s < IDENTICON_STAGES; s++) {
+			if (stats[s].queue_max_depth > config.items) {
+				printf("  pipeline: %zu items in the queue of stage %d (pass %d)\n", stats[s].queue_max_depth, s,
+						pass);
+				ok = false;
+			}
+		}
+
+		free_identicon_pipeline(pipeline);
+	}
+
+	return ok;
+}
+
+
+int main(void) {
+	static const struct {
+		const char *name;
+		bool (*run)(void);
+	} tests[] = {
+		{ "encoder sizes", test_encoder_sizes },
+		{ "no allocation", test_no_allocation },
+		{ "sha block functions", test_sha_paths },
+		{ "pool encoders", test_pool_encode },
+		{ "render errors", test_render_errors },
+		{ "batch errors", test_batch_errors },
+		{ "hash vectors", test_hash_vectors },
+		{ "blake2b vectors", test_blake2b_vectors },
+		{ "ctx encode", test_ctx_encode },
+		{ "descriptor", test_descriptor },
+		{ "svg", test_svg },
+		{ "write png", test_write_png },
+		{ "png cache", test_png_cache },
+		{ "render rows", test_render_rows },
+#if defined(HAVE_LIBPNG)
+		{ "libpng", test_libpng },
+#endif
+		{ "opts2", test_opts2 },
+		{ "prefix reuse", test_prefix_reuse },
+		{ "pipeline", test_pipeline },
+	};
+	size_t i, failed = 0;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (tests[i].run()) {
+			printf("ok      %s\n", tests[i].name);
+		} else {
+			printf("FAILED  %s\n", tests[i].name);
+			failed++;
+		}
+	}
+
+	return (failed == 0) ? 0 : 1;
+}